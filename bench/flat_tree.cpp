@@ -0,0 +1,322 @@
+#include "flat_tree.hpp"
+#include <functional>
+#include <stdexcept>
+
+namespace fstree {
+
+namespace {
+std::size_t tableSize(std::size_t entries) {
+  std::size_t slots = 16;
+  while (slots < entries * 2)
+    slots <<= 1;
+  return slots;
+}
+
+template <typename T>
+std::size_t bytes(const std::vector<T>& v) {
+  return v.capacity() * sizeof(T);
+}
+
+// Heap bytes behind a string, 0 while it fits the small string buffer
+std::size_t heapBytes(const std::string& s) {
+  return s.capacity() > std::string().capacity() ? s.capacity() + 1 : 0;
+}
+}  // namespace
+
+// ---------- NameTable ----------
+
+std::size_t NameTable::slot(std::string_view name) const {
+  std::size_t mask = slots_.size() - 1;
+  std::size_t i    = std::hash<std::string_view>{}(name) & mask;
+  while (slots_[i] != EMPTY && this->name(slots_[i]) != name)
+    i = (i + 1) & mask;
+  return i;
+}
+
+void NameTable::rehash(std::size_t slots) {
+  slots_.assign(slots, EMPTY);
+  for (NameId id = 0; id < size(); ++id)
+    slots_[slot(name(id))] = id;
+}
+
+NameId NameTable::intern(std::string_view name) {
+  if ((size() + 1) * 2 > slots_.size())
+    rehash(tableSize(size() + 1));
+
+  std::size_t i = slot(name);
+  if (slots_[i] != EMPTY)
+    return slots_[i];
+
+  if (chars_.size() + name.size() > UINT32_MAX)
+    throw std::length_error("Too many names.");
+  auto id = static_cast<NameId>(size());
+  chars_.append(name);
+  offsets_.push_back(static_cast<uint32_t>(chars_.size()));
+  slots_[i] = id;
+  return id;
+}
+
+std::optional<NameId> NameTable::find(std::string_view name) const {
+  if (slots_.empty())
+    return std::nullopt;
+  NameId id = slots_[slot(name)];
+  if (id == EMPTY)
+    return std::nullopt;
+  return id;
+}
+
+std::string_view NameTable::name(NameId id) const {
+  return std::string_view(chars_).substr(offsets_[id],
+                                         offsets_[id + 1] - offsets_[id]);
+}
+
+std::size_t NameTable::memoryUsage() const {
+  return chars_.capacity() + bytes(offsets_) + bytes(slots_);
+}
+
+// ---------- FlatTree ----------
+
+FlatTree::FlatTree(const DirectoryTree& tree)
+    : root_path_(tree.root_path),
+      root_node_path_(tree.root->path),
+      hash_algorithm_(tree.hash_algorithm) {
+  std::size_t count = tree.index.size();
+  if (count >= NONE)
+    throw std::length_error("Tree too large.");
+
+  name_.reserve(count);
+  parent_.reserve(count);
+  first_child_.reserve(count);
+  child_count_.reserve(count);
+  type_.reserve(count);
+  mtime_.reserve(count);
+  size_.reserve(count);
+  hash_.reserve(count);
+  has_hash_.reserve(count);
+  stub_.reserve(count);
+
+  // Breadth first, so each directory's children get consecutive ids
+  std::vector<const Node*> order{tree.root.get()};
+  parent_.push_back(NONE);
+  for (std::size_t i = 0; i < order.size(); ++i) {
+    const Node& node = *order[i];
+    const std::optional<Hash>& hash =
+        node.type == NodeType::File ? std::get<FileMeta>(node.data).file_hash
+                                    : node.dir_hash;
+
+    name_.push_back(names_.intern(node.name));
+    type_.push_back(node.type);
+    mtime_.push_back(node.mtime.time_since_epoch().count());
+    size_.push_back(node.type == NodeType::File
+                        ? std::get<FileMeta>(node.data).size
+                        : 0);
+    hash_.push_back(hash.value_or(Hash{}));
+    has_hash_.push_back(hash.has_value());
+    stub_.push_back(node.stub);
+
+    if (node.type == NodeType::File) {
+      first_child_.push_back(NONE);
+      child_count_.push_back(0);
+      continue;
+    }
+    const auto& kids = children(node);
+    first_child_.push_back(static_cast<NodeId>(order.size()));
+    child_count_.push_back(static_cast<uint32_t>(kids.size()));
+    for (const auto& kid : kids) {
+      order.push_back(kid.get());
+      parent_.push_back(static_cast<NodeId>(i));
+    }
+  }
+
+  index_.assign(tableSize(nodeCount()), NONE);
+  for (NodeId id = 1; id < nodeCount(); ++id)
+    index_[slot(parent_[id], name_[id])] = id;
+}
+
+std::size_t FlatTree::slot(NodeId parent, NameId name) const {
+  std::size_t mask = index_.size() - 1;
+  uint64_t key     = (static_cast<uint64_t>(parent) << 32) | name;
+  std::size_t i    = static_cast<std::size_t>(
+                      (key * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+  while (index_[i] != NONE &&
+         (parent_[index_[i]] != parent || name_[index_[i]] != name))
+    i = (i + 1) & mask;
+  return i;
+}
+
+FlatTree::NodeId FlatTree::find(const fs::path& path) const {
+  NodeId id = ROOT;
+  for (const auto& part : path) {
+    if (part == "." || part.empty())
+      continue;
+    if (type_[id] != NodeType::Directory)
+      return NONE;
+    auto name = names_.find(part.string());
+    if (!name)
+      return NONE;
+    id = index_[slot(id, *name)];
+    if (id == NONE)
+      return NONE;
+  }
+  return id;
+}
+
+fs::path FlatTree::path(NodeId id) const {
+  if (id == ROOT)
+    return root_node_path_;
+
+  std::vector<NodeId> chain;
+  for (; id != ROOT; id = parent_[id])
+    chain.push_back(id);
+
+  // Same shape as the scan: children of "." are plain relative paths
+  fs::path path = root_node_path_ == "." ? fs::path() : root_node_path_;
+  for (auto it = chain.rbegin(); it != chain.rend(); ++it)
+    path /= std::string(name(*it));
+  return path;
+}
+
+fs::file_time_type FlatTree::mtime(NodeId id) const {
+  return fs::file_time_type(fs::file_time_type::duration(mtime_[id]));
+}
+
+const Hash* FlatTree::hash(NodeId id) const {
+  return has_hash_[id] ? &hash_[id] : nullptr;
+}
+
+std::size_t FlatTree::memoryUsage() const {
+  return names_.memoryUsage() + bytes(name_) + bytes(parent_) +
+         bytes(first_child_) + bytes(child_count_) + bytes(type_) +
+         bytes(mtime_) + bytes(size_) + bytes(hash_) +
+         has_hash_.capacity() / 8 + stub_.capacity() / 8 + bytes(index_);
+}
+
+std::unique_ptr<Node> FlatTree::buildNode(NodeId id) const {
+  std::optional<Hash> hash;
+  if (has_hash_[id])
+    hash = hash_[id];
+
+  if (type_[id] == NodeType::File) {
+    return std::unique_ptr<Node>(
+        new Node{path(id), std::string(name(id)), NodeType::File, mtime(id),
+                 Node::Data{FileMeta{size_[id], hash}}});
+  }
+
+  std::vector<std::unique_ptr<Node>> kids;
+  kids.reserve(child_count_[id]);
+  for (uint32_t i = 0; i < child_count_[id]; ++i)
+    kids.push_back(buildNode(first_child_[id] + i));
+
+  auto node      = std::unique_ptr<Node>(
+      new Node{path(id), std::string(name(id)), NodeType::Directory,
+               mtime(id), Node::Data{std::move(kids)}});
+  node->dir_hash = hash;
+  node->stub     = stub_[id];
+  return node;
+}
+
+DirectoryTree FlatTree::toTree() const {
+  DirectoryTree tree(root_path_, buildNode(ROOT));
+  tree.hash_algorithm = hash_algorithm_;
+  return tree;
+}
+
+std::size_t estimateMemoryUsage(const DirectoryTree& tree) {
+  // Per index entry: hash node with key, value and cached hash + bucket
+  constexpr std::size_t INDEX_ENTRY =
+      sizeof(void*) + sizeof(fs::path) + sizeof(Node*) + sizeof(std::size_t) +
+      sizeof(void*);
+
+  std::size_t total = 0;
+  std::function<void(const Node&)> visit = [&](const Node& node) {
+    // The index key is a second copy of the path
+    std::size_t path = heapBytes(node.path.native());
+    total += sizeof(Node) + path + heapBytes(node.name) + INDEX_ENTRY + path;
+    if (node.type == NodeType::Directory) {
+      const auto& kids = children(node);
+      total += kids.capacity() * sizeof(kids[0]);
+      for (const auto& kid : kids)
+        visit(*kid);
+    }
+  };
+  visit(*tree.root);
+  return total;
+}
+
+// ---------- Diff ----------
+
+namespace {
+using NodeId = FlatTree::NodeId;
+
+bool sameHash(const Hash* a, const Hash* b) {
+  return a == nullptr ? b == nullptr : b != nullptr && *a == *b;
+}
+
+// Mirrors diffTree() on DirectoryTrees: a two pointer walk over each pair of
+// matching directories, skipping subtrees whose Merkle hashes agree
+void diffDirectory(const FlatTree& a,
+                   const FlatTree& b,
+                   NodeId old_dir,
+                   NodeId new_dir,
+                   std::vector<FlatDiff>& out,
+                   std::vector<fs::path>* unloaded) {
+  if (a.stub(old_dir) || b.stub(new_dir)) {
+    if (unloaded)
+      unloaded->push_back(b.path(new_dir));
+    return;
+  }
+  NodeId old_it  = a.firstChild(old_dir);
+  NodeId new_it  = b.firstChild(new_dir);
+  NodeId old_end = old_it + a.childCount(old_dir);
+  NodeId new_end = new_it + b.childCount(new_dir);
+
+  while (old_it != old_end && new_it != new_end) {
+    auto old_name = a.name(old_it);
+    auto new_name = b.name(new_it);
+    if (old_name == new_name) {
+      if (a.type(old_it) != b.type(new_it)) {
+        out.push_back({ChangeType::Modified, old_it, new_it});
+      } else if (a.type(old_it) == NodeType::File) {
+        bool changed;
+        if (a.fileSize(old_it) != b.fileSize(new_it))
+          changed = true;
+        else if (a.hash(old_it) && b.hash(new_it))
+          changed = *a.hash(old_it) != *b.hash(new_it);
+        else  // quick check
+          changed = a.mtime(old_it) != b.mtime(new_it);
+        if (changed)
+          out.push_back({ChangeType::Modified, old_it, new_it});
+      } else if (!a.hash(old_it) ||
+                 !sameHash(a.hash(old_it), b.hash(new_it))) {
+        diffDirectory(a, b, old_it, new_it, out, unloaded);
+      }
+      old_it++;
+      new_it++;
+    } else if (old_name < new_name) {
+      out.push_back({ChangeType::Deleted, old_it++, FlatTree::NONE});
+    } else {
+      out.push_back({ChangeType::Added, FlatTree::NONE, new_it++});
+    }
+  }
+
+  for (; old_it != old_end; ++old_it)
+    out.push_back({ChangeType::Deleted, old_it, FlatTree::NONE});
+  for (; new_it != new_end; ++new_it)
+    out.push_back({ChangeType::Added, FlatTree::NONE, new_it});
+}
+}  // namespace
+
+std::vector<FlatDiff> diffTree(const FlatTree& old_tree,
+                               const FlatTree& new_tree,
+                               std::vector<fs::path>* unloaded) {
+  if (old_tree.hashAlgorithm() != new_tree.hashAlgorithm())
+    throw std::invalid_argument("Trees are hashed with different algorithms.");
+
+  std::vector<FlatDiff> out;
+  const Hash* old_root = old_tree.hash(FlatTree::ROOT);
+  if (!old_root || !sameHash(old_root, new_tree.hash(FlatTree::ROOT)))
+    diffDirectory(
+        old_tree, new_tree, FlatTree::ROOT, FlatTree::ROOT, out, unloaded);
+  return out;
+}
+}  // namespace fstree
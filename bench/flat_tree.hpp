@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "../include/fstree/fstree.hpp"
+
+// Benchmark-only prototype, not used by the sync engine: a compact,
+// read-only form of a DirectoryTree for keeping and diffing very large
+// trees, timed against diffTree() by the flat_diff benchmark. Nodes live in
+// parallel arrays indexed by a 32-bit NodeId in breadth-first order, so
+// every directory's children are one contiguous id range in the
+// DirectoryTree's child order. Names are interned once per tree and paths
+// are rebuilt from parent links when asked for; lookups by path go through
+// an open-addressing table keyed by (parent id, name id).
+namespace fstree {
+
+using NameId = uint32_t;
+
+// One copy of each distinct string, addressed by a dense id
+class NameTable {
+ public:
+  NameId intern(std::string_view);
+  std::optional<NameId> find(std::string_view) const;
+  std::string_view name(NameId) const;
+
+  std::size_t size() const { return offsets_.size() - 1; }
+  std::size_t memoryUsage() const;
+
+ private:
+  static constexpr NameId EMPTY = UINT32_MAX;
+
+  std::size_t slot(std::string_view) const;  // where it is or would go
+  void rehash(std::size_t slots);
+
+  std::string chars_;                 // all names back to back
+  std::vector<uint32_t> offsets_{0};  // name i is [offsets_[i], [i + 1])
+  std::vector<NameId> slots_;         // power of two, EMPTY if unused
+};
+
+class FlatTree {
+ public:
+  using NodeId                 = uint32_t;
+  static constexpr NodeId NONE = UINT32_MAX;
+  static constexpr NodeId ROOT = 0;
+
+  explicit FlatTree(const DirectoryTree&);
+  DirectoryTree toTree() const;
+
+  const fs::path& rootPath() const { return root_path_; }
+  HashAlgorithm hashAlgorithm() const { return hash_algorithm_; }
+  std::size_t nodeCount() const { return type_.size(); }
+
+  // Paths relative to the root like DirectoryTree::index, "." is the root
+  NodeId find(const fs::path&) const;
+  fs::path path(NodeId) const;
+
+  std::string_view name(NodeId id) const { return names_.name(name_[id]); }
+  NodeType type(NodeId id) const { return type_[id]; }
+  fs::file_time_type mtime(NodeId) const;
+  uint64_t fileSize(NodeId id) const { return size_[id]; }
+  const Hash* hash(NodeId) const;  // file or Merkle hash, nullptr if unknown
+  bool stub(NodeId id) const { return stub_[id]; }  // see Node::stub
+
+  NodeId parent(NodeId id) const { return parent_[id]; }
+  // Children are the ids [firstChild, firstChild + childCount)
+  NodeId firstChild(NodeId id) const { return first_child_[id]; }
+  uint32_t childCount(NodeId id) const { return child_count_[id]; }
+
+  // Bytes held, to compare against estimateMemoryUsage(DirectoryTree)
+  std::size_t memoryUsage() const;
+
+ private:
+  std::size_t slot(NodeId parent, NameId) const;
+  std::unique_ptr<Node> buildNode(NodeId) const;
+
+  fs::path root_path_;
+  fs::path root_node_path_;
+  HashAlgorithm hash_algorithm_;
+  NameTable names_;
+
+  std::vector<NameId> name_;
+  std::vector<NodeId> parent_;
+  std::vector<NodeId> first_child_;
+  std::vector<uint32_t> child_count_;
+  std::vector<NodeType> type_;
+  std::vector<int64_t> mtime_;
+  std::vector<uint64_t> size_;  // files only
+  std::vector<Hash> hash_;
+  std::vector<bool> has_hash_;
+  std::vector<bool> stub_;
+
+  std::vector<NodeId> index_;  // power of two, NONE if unused
+};
+
+// Approximate heap use of a DirectoryTree: nodes, their paths and names,
+// child vectors and the index
+std::size_t estimateMemoryUsage(const DirectoryTree&);
+
+struct FlatDiff {
+  ChangeType type;
+  FlatTree::NodeId old_node;  // NONE when Added
+  FlatTree::NodeId new_node;  // NONE when Deleted
+};
+
+// The same changes, in the same order, as diffTree() on the trees they were
+// built from: throws if they were hashed with different algorithms, and
+// directories that differ but are a stub on either side go to unloaded
+std::vector<FlatDiff> diffTree(const FlatTree&,
+                               const FlatTree&,
+                               std::vector<fs::path>* unloaded = nullptr);
+}  // namespace fstree
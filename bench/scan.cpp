@@ -0,0 +1,56 @@
+// Measures DirectoryTree construction (scan + hash) as worker threads are
+// added. Results depend heavily on the page cache: run once to warm it, or
+// drop caches between runs to measure cold disk throughput.
+//
+//   make build FILE=bench/scan
+//   ./misc/build/scan <dir> [max_threads]
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <variant>
+#include "../include/fstree/fstree.hpp"
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << " <dir> [max_threads]\n";
+    return 1;
+  }
+
+  std::filesystem::path dir = argv[1];
+  unsigned max_threads      = argc > 2 ? std::stoul(argv[2])
+                                       : std::thread::hardware_concurrency();
+  if (max_threads == 0)
+    max_threads = 1;
+
+  std::cout << std::left << std::setw(10) << "threads" << std::setw(12)
+            << "seconds" << std::setw(14) << "files/s" << std::setw(12)
+            << "MB/s" << "\n";
+
+  for (unsigned threads = 1;; threads = std::min(threads * 2, max_threads)) {
+    auto start = std::chrono::steady_clock::now();
+    // Hash cache off so every run reads and hashes every file
+    fstree::DirectoryTree tree(dir, fstree::ScanOptions{threads, false});
+    auto end = std::chrono::steady_clock::now();
+
+    uint64_t files = 0, bytes = 0;
+    for (auto& [path, node] : tree.index) {
+      if (node->type == fstree::NodeType::File) {
+        files++;
+        bytes += std::get<fstree::FileMeta>(node->data).size;
+      }
+    }
+
+    double secs = std::chrono::duration<double>(end - start).count();
+    std::cout << std::left << std::setw(10) << threads << std::setw(12)
+              << std::fixed << std::setprecision(3) << secs << std::setw(14)
+              << std::setprecision(0) << files / secs << std::setw(12)
+              << std::setprecision(1) << bytes / secs / (1024 * 1024) << "\n";
+
+    if (threads == max_threads)
+      break;
+  }
+}
@@ -0,0 +1,488 @@
+// Benchmark suite over the synthetic trees in workload.hpp: scanning, hashing,
+// tree serialization, diffing, and a loopback sync between two peers. Each
+// benchmark repeats until it has run for --min-time seconds and reports the
+// mean per iteration. --json also writes the results in Google Benchmark's
+// JSON format, so its compare tooling can diff two runs.
+//
+// Trees are generated under --dir and removed afterwards. Small trees sit in
+// the page cache, so the numbers are warm-cache throughput.
+//
+//   make bench
+//   ./misc/build/suite [--json <file>] [--filter <text>] [--scale <n>]
+//                      [--min-time <seconds>] [--dir <work_dir>]
+//   ./misc/build/suite --generate <shape> <dir>   # just write a tree
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <fstream>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <variant>
+#include <vector>
+#include "../include/fstree/fstree.hpp"
+#include "../include/fstree/thread_pool.hpp"
+#include "../include/net/peer.hpp"
+#include "flat_tree.hpp"
+#include "workload.hpp"
+
+namespace {
+namespace fs   = std::filesystem;
+namespace asio = boost::asio;
+using Clock    = std::chrono::steady_clock;
+
+struct Work {
+  uint64_t items = 0;  // files, or tree entries
+  uint64_t bytes = 0;
+};
+
+struct Result {
+  std::string name;
+  uint64_t iterations = 0;
+  double real_time    = 0;  // seconds per iteration
+  double cpu_time     = 0;  // process CPU seconds, all threads
+  Work work;
+};
+
+struct Options {
+  std::string json;
+  std::string filter;
+  unsigned scale  = 1;
+  double min_time = 0.5;
+  fs::path dir    = fs::temp_directory_path() / "file-sync-bench";
+};
+
+Work treeWork(const fstree::DirectoryTree& tree) {
+  Work work;
+  for (auto& [path, node] : tree.index) {
+    if (node->type == fstree::NodeType::File) {
+      work.items++;
+      work.bytes += std::get<fstree::FileMeta>(node->data).size;
+    }
+  }
+  return work;
+}
+
+// Runs fn until min_time has passed, at least once. setup runs untimed
+// before every iteration.
+template <typename Fn, typename Setup>
+Result measure(std::string name, double min_time, Fn fn, Setup setup) {
+  Result result{std::move(name), 0, 0, 0, {}};
+  double real = 0, cpu = 0;
+  while (result.iterations == 0 || real < min_time) {
+    setup();
+    auto cpu_start = std::clock();
+    auto start     = Clock::now();
+    result.work    = fn();
+    real += std::chrono::duration<double>(Clock::now() - start).count();
+    cpu += double(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+    result.iterations++;
+  }
+  result.real_time = real / result.iterations;
+  result.cpu_time  = cpu / result.iterations;
+  return result;
+}
+
+template <typename Fn>
+Result measure(std::string name, double min_time, Fn fn) {
+  return measure(std::move(name), min_time, fn, [] {});
+}
+
+// flat_diff is only worth timing while it gives diff's answer. Also checked
+// on a lazily received copy of old_tree, whose stubs must come back as
+// unloaded and survive toTree(), and on trees of different hash algorithms.
+void checkFlatDiff(const fstree::DirectoryTree& old_tree,
+                   const fstree::DirectoryTree& new_tree) {
+  auto check = [&](const fstree::DirectoryTree& tree) {
+    fstree::FlatTree flat_old(tree), flat_new(new_tree);
+    std::vector<fs::path> unloaded, flat_unloaded;
+    auto diffs = fstree::diffTree(tree, new_tree, &unloaded);
+    auto flat  = fstree::diffTree(flat_old, flat_new, &flat_unloaded);
+
+    bool same = diffs.size() == flat.size() && unloaded == flat_unloaded;
+    for (std::size_t i = 0; same && i < diffs.size(); ++i) {
+      const auto& d = diffs[i];
+      same = d.type == flat[i].type &&
+             (d.new_node ? d.new_node->path == flat_new.path(flat[i].new_node)
+                         : d.old_node->path == flat_old.path(flat[i].old_node));
+    }
+    if (!same || fstree::serializeTree(flat_old.toTree()) !=
+                     fstree::serializeTree(tree))
+      throw std::runtime_error("flat_diff disagrees with diff");
+  };
+  check(old_tree);
+
+  auto lazy = fstree::deserializeTree(
+      fstree::serializeTree(old_tree, fstree::TreeFormat::Compact, 1));
+  lazy.hash_algorithm = old_tree.hash_algorithm;
+  check(lazy);
+
+  auto other           = new_tree.clone();
+  other.hash_algorithm = old_tree.hash_algorithm == fstree::HashAlgorithm::Sha256
+                             ? fstree::HashAlgorithm::Blake2b
+                             : fstree::HashAlgorithm::Sha256;
+  try {
+    fstree::diffTree(fstree::FlatTree(old_tree), fstree::FlatTree(other));
+  } catch (const std::invalid_argument&) {
+    return;
+  }
+  throw std::runtime_error("flat_diff compared different hash algorithms");
+}
+
+// Two peers in this process connected over 127.0.0.1, each running its own
+// io_context. sync() streams a tree the way the sync command does once the
+// diff is known.
+class Loopback {
+ public:
+  Loopback()
+      : server_(std::make_shared<net::Peer>(0)),
+        client_(std::make_shared<net::Peer>(0)),
+        server_work_(server_->getExecutor()),
+        client_work_(client_->getExecutor()) {
+    // Only one connection is made, the acceptor stays open until stop()
+    auto accepted =
+        std::make_shared<std::promise<std::shared_ptr<net::Session>>>();
+    auto server_session = accepted->get_future();
+    server_->doAccept([accepted](std::weak_ptr<net::Session> session) {
+      accepted->set_value(session.lock());
+    });
+    server_thread_ = std::thread([peer = server_] { peer->run(); });
+    client_thread_ = std::thread([peer = client_] { peer->run(); });
+
+    net::tcp::endpoint endpoint(asio::ip::make_address("127.0.0.1"),
+                                server_->port());
+    client_session_ = asio::co_spawn(client_->getExecutor(),
+                                     client_->connect(endpoint),
+                                     asio::use_future)
+                          .get();
+    server_session_ = server_session.get();
+
+    auto hello = [](std::shared_ptr<net::Session> session) {
+      return [session]() -> asio::awaitable<void> {
+        net::Session::HelloPacket packet{
+            0,
+            "bench",
+            0,
+            false,
+            net::FEATURE_COMPACT_TREE | net::compression::FEATURE_DEFLATE,
+            fstree::HashAlgorithm::Sha256};
+        co_await session->sendHello(packet);
+        co_await session->receiveHello();
+      };
+    };
+    auto server_hello = asio::co_spawn(server_->getExecutor(),
+                                       hello(server_session_),
+                                       asio::use_future);
+    auto client_hello = asio::co_spawn(client_->getExecutor(),
+                                       hello(client_session_),
+                                       asio::use_future);
+    server_hello.get();
+    client_hello.get();
+  }
+
+  ~Loopback() {
+    server_session_.reset();
+    client_session_.reset();
+    server_->stop();
+    client_->stop();
+    server_thread_.join();
+    client_thread_.join();
+  }
+
+  Loopback(const Loopback&)            = delete;
+  Loopback& operator=(const Loopback&) = delete;
+
+  // Sends every file of tree into the empty directory dst and returns once
+  // they are all on disk
+  void sync(const fstree::DirectoryTree& tree, const fs::path& dst) {
+    std::vector<net::SyncOp> ops;
+    for (auto& [path, node] : tree.index)
+      if (node->type == fstree::NodeType::File)
+        ops.push_back({net::SyncOp::Kind::File, node, {}});
+    fstree::DirectoryTree dst_tree(dst);
+
+    auto received = asio::co_spawn(
+        server_->getExecutor(),
+        [this, &dst_tree]() -> asio::awaitable<void> {
+          using PacketType = net::Session::PacketType;
+          for (;;) {
+            auto type = co_await server_session_->receivePacketType();
+            if (type == PacketType::SyncDone)
+              break;
+            if (type == PacketType::FileData)
+              co_await server_session_->receiveFile(dst_tree, false);
+            else if (type == PacketType::FileBundle)
+              co_await server_session_->receiveFileBundle(dst_tree);
+            else
+              throw std::runtime_error("unexpected packet during sync");
+          }
+          co_await server_session_->flushWrites();
+        },
+        asio::use_future);
+    auto sent = asio::co_spawn(
+        client_->getExecutor(),
+        [this, &tree, &ops]() -> asio::awaitable<void> {
+          co_await client_session_->sendSyncOps(tree, ops, read_pool_,
+                                                options_);
+          co_await client_session_->sendSyncDone();
+        },
+        asio::use_future);
+    sent.get();
+    received.get();
+  }
+
+ private:
+  std::shared_ptr<net::Peer> server_, client_;
+  // run() returns once its io_context runs out of work, which it does
+  // between the steps driven from here
+  asio::executor_work_guard<asio::any_io_executor> server_work_, client_work_;
+  std::thread server_thread_, client_thread_;
+  std::shared_ptr<net::Session> server_session_, client_session_;
+  fstree::ThreadPool read_pool_;
+  net::TransferOptions options_;
+};
+
+const char* const BENCHMARKS[] = {"scan",
+                                  "scan_hash",
+                                  "scan_hash_sha512-256",
+                                  "scan_hash_blake2b",
+                                  "serialize",
+                                  "deserialize",
+                                  "diff",
+                                  "flat_diff",
+                                  "loopback"};
+
+void benchWorkload(const bench::Workload& workload,
+                   const Options& options,
+                   std::vector<Result>& results) {
+  auto root = options.dir / workload.name;
+  auto src  = root / "src";
+  auto dst  = root / "dst";
+  auto name = [&](const char* bench) {
+    return std::string(bench) + "/" + workload.name;
+  };
+  auto wanted = [&](const char* bench) {
+    return name(bench).find(options.filter) != std::string::npos;
+  };
+  auto run = [&](Result result) {
+    std::cerr << "  " << result.name << "\n";
+    results.push_back(std::move(result));
+  };
+
+  if (std::none_of(std::begin(BENCHMARKS), std::end(BENCHMARKS), wanted))
+    return;
+
+  std::cerr << "generating " << workload.name << "\n";
+  bench::generate(src, workload.shape, options.scale);
+
+  // Hash cache off throughout, so every scan reads and hashes every file
+  const fstree::ScanOptions quick{0, false, true};
+  const fstree::ScanOptions full{0, false, false};
+
+  if (wanted("scan"))
+    run(measure(name("scan"), options.min_time, [&] {
+      // Stat only, file data isn't read
+      return Work{treeWork(fstree::DirectoryTree(src, quick)).items, 0};
+    }));
+  if (wanted("scan_hash"))
+    run(measure(name("scan_hash"), options.min_time, [&] {
+      return treeWork(fstree::DirectoryTree(src, full));
+    }));
+  // scan_hash is SHA-256, these the alternatives to it
+  for (auto algorithm : {fstree::HashAlgorithm::Sha512_256,
+                         fstree::HashAlgorithm::Blake2b}) {
+    auto bench = std::string("scan_hash_") +
+                 fstree::hashAlgorithmName(algorithm);
+    if (!wanted(bench.c_str()))
+      continue;
+    auto scan           = full;
+    scan.hash_algorithm = algorithm;
+    run(measure(name(bench.c_str()), options.min_time, [&] {
+      return treeWork(fstree::DirectoryTree(src, scan));
+    }));
+  }
+
+  fstree::DirectoryTree before(src, full);
+  auto payload = fstree::serializeTree(before);
+  Work entries{before.index.size(), payload.size()};
+
+  if (wanted("serialize"))
+    run(measure(name("serialize"), options.min_time, [&] {
+      return Work{entries.items, fstree::serializeTree(before).size()};
+    }));
+  if (wanted("deserialize"))
+    run(measure(name("deserialize"), options.min_time, [&] {
+      fstree::deserializeTree(payload);
+      return entries;
+    }));
+
+  bench::touchSome(src, 100);
+  fstree::DirectoryTree after(src, full);
+  Work compared{entries.items, 0};
+
+  if (wanted("diff"))
+    run(measure(name("diff"), options.min_time, [&] {
+      fstree::diffTree(before, after);
+      return compared;
+    }));
+  if (wanted("flat_diff")) {
+    checkFlatDiff(before, after);
+    fstree::FlatTree flat_before(before), flat_after(after);
+    run(measure(name("flat_diff"), options.min_time, [&] {
+      fstree::diffTree(flat_before, flat_after);
+      return compared;
+    }));
+  }
+
+  if (wanted("loopback")) {
+    Loopback link;
+    auto clear = [&] {
+      fs::remove_all(dst);
+      fs::create_directories(dst);
+    };
+    run(measure(
+        name("loopback"), options.min_time,
+        [&] {
+          link.sync(after, dst);
+          return treeWork(after);
+        },
+        clear));
+  }
+
+  fs::remove_all(root);
+}
+
+std::string jsonString(const std::string& s) {
+  std::ostringstream out;
+  out << '"';
+  for (unsigned char c : s) {
+    if (c == '"' || c == '\\')
+      out << '\\' << c;
+    else if (c < 0x20)
+      out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c)
+          << std::dec << std::setfill(' ');
+    else
+      out << c;
+  }
+  out << '"';
+  return out.str();
+}
+
+// Google Benchmark's --benchmark_format=json layout, times in milliseconds
+void writeJson(std::ostream& out,
+               const std::vector<Result>& results,
+               const Options& options,
+               const char* executable) {
+  char date[64];
+  auto now = std::time(nullptr);
+  std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z",
+                std::localtime(&now));
+
+  out << std::setprecision(10);
+  out << "{\n  \"context\": {\n"
+      << "    \"date\": " << jsonString(date) << ",\n"
+      << "    \"host_name\": " << jsonString(asio::ip::host_name()) << ",\n"
+      << "    \"executable\": " << jsonString(executable) << ",\n"
+      << "    \"num_cpus\": " << std::thread::hardware_concurrency() << ",\n"
+      << "    \"scale\": " << options.scale << ",\n"
+      << "    \"library_build_type\": \"release\"\n"
+      << "  },\n  \"benchmarks\": [";
+  for (std::size_t i = 0; i < results.size(); ++i) {
+    const auto& r = results[i];
+    out << (i ? ",\n" : "\n") << "    {\n"
+        << "      \"name\": " << jsonString(r.name) << ",\n"
+        << "      \"run_name\": " << jsonString(r.name) << ",\n"
+        << "      \"run_type\": \"iteration\",\n"
+        << "      \"repetitions\": 1,\n"
+        << "      \"iterations\": " << r.iterations << ",\n"
+        << "      \"real_time\": " << r.real_time * 1e3 << ",\n"
+        << "      \"cpu_time\": " << r.cpu_time * 1e3 << ",\n"
+        << "      \"time_unit\": \"ms\",\n"
+        << "      \"bytes_per_second\": " << r.work.bytes / r.real_time
+        << ",\n"
+        << "      \"items_per_second\": " << r.work.items / r.real_time
+        << "\n    }";
+  }
+  out << "\n  ]\n}\n";
+}
+
+void printTable(const std::vector<Result>& results) {
+  std::cout << std::left << std::setw(26) << "benchmark" << std::setw(8)
+            << "iters" << std::setw(12) << "ms/iter" << std::setw(14)
+            << "items/s" << std::setw(12) << "MB/s" << "\n";
+  for (const auto& r : results) {
+    std::cout << std::left << std::setw(26) << r.name << std::setw(8)
+              << r.iterations << std::setw(12) << std::fixed
+              << std::setprecision(3) << r.real_time * 1e3 << std::setw(14)
+              << std::setprecision(0) << r.work.items / r.real_time
+              << std::setw(12) << std::setprecision(1)
+              << r.work.bytes / r.real_time / (1024 * 1024) << "\n";
+  }
+}
+
+const bench::Workload* findWorkload(const std::string& name) {
+  for (const auto& workload : bench::workloads())
+    if (name == workload.name)
+      return &workload;
+  return nullptr;
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  Options options;
+  try {
+    for (int i = 1; i < argc; ++i) {
+      std::string arg = argv[i];
+      auto value      = [&]() -> std::string {
+        if (i + 1 >= argc)
+          throw std::invalid_argument(arg + " needs a value");
+        return argv[++i];
+      };
+
+      if (arg == "--json")
+        options.json = value();
+      else if (arg == "--filter")
+        options.filter = value();
+      else if (arg == "--scale")
+        options.scale = std::max(1ul, std::stoul(value()));
+      else if (arg == "--min-time")
+        options.min_time = std::stod(value());
+      else if (arg == "--dir")
+        options.dir = value();
+      else if (arg == "--generate") {
+        auto shape = value();
+        fs::path dir = value();
+        auto* workload = findWorkload(shape);
+        if (!workload)
+          throw std::invalid_argument("unknown shape " + shape);
+        auto bytes = bench::generate(dir, workload->shape, options.scale);
+        std::cout << "wrote " << bytes << " bytes to " << dir << "\n";
+        return 0;
+      } else
+        throw std::invalid_argument("unknown option " + arg);
+    }
+
+    std::vector<Result> results;
+    for (const auto& workload : bench::workloads())
+      benchWorkload(workload, options, results);
+    fs::remove_all(options.dir);
+
+    printTable(results);
+    if (!options.json.empty()) {
+      std::ofstream out(options.json);
+      writeJson(out, results, options, argv[0]);
+      if (!out)
+        throw std::runtime_error("cannot write " + options.json);
+    }
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << "\n";
+    return 1;
+  }
+}
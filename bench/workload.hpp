@@ -0,0 +1,115 @@
+#pragma once
+
+// Synthetic trees for the benchmarks. Contents come from a seeded generator,
+// so a shape and scale always produce the same bytes and a tree can be
+// rebuilt anywhere to compare runs.
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace bench {
+namespace fs = std::filesystem;
+
+enum class Shape { SmallFiles, HugeFiles, Deep, Wide };
+
+struct Workload {
+  const char* name;
+  Shape shape;
+};
+
+inline const std::vector<Workload>& workloads() {
+  static const std::vector<Workload> all{
+      {"small_files", Shape::SmallFiles},  // many 1-8 KB files in 100 dirs
+      {"huge_files", Shape::HugeFiles},    // a few 64 MB files
+      {"deep", Shape::Deep},               // a chain of 64 nested dirs
+      {"wide", Shape::Wide},               // one directory, many entries
+  };
+  return all;
+}
+
+inline void writeRandomFile(const fs::path& path,
+                            uint64_t size,
+                            std::mt19937_64& rng) {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out)
+    throw std::runtime_error("cannot create " + path.string());
+
+  std::vector<uint64_t> block(64 * 1024 / sizeof(uint64_t));
+  while (size > 0) {
+    for (auto& word : block)
+      word = rng();
+    auto n = static_cast<std::size_t>(
+        std::min<uint64_t>(size, block.size() * sizeof(uint64_t)));
+    out.write(reinterpret_cast<const char*>(block.data()), n);
+    size -= n;
+  }
+  if (!out)
+    throw std::runtime_error("cannot write " + path.string());
+}
+
+// Replaces root with the shape's tree. scale multiplies the file count (and
+// for HugeFiles the file size). Returns the number of bytes written.
+inline uint64_t generate(const fs::path& root, Shape shape, unsigned scale) {
+  fs::remove_all(root);
+  fs::create_directories(root);
+  std::mt19937_64 rng(static_cast<uint64_t>(shape) + 1);
+  uint64_t bytes = 0;
+
+  auto file = [&](const fs::path& path, uint64_t size) {
+    writeRandomFile(path, size, rng);
+    bytes += size;
+  };
+  auto small_size = [&] { return 1024 + rng() % (7 * 1024); };
+
+  switch (shape) {
+    case Shape::SmallFiles:
+      for (unsigned d = 0; d < 100; ++d) {
+        auto dir = root / ("dir" + std::to_string(d));
+        fs::create_directory(dir);
+        for (unsigned f = 0; f < 100 * scale; ++f)
+          file(dir / ("file" + std::to_string(f)), small_size());
+      }
+      break;
+
+    case Shape::HugeFiles:
+      for (unsigned f = 0; f < 4; ++f)
+        file(root / ("huge" + std::to_string(f) + ".bin"),
+             uint64_t{64} * 1024 * 1024 * scale);
+      break;
+
+    case Shape::Deep: {
+      auto dir = root;
+      for (unsigned depth = 0; depth < 64; ++depth) {
+        dir /= "level" + std::to_string(depth);
+        fs::create_directory(dir);
+        for (unsigned f = 0; f < 16 * scale; ++f)
+          file(dir / ("file" + std::to_string(f)), small_size());
+      }
+      break;
+    }
+
+    case Shape::Wide:
+      for (unsigned f = 0; f < 10000 * scale; ++f)
+        file(root / ("entry" + std::to_string(f)), 512);
+      break;
+  }
+  return bytes;
+}
+
+// Rewrites about one in every files of the tree in place, keeping sizes,
+// so a rescan sees changed contents for diffTree() to find
+inline void touchSome(const fs::path& root, unsigned every) {
+  std::mt19937_64 rng(every);
+  unsigned seen = 0;
+  for (const auto& entry : fs::recursive_directory_iterator(root)) {
+    if (!entry.is_regular_file() || seen++ % every != 0)
+      continue;
+    writeRandomFile(entry.path(), entry.file_size(), rng);
+  }
+}
+}  // namespace bench
@@ -0,0 +1,423 @@
+#include <pthread.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cctype>
+#include <csignal>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "./include/engine/engine.hpp"
+#include "./include/net/metrics_server.hpp"
+
+// The sync engine without a front end, for servers: it serves its directory
+// to any peer and keeps it a mirror of the configured peers, pulling from
+// them every few minutes or as soon as one pushes a change.
+//
+//   file-sync-daemon [--config <file>] [--<key> <value>]... [<port> <dir>]
+//
+// Keys, also accepted as "key = value" lines in the config file, where #
+// starts a comment. Options after --config override the file.
+//   port          listen port
+//   dir           directory to sync
+//   peer          host:port to mirror, may be given more than once
+//   interval      seconds between pulls from every peer, 0 = never
+//   follow        on: pull once a peer pushes a changed tree and push ours
+//                 when it changes (default on)
+//   timeout       handshake timeout in seconds (default 5)
+//   hash          sha256 (default), sha512-256 or blake2b; peers must agree
+//   lazy          on: exchange only the top of each tree and fetch the
+//                 directories that differ (default off)
+//   order         files we serve go small-first (default), newest-first or
+//                 diff, in the order the diff found them
+//   priority      glob of files served ahead of the rest, e.g. *.conf or
+//                 etc/**; may be given more than once, earlier ones first
+//   interleave    bytes of other files sent per range of a huge file, 0 =
+//                 send it whole (default 8m)
+//   rate-limit    bytes per second sent to all peers together, 0 = unlimited
+//   peer-rate-limit  the same for each peer; sizes take a k, m or g suffix
+//   metrics-port  serve /metrics and /metrics.json on this port
+//   metrics-address  where to serve them (default 127.0.0.1), e.g. 0.0.0.0
+//                 for every interface
+
+namespace {
+constexpr auto RECONNECT_DELAY = std::chrono::seconds(10);
+
+struct Config {
+  uint16_t port = 0;
+  std::filesystem::path dir;
+  struct Peer {
+    std::string host;
+    uint16_t port;
+  };
+  std::vector<Peer> peers;
+  std::chrono::seconds interval{0};
+  bool follow = true;
+  std::chrono::seconds timeout{5};
+  fstree::HashAlgorithm hash = fstree::HashAlgorithm::Sha256;
+  bool lazy = false;
+  net::ScheduleOptions schedule;
+  uint64_t rate_limit      = 0;
+  uint64_t peer_rate_limit = 0;
+  std::optional<uint16_t> metrics_port;
+  boost::asio::ip::address metrics_address =
+      boost::asio::ip::address_v4::loopback();
+};
+
+uint16_t parsePort(const std::string& s) {
+  std::size_t end = 0;
+  unsigned long port = 0;
+  try {
+    port = std::stoul(s, &end);
+  } catch (const std::exception&) {
+  }
+  if (end != s.size() || port == 0 || port > 65535)
+    throw std::invalid_argument("not a port: " + s);
+  return static_cast<uint16_t>(port);
+}
+
+std::chrono::seconds parseSeconds(const std::string& s) {
+  std::size_t end = 0;
+  long seconds    = -1;
+  try {
+    seconds = std::stol(s, &end);
+  } catch (const std::exception&) {
+  }
+  if (end != s.size() || seconds < 0)
+    throw std::invalid_argument("not a number of seconds: " + s);
+  return std::chrono::seconds(seconds);
+}
+
+// A byte count, with an optional k, m or g for KiB, MiB or GiB
+uint64_t parseBytes(const std::string& s) {
+  std::size_t end      = 0;
+  unsigned long long n = 0;
+  try {
+    if (!s.empty() && s[0] != '-')
+      n = std::stoull(s, &end);
+  } catch (const std::exception&) {
+  }
+  int shift = 0;
+  if (end > 0 && end + 1 == s.size()) {
+    auto unit = std::string_view("kmg").find(std::tolower(static_cast<unsigned char>(s[end])));
+    if (unit != std::string_view::npos) {
+      shift = 10 * static_cast<int>(unit + 1);
+      ++end;
+    }
+  }
+  if (end == 0 || end != s.size() || n > (UINT64_MAX >> shift))
+    throw std::invalid_argument("not a size: " + s);
+  return static_cast<uint64_t>(n) << shift;
+}
+
+bool parseBool(const std::string& s) {
+  if (s == "on" || s == "true" || s == "yes" || s == "1")
+    return true;
+  if (s == "off" || s == "false" || s == "no" || s == "0")
+    return false;
+  throw std::invalid_argument("not on or off: " + s);
+}
+
+void set(Config& config, const std::string& key, const std::string& value) {
+  if (key == "port") {
+    config.port = parsePort(value);
+  } else if (key == "dir") {
+    config.dir = value;
+  } else if (key == "peer") {
+    auto colon = value.rfind(':');
+    if (colon == std::string::npos || colon == 0)
+      throw std::invalid_argument("peer is not host:port: " + value);
+    config.peers.push_back(
+        {value.substr(0, colon), parsePort(value.substr(colon + 1))});
+  } else if (key == "interval") {
+    config.interval = parseSeconds(value);
+  } else if (key == "follow") {
+    config.follow = parseBool(value);
+  } else if (key == "timeout") {
+    config.timeout = parseSeconds(value);
+  } else if (key == "hash") {
+    auto hash = fstree::parseHashAlgorithm(value);
+    if (!hash)
+      throw std::invalid_argument("unknown hash algorithm: " + value);
+    config.hash = *hash;
+  } else if (key == "lazy") {
+    config.lazy = parseBool(value);
+  } else if (key == "order") {
+    auto order = net::parseOrder(value);
+    if (!order)
+      throw std::invalid_argument("unknown order: " + value);
+    config.schedule.order = *order;
+  } else if (key == "priority") {
+    config.schedule.priority.push_back(value);
+  } else if (key == "interleave") {
+    config.schedule.interleave_bytes = parseBytes(value);
+  } else if (key == "rate-limit") {
+    config.rate_limit = parseBytes(value);
+  } else if (key == "peer-rate-limit") {
+    config.peer_rate_limit = parseBytes(value);
+  } else if (key == "metrics-port") {
+    config.metrics_port = parsePort(value);
+  } else if (key == "metrics-address") {
+    boost::system::error_code ec;
+    config.metrics_address = boost::asio::ip::make_address(value, ec);
+    if (ec)
+      throw std::invalid_argument("not an IP address: " + value);
+  } else {
+    throw std::invalid_argument("unknown option: " + key);
+  }
+}
+
+std::string trim(const std::string& s) {
+  auto first = s.find_first_not_of(" \t\r");
+  if (first == std::string::npos)
+    return {};
+  return s.substr(first, s.find_last_not_of(" \t\r") - first + 1);
+}
+
+void load(Config& config, const std::filesystem::path& path) {
+  std::ifstream in(path);
+  if (!in)
+    throw std::runtime_error("cannot read " + path.string());
+  std::string line;
+  for (int number = 1; std::getline(in, line); ++number) {
+    line = trim(line.substr(0, line.find('#')));
+    if (line.empty())
+      continue;
+    auto eq = line.find('=');
+    if (eq == std::string::npos)
+      throw std::invalid_argument(path.string() + ":" +
+                                  std::to_string(number) + ": expected "
+                                  "key = value");
+    set(config, trim(line.substr(0, eq)), trim(line.substr(eq + 1)));
+  }
+}
+
+Config parse(int argc, char* argv[]) {
+  Config config;
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg.rfind("--", 0) != 0) {
+      positional.push_back(arg);
+      continue;
+    }
+    if (i + 1 == argc)
+      throw std::invalid_argument(arg + " needs a value");
+    std::string value = argv[++i];
+    if (arg == "--config")
+      load(config, value);
+    else
+      set(config, arg.substr(2), value);
+  }
+
+  if (positional.size() > 2)
+    throw std::invalid_argument("too many arguments");
+  if (positional.size() > 0)
+    config.port = parsePort(positional[0]);
+  if (positional.size() > 1)
+    config.dir = positional[1];
+  if (config.port == 0 || config.dir.empty())
+    throw std::invalid_argument("a port and a directory are required");
+  return config;
+}
+
+std::mutex log_mtx;
+
+void log(const std::string& message) {
+  std::lock_guard<std::mutex> lock(log_mtx);
+  std::cerr << "file-sync-daemon: " << message << std::endl;
+}
+
+// Everything the engine's callbacks and the signal thread hand to the main
+// loop, which does the rest
+struct Shared {
+  std::mutex mtx;
+  std::condition_variable cv;
+  bool stopping = false;
+  bool woken    = false;
+  std::set<uint64_t> pushed;  // peers whose tree changed, by id
+  std::vector<uint64_t> connected;  // per Config::peers, 0 until connected
+
+  void wake() {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      woken = true;
+    }
+    cv.notify_one();
+  }
+};
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  Config config;
+  try {
+    config = parse(argc, argv);
+  } catch (const std::exception& e) {
+    std::cerr << "file-sync-daemon: " << e.what() << "\nusage: "
+              << "file-sync-daemon [--config <file>] [--<key> <value>]... "
+                 "[<port> <dir>]\n";
+    return 2;
+  }
+
+  // Taken by the signal thread alone, the engine's threads inherit the mask
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  Shared shared;
+  shared.connected.assign(config.peers.size(), 0);
+
+  engine::Options options;
+  options.port                = config.port;
+  options.root                = config.dir;
+  options.push_changes        = config.follow;
+  options.scan.hash_algorithm = config.hash;
+  options.lazy_trees          = config.lazy;
+  options.schedule            = config.schedule;
+  options.total_rate_limit    = config.rate_limit;
+  options.peer_rate_limit     = config.peer_rate_limit;
+
+  engine::Callbacks callbacks;
+  callbacks.changed = [&] { shared.wake(); };
+  callbacks.error   = [](const std::string& title, const std::string& msg) {
+    log(title + ": " + msg);
+  };
+  callbacks.peer_tree = [&](uint64_t peer_id) {
+    {
+      std::lock_guard<std::mutex> lock(shared.mtx);
+      shared.pushed.insert(peer_id);
+      shared.woken = true;
+    }
+    shared.cv.notify_one();
+  };
+
+  std::unique_ptr<engine::SyncEngine> sync_engine;
+  std::unique_ptr<net::MetricsServer> metrics_server;
+  try {
+    sync_engine = std::make_unique<engine::SyncEngine>(options, callbacks);
+    if (config.metrics_port)
+      metrics_server = std::make_unique<net::MetricsServer>(
+          *config.metrics_port, config.metrics_address);
+  } catch (const std::exception& e) {
+    log(e.what());
+    return 1;
+  }
+  sync_engine->start();
+  log("serving " + config.dir.string() + " on port " +
+      std::to_string(sync_engine->port()));
+
+  std::thread signal_thread([&] {
+    int signal = 0;
+    sigwait(&signals, &signal);
+    std::lock_guard<std::mutex> lock(shared.mtx);
+    shared.stopping = true;
+    shared.cv.notify_one();
+  });
+
+  using clock       = std::chrono::steady_clock;
+  auto now          = clock::now();
+  auto next_connect = now;
+  auto next_pull    = now + config.interval;
+  std::vector<bool> due(config.peers.size(), false);
+  std::set<uint64_t> pushed;  // kept until the peer's sync can start
+  std::optional<std::size_t> syncing;  // index into config.peers
+
+  while (true) {
+    std::vector<uint64_t> connected;
+    {
+      std::unique_lock<std::mutex> lock(shared.mtx);
+      auto wake_at = next_connect;
+      if (config.interval.count() > 0)
+        wake_at = std::min(wake_at, next_pull);
+      shared.cv.wait_until(lock, wake_at, [&] {
+        return shared.stopping || shared.woken;
+      });
+      if (shared.stopping)
+        break;
+      shared.woken = false;
+      pushed.merge(shared.pushed);
+      connected = shared.connected;
+    }
+    now = clock::now();
+
+    // Handshakes take at most config.timeout, so an attempt is over by the
+    // time the next one is due
+    if (now >= next_connect) {
+      next_connect = now + std::max<clock::duration>(RECONNECT_DELAY,
+                                                     2 * config.timeout);
+      for (std::size_t i = 0; i < config.peers.size(); ++i) {
+        if (connected[i] && sync_engine->findPeer(connected[i]))
+          continue;
+        sync_engine->connect(config.peers[i].host,
+                     config.peers[i].port,
+                     config.timeout,
+                     [&, i](uint64_t peer_id) {
+                       log("connected to " + config.peers[i].host + ":" +
+                           std::to_string(config.peers[i].port));
+                       // Catch up with whatever changed while apart
+                       {
+                         std::lock_guard<std::mutex> lock(shared.mtx);
+                         shared.connected[i] = peer_id;
+                         shared.pushed.insert(peer_id);
+                         shared.woken = true;
+                       }
+                       shared.cv.notify_one();
+                     });
+      }
+    }
+
+    if (config.interval.count() > 0 && now >= next_pull) {
+      next_pull = now + config.interval;
+      std::fill(due.begin(), due.end(), true);
+    }
+
+    auto status = sync_engine->syncStatus();
+    if (syncing && !status.busy()) {
+      const auto& peer = config.peers[*syncing];
+      if (status.phase == engine::SyncPhase::Done)
+        log("synced from " + peer.host + ":" + std::to_string(peer.port) +
+            ", " + std::to_string(status.files_done) + " changes");
+      else
+        log("sync from " + peer.host + ":" + std::to_string(peer.port) +
+            " failed");
+      syncing.reset();
+    }
+    if (status.busy())
+      continue;
+
+    // One pull at a time, and only when the trees differ. A sync gives
+    // files it finds equal by hash the peer's mtime, so two daemons
+    // mirroring each other go quiet once they agree. Directories of a lazy
+    // tree not fetched yet are taken to differ.
+    for (std::size_t i = 0; i < config.peers.size() && !syncing; ++i) {
+      if (!connected[i])
+        continue;
+      bool was_pushed = pushed.erase(connected[i]) > 0;
+      if (!due[i] && !(config.follow && was_pushed))
+        continue;
+      auto diff = sync_engine->diff(connected[i]);
+      if (!diff)
+        continue;  // disconnected, retried above
+      due[i]      = false;
+      bool needed = !diff->diffs.empty() || !diff->unloaded.empty();
+      if (needed && sync_engine->sync(connected[i]))
+        syncing = i;
+    }
+  }
+
+  log("stopping");
+  signal_thread.join();
+  sync_engine->stop();
+}
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "../fstree/fstree.hpp"
+#include "../fstree/thread_pool.hpp"
+#include "../fstree/watcher.hpp"
+#include "../metrics/metrics.hpp"
+#include "../net/peer.hpp"
+#include "../net/rate_limiter.hpp"
+#include "../net/scheduler.hpp"
+
+// The sync engine behind both front ends: the TUI (main.cpp) and the
+// headless daemon (daemon.cpp). It owns the peer, the local tree and its
+// watcher, the handshakes and the per-session listeners that serve and
+// receive syncs. Front ends drive it through the public calls and hear back
+// through Callbacks; nothing here renders or blocks on a front end.
+namespace engine {
+namespace asio = boost::asio;
+namespace fs   = std::filesystem;
+
+struct PeerInfo {
+  std::string name;
+  uint64_t peer_id;
+  asio::ip::address address;
+  uint16_t port;  // the peer's listen port
+  // Never changed once stored: updates replace it with a changed copy, so
+  // whoever holds the pointer can read it without locks
+  std::shared_ptr<fstree::DirectoryTree> tree;
+  std::weak_ptr<net::Session> session;
+};
+
+// One sync at a time, the one this peer requested last
+enum class SyncPhase { Idle, SyncingTrees, SyncingFiles, Done, Error };
+
+struct SyncStatus {
+  SyncPhase phase = SyncPhase::Idle;
+  int files_done  = 0;
+  int files_total = 0;
+
+  bool busy() const {
+    return phase == SyncPhase::SyncingTrees ||
+           phase == SyncPhase::SyncingFiles;
+  }
+};
+
+struct Options {
+  uint16_t port = 0;
+  fs::path root;
+  unsigned io_threads      = 0;  // 0 = hardware concurrency
+  unsigned compute_threads = 2;
+  // Files are only hashed when a sync finds equal sizes with other mtimes
+  fstree::ScanOptions scan{0, true, true};
+  net::TransferOptions transfer;
+  // Which files of a sync we serve go first
+  net::ScheduleOptions schedule;
+  // Bytes per second we send to each peer and to all of them together,
+  // syncs and tree exchanges alike. 0 = unlimited.
+  uint64_t peer_rate_limit  = 0;
+  uint64_t total_rate_limit = 0;
+  // Peers syncing from us at the same time share the file reads
+  bool chunk_cache = true;
+
+  // Watcher events are applied once they go quiet for watch_quiet, but no
+  // later than watch_max_delay after the first one
+  std::chrono::milliseconds watch_quiet{250};
+  std::chrono::milliseconds watch_max_delay{2000};
+  // Send the local tree to every peer after it changes, so mirrors of it
+  // can follow without polling
+  bool push_changes = false;
+  // Offer lazy trees: peers that both do exchange only the top of their
+  // trees and fetch the directories a diff finds different, see
+  // net::FEATURE_LAZY_TREE
+  bool lazy_trees = false;
+};
+
+// Called from the io_context threads, so they must be quick and thread
+// safe. Any of them may be empty.
+struct Callbacks {
+  // Peers, trees or sync progress changed
+  std::function<void()> changed;
+  // Something failed that a user should hear about
+  std::function<void(const std::string& title, const std::string& message)>
+      error;
+  // A peer pushed its tree without being asked, e.g. after a local change
+  std::function<void(uint64_t peer_id)> peer_tree;
+};
+
+// A diffTree() of the local tree against a peer's, see SyncEngine::diff()
+struct Diff {
+  uint64_t version = 0;  // SyncEngine::treeVersion() it was taken at
+  std::vector<fstree::NodeDiff> diffs;
+  // Directories that differ but aren't fetched from a lazy peer yet; their
+  // contents are missing from diffs until they arrive
+  std::vector<fs::path> unloaded;
+};
+
+class SyncEngine {
+ public:
+  // Scans root before returning; start() begins serving
+  explicit SyncEngine(Options, Callbacks = {});
+  ~SyncEngine();  // stop()s
+
+  SyncEngine(const SyncEngine&)            = delete;
+  SyncEngine& operator=(const SyncEngine&) = delete;
+
+  // Accepts peers, watches the tree and runs the io_context on its own
+  // threads until stop()
+  void start();
+  void stop();
+
+  const PeerInfo& local() const { return local_; }
+  uint16_t port() const { return local_.port; }
+  std::vector<PeerInfo> peers() const;
+  std::optional<PeerInfo> findPeer(uint64_t peer_id) const;
+
+  // Bumped whenever the local tree or a peer's tree changes
+  uint64_t treeVersion() const;
+  std::optional<Diff> diff(uint64_t peer_id) const;
+  SyncStatus syncStatus() const;
+
+  // Handshakes with host:port, giving up after timeout. on_connected gets
+  // the peer's id once it is in peers(), also if it already was; failures
+  // go to Callbacks::error.
+  void connect(const std::string& host,
+               uint16_t port,
+               std::chrono::seconds timeout,
+               std::function<void(uint64_t peer_id)> on_connected = {});
+  // Picks up local changes and, for a connected peer, swaps trees with it.
+  // Clears the status of a finished sync.
+  void refresh(std::optional<uint64_t> peer_id = std::nullopt);
+  // Makes the local tree a copy of the peer's. False if a sync is already
+  // running or there is no such peer.
+  bool sync(uint64_t peer_id);
+  void disconnect(uint64_t peer_id);
+
+ private:
+  using SessionPtr = std::shared_ptr<net::Session>;
+  using PacketType = net::Session::PacketType;
+
+  // Coroutines that keep Node references into local_.tree across co_awaits
+  // (e.g. while streaming a sync) pin it; updates wait meanwhile.
+  struct TreePin {
+    int& pins;
+    explicit TreePin(int& p) : pins(p) { ++pins; }
+    ~TreePin() { --pins; }
+  };
+
+  // A control session's listen(). Both ends may sync at once: packets of
+  // the peer's sync are dispatched while serveSync() waits for a reply, and
+  // a SyncRequest that comes in meanwhile is served after it.
+  struct Listener {
+    SessionPtr session;
+    uint64_t peer_id    = 0;
+    bool serving        = false;  // in serveSync()
+    bool sync_requested = false;  // SyncRequest in, its tree not yet
+    bool sync_pending   = false;  // both in, to be served
+  };
+
+  void changed();
+  void error(const std::string& title, const std::string& message);
+  bool known(uint64_t peer_id) const;
+  std::vector<SessionPtr> sessions() const;
+  // With peer_mutex_ held
+  bool removePeer(const SessionPtr&);
+  PeerInfo* findPeer(const SessionPtr&);
+  // What sessions to the peer send through, empty without limits
+  std::vector<std::shared_ptr<net::RateLimiter>> rateLimiters(
+      uint64_t peer_id);
+
+  net::Session::HelloPacket localHello(bool data_channel);
+  asio::awaitable<void> sendLocalTree(SessionPtr, bool tagged);
+  asio::awaitable<std::shared_ptr<fstree::DirectoryTree>> scanLocalTree(
+      std::shared_ptr<fstree::DirectoryTree> base);
+  asio::awaitable<void> updateLocalTree();
+  asio::awaitable<void> pushLocalTree();
+  asio::awaitable<void> watch();
+
+  asio::awaitable<void> accepted(SessionPtr);
+  asio::awaitable<void> handshake(SessionPtr,
+                                  std::function<void(uint64_t)> on_connected);
+  // Adds the peer once its tree is in, false if it already was there
+  bool addPeer(PeerInfo);
+
+  std::shared_ptr<fstree::DirectoryTree> peerTree(const SessionPtr&);
+  asio::awaitable<std::shared_ptr<fstree::DirectoryTree>> receivePeerTree(
+      SessionPtr, PacketType);
+  // Lazy trees: loadSubtrees() asks for the stubs that differ from the local
+  // tree, receiveSubtrees() grafts the answer and returns the paths it held
+  asio::awaitable<void> loadSubtrees(SessionPtr);
+  asio::awaitable<void> serveSubtrees(SessionPtr);
+  asio::awaitable<std::vector<fs::path>> receiveSubtrees(SessionPtr);
+  asio::awaitable<std::vector<SessionPtr>> openDataChannels(SessionPtr,
+                                                            unsigned count);
+  asio::awaitable<void> sendSyncOps(SessionPtr, std::vector<net::SyncOp>);
+  asio::awaitable<void> serveSync(
+      Listener&, std::shared_ptr<fstree::DirectoryTree> requester_tree);
+  asio::awaitable<bool> dispatch(Listener&, PacketType);
+  asio::awaitable<void> listen(SessionPtr);
+  asio::awaitable<void> listenData(SessionPtr);
+  bool lost(const SessionPtr&);
+
+  metrics::Histogram& packetSeconds(PacketType);
+
+  Options options_;
+  Callbacks callbacks_;
+  std::shared_ptr<net::Peer> peer_;
+  PeerInfo local_;
+
+  // Reads small files ahead of the socket while streaming a sync
+  fstree::ThreadPool read_pool_;
+  // Rescans, diffs and signatures, so they never stall the io_context
+  fstree::ThreadPool compute_pool_;
+  std::unique_ptr<fstree::Watcher> watcher_;  // null without inotify
+
+  // peers_, the tree pointers and tree_version_. Trees are swapped from the
+  // app strand, which reads them without it.
+  mutable std::mutex peer_mutex_;
+  std::vector<PeerInfo> peers_;
+  uint64_t tree_version_ = 0;
+  // Stubs asked for per peer id since its last full tree, also peer_mutex_
+  std::unordered_map<uint64_t, std::unordered_set<fs::path>> subtree_requests_;
+  // Per peer id, shared by its data channels, also peer_mutex_
+  std::unordered_map<uint64_t, std::shared_ptr<net::RateLimiter>>
+      rate_limiters_;
+  std::shared_ptr<net::RateLimiter> total_rate_limiter_;  // null = unlimited
+
+  // App strand only
+  int tree_pins_ = 0;
+  bool updating_ = false;
+  std::shared_ptr<fstree::DirectoryTree> pending_tree_;
+  asio::steady_timer update_done_;  // cancelled as each update ends
+  std::array<metrics::Histogram*, 256> packet_histograms_{};
+
+  std::atomic<SyncPhase> phase_{SyncPhase::Idle};
+  std::atomic<int> files_done_{0};
+  std::atomic<int> files_total_{0};
+
+  uint64_t pool_metrics_ = 0;
+  std::thread io_thread_;
+};
+}  // namespace engine
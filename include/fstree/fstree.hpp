@@ -1,12 +1,14 @@
 #pragma once
 
 #include <array>
+#include <cstddef>
 #include <cstdint>
 #include <filesystem>
 #include <istream>
 #include <memory>
 #include <optional>
 #include <ostream>
+#include <span>
 #include <string>
 #include <unordered_map>
 #include <variant>
@@ -17,6 +19,23 @@ namespace fstree {
 namespace fs = std::filesystem;
 using Hash   = std::array<uint8_t, 32>;
 
+// What file and directory hashes are computed with, one per tree. Both peers
+// must use the same, see net::Session::HelloPacket::hash. All go through
+// OpenSSL, which picks SHA-NI / AVX2 code paths where the CPU has them:
+// SHA-256 is fastest with SHA-NI, SHA-512/256 and BLAKE2b on 64-bit CPUs
+// without it. BLAKE2b's 512-bit digest is cut to 256 bits.
+enum class HashAlgorithm : uint8_t { Sha256, Sha512_256, Blake2b };
+const char* hashAlgorithmName(HashAlgorithm);
+std::optional<HashAlgorithm> parseHashAlgorithm(const std::string&);
+
+// Files are hashed in blocks of this size, so hashing memory stays constant
+constexpr std::size_t HASH_BLOCK_SIZE = 1024 * 1024;  // 1 MB
+
+// File-sync's own files are named with this prefix (hash cache, partial and
+// delta files, see isInternal()) and are never part of a DirectoryTree
+constexpr const char* INTERNAL_PREFIX = ".file-sync";
+bool isInternal(const fs::path&);
+
 enum class NodeType : uint8_t { File, Directory };
 
 struct FileMeta {
@@ -33,11 +52,18 @@ struct Node {
   using Data = std::variant<FileMeta, std::vector<std::unique_ptr<Node>>>;
 
   Data data;
+  std::optional<Hash> dir_hash;  // directories only, Merkle hash of children
+  // Directories only: a lazily sent tree left the children out, dir_hash
+  // still covers them. See DirectoryTree::graft().
+  bool stub = false;
 
   static Node file(fs::path);
-  static Node directory(fs::path);
-  void generate_hash(const fs::path&);
+  void generate_hash(const fs::path&, HashAlgorithm);
   friend std::unique_ptr<Node> deserializeNode(std::istream&);
+  friend std::unique_ptr<Node> cloneNode(const Node&);
+  friend class NodeCodec;
+  friend class FlatTree;
+  friend struct DirectoryTree;
 
  private:
   Node(NodeType, fs::path, Data&&);
@@ -46,18 +72,89 @@ struct Node {
 
 const std::vector<std::unique_ptr<Node>>& children(const Node&);
 std::vector<std::unique_ptr<Node>>& children(Node&);
+std::unique_ptr<Node> cloneNode(const Node&);  // deep copy of a subtree
+
+struct TreeDelta;
+
+class ThreadPool;
+
+struct ScanOptions {
+  unsigned threads = 0;     // scan / hash workers, 0 = hardware concurrency
+  bool hash_cache  = true;  // reuse hashes stored under the root, see HashCache
+  // Stat only: files keep no hash unless the hash cache has one, diffTree()
+  // takes equal size and mtime for equal content. See NodeDiff::needsHash().
+  bool quick_check = false;
+  HashAlgorithm hash_algorithm = HashAlgorithm::Sha256;
+};
 
 struct DirectoryTree {
   fs::path root_path;
   std::unique_ptr<Node> root;
   std::unordered_map<fs::path, Node*> index;
+  // Of the hashes held and the ones computed from now on. Trees built from
+  // nodes (received, cloned) get the default, set it to the sender's.
+  HashAlgorithm hash_algorithm = HashAlgorithm::Sha256;
 
   explicit DirectoryTree(fs::path);
+  explicit DirectoryTree(fs::path, const ScanOptions&);
   explicit DirectoryTree(fs::path, std::unique_ptr<Node>);
+  // Deep copy with the same hash settings, for changing a tree others may
+  // still be reading
+  DirectoryTree clone() const;
+
+  // Incremental maintenance, paths are relative to root_path. refresh() brings
+  // one path in line with the disk: it is rescanned (and rehashed) if it
+  // exists and removed otherwise. rename() moves a subtree without rehashing.
+  // Each change clears the directory hashes above it, updateHashes() then
+  // recomputes just those once a batch of changes is applied.
+  void refresh(const fs::path&);
+  void remove(const fs::path&);
+  void rename(const fs::path& from, const fs::path& to);
+  void updateHashes();
+
+  // Returns false if the tree isn't the delta's base, or doesn't match its
+  // result afterwards; the tree must then be replaced by a full copy.
+  bool applyDelta(TreeDelta&&);
+
+  // Lazily received trees. graft() puts a fetched directory in place of its
+  // stub, false unless the stub is there with the same hash. keepLoaded()
+  // copies in what an earlier version of the tree had fetched, wherever
+  // that is still a stub with the same hash.
+  bool graft(std::unique_ptr<Node>);
+  void keepLoaded(const DirectoryTree& previous);
 
  private:
+  void scan(Node&, ThreadPool&);
+  void insert(std::unique_ptr<Node>);
+  std::unique_ptr<Node> detach(const fs::path&);
+  void invalidate(const fs::path& dir);
   void buildIndex(Node&, bool change_path = false);
-  void generate_hash();
+  void generate_hash(ThreadPool&, const ScanOptions&);
+
+  bool quick_check_ = false;  // refresh() leaves files unhashed too
+};
+
+// Content hash of a file, what FileMeta::file_hash holds
+Hash hashFile(const fs::path&, HashAlgorithm);
+
+struct HashKey {
+  std::size_t operator()(const Hash&) const;
+};
+
+// Reverse of DirectoryTree::index: paths of files by content hash, to find
+// copies of the same bytes. A tree contributes the files it has hashes for,
+// add() takes hashes computed elsewhere. Doesn't follow later tree changes.
+class ContentIndex {
+ public:
+  ContentIndex() = default;
+  explicit ContentIndex(const DirectoryTree&);
+
+  void add(const Hash&, const fs::path&);
+  const fs::path* find(const Hash&) const;  // first path added
+  std::optional<fs::path> take(const Hash&);  // removes the path it returns
+
+ private:
+  std::unordered_map<Hash, std::vector<fs::path>, HashKey> paths_;
 };
 
 enum class ChangeType : uint8_t { Added, Deleted, Modified };
@@ -81,18 +178,98 @@ struct NodeDiff {
   static NodeDiff added(const Node&);
   static NodeDiff deleted(const Node&);
   static NodeDiff modified(const Node&, const Node&);
+
+  // A modified file of unchanged size but another mtime, with no hash on
+  // one side: it only differs if hashing both copies says so
+  bool needsHash() const;
 };
 
-std::vector<NodeDiff> diffTree(const DirectoryTree&, const DirectoryTree&);
+// Files of equal size are compared by hash when both have one and by mtime
+// otherwise. Subtrees with equal Merkle hashes are skipped. Throws if the
+// trees were hashed with different algorithms. Directories that differ but
+// are a stub on either side can't be compared; their paths go to unloaded
+// when given, and they are left out of the diff.
+std::vector<NodeDiff> diffTree(const DirectoryTree&,
+                               const DirectoryTree&,
+                               std::vector<fs::path>* unloaded = nullptr);
 
 // TODO: Instead of printing return a std::string
 void printTree(Node&, std::string prefix = "");
 void printHash(const Hash&);
 void printDiff(const std::vector<NodeDiff>&);
 
+// Tree wire formats. Legacy writes every node's full path with fixed-width
+// fields, Compact starts with a magic + version and writes names only (paths
+// are rebuilt from the parent), varints and an optional table of repeated
+// names. Readers accept both. Only Compact can carry stubs and directory
+// hashes; Legacy is the original layout, byte for byte.
+enum class TreeFormat : uint8_t { Legacy, Compact };
+
+// Levels written below the root; directories at the limit are written as
+// stubs, with their hash but without children
+constexpr std::size_t FULL_DEPTH = SIZE_MAX;
+
 void serializeNode(std::ostream&, const Node&);
 std::unique_ptr<Node> deserializeNode(std::istream&);
 
-std::vector<uint8_t> serializeTree(const DirectoryTree&);
-DirectoryTree deserializeTree(std::vector<uint8_t>);
+std::vector<uint8_t> serializeTree(const DirectoryTree&,
+                                   TreeFormat = TreeFormat::Compact,
+                                   std::size_t depth = FULL_DEPTH);
+DirectoryTree deserializeTree(std::span<const uint8_t>);
+
+// Builds a tree from its serialized form (either format) while the bytes
+// arrive, so a receiver never holds the whole payload. feed() takes the bytes
+// split anywhere; finish() throws unless they were exactly one tree.
+class TreeDecoder {
+ public:
+  TreeDecoder();
+  ~TreeDecoder();
+  TreeDecoder(TreeDecoder&&) noexcept;
+  TreeDecoder& operator=(TreeDecoder&&) noexcept;
+
+  void feed(std::span<const uint8_t>);
+  DirectoryTree finish();
+
+ private:
+  struct State;
+  std::unique_ptr<State> state_;
+};
+
+// ---------- Tree Delta ----------
+
+// Changes turning one version of a tree into a later one. Upserted nodes carry
+// their whole subtree. Versions are identified by a generation number chosen
+// by the sender and by the Merkle root of the tree.
+struct TreeDelta {
+  uint64_t base_generation = 0;
+  uint64_t generation      = 0;
+  Hash base_root{};
+  Hash root{};
+
+  std::vector<fs::path> removed;
+  std::vector<std::unique_ptr<Node>> upserted;
+};
+
+// Empty when either tree lacks a root hash
+std::optional<TreeDelta> makeDelta(const DirectoryTree& base,
+                                   const DirectoryTree& tree);
+
+std::vector<uint8_t> serializeDelta(const TreeDelta&,
+                                    TreeFormat = TreeFormat::Compact);
+TreeDelta deserializeDelta(std::span<const uint8_t>);
+
+// ---------- Subtrees ----------
+
+// Directories of a tree sent on their own, to fill in stubs of a lazily
+// received copy. node is null where the path isn't a directory (any more).
+struct Subtree {
+  fs::path path;
+  std::unique_ptr<Node> node;
+};
+
+// Always compact, each directory written depth levels deep
+std::vector<uint8_t> serializeSubtrees(const DirectoryTree&,
+                                       const std::vector<fs::path>&,
+                                       std::size_t depth);
+std::vector<Subtree> deserializeSubtrees(std::span<const uint8_t>);
 }  // namespace fstree
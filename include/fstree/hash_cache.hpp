@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include "fstree.hpp"
+
+namespace fstree {
+
+// On-disk map from a file's relative path to the hash computed the last time
+// the file was seen. An entry is reused only while size, mtime and inode all
+// still match, so a warm rescan costs one stat() per unchanged file.
+//
+// Lookups and stores are thread safe. save() writes back only the entries
+// looked up or stored since load, so files that vanished are dropped.
+// A cache holds hashes of one algorithm; one written with another is ignored
+// and replaced on save().
+class HashCache {
+ public:
+  static constexpr const char* FILE_NAME = ".file-sync.cache";
+
+  struct Stat {
+    uint64_t size;
+    int64_t mtime_ns;
+    uint64_t inode;
+
+    bool operator==(const Stat&) const = default;
+  };
+
+  explicit HashCache(fs::path cache_file,
+                     HashAlgorithm = HashAlgorithm::Sha256);
+
+  static std::optional<Stat> stat(const fs::path&);
+
+  std::optional<Hash> find(const fs::path& rel_path, const Stat&);
+  void store(const fs::path& rel_path, const Stat&, const Hash&);
+
+  // Atomically replaces the cache file. Returns false if it can't be written;
+  // the cache is only an optimisation, so callers may ignore failure.
+  bool save();
+
+ private:
+  struct Entry {
+    Stat stat;
+    Hash hash;
+  };
+
+  void load();
+
+  fs::path file_;
+  HashAlgorithm algorithm_;
+  std::mutex mtx_;
+  std::unordered_map<std::string, Entry> loaded_;
+  std::unordered_map<std::string, Entry> live_;
+};
+}  // namespace fstree
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "fstree.hpp"
+
+struct evp_md_ctx_st;
+
+// Block-level file delta in the style of rsync. The side holding an old copy
+// sends a Signature (weak rolling checksum + strong hash per block); the side
+// holding the new copy answers with Copy / Literal ops against those blocks.
+namespace fstree::rsync {
+
+constexpr uint32_t MIN_BLOCK_SIZE = 4 * 1024;     // 4 KB
+constexpr uint32_t MAX_BLOCK_SIZE = 1024 * 1024;  // 1 MB
+
+// ~sqrt(size), which balances signature size against the literal data
+// resent around each change
+uint32_t blockSize(uint64_t file_size);
+
+struct BlockSignature {
+  uint32_t weak;
+  Hash strong;
+};
+
+struct Signature {
+  uint64_t file_size  = 0;
+  uint32_t block_size = 0;  // 0 = no base file, send in full
+  std::vector<BlockSignature> blocks;
+};
+
+Signature computeSignature(const fs::path&);
+
+// SHA-256 of a whole file as it streams through, checked by the receiver of
+// a delta like rsync's whole-file checksum: a base copy that changed since
+// its Signature rebuilds the wrong bytes at the right size
+class FileChecksum {
+ public:
+  FileChecksum();
+  void update(const char* data, std::size_t size);
+  Hash final();
+
+ private:
+  std::unique_ptr<evp_md_ctx_st, void (*)(evp_md_ctx_st*)> ctx_;
+};
+
+struct DeltaOp {
+  enum class Kind : uint8_t { End = 0, Copy = 1, Literal = 2 };
+
+  Kind kind;
+  uint64_t block = 0;  // Copy: first base block
+  uint32_t count = 0;  // Copy: consecutive blocks
+  std::vector<char> data;  // Literal
+};
+
+// Produces the ops rebuilding a file from a Signature of an older version.
+// Reads the file once through a small window, so memory stays bounded.
+class DeltaEncoder {
+ public:
+  DeltaEncoder(const fs::path&, const Signature&);
+
+  // Appends ops until about max_literal bytes of literal data are pending or
+  // the file ends. Returns false once the whole file has been encoded.
+  bool next(std::vector<DeltaOp>&, std::size_t max_literal);
+  // Of every byte encoded, once next() returned false
+  Hash checksum();
+
+ private:
+  bool fill(std::size_t want);
+  void emitCopy(std::vector<DeltaOp>&, uint64_t block);
+  std::optional<uint64_t> match(std::size_t len);
+
+  std::ifstream file_;
+  const Signature& sig_;
+  uint64_t short_block_ = 0;  // size of the signature's last block
+  std::unordered_multimap<uint32_t, uint64_t> weak_index_;
+
+  std::vector<char> buf_;
+  std::size_t pos_ = 0, end_ = 0;
+  bool eof_        = false;
+  bool done_       = false;
+
+  bool rolling_ = false;
+  uint32_t a_ = 0, b_ = 0;
+  FileChecksum checksum_;
+};
+
+// Rebuilds a file from a base copy and a stream of ops
+class DeltaWriter {
+ public:
+  DeltaWriter(const fs::path& base, const fs::path& out, uint32_t block_size);
+
+  void apply(const DeltaOp&);
+  uint64_t written() const;
+  Hash checksum();  // of every byte written
+
+ private:
+  std::ifstream base_;
+  std::ofstream out_;
+  uint32_t block_size_;
+  uint64_t written_ = 0;
+  std::vector<char> buf_;
+  FileChecksum checksum_;
+};
+
+// Hashes of the whole blocks at the start of a file, none if it can't be
+// read. A partly received copy offers these to resume from.
+std::vector<Hash> blockHashes(const fs::path&, uint32_t block_size);
+
+// Bytes at the start of the file equal to the blocks behind those hashes,
+// where a transfer onto that copy can pick up
+uint64_t matchingPrefix(const fs::path&,
+                        const std::vector<Hash>&,
+                        uint32_t block_size);
+}  // namespace fstree::rsync
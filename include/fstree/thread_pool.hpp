@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fstree {
+
+// Work-stealing pool. Each worker owns a deque: tasks submitted from a worker
+// go to the back of its own deque and are popped LIFO, idle workers steal
+// from the front of other deques.
+class ThreadPool {
+ public:
+  using Task = std::function<void()>;
+
+  explicit ThreadPool(unsigned threads = 0);  // 0 = hardware concurrency
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&)            = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  void submit(Task);
+
+  // Blocks until every submitted task, including tasks submitted by tasks,
+  // has finished. Rethrows the first exception thrown by a task.
+  void wait();
+
+  unsigned size() const;
+  std::size_t queued() const;  // tasks waiting for a worker
+
+ private:
+  struct Queue {
+    std::mutex mtx;
+    std::deque<Task> tasks;
+  };
+
+  void workerLoop(unsigned);
+  bool tryPop(unsigned, Task&);
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+
+  mutable std::mutex mtx_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  std::size_t queued_  = 0;  // guarded by mtx_
+  std::size_t pending_ = 0;  // queued + running, guarded by mtx_
+  bool stop_           = false;
+  std::exception_ptr error_;
+
+  std::atomic<unsigned> next_queue_{0};
+};
+}  // namespace fstree
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "fstree.hpp"
+
+namespace fstree {
+
+// Tracks local changes under a root with inotify so a DirectoryTree can be
+// kept current at O(changes) cost instead of being rebuilt.
+//
+// read() drains pending kernel events without blocking and coalesces them;
+// apply() then replays renames and refreshes every touched path once, so a
+// burst of writes to one file costs a single rehash. Callers debounce by
+// waiting on fd() and delaying apply() until events stop arriving.
+class Watcher {
+ public:
+  explicit Watcher(fs::path root);
+  ~Watcher();
+
+  Watcher(const Watcher&)            = delete;
+  Watcher& operator=(const Watcher&) = delete;
+
+  int fd() const;  // readable while kernel events are pending
+
+  // Returns true if any new event was read
+  bool read();
+  bool pending() const;
+
+  // Returns false if events were lost (kernel queue overflow); the caller must
+  // rebuild the tree, watches are re-established for it.
+  bool apply(DirectoryTree&);
+
+ private:
+  void watch(const fs::path& rel_dir);  // recursive
+  void handle(int wd, uint32_t mask, uint32_t cookie, const char* name);
+
+  fs::path root_;
+  int fd_ = -1;
+
+  std::unordered_map<int, fs::path> watches_;  // wd -> relative directory
+  std::unordered_map<uint32_t, fs::path> moved_from_;  // cookie -> path
+  std::vector<std::pair<fs::path, fs::path>> renames_;
+  std::set<fs::path> dirty_;  // ordered, so parents refresh before children
+  bool overflow_ = false;
+};
+}  // namespace fstree
@@ -1,9 +1,13 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <istream>
 #include <ostream>
+#include <span>
 #include <string>
+#include <string_view>
+#include <vector>
 
 namespace fstree::wire {
 
@@ -17,4 +21,56 @@ uint64_t read_u64(std::istream&);
 
 void write_string(std::ostream&, const std::string&);
 std::string read_string(std::istream&);
+
+// The same encodings without a stream in between, plus LEB128 varints
+// (signed values zigzag encoded). Writer appends to a vector it doesn't own,
+// so the result is moved out instead of copied from a stringbuf.
+class Writer {
+ public:
+  explicit Writer(std::vector<uint8_t>& out) : out_(out) {}
+
+  void write_u8(uint8_t);
+  void write_u32(uint32_t);
+  void write_u64(uint64_t);
+  void write_varint(uint64_t);
+  void write_svarint(int64_t);
+  void write_string(std::string_view);   // u32 length
+  void write_vstring(std::string_view);  // varint length
+  void write_bytes(const void*, std::size_t);
+
+ private:
+  std::vector<uint8_t>& out_;
+};
+
+// Reads in place from a byte range. Like a stream it goes bad instead of
+// throwing: a read past the end returns zeros and leaves the reader
+// truncated(), which incremental decoders take as "wait for more data";
+// other bad input (an overlong varint) fails without being truncated.
+class Reader {
+ public:
+  explicit Reader(std::span<const uint8_t> data) : data_(data) {}
+
+  uint8_t read_u8();
+  uint32_t read_u32();
+  uint64_t read_u64();
+  uint64_t read_varint();
+  int64_t read_svarint();
+  std::string read_string();
+  std::string read_vstring();
+  void read_bytes(void*, std::size_t);
+  void skip(std::size_t);
+
+  std::size_t position() const { return pos_; }
+  std::size_t remaining() const { return data_.size() - pos_; }
+  bool truncated() const { return truncated_; }
+  explicit operator bool() const { return !failed_; }
+
+ private:
+  const uint8_t* take(std::size_t);  // nullptr once out of data
+
+  std::span<const uint8_t> data_;
+  std::size_t pos_ = 0;
+  bool failed_     = false;
+  bool truncated_  = false;
+};
 }  // namespace fstree::wire
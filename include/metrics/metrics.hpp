@@ -0,0 +1,120 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Process-wide counters, gauges and latency histograms for the hot paths,
+// exported as Prometheus text or JSON (see net::MetricsServer).
+//
+// Lookups by name take a lock, so call sites look a metric up once and keep
+// the reference, e.g. in a function-local static. Metrics live until exit;
+// updating one is a relaxed atomic add.
+namespace metrics {
+
+using Labels = std::vector<std::pair<std::string, std::string>>;
+
+class Counter {
+ public:
+  void add(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+  uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<uint64_t> value_{0};
+};
+
+class Gauge {
+ public:
+  void set(int64_t v) { value_.store(v, std::memory_order_relaxed); }
+  void add(int64_t n) { value_.fetch_add(n, std::memory_order_relaxed); }
+  int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<int64_t> value_{0};
+};
+
+// Durations in power-of-two buckets from 1 µs up to about 18 minutes, the
+// last bucket takes everything longer
+class Histogram {
+ public:
+  static constexpr std::size_t BUCKETS = 32;
+
+  void observe(std::chrono::nanoseconds);
+
+  struct Snapshot {
+    std::array<uint64_t, BUCKETS> counts{};  // per bucket, not cumulative
+    uint64_t count = 0;
+    double sum     = 0;  // seconds
+  };
+  Snapshot snapshot() const;
+
+  // Inclusive upper bound of bucket i in seconds, infinity for the last
+  static double upperBound(std::size_t i);
+
+ private:
+  std::array<std::atomic<uint64_t>, BUCKETS> counts_{};
+  std::atomic<uint64_t> sum_ns_{0};
+};
+
+// Observes the time from construction to destruction, nothing if null
+class Timer {
+ public:
+  explicit Timer(Histogram* histogram)
+      : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+  explicit Timer(Histogram& histogram) : Timer(&histogram) {}
+  ~Timer() {
+    if (histogram_)
+      histogram_->observe(std::chrono::steady_clock::now() - start_);
+  }
+
+  Timer(const Timer&)            = delete;
+  Timer& operator=(const Timer&) = delete;
+
+ private:
+  Histogram* histogram_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// The same name with the same labels always returns the same metric. A
+// name belongs to one kind of metric, help is taken from the first call.
+Counter& counter(const std::string& name,
+                 const std::string& help,
+                 const Labels& labels = {});
+Gauge& gauge(const std::string& name,
+             const std::string& help,
+             const Labels& labels = {});
+Histogram& histogram(const std::string& name,
+                     const std::string& help,
+                     const Labels& labels = {});
+
+// Values read at export time rather than updated as they change, like a
+// queue length behind a lock. Collectors run on the exporting thread.
+enum class Kind { Counter, Gauge };
+struct Sample {
+  Labels labels;
+  double value;
+};
+using Collector = std::function<std::vector<Sample>()>;
+
+// Returns an id for removeCollector(), which must be called before what the
+// collector reads goes away. Several collectors may share a name.
+uint64_t addCollector(const std::string& name,
+                      const std::string& help,
+                      Kind,
+                      Collector);
+void removeCollector(uint64_t id);
+
+// Prometheus text exposition format, version 0.0.4
+std::string prometheus();
+// {"<name>": {"type": "...", "help": "...", "series": [{"labels": {...},
+// "value": v}, ...]}, ...}. Histogram series have count, sum (seconds) and
+// cumulative [upper bound, count] buckets up to the last non-empty one in
+// place of value.
+std::string json();
+}  // namespace metrics
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace net {
+
+constexpr std::size_t CHUNK_CACHE_SIZE = 128 * 1024 * 1024;  // 128 MB
+
+// File data read for sending, shared by every session of a Peer, so a tree
+// synced to many peers at once is read and deflated once rather than once
+// per peer. A get() of a missing chunk loads it while concurrent get()s of
+// the same chunk wait for that load; chunks then stay until they are the
+// least recently used past the byte budget.
+//
+// Keys carry the file's size and mtime at the time it was opened, a file
+// changed since never hits data of its old version. Thread safe.
+class ChunkCache {
+ public:
+  using Chunk = std::shared_ptr<const std::vector<char>>;
+  using Load  = std::function<std::vector<char>()>;
+
+  struct Key {
+    std::string path;
+    uint64_t size   = 0;
+    int64_t mtime   = 0;
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    int level       = 0;  // deflate level of the bytes, 0 = as on disk
+
+    bool operator==(const Key&) const = default;
+  };
+
+  // Offset and length left for the caller, nullopt if path can't be stat'ed
+  static std::optional<Key> identify(const std::filesystem::path&);
+
+  explicit ChunkCache(std::size_t capacity = CHUNK_CACHE_SIZE);
+
+  ChunkCache(const ChunkCache&)            = delete;
+  ChunkCache& operator=(const ChunkCache&) = delete;
+
+  // Blocks while another thread loads the same key, so not for io threads.
+  // What load() throws reaches every waiter and nothing is cached.
+  Chunk get(const Key&, const Load&);
+  // Never waits: empty unless the chunk is loaded
+  Chunk find(const Key&);
+  void put(const Key&, Chunk);
+
+ private:
+  struct KeyHash {
+    std::size_t operator()(const Key&) const;
+  };
+  struct Entry {
+    std::shared_future<Chunk> chunk;
+    bool loaded      = false;
+    std::size_t size = 0;
+    std::list<Key>::iterator lru;  // when loaded
+  };
+
+  void store(const Key&, const Chunk&);  // mtx_ held
+  void evict();                          // mtx_ held
+
+  std::size_t capacity_;
+  std::mutex mtx_;
+  std::size_t used_ = 0;
+  std::list<Key> lru_;  // loaded entries, most recently used first
+  std::unordered_map<Key, Entry, KeyHash> entries_;
+};
+}  // namespace net
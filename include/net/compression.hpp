@@ -0,0 +1,82 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <span>
+#include <vector>
+
+// Optional deflate (zlib) compression of file chunks and tree payloads. Both
+// peers advertise FEATURE_DEFLATE in their Hello; once both have, compressed
+// data is marked by a flag bit in the length field it would otherwise use.
+namespace net::compression {
+namespace fs = std::filesystem;
+
+constexpr uint32_t FEATURE_DEFLATE = 1u << 0;  // HelloPacket::features
+
+// u32 chunk length | CHUNK_COMPRESSED is followed by the u32 raw length
+constexpr uint32_t CHUNK_COMPRESSED = 0x80000000u;
+// u64 payload size | PAYLOAD_COMPRESSED is followed by the u64 raw size
+constexpr uint64_t PAYLOAD_COMPRESSED = 1ull << 63;
+
+// Compressed file data goes in chunks of at most this much raw data, so it
+// still streams
+constexpr std::size_t CHUNK_SIZE  = 1024 * 1024;  // 1 MB
+constexpr std::size_t SAMPLE_SIZE = 64 * 1024;
+
+// Compresses into out (replaced). Returns false when that doesn't save at
+// least 1/16 of the size; out is unspecified then.
+bool deflate(const void* data,
+             std::size_t size,
+             int level,
+             std::vector<uint8_t>& out);
+
+// Throws unless data inflates to exactly raw_size bytes
+void inflate(const void* data,
+             std::size_t size,
+             void* out,
+             std::size_t raw_size);
+
+// Streaming inflate() for payloads decoded while they arrive: output goes to
+// the sink in pieces as input is fed in.
+class Inflater {
+ public:
+  using Sink = std::function<void(std::span<const uint8_t>)>;
+
+  explicit Inflater(uint64_t raw_size);
+  ~Inflater();
+
+  Inflater(const Inflater&)            = delete;
+  Inflater& operator=(const Inflater&) = delete;
+
+  void feed(const void* data, std::size_t size, const Sink&);
+  void finish();  // throws unless exactly raw_size bytes came out
+
+ private:
+  struct Stream;
+  std::unique_ptr<Stream> stream_;
+};
+
+// False for formats that are compressed already (archives, media, ...)
+bool compressibleName(const fs::path&);
+// Byte entropy of a sample, false for data that looks random
+bool compressibleSample(const void* data, std::size_t size);
+
+// Trades ratio for speed per stream: raises the level while the socket is
+// the bottleneck, lowers it when compression is.
+class AdaptiveLevel {
+ public:
+  static constexpr int MIN_LEVEL = 1;
+  static constexpr int MAX_LEVEL = 6;
+
+  int level() const { return level_; }
+  void update(std::chrono::steady_clock::duration compress,
+              std::chrono::steady_clock::duration send);
+
+ private:
+  int level_ = MIN_LEVEL;
+};
+}  // namespace net::compression
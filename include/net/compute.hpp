@@ -0,0 +1,61 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include "../fstree/thread_pool.hpp"
+
+namespace net {
+namespace asio = boost::asio;
+
+// Runs fn on pool and resumes the awaiting coroutine on its own executor with
+// fn's result, rethrowing whatever fn threw. For hashing, scanning and diffing
+// that would otherwise hold an io_context thread. fn must be copyable, it is
+// stored in a ThreadPool::Task, and is taken by reference, so co_await the
+// result right away. Pass a lambda that captures by value as a named local:
+// GCC 12 mangles such temporaries in a co_await expression.
+template <typename Fn>
+asio::awaitable<std::invoke_result_t<std::decay_t<Fn>&>> offload(
+    fstree::ThreadPool& pool, Fn&& fn) {
+  using T      = std::invoke_result_t<std::decay_t<Fn>&>;
+  using Stored = std::conditional_t<std::is_void_v<T>, bool, T>;
+
+  auto result = std::make_shared<std::optional<Stored>>();
+  // A named local: GCC 12 can destroy a temporary in a co_await expression
+  // twice, dropping a reference to result too many
+  auto initiate = [&pool, &fn, result](auto handler) {
+    using Handler = decltype(handler);
+    auto owner    = std::make_shared<Handler>(std::move(handler));
+    // Keeps the io_context from running out of work meanwhile
+    auto ex = asio::prefer(asio::get_associated_executor(*owner),
+                           asio::execution::outstanding_work.tracked);
+
+    pool.submit([fn = std::decay_t<Fn>(std::forward<Fn>(fn)),
+                 result,
+                 owner,
+                 ex]() mutable {
+      std::exception_ptr error;
+      try {
+        if constexpr (std::is_void_v<T>) {
+          fn();
+          result->emplace(true);
+        } else {
+          result->emplace(fn());
+        }
+      } catch (...) {
+        error = std::current_exception();
+      }
+      asio::post(ex, [owner, error] { std::move(*owner)(error); });
+    });
+  };
+  co_await asio::async_initiate<decltype(asio::use_awaitable),
+                                void(std::exception_ptr)>(initiate,
+                                                          asio::use_awaitable);
+
+  if constexpr (!std::is_void_v<T>)
+    co_return std::move(**result);
+}
+}  // namespace net
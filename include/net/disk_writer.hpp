@@ -0,0 +1,81 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace net {
+namespace asio = boost::asio;
+
+constexpr std::size_t RECV_BUFFER_SIZE  = 1024 * 1024;  // 1 MB
+constexpr std::size_t RECV_BUFFER_COUNT = 8;
+
+// Write-behind stage for received data. Jobs run in submission order on a
+// dedicated disk thread, so the session keeps reading the socket while
+// earlier data is written out. Sends read their next chunk ahead on the
+// same thread.
+//
+// Receive buffers come from a fixed pool: acquire() hands one out and waits
+// while all of them are queued for writing, which bounds memory and applies
+// backpressure when the disk is the slower side. Jobs return buffers with
+// release() once written.
+class DiskWriter {
+ public:
+  using Buffer = std::vector<char>;
+  using Job    = std::function<void()>;
+
+  explicit DiskWriter(asio::strand<asio::any_io_executor>,
+                      std::size_t buffers = RECV_BUFFER_COUNT);
+  ~DiskWriter();  // finishes queued jobs
+
+  DiskWriter(const DiskWriter&)            = delete;
+  DiskWriter& operator=(const DiskWriter&) = delete;
+
+  // Strand only. A buffer resized to size, capacity is kept across uses.
+  asio::awaitable<Buffer> acquire(std::size_t size);
+  void release(Buffer);  // any thread
+
+  void submit(Job);
+
+  // Waits for every job submitted so far and rethrows the first exception a
+  // job threw since the last flush().
+  asio::awaitable<void> flush();
+
+ private:
+  // Shared with handlers posted back to the strand, which may still be
+  // queued after the writer is gone
+  struct State {
+    explicit State(asio::strand<asio::any_io_executor>);
+
+    asio::strand<asio::any_io_executor> strand;
+    asio::steady_timer wake;  // cancelled when a buffer or job finishes
+
+    // strand only
+    std::vector<Buffer> free;
+    std::size_t allocated = 0;
+    std::size_t submitted = 0;
+    std::size_t completed = 0;
+    std::exception_ptr error;
+
+    void notify();
+  };
+
+  void run();
+
+  std::shared_ptr<State> state_;
+  std::size_t max_buffers_;
+
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  std::deque<Job> jobs_;  // guarded by mtx_
+  bool stop_ = false;
+  std::thread thread_;
+};
+}  // namespace net
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <cstdint>
+#include <thread>
+
+namespace net {
+namespace asio = boost::asio;
+using tcp      = asio::ip::tcp;
+
+// Serves metrics::prometheus() at /metrics and metrics::json() at
+// /metrics.json over plain HTTP, one response per connection. Runs its own
+// io_context on its own thread, so scrapes are answered while the peer's
+// threads are saturated. Listens on loopback unless given another address,
+// e.g. 0.0.0.0 for every interface.
+class MetricsServer {
+ public:
+  // port 0 picks a free port
+  explicit MetricsServer(
+      uint16_t port,
+      const asio::ip::address& address = asio::ip::address_v4::loopback());
+  ~MetricsServer();
+
+  MetricsServer(const MetricsServer&)            = delete;
+  MetricsServer& operator=(const MetricsServer&) = delete;
+
+  uint16_t port() const;
+
+ private:
+  asio::awaitable<void> acceptLoop();
+  static asio::awaitable<void> serve(tcp::socket);
+
+  asio::io_context io_;
+  tcp::acceptor acceptor_;
+  std::thread thread_;
+};
+}  // namespace net
@@ -1,32 +1,130 @@
 #pragma once
 
 #include <boost/endian/conversion.hpp>
-#include <atomic>
 #include <boost/asio.hpp>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <deque>
+#include <exception>
+#include <fstream>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <type_traits>
 #include <unordered_set>
 #include <vector>
 #include "../fstree/fstree.hpp"
+#include "../fstree/rsync.hpp"
+#include "../fstree/thread_pool.hpp"
+#include "../metrics/metrics.hpp"
+#include "chunk_cache.hpp"
+#include "compression.hpp"
+#include "disk_writer.hpp"
+#include "rate_limiter.hpp"
 
 namespace net {
 using boost::asio::ip::tcp;
 namespace asio = boost::asio;
 namespace fs   = std::filesystem;
 
+// Deltas are read whole, full trees are decoded as they arrive and have no
+// size limit
 constexpr uint64_t MAX_TREE_SIZE       = 64 * 1024 * 1024;  // 64MB
+constexpr std::size_t TREE_READ_SIZE   = 256 * 1024;        // per read
 constexpr uint32_t MAX_FILE_CHUNK_SIZE = 64 * 1024 * 1024;  // 64 MB
+// Bounds for chunks sized from the socket send buffer, see chunkSize()
+constexpr uint32_t MIN_SEND_CHUNK_SIZE = 64 * 1024;         // 64 KB
+constexpr uint32_t MAX_SEND_CHUNK_SIZE = 4 * 1024 * 1024;   // 4 MB
+// Modified files at least this large are sent as a block delta
+constexpr uint64_t DELTA_MIN_FILE_SIZE = 1024 * 1024;       // 1 MB
+constexpr std::size_t DELTA_MAX_LITERAL = 1024 * 1024;      // per write
+// Files at least this large, and files sent in ranges, are received into
+// partialPath() and renamed into place when complete. A later sync resumes
+// them from the RESUME_BLOCK_SIZE blocks that match the sender's copy.
+constexpr uint64_t RESUME_MIN_FILE_SIZE = 1024 * 1024;      // 1 MB
+constexpr uint32_t RESUME_BLOCK_SIZE    = 4 * 1024 * 1024;  // 4 MB
+// Files at least this large are cloned or moved from a copy the requester
+// already has instead of being sent again
+constexpr uint64_t LOCAL_COPY_MIN_FILE_SIZE = 4 * 1024;     // 4 KB
+// Small reads pull this much ahead from the socket, larger ones bypass it
+constexpr std::size_t READ_AHEAD_SIZE  = 64 * 1024;
+// Queued packets not yet written past which senders wait for theirs
+constexpr std::size_t TX_QUEUE_LIMIT   = 4 * 1024 * 1024;
+// Hello feature bit next to compression::FEATURE_DEFLATE: trees and deltas
+// use fstree::TreeFormat::Compact
+constexpr uint32_t FEATURE_COMPACT_TREE = 1u << 1;
+// Lazy trees, needs FEATURE_COMPACT_TREE too: trees go LAZY_TREE_DEPTH levels
+// deep with deeper directories as stubs, which the receiver fetches with a
+// SubtreeRequest, SUBTREE_DEPTH levels at a time. No tree deltas then.
+constexpr uint32_t FEATURE_LAZY_TREE  = 1u << 2;
+constexpr std::size_t LAZY_TREE_DEPTH = 1;
+constexpr std::size_t SUBTREE_DEPTH   = 2;
+// Packet families past the original protocol, each sent only once both
+// Hellos offered its bit. Without them a sync falls back to full Trees and
+// FileData.
+constexpr uint32_t FEATURE_TREE_DELTA   = 1u << 3;  // TreeDelta, TreeResync
+constexpr uint32_t FEATURE_FILE_DELTA   = 1u << 4;  // Signature..DeltaResult
+constexpr uint32_t FEATURE_FILE_BUNDLE  = 1u << 5;  // FileBundle
+constexpr uint32_t FEATURE_MULTI_STREAM = 1u << 6;  // data channels, FileRange
+constexpr uint32_t FEATURE_FILE_HASHES  = 1u << 7;  // HashRequest, SetMtime
+constexpr uint32_t FEATURE_RESUME       = 1u << 8;  // ResumeRequest, offsets
+constexpr uint32_t FEATURE_LOCAL_COPY   = 1u << 9;  // CopyFile, MoveFile
+// Tunables for the pipelined sync stream, see Session::sendSyncOps()
+struct TransferOptions {
+  uint64_t small_file_size  = 256 * 1024;   // read ahead and batched
+  std::size_t batch_size    = 1024 * 1024;  // bytes per socket write
+  std::size_t read_ahead    = 64;           // small file reads in flight
+  unsigned read_threads     = 4;            // for the read pool
+  uint64_t bundle_file_size = 64 * 1024;    // packed into FileBundles, 0 = off
+  std::size_t bundle_size   = 1024 * 1024;  // payload per FileBundle
+  bool compression          = true;         // offer deflate in Hello
+
+  // Multi-stream: extra data connections carry files above small_file_size,
+  // split into ranges, once a sync has at least multi_stream_min_bytes of
+  // them. 1 = everything on the control session.
+  unsigned streams               = 4;
+  uint64_t range_size            = 16 * 1024 * 1024;   // 16 MB
+  uint64_t multi_stream_min_bytes = 32 * 1024 * 1024;  // 32 MB
+};
+
+// One step of a sync stream, see Session::sendSyncOps()
+struct SyncOp {
+  // Copy and Move make node from the requester's file at path. Mtime gives
+  // the requester's copy of node, found to hold the same bytes, its mtime.
+  enum class Kind : uint8_t { File, Delete, CreateDir, Copy, Move, Mtime };
+
+  Kind kind;
+  const fstree::Node* node = nullptr;  // File / Copy / Move / Mtime
+  fs::path path;                       // Delete / CreateDir / Copy / Move
+  uint64_t offset = 0;  // File: bytes already in the requester's partial file
+};
+
+// Where a file is received before it replaces abs_path, an internal name
+// next to it
+fs::path partialPath(const fs::path& abs_path);
 
 class Session : public std::enable_shared_from_this<Session> {
  public:
   struct HelloPacket {
     uint64_t peer_id;
     std::string hostname;
+    uint16_t listen_port = 0;   // 0 = unknown
+    bool data_channel    = false;  // extra connection for a running sync
+    uint32_t features    = 0;      // FEATURE_* bits supported
+    // What the sender's tree is hashed with, older peers only know SHA-256.
+    // Trees are only comparable if both sides use the same.
+    fstree::HashAlgorithm hash = fstree::HashAlgorithm::Sha256;
   };
   using OnClose = std::function<void(std::shared_ptr<Session>)>;
 
-  explicit Session(tcp::socket, OnClose);
+  // Sends read file data through cache when given one
+  explicit Session(tcp::socket,
+                   OnClose,
+                   std::shared_ptr<ChunkCache> cache = nullptr);
 
   // Traffic
   asio::awaitable<void> sendTree(
@@ -35,12 +133,21 @@ class Session : public std::enable_shared_from_this<Session> {
       const fstree::DirectoryTree&);  // post-handshake: Tree tag + payload
   asio::awaitable<fstree::DirectoryTree> receiveTree();  // handshake: no tag
   asio::awaitable<fstree::DirectoryTree> receiveTreePayload();
+  // Empty if the delta isn't based on the last tree received, the peer
+  // should then be asked for a full tree with sendTreeResync()
+  asio::awaitable<std::optional<fstree::TreeDelta>> receiveTreeDeltaPayload();
 
+  // chunk_size 0 sizes chunks from the socket send buffer
   asio::awaitable<void> sendFile(const fstree::DirectoryTree&,
                                  const fstree::Node&,
-                                 uint32_t chunk_size = MAX_FILE_CHUNK_SIZE);
+                                 uint32_t chunk_size = 0);
   asio::awaitable<void> receiveFile(fstree::DirectoryTree&,
                                     bool rebuild_tree = true);
+  // Received files are written behind the socket reads; flushWrites() waits
+  // for everything received so far to be on disk. Other disk changes that
+  // must stay ordered with those writes go through queueDiskJob().
+  asio::awaitable<void> flushWrites();
+  void queueDiskJob(DiskWriter::Job);
   asio::awaitable<void> sendHello(const HelloPacket&);
   asio::awaitable<HelloPacket> receiveHello();
 
@@ -55,29 +162,147 @@ class Session : public std::enable_shared_from_this<Session> {
     SyncHeader  = 0x07,  // sender announces total op count before streaming
     CreateDir   = 0x08,  // sender tells requester to create an empty directory
     DisconnectRequest = 0x09,  // sender tells requester to disconnect
+    TreeDelta   = 0x0A,  // changes since the last tree sent on this session
+    TreeResync  = 0x0B,  // receiver couldn't apply a delta, wants a full tree
+    SignatureRequest = 0x0C,  // sender asks for block checksums of a path
+    Signature   = 0x0D,  // requester's block checksums of its old copy
+    FileDelta   = 0x0E,  // sender streams a file as ops against those blocks
+    FileBundle  = 0x0F,  // sender packs many small files into one packet
+    FileRange   = 0x10,  // one byte range of a file, on a data channel
+    HashRequest = 0x11,  // sender asks for content hashes of some paths
+    Hashes      = 0x12,  // requester's hashes, in request order
+    ResumeRequest = 0x13,  // sender asks what partial files are left
+    ResumeState = 0x14,  // requester's block hashes of those partial files
+    FileComplete = 0x15,  // all ranges of a file are sent, rename it
+    CopyFile    = 0x16,  // requester clones a file it has to another path
+    MoveFile    = 0x17,  // requester renames a file it would delete
+    SubtreeRequest = 0x18,  // receiver of a lazy tree wants some stubs
+    Subtrees    = 0x19,  // the directories asked for, see fstree::Subtree
+    SetMtime    = 0x1A,  // requester's copy has our content, takes our mtime
+    DeltaResult = 0x1B,  // requester applied a FileDelta, or wants it whole
   };
 
   asio::awaitable<void> sendPacketType(PacketType);
   asio::awaitable<PacketType> receivePacketType();
+  static const char* packetTypeName(PacketType);  // "?" if unknown
 
   // Refresh (tree exchange only)
   asio::awaitable<void> sendTreeRequest();
   asio::awaitable<bool> receiveTreeRequest();
 
   // Sync helpers — called by the listener / sync coroutine
+  // offset > 0 resumes onto the partial file the requester has, which
+  // holds that many bytes of this version
   asio::awaitable<void> sendTaggedFile(const fstree::DirectoryTree&,
-                                       const fstree::Node&);
+                                       const fstree::Node&,
+                                       uint64_t offset = 0);
+  // Part of a file, so large files can be spread over several sessions.
+  // receiveFileRange() returns true for the range ending the file.
+  asio::awaitable<void> sendFileRange(const fstree::DirectoryTree&,
+                                      const fstree::Node&,
+                                      uint64_t offset,
+                                      uint64_t length);
+  asio::awaitable<bool> receiveFileRange(fstree::DirectoryTree&);
+  // Ranges go to the partial file; once every session has written its
+  // ranges, this moves the file into place
+  asio::awaitable<void> sendFileComplete(const fstree::Node&);
+  asio::awaitable<void> receiveFileComplete(fstree::DirectoryTree&);
+  // SyncOp::Kind::Mtime, so files a hash found equal pass the next quick
+  // check instead of being hashed again
+  asio::awaitable<void> receiveSetMtime(fstree::DirectoryTree&);
   asio::awaitable<void> sendDeleteNotice(const std::filesystem::path& rel_path);
   asio::awaitable<void> sendCreateDir(const std::filesystem::path& rel_path);
   asio::awaitable<void> sendSyncDone();
+  // Sends the ops in order with the same packets as sendTaggedFile(),
+  // sendDeleteNotice() and sendCreateDir(), but batched into few writes
+  asio::awaitable<void> sendSyncOps(const fstree::DirectoryTree&,
+                                    const std::vector<SyncOp>&,
+                                    fstree::ThreadPool& read_pool,
+                                    const TransferOptions& = {});
+  // Returns the number of files written
+  asio::awaitable<uint32_t> receiveFileBundle(fstree::DirectoryTree&);
+  // SyncOp::Kind::Copy and Move, a copy is a reflink where the file system
+  // has them. A missing source leaves the path for the next sync.
+  asio::awaitable<void> receiveCopyFile(fstree::DirectoryTree&);
+  asio::awaitable<void> receiveMoveFile(fstree::DirectoryTree&);
   asio::awaitable<void> sendSyncHeader(uint32_t total_ops);
   asio::awaitable<uint32_t> receiveSyncHeader();
   asio::awaitable<std::filesystem::path> receiveRelPath();
   asio::awaitable<void> sendDisconnectRequest();
 
+  // Tree deltas
+  asio::awaitable<void> sendTreeResync();
+  void resetTreeDelta();  // next sendTaggedTree() sends a full tree
+
+  // Whether both Hellos offered all of the FEATURE_* bits given. Packets
+  // of a family the peer lacks must not be sent to it.
+  bool supports(uint32_t features) const {
+    return (local_features_ & remote_features_ & features) == features;
+  }
+
+  // Lazy trees, once both Hellos offered FEATURE_LAZY_TREE. Subtrees are
+  // read whole, like deltas.
+  bool lazyTrees() const { return lazy_; }
+  asio::awaitable<void> sendSubtreeRequest(
+      const std::vector<std::filesystem::path>& rel_paths);
+  asio::awaitable<std::vector<std::filesystem::path>> receiveSubtreeRequest();
+  asio::awaitable<void> sendSubtrees(
+      const fstree::DirectoryTree&,
+      const std::vector<std::filesystem::path>& rel_paths);
+  asio::awaitable<std::vector<fstree::Subtree>> receiveSubtrees();
+
+  // Block deltas for modified files: the sender asks for a Signature of the
+  // requester's copy, then sends a FileDelta against it. The requester
+  // checks the rebuilt file against the delta's whole-file checksum and
+  // answers with a DeltaResult; false keeps its old copy and asks for the
+  // file in full, e.g. because it changed since the Signature.
+  asio::awaitable<void> sendSignatureRequest(
+      const std::filesystem::path& rel_path);
+  asio::awaitable<void> sendSignature(const fstree::rsync::Signature&);
+  asio::awaitable<fstree::rsync::Signature> receiveSignature();
+  asio::awaitable<void> sendFileDelta(const fstree::DirectoryTree&,
+                                      const fstree::Node&,
+                                      const fstree::rsync::Signature&);
+  asio::awaitable<bool> receiveFileDelta(fstree::DirectoryTree&);
+  asio::awaitable<void> sendDeltaResult(bool applied);
+  asio::awaitable<bool> receiveDeltaResult();
+
+  // Trees scanned with quick_check carry no file hashes. Files whose size
+  // matches but mtime doesn't are settled by hashing both copies on demand,
+  // nullopt where the requester has no readable file.
+  asio::awaitable<void> sendHashRequest(
+      const std::vector<std::filesystem::path>& rel_paths);
+  asio::awaitable<std::vector<std::filesystem::path>> receiveHashRequest();
+  asio::awaitable<void> sendHashes(
+      const std::vector<std::optional<fstree::Hash>>&);
+  asio::awaitable<std::vector<std::optional<fstree::Hash>>> receiveHashes();
+
+  // Resuming transfers a dropped sync left behind: the requester answers
+  // with RESUME_BLOCK_SIZE block hashes of each path's partial file, empty
+  // where there is none
+  asio::awaitable<void> sendResumeRequest(
+      const std::vector<std::filesystem::path>& rel_paths);
+  asio::awaitable<std::vector<std::filesystem::path>> receiveResumeRequest();
+  asio::awaitable<void> sendResumeState(
+      const std::vector<std::vector<fstree::Hash>>&);
+  asio::awaitable<std::vector<std::vector<fstree::Hash>>> receiveResumeState();
+
+  // Socket bytes since the session started, any thread
+  struct Stats {
+    std::string remote;  // address:port, empty if unknown
+    std::chrono::steady_clock::time_point started;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+  };
+  Stats stats() const;
+
+  // Bandwidth: every outbound write waits on each limiter, e.g. one for
+  // the peer and one shared by all peers. Empty = unlimited. Any thread.
+  void limitRate(std::vector<std::shared_ptr<RateLimiter>>);
+
   // Utlilities
   tcp::socket& socket();
-  void close();
+  void close();  // any thread
 
  private:
   OnClose on_close_;
@@ -85,9 +310,163 @@ class Session : public std::enable_shared_from_this<Session> {
   tcp::socket socket_;
   asio::strand<asio::any_io_executor> strand_;
 
-  std::atomic<bool> busy_{false};
+  DiskWriter disk_{strand_};
+  std::shared_ptr<ChunkCache> cache_;  // may be null
+
+  std::string remote_;
+  std::chrono::steady_clock::time_point started_;
+  std::atomic<uint64_t> bytes_sent_{0};
+  std::atomic<uint64_t> bytes_received_{0};
+  void countSent(std::size_t);
+
+  // Drops a claimSocket() or receiveTurn() when it goes out of scope
+  class Turn {
+   public:
+    Turn(Session*, void (Session::*release)());
+    Turn(Turn&&) noexcept;
+    Turn& operator=(Turn&&) = delete;
+    ~Turn();
+
+   private:
+    Session* session_;
+    void (Session::*release_)();
+  };
+  struct Signal;
+  struct Outgoing;
+
+  // Outbound, strand_ only. Senders frame a whole packet and queue it; one
+  // writer coroutine drains the queue with gathered writes, so packets
+  // queued while a write is in flight share the next syscall. Streams that
+  // don't fit in memory claim the socket instead and write it directly once
+  // everything queued before them is out.
+  std::deque<std::shared_ptr<Outgoing>> tx_queue_;
+  std::size_t tx_queued_{0};  // bytes in tx_queue_
+  bool tx_writing_{false};    // writeQueued() running
+  bool tx_claimed_{false};    // a stream owns the socket
+  boost::system::error_code tx_error_;
+  // Returns once queued while under TX_QUEUE_LIMIT, else once written
+  asio::awaitable<void> send(std::vector<uint8_t> head,
+                             std::vector<uint8_t> body = {});
+  asio::awaitable<Turn> claimSocket();
+  void releaseSocket();
+  void startWriter();
+  asio::awaitable<void> writeQueued();
+  // Streams on a claimed socket write through this, counted like the queue
+  template <typename Buffers>
+  asio::awaitable<void> write(const Buffers&);
+  // Waits out the limiters before a write of that many bytes
+  std::vector<std::shared_ptr<RateLimiter>> limiters_;
+  asio::awaitable<void> throttle(std::size_t bytes);
+
+  // Inbound, strand_ only. Receives take turns in call order, and read()
+  // serves them from a read-ahead buffer so a tag, its header and a small
+  // payload usually arrive in one syscall.
+  bool rx_busy_{false};
+  std::deque<std::shared_ptr<Signal>> rx_waiters_;
+  std::vector<uint8_t> rx_buf_;
+  std::size_t rx_begin_{0};
+  std::size_t rx_end_{0};
+  asio::awaitable<Turn> receiveTurn();
+  void releaseReceive();
+  // timed: counts as waiting on the network, not where the peer may be idle
+  asio::awaitable<void> read(asio::mutable_buffer, bool timed = true);
+
+  // Receive side scratch
   std::vector<uint8_t> buffer_;
+  std::vector<uint8_t> packed_;  // compressed form of buffer_
   uint64_t size_be_{0};
+  uint64_t raw_size_be_{0};
+
+  // Compression and the compact tree format are on once both Hellos
+  // advertised them
+  uint32_t local_features_{0};
+  uint32_t remote_features_{0};
+  // Given to the trees received, from the peer's Hello
+  fstree::HashAlgorithm remote_hash_{fstree::HashAlgorithm::Sha256};
+  bool compress_{false};
+  bool lazy_{false};
+  fstree::TreeFormat tree_format_{fstree::TreeFormat::Legacy};
+  compression::AdaptiveLevel level_;
+  void updateFeatures();
+  asio::awaitable<void> sendTreePayload(std::optional<PacketType> tag,
+                                        std::vector<uint8_t> payload);
+  struct PayloadSize {
+    uint64_t size;
+    uint64_t raw_size;
+    bool compressed;
+  };
+  asio::awaitable<PayloadSize> readPayloadSize();
+  asio::awaitable<void> readTreePayload();
+  asio::awaitable<fstree::DirectoryTree> readTree();
+
+  // Tree versions. Every tree sent or received, full or delta, advances the
+  // generation on both ends; last_sent_ is the base for the next delta,
+  // never kept for lazy trees.
+  std::unique_ptr<fstree::DirectoryTree> last_sent_;
+  uint64_t tx_generation_{0};
+  uint64_t rx_generation_{0};
+
+  void recordSentTree(const fstree::DirectoryTree&);
+  asio::awaitable<void> sendTaggedPath(PacketType,
+                                       const std::filesystem::path&);
+  asio::awaitable<void> sendPathList(
+      PacketType, const std::vector<std::filesystem::path>&);
+  asio::awaitable<std::vector<std::filesystem::path>> receivePathList();
+  asio::awaitable<std::vector<uint8_t>> receiveSizedPayload(const char* what);
+  asio::awaitable<void> receiveLocalFile(fstree::DirectoryTree&, bool move);
+  asio::awaitable<void> streamFile(const std::string& prefix,
+                                   const fs::path&,
+                                   uint64_t offset,
+                                   uint64_t length,
+                                   uint32_t chunk_size);
+  asio::awaitable<void> copyChunks(std::shared_ptr<std::ifstream>,
+                                   uint64_t offset,
+                                   uint64_t length,
+                                   uint32_t chunk_size,
+                                   std::optional<ChunkCache::Key>);
+  asio::awaitable<void> streamCompressed(const std::string& prefix,
+                                         std::shared_ptr<std::ifstream>,
+                                         uint64_t offset,
+                                         uint64_t length,
+                                         uint32_t chunk_size,
+                                         std::optional<ChunkCache::Key>);
+  uint32_t chunkSize();
+  asio::awaitable<void> receiveChunks(std::shared_ptr<std::fstream>,
+                                      uint64_t length);
+
+  // Public coroutines enter through this when called off strand_: the body
+  // runs on strand_, the caller resumes on its own executor afterwards.
+  // co_spawn() can resume the caller inline from inside strand_, where
+  // running_in_this_thread() would wrongly hold for its next call, so the
+  // caller is posted back instead.
+  template <typename T>
+  asio::awaitable<T> onStrand(asio::awaitable<T> op) {
+    // co_spawn() needs a default constructible result, trees aren't
+    using Stored = std::conditional_t<std::is_void_v<T>, bool, T>;
+    auto boxed =
+        [](asio::awaitable<T> op) -> asio::awaitable<std::optional<Stored>> {
+      if constexpr (std::is_void_v<T>) {
+        co_await std::move(op);
+        co_return true;
+      } else {
+        co_return co_await std::move(op);
+      }
+    };
+
+    std::optional<Stored> result;
+    std::exception_ptr error;
+    try {
+      result = co_await asio::co_spawn(
+          strand_, boxed(std::move(op)), asio::use_awaitable);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    co_await asio::post(asio::use_awaitable);
+    if (error)
+      std::rethrow_exception(error);
+    if constexpr (!std::is_void_v<T>)
+      co_return std::move(*result);
+  }
 };
 
 class Peer : public std::enable_shared_from_this<Peer> {
@@ -96,10 +475,15 @@ class Peer : public std::enable_shared_from_this<Peer> {
   using OnConnect = std::function<void(std::weak_ptr<Session>)>;
   using OnError   = std::function<void(const boost::system::error_code&)>;
 
-  explicit Peer(uint16_t);
+  // The io_context runs on `threads` threads (0 = hardware concurrency).
+  // Sessions serialize on their own strands and run in parallel.
+  explicit Peer(uint16_t, unsigned threads = 0);
+  ~Peer();
 
+  // Strand for application coroutines: they never run concurrently with
+  // each other, and Session calls resume them back on it
   asio::any_io_executor getExecutor();
-  void run();
+  void run();  // blocks, running the io_context on every thread
   void stop();
 
   void doAccept(OnAccept);
@@ -111,14 +495,34 @@ class Peer : public std::enable_shared_from_this<Peer> {
   void doResolveAndConnect(const std::string&, uint16_t, OnConnect, OnError);
   void clearSessions();
 
+  // Sessions created from now on share one ChunkCache, for serving the same
+  // files to many peers at once. Call before run().
+  void enableChunkCache(std::size_t capacity = CHUNK_CACHE_SIZE);
+
+  // For extra connections opened from a coroutine, e.g. sync data channels
+  asio::awaitable<std::shared_ptr<Session>> connect(tcp::endpoint);
+  uint16_t port() const;
+
   uint64_t id();
 
  private:
+  static unsigned defaultThreads();
+
   uint64_t id_;
   std::shared_ptr<Session> createSession(tcp::socket);
   boost::asio::io_context io_;
+  unsigned threads_;
+  asio::strand<asio::io_context::executor_type> app_;
   tcp::acceptor acceptor_;
   tcp::resolver resolver_;
+  std::mutex sessions_mtx_;
   std::unordered_set<std::shared_ptr<Session>> sessions_;
+  std::shared_ptr<ChunkCache> chunk_cache_;
+
+  // Per-session byte counts and rates, exported from sessions_
+  std::vector<uint64_t> collectors_;
+  void addSessionMetrics();
+  std::vector<metrics::Sample> sessionSamples(
+      const std::function<double(const Session&, const Session::Stats&)>&);
 };
 }  // namespace net
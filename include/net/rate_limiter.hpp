@@ -0,0 +1,37 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace net {
+
+// Token bucket over bytes: fills at `rate` bytes per second up to `burst`
+// (one second's worth if 0). Sessions share one per peer and one for all
+// peers, see Session::limitRate(). Thread safe.
+class RateLimiter {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit RateLimiter(uint64_t rate, uint64_t burst = 0);
+
+  RateLimiter(const RateLimiter&)            = delete;
+  RateLimiter& operator=(const RateLimiter&) = delete;
+
+  // Takes bytes from the bucket right away, running it into debt if need
+  // be, and returns how long to wait before writing them. Later callers
+  // queue behind the debt, so concurrent writers share the rate.
+  Clock::duration reserve(std::size_t bytes);
+
+  uint64_t rate() const { return rate_; }
+
+ private:
+  const uint64_t rate_;
+  const double burst_;
+
+  std::mutex mtx_;
+  double tokens_;  // negative while in debt
+  Clock::time_point last_;
+};
+}  // namespace net
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "peer.hpp"
+
+namespace net {
+
+// The order a sync streams its files in, see scheduleOps()
+struct ScheduleOptions {
+  enum class Order : uint8_t {
+    Diff,         // as diffTree() found them
+    SmallFirst,   // fewest bytes left to send first
+    NewestFirst,  // latest mtime first
+  };
+  Order order = Order::SmallFirst;
+  // Globs (see globMatch()) for files that go ahead of the rest, earlier
+  // ones first; order applies among files of the same glob
+  std::vector<std::string> priority;
+  // Without data channels, files above TransferOptions::range_size are cut
+  // into ranges and sent one range per this many bytes of other files, so
+  // they don't hold the rest back. 0 = each file whole, in order.
+  uint64_t interleave_bytes = 8 * 1024 * 1024;  // 8 MB
+};
+
+const char* orderName(ScheduleOptions::Order);
+std::optional<ScheduleOptions::Order> parseOrder(const std::string&);
+
+// Relative paths against a glob: * and ? stay within a path component, **
+// spans any number of them. A glob without a / is matched against the file
+// name alone.
+bool globMatch(std::string_view glob, const fs::path& rel_path);
+
+// Reorders the file ops of a sync, stably. Everything else keeps its place
+// in front of them: moves take their sources before deletes run, and a file
+// may replace a deleted path.
+void scheduleOps(std::vector<SyncOp>&, const ScheduleOptions&);
+}  // namespace net
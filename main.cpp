@@ -1,126 +1,81 @@
 #include <algorithm>
+#include <atomic>
 #include <boost/asio.hpp>
-#include <boost/asio/experimental/awaitable_operators.hpp>
 #include <cctype>
+#include <chrono>
 #include <cstdint>
 #include <filesystem>
 #include <ftxui/component/component.hpp>
 #include <ftxui/component/screen_interactive.hpp>
 #include <ftxui/dom/elements.hpp>
 #include <ftxui/screen/screen.hpp>
+#include <ftxui/screen/terminal.hpp>
+#include <iostream>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <sstream>
 #include <string>
-#include <thread>
 #include <vector>
+#include "./include/engine/engine.hpp"
 #include "./include/fstree/fstree.hpp"
-#include "./include/net/peer.hpp"
+#include "./include/fstree/thread_pool.hpp"
+#include "./include/metrics/metrics.hpp"
+#include "./include/net/metrics_server.hpp"
 
-namespace asio = boost::asio;
-using namespace asio::experimental::awaitable_operators;
-std::pair<std::string, asio::ip::address> GetHostInfo() {
-  boost::asio::io_context io;
-
-  std::string hostname = boost::asio::ip::host_name();
-  asio::ip::address ip;
-
-  try {
-    boost::asio::ip::udp::socket socket(io);
-
-    socket.connect(boost::asio::ip::udp::endpoint(
-        boost::asio::ip::make_address("8.8.8.8"), 80));
-
-    ip = socket.local_endpoint().address();
-  } catch (...) {
-  }
-
-  return {hostname, ip};
-}
-
-struct PeerInfo {
-  std::string name;
-  uint64_t peer_id;
-  asio::ip::address address;
-  uint16_t port;
-  std::shared_ptr<fstree::DirectoryTree> tree;
-  std::weak_ptr<net::Session> session;
-};
-
-PeerInfo ExtractPeerInfo(std::shared_ptr<net::Session> session,
-                         const net::Session::HelloPacket& hello) {
-  auto& socket  = session->socket();
-  auto endpoint = socket.remote_endpoint();
-
-  PeerInfo info;
-  info.address = endpoint.address();
-  info.port    = endpoint.port();
-  info.session = session;
-
-  info.peer_id = hello.peer_id;
-  info.name    = hello.hostname;
-
-  return info;
-}
-
-// TODO: Separate sync_state for each peer
-// TODO: Implement parallel sending and receiving files
+// The TUI front end of engine::SyncEngine, see daemon.cpp for the headless one
+// TODO: Separate sync state for each peer
 int main(int argc, char* argv[]) {
   using namespace ftxui;
-
-  if (argc != 3) {
+  using engine::PeerInfo;
+
+  // file-sync [--hash <algorithm>] [--lazy] [--metrics-address <ip>]
+  //           <port> <dir> [metrics_port]
+  auto hash_algorithm = fstree::HashAlgorithm::Sha256;
+  bool lazy_trees     = false;
+  auto metrics_address =
+      boost::asio::ip::address(boost::asio::ip::address_v4::loopback());
+  while (argc > 1) {
+    std::string flag = argv[1];
+    if (flag == "--lazy") {
+      lazy_trees = true;
+      argc -= 1;
+      argv += 1;
+    } else if (flag == "--hash" && argc > 2) {
+      auto parsed = fstree::parseHashAlgorithm(argv[2]);
+      if (!parsed) {
+        std::cerr << "unknown hash algorithm, use sha256, sha512-256 or "
+                     "blake2b\n";
+        return 2;
+      }
+      hash_algorithm = *parsed;
+      argc -= 2;
+      argv += 2;
+    } else if (flag == "--metrics-address" && argc > 2) {
+      boost::system::error_code ec;
+      metrics_address = boost::asio::ip::make_address(argv[2], ec);
+      if (ec) {
+        std::cerr << "not an IP address: " << argv[2] << "\n";
+        return 2;
+      }
+      argc -= 2;
+      argv += 2;
+    } else {
+      break;
+    }
+  }
+  if (argc != 3 && argc != 4) {
     return 0;
   }
 
   auto screen   = ScreenInteractive::Fullscreen();
   auto bg_color = Color::Palette256(16);
 
-  auto [hostname, ip_addr] = GetHostInfo();
-  std::string ip           = ip_addr.to_string();
   std::string peer_ip, peer_port, peer_timeout;
-  std::mutex peer_mutex;
-  std::vector<PeerInfo> peer_list;
   int selected_peer = 0;
 
-  // Must be called with peer_mutex already held OR from UI thread after lock.
-  auto remove_peer_by_session = [&](std::shared_ptr<net::Session> s) -> bool {
-    for (auto it = peer_list.begin(); it != peer_list.end(); ++it) {
-      if (it->session.lock().get() == s.get()) {
-        peer_list.erase(it);
-        // Clamp selected_peer so it stays in range.
-        if (selected_peer >= static_cast<int>(peer_list.size()))
-          selected_peer = std::max(0, static_cast<int>(peer_list.size()) - 1);
-        return true;
-      }
-    }
-    return false;
-  };
-  uint16_t port = std::stoi(argv[1]);
-  auto peer     = std::make_shared<net::Peer>(port);
-  PeerInfo local_peer{
-      hostname,
-      peer->id(),
-      ip_addr,
-      port,
-      std::make_shared<fstree::DirectoryTree>(
-          fstree::DirectoryTree(std::filesystem::path(argv[2])))};
-
-  // NOTE: Use this string for debugging
-  std::string debug_str;
-
-  // -------------------------------------------------------------------------------------------------
-  // SYNC STATE  (written from IO thread, read by UI thread)
-  // -------------------------------------------------------------------------------------------------
-  struct SyncState {
-    enum class Phase { Idle, SyncingTrees, SyncingFiles, Done, Error };
-    std::atomic<Phase> phase{Phase::Idle};
-    std::atomic<int> files_done{0};
-    std::atomic<int> files_total{0};
-  };
-  SyncState sync_state;
-
   // -------------------------------------------------------------------------------------------------
-  // ERROR STATE  (written from IO thread, shown as modal in UI thread)
+  // ERROR STATE  (written from the io threads, shown as modal in UI thread)
   // -------------------------------------------------------------------------------------------------
   struct ErrorState {
     std::mutex mtx;
@@ -130,75 +85,63 @@ int main(int argc, char* argv[]) {
   };
   auto error_state = std::make_shared<ErrorState>();
 
+  // The engine reports every packet of a sync; one redraw is posted until the
+  // next frame picks it up
+  std::atomic<bool> redraw_posted{false};
+  auto redraw = [&] {
+    if (!redraw_posted.exchange(true))
+      screen.PostEvent(Event::Custom);
+  };
+
   // Post an error from any thread — shows the modal and triggers a UI refresh.
-  auto post_error = [&](std::string title, std::string msg) {
+  auto post_error = [&](const std::string& title, const std::string& msg) {
     {
       std::lock_guard<std::mutex> lk(error_state->mtx);
       error_state->visible = true;
-      error_state->title   = std::move(title);
-      error_state->message = std::move(msg);
+      error_state->title   = title;
+      error_state->message = msg;
     }
-    screen.PostEvent(Event::Custom);
+    redraw();
   };
 
-  std::function<void(std::size_t, std::shared_ptr<net::Session>)>
-      start_refresh_listener;  // Forward declaration
-
   // -------------------------------------------------------------------------------------------------
-  // ACCEPT LOOP
+  // SYNC ENGINE
   // -------------------------------------------------------------------------------------------------
+  engine::Options options;
+  options.port                = static_cast<uint16_t>(std::stoi(argv[1]));
+  options.root                = std::filesystem::path(argv[2]);
+  options.scan.hash_algorithm = hash_algorithm;
+  options.lazy_trees          = lazy_trees;
+
+  engine::Callbacks callbacks;
+  callbacks.changed = redraw;
+  callbacks.error   = post_error;
+
+  // Prometheus text at /metrics, JSON at /metrics.json
+  std::unique_ptr<net::MetricsServer> metrics_server;
+  if (argc == 4)
+    metrics_server = std::make_unique<net::MetricsServer>(
+        std::stoi(argv[3]), metrics_address);
+
+  engine::SyncEngine sync_engine(options, callbacks);
+  const auto& local_peer = sync_engine.local();
+  std::string hostname   = local_peer.name;
+  std::string ip         = local_peer.address.to_string();
+  uint16_t port          = local_peer.port;
+
+  // The selected peer, with selected_peer clamped to the peers still there.
+  // UI thread only.
+  auto selected = [&]() -> std::optional<PeerInfo> {
+    auto peers = sync_engine.peers();
+    if (peers.empty())
+      return std::nullopt;
+    selected_peer =
+        std::clamp(selected_peer, 0, static_cast<int>(peers.size()) - 1);
+    return peers[selected_peer];
+  };
 
-  peer->doAccept([&](std::weak_ptr<net::Session> weak_session) {
-    if (auto session = weak_session.lock()) {
-      asio::co_spawn(
-          peer->getExecutor(),
-          [&, session]() -> asio::awaitable<void> {
-            try {
-              co_await session->sendHello({peer->id(), hostname});
-              auto hello = co_await session->receiveHello();
-              auto info  = ExtractPeerInfo(session, hello);
-
-              {
-                std::lock_guard<std::mutex> lock(peer_mutex);
-                for (auto& existing : peer_list) {
-                  if (existing.peer_id == hello.peer_id) {
-                    session->close();
-                    co_return;
-                  }
-                }
-              }
-
-              co_await session->sendTree(*local_peer.tree);
-              info.tree = std::make_shared<fstree::DirectoryTree>(
-                  co_await session->receiveTree());
+  sync_engine.start();
 
-              {
-                std::lock_guard<std::mutex> lock(peer_mutex);
-                peer_list.push_back(std::move(info));
-              }
-
-              start_refresh_listener(peer_list.size() - 1, session);
-              screen.PostEvent(Event::Custom);
-            } catch (const boost::system::system_error& e) {
-              session->close();
-              post_error("Incoming Connection Error",
-                         std::string("Handshake with incoming peer failed: ") +
-                             e.what());
-            } catch (const std::exception& e) {
-              session->close();
-              post_error("Incoming Connection Error", e.what());
-            } catch (...) {
-              session->close();
-              // Silently drop truly unknown errors on accept side
-            }
-          },
-          asio::detached);
-    }
-  });
-
-  std::thread io_thread([peer]() {
-    peer->run();
-  });
 
   // -------------------------------------------------------------------------------------------------
   // STATUS BAR
@@ -209,8 +152,8 @@ int main(int argc, char* argv[]) {
     };
 
     std::string separator = "  ";
-    std::string peer_no =
-        peer_list.size() > 0 ? std::to_string(peer_list.size()) : "no";
+    auto peer_count     = sync_engine.peers().size();
+    std::string peer_no = peer_count > 0 ? std::to_string(peer_count) : "no";
 
     return hbox({
                text("file-sync") | color(Color::White) | bold,
@@ -307,9 +250,9 @@ int main(int argc, char* argv[]) {
     // Self-connect guard
     boost::system::error_code ec;
     auto addr = boost::asio::ip::make_address(check_ip, ec);
-    if (!ec && addr == ip_addr && check_port == port)
+    if (!ec && addr == local_peer.address && check_port == port)
       return true;
-    for (auto& p : peer_list) {
+    for (auto& p : sync_engine.peers()) {
       if (p.address == addr && p.port == check_port)
         return true;
     }
@@ -337,7 +280,6 @@ int main(int argc, char* argv[]) {
       }
     }
     uint16_t p = static_cast<uint16_t>(std::stoi(peer_port));
-    std::lock_guard<std::mutex> lock(peer_mutex);
     return !isDuplicate(peer_ip, p);
   };
 
@@ -365,7 +307,6 @@ int main(int argc, char* argv[]) {
     }
     if (ip_st == FieldState::Valid && port_st == FieldState::Valid) {
       uint16_t p = static_cast<uint16_t>(std::stoi(peer_port));
-      std::lock_guard<std::mutex> lock(peer_mutex);
       if (isDuplicate(peer_ip, p))
         return "  Already connected to this peer";
     }
@@ -376,7 +317,7 @@ int main(int argc, char* argv[]) {
   auto peer_connect_button = Button({
       .label = "CONNECT",
       .on_click =
-          [&, peer]() {
+          [&]() {
             if (!connectReady())
               return;
             uint16_t p = static_cast<uint16_t>(std::stoi(peer_port));
@@ -389,104 +330,7 @@ int main(int argc, char* argv[]) {
               }
             }
 
-            peer->doResolveAndConnect(
-                peer_ip,
-                p,
-                [&, timeout_secs](std::weak_ptr<net::Session> ws) {
-                  if (auto session = ws.lock()) {
-                    asio::co_spawn(
-                        peer->getExecutor(),
-                        [&, session, timeout_secs]() -> asio::awaitable<void> {
-                          // Helper: run the handshake coroutine, optionally
-                          // racing it against a steady_timer deadline.
-                          auto do_handshake =
-                              [&, session]() -> asio::awaitable<void> {
-                            auto hello = co_await session->receiveHello();
-                            co_await session->sendHello({peer->id(), hostname});
-                            auto info = ExtractPeerInfo(session, hello);
-
-                            {
-                              std::lock_guard<std::mutex> lock(peer_mutex);
-                              for (auto& existing : peer_list) {
-                                if (existing.peer_id == hello.peer_id) {
-                                  session->close();
-                                  co_return;
-                                }
-                              }
-                            }
-
-                            info.tree = std::make_shared<fstree::DirectoryTree>(
-                                co_await session->receiveTree());
-                            co_await session->sendTree(*local_peer.tree);
-
-                            {
-                              std::lock_guard<std::mutex> lock(peer_mutex);
-                              peer_list.push_back(std::move(info));
-                            }
-
-                            start_refresh_listener(peer_list.size() - 1,
-                                                   session);
-                            screen.PostEvent(Event::Custom);
-                          };
-
-                          try {
-                            // Always race the handshake against the timeout.
-                            // Snapshot target address before we potentially
-                            // close the socket on timeout.
-                            std::string target_addr;
-                            try {
-                              target_addr = session->socket()
-                                                .remote_endpoint()
-                                                .address()
-                                                .to_string();
-                            } catch (...) {
-                              target_addr = peer_ip;
-                            }
-
-                            asio::steady_timer timer(
-                                co_await asio::this_coro::executor);
-                            timer.expires_after(
-                                std::chrono::seconds(timeout_secs));
-
-                            auto result = co_await (
-                                do_handshake() ||
-                                timer.async_wait(asio::use_awaitable));
-
-                            if (result.index() == 1) {
-                              // Timer won — timeout
-                              session->close();
-                              post_error("Connection Timed Out",
-                                         "Could not complete handshake with " +
-                                             target_addr + " within " +
-                                             std::to_string(timeout_secs) +
-                                             " s.");
-                            }
-                            // index == 0 means handshake completed normally
-                          } catch (const boost::system::system_error& e) {
-                            session->close();
-                            post_error("Connection Error",
-                                       std::string("Network error during "
-                                                   "handshake: ") +
-                                           e.what());
-                          } catch (const std::exception& e) {
-                            session->close();
-                            post_error("Handshake Failed", e.what());
-                          } catch (...) {
-                            session->close();
-                            post_error("Connection Error",
-                                       "An unknown error occurred while "
-                                       "connecting.");
-                          }
-                        },
-                        asio::detached);
-                  }
-                },
-                // on_error: called when resolve or TCP connect itself fails
-                [&](const boost::system::error_code& ec) {
-                  post_error("Connection Failed",
-                             "Could not connect to " + peer_ip + ":" +
-                                 peer_port + ".\n" + ec.message());
-                });
+            sync_engine.connect(peer_ip, p, std::chrono::seconds(timeout_secs));
           },
       .transform =
           [&](EntryState state) {
@@ -593,10 +437,13 @@ int main(int argc, char* argv[]) {
   auto rebuild_peer_list = [&]() {
     connected_peer_container->DetachAllChildren();
 
-    std::lock_guard<std::mutex> lock(peer_mutex);
-    for (auto& info : peer_list) {
+    auto peers = sync_engine.peers();
+    for (auto& info : peers) {
       connected_peer_container->Add(connected_peer_menu_entry(info));
     }
+    // Peers that left take their entries with them
+    if (selected_peer >= static_cast<int>(peers.size()))
+      selected_peer = std::max(0, static_cast<int>(peers.size()) - 1);
   };
 
   auto connected_peer_renderer = Renderer(connected_peer_container, [&]() {
@@ -615,6 +462,90 @@ int main(int argc, char* argv[]) {
   // DIFF VIEW
   // -------------------------------------------------------------------------------------------------
 
+  // ---- Diff cache ----
+
+  // diffTree() runs on diff_pool once per (peer, treeVersion()) rather than on
+  // every frame; the renderer only swaps in the latest finished snapshot.
+  struct DiffSnapshot {
+    uint64_t peer_id = 0;
+    uint64_t version = 0;
+    std::vector<fstree::NodeDiff> diffs;
+    int added = 0, deleted = 0, modified = 0;
+    std::size_t unloaded = 0;  // lazy peer directories still being fetched
+  };
+  struct DiffCache {
+    std::mutex mtx;
+    std::shared_ptr<const DiffSnapshot> latest;  // last finished
+    uint64_t want_peer    = 0;                   // last requested
+    uint64_t want_version = 0;
+    bool requested        = false;
+  };
+  DiffCache diff_cache;
+  fstree::ThreadPool diff_pool(1);
+
+  // Removed before diff_pool goes away; the engine reports its own pools
+  struct PoolMetrics {
+    uint64_t collector;
+    ~PoolMetrics() { metrics::removeCollector(collector); }
+  } pool_metrics{metrics::addCollector(
+      "file_sync_pool_queued_tasks",
+      "Tasks waiting for a worker of a thread pool",
+      metrics::Kind::Gauge,
+      [&] {
+        return std::vector<metrics::Sample>{
+            {{{"pool", "diff"}}, static_cast<double>(diff_pool.queued())},
+        };
+      })};
+
+  auto request_diff = [&](uint64_t peer_id, uint64_t version) {
+    {
+      std::lock_guard<std::mutex> lock(diff_cache.mtx);
+      if (diff_cache.requested && diff_cache.want_peer == peer_id &&
+          diff_cache.want_version == version)
+        return;
+      diff_cache.requested    = true;
+      diff_cache.want_peer    = peer_id;
+      diff_cache.want_version = version;
+    }
+
+    diff_pool.submit([&, peer_id, version] {
+      {
+        // A later request is queued behind this one
+        std::lock_guard<std::mutex> lock(diff_cache.mtx);
+        if (diff_cache.want_peer != peer_id ||
+            diff_cache.want_version != version)
+          return;
+      }
+
+      auto diff = sync_engine.diff(peer_id);
+      if (!diff)
+        return;
+      auto snapshot      = std::make_shared<DiffSnapshot>();
+      snapshot->peer_id  = peer_id;
+      snapshot->version  = diff->version;
+      snapshot->diffs    = std::move(diff->diffs);
+      snapshot->unloaded = diff->unloaded.size();
+
+      for (auto& d : snapshot->diffs) {
+        if (d.type == fstree::ChangeType::Added)
+          ++snapshot->added;
+        else if (d.type == fstree::ChangeType::Deleted)
+          ++snapshot->deleted;
+        else
+          ++snapshot->modified;
+      }
+      {
+        std::lock_guard<std::mutex> lock(diff_cache.mtx);
+        diff_cache.latest = std::move(snapshot);
+      }
+      redraw();
+    });
+  };
+
+  // First diff row shown; only the rows that fit the terminal are built
+  int diff_scroll = 0;
+  Box diff_box;
+
   // ---- Helpers ----
 
   auto fmt_size = [](uint64_t sz) -> std::string {
@@ -670,26 +601,9 @@ int main(int argc, char* argv[]) {
       .label = "REFRESH",
       .on_click =
           [&]() {
-            local_peer.tree = std::make_shared<fstree::DirectoryTree>(
-                local_peer.tree->root_path);
-            sync_state.phase.store(SyncState::Phase::Idle);
-            std::shared_ptr<net::Session> session;
-            {
-              std::lock_guard<std::mutex> lock(peer_mutex);
-              if (peer_list.empty() ||
-                  selected_peer >= static_cast<int>(peer_list.size()))
-                return;
-              session = peer_list[selected_peer].session.lock();
-              if (!session)
-                return;
-            }
-            asio::co_spawn(
-                peer->getExecutor(),
-                [&, session]() -> asio::awaitable<void> {
-                  co_await session->sendTreeRequest();
-                  co_await session->sendTaggedTree(*local_peer.tree);
-                },
-                asio::detached);
+            auto peer = selected();
+            sync_engine.refresh(peer ? std::optional(peer->peer_id)
+                                     : std::nullopt);
           },
       .transform =
           [](EntryState state) {
@@ -699,72 +613,18 @@ int main(int argc, char* argv[]) {
   });
 
   // ---- Sync button ----
-  // Sends SyncRequest + our tree. The listener on the remote side handles it:
-  // it computes the diff (from the requester's perspective), streams files /
-  // delete notices, then sends SyncDone. Our listener receives all of that and
-  // updates sync_state as it goes, posting events so the UI re-renders.
+  // The engine sends SyncRequest + our tree and follows the remote side's
+  // files / delete notices up to SyncDone; its changed() callback re-renders.
   auto sync_button = Button({
       .label = "SYNC",
       .on_click =
           [&]() {
-            using Phase = SyncState::Phase;
-            auto ph     = sync_state.phase.load();
-            if (ph == Phase::SyncingTrees || ph == Phase::SyncingFiles)
-              return;
-
-            std::shared_ptr<net::Session> session;
-            {
-              std::lock_guard<std::mutex> lock(peer_mutex);
-              if (peer_list.empty() ||
-                  selected_peer >= static_cast<int>(peer_list.size()))
-                return;
-              session = peer_list[selected_peer].session.lock();
-              if (!session)
-                return;
-            }
-
-            sync_state.phase.store(Phase::SyncingTrees);
-            sync_state.files_done.store(0);
-            sync_state.files_total.store(0);
-            screen.PostEvent(Event::Custom);
-
-            asio::co_spawn(
-                peer->getExecutor(),
-                [&, session]() -> asio::awaitable<void> {
-                  // Send SyncRequest tag + our current tree.
-                  // The remote listener will:
-                  //   1. receive our tree
-                  //   2. compute diffs (what WE are missing)
-                  //   3. stream FileData / DeleteFile packets
-                  //   4. send SyncDone
-                  // Our listener picks all of that up and updates sync_state.
-                  try {
-                    co_await session->sendPacketType(
-                        net::Session::PacketType::SyncRequest);
-                    co_await session->sendTaggedTree(*local_peer.tree);
-                  } catch (const boost::system::system_error& e) {
-                    sync_state.phase.store(Phase::Error);
-                    post_error("Sync Failed",
-                               std::string("Failed to send sync request: ") +
-                                   e.what());
-                  } catch (const std::exception& e) {
-                    sync_state.phase.store(Phase::Error);
-                    post_error("Sync Failed", e.what());
-                  } catch (...) {
-                    sync_state.phase.store(Phase::Error);
-                    post_error(
-                        "Sync Failed",
-                        "An unknown error occurred while starting sync.");
-                    screen.PostEvent(Event::Custom);
-                  }
-                },
-                asio::detached);
+            if (auto peer = selected())
+              sync_engine.sync(peer->peer_id);
           },
       .transform =
           [&](EntryState state) {
-            using Phase = SyncState::Phase;
-            auto ph     = sync_state.phase.load();
-            bool busy = ph == Phase::SyncingTrees || ph == Phase::SyncingFiles;
+            bool busy = sync_engine.syncStatus().busy();
             auto btn  = text(busy ? " Syncing... " : " Sync ") | center;
             if (busy)
               return btn | borderLight | dim;
@@ -777,46 +637,15 @@ int main(int argc, char* argv[]) {
       .label = "DISCONNECT",
       .on_click =
           [&]() {
-            using Phase = SyncState::Phase;
-            auto ph     = sync_state.phase.load();
-            if (ph == Phase::SyncingTrees || ph == Phase::SyncingFiles)
+            if (sync_engine.syncStatus().busy())
               return;
-
-            std::shared_ptr<net::Session> session;
-            {
-              std::lock_guard<std::mutex> lock(peer_mutex);
-              if (peer_list.empty() ||
-                  selected_peer >= static_cast<int>(peer_list.size()))
-                return;
-              session = peer_list[selected_peer].session.lock();
-              if (!session)
-                return;
-              remove_peer_by_session(session);
-            }
-
-            sync_state.phase.store(Phase::Idle);
-            screen.PostEvent(Event::Custom);
-
-            // Notify the remote peer, then close the socket
-            asio::co_spawn(
-                peer->getExecutor(),
-                [&, session]() -> asio::awaitable<void> {
-                  try {
-                    co_await session->sendDisconnectRequest();
-                  } catch (...) {
-                    // Best-effort: ignore send errors on disconnect
-                  }
-                  session->close();
-                },
-                asio::detached);
+            if (auto peer = selected())
+              sync_engine.disconnect(peer->peer_id);
           },
       .transform =
           [&](EntryState state) {
-            using Phase = SyncState::Phase;
-            auto ph     = sync_state.phase.load();
-            bool busy = ph == Phase::SyncingTrees || ph == Phase::SyncingFiles;
-            bool no_peer = peer_list.empty() ||
-                           selected_peer >= static_cast<int>(peer_list.size());
+            bool busy    = sync_engine.syncStatus().busy();
+            bool no_peer = !selected();
             auto btn     = text(" Disconnect ") | center;
             if (busy || no_peer)
               return btn | borderLight | dim | color(Color::GrayDark);
@@ -830,23 +659,28 @@ int main(int argc, char* argv[]) {
       Container::Horizontal({refresh_button, sync_button, disconnect_button}),
       [&]() -> Element {
         std::string peer_name;
-        std::vector<fstree::NodeDiff> diffs;
+        std::shared_ptr<const DiffSnapshot> snapshot;
         bool has_peer = false;
         bool has_tree = false;
+        bool stale    = false;
+        uint64_t peer_id = 0, version = 0;
+
+        if (auto peer = selected()) {
+          has_peer  = true;
+          peer_name = peer->name + "  (" + peer->address.to_string() + ":" +
+                      std::to_string(peer->port) + ")";
+          has_tree  = peer->tree != nullptr;
+          peer_id   = peer->peer_id;
+          version   = sync_engine.treeVersion();
+        }
 
-        {
-          std::lock_guard<std::mutex> lock(peer_mutex);
-          has_peer = !peer_list.empty() &&
-                     selected_peer < static_cast<int>(peer_list.size());
-          if (has_peer) {
-            peer_name = peer_list[selected_peer].name + "  (" +
-                        peer_list[selected_peer].address.to_string() + ":" +
-                        std::to_string(peer_list[selected_peer].port) + ")";
-            has_tree  = peer_list[selected_peer].tree != nullptr;
-            if (has_tree)
-              diffs = fstree::diffTree(*local_peer.tree,
-                                       *peer_list[selected_peer].tree);
-          }
+        if (has_tree) {
+          request_diff(peer_id, version);
+          std::lock_guard<std::mutex> lock(diff_cache.mtx);
+          snapshot = diff_cache.latest;
+          if (snapshot && snapshot->peer_id != peer_id)
+            snapshot.reset();
+          stale = !snapshot || snapshot->version != version;
         }
 
         // -- Header row --
@@ -866,10 +700,11 @@ int main(int argc, char* argv[]) {
         });
 
         // -- Progress bar (shown while syncing) --
-        using Phase = SyncState::Phase;
-        auto phase  = sync_state.phase.load();
-        int f_done  = sync_state.files_done.load();
-        int f_total = sync_state.files_total.load();
+        using Phase = engine::SyncPhase;
+        auto status = sync_engine.syncStatus();
+        auto phase  = status.phase;
+        int f_done  = status.files_done;
+        int f_total = status.files_total;
 
         Elements progress_row;
         if (phase == Phase::SyncingTrees || phase == Phase::SyncingFiles ||
@@ -916,300 +751,89 @@ int main(int argc, char* argv[]) {
         } else if (!has_tree) {
           rows.push_back(text("  Waiting for tree from peer...") | dim |
                          center);
-        } else if (diffs.empty()) {
+        } else if (!snapshot) {
+          rows.push_back(text("  Comparing trees...") | dim | center);
+        } else if (snapshot->diffs.empty() && snapshot->unloaded == 0) {
           rows.push_back(text("  Trees are identical.") | color(Color::Green) |
                          center);
+        } else if (snapshot->diffs.empty()) {
+          rows.push_back(text("  Fetching directories that differ...") | dim |
+                         center);
         } else {
-          int added = 0, deleted = 0, modified = 0;
-          for (auto& d : diffs) {
-            if (d.type == fstree::ChangeType::Added)
-              ++added;
-            else if (d.type == fstree::ChangeType::Deleted)
-              ++deleted;
-            else
-              ++modified;
-          }
+          const auto& diffs = snapshot->diffs;
+          int total         = static_cast<int>(diffs.size());
+
+          // Rows that fit below the summary in the last frame
+          int area    = diff_box.y_max - diff_box.y_min + 1 - 3;
+          int visible = area > 0 ? area : std::max(1, Terminal::Size().dimy);
+          diff_scroll =
+              std::clamp(diff_scroll, 0, std::max(0, total - visible));
+          int last = std::min(total, diff_scroll + visible);
+
           rows.push_back(hbox({
               text("  "),
-              text("+" + std::to_string(added)) | color(Color::Green) | bold,
+              text("+" + std::to_string(snapshot->added)) |
+                  color(Color::Green) | bold,
               text("  "),
-              text("-" + std::to_string(deleted)) | color(Color::Red) | bold,
+              text("-" + std::to_string(snapshot->deleted)) |
+                  color(Color::Red) | bold,
               text("  "),
-              text("~" + std::to_string(modified)) | color(Color::Yellow) |
-                  bold,
+              text("~" + std::to_string(snapshot->modified)) |
+                  color(Color::Yellow) | bold,
               text("  changes") | dim,
+              filler(),
+              stale ? text("updating...  ") | dim : text(""),
+              snapshot->unloaded
+                  ? text("fetching " + std::to_string(snapshot->unloaded) +
+                         " dirs  ") |
+                        dim
+                  : text(""),
+              text(std::to_string(diff_scroll + 1) + "-" +
+                   std::to_string(last) + " of " + std::to_string(total) +
+                   "  ") |
+                  dim,
           }));
           rows.push_back(separatorLight());
-          for (auto& d : diffs)
-            rows.push_back(diff_row(d));
+          for (int i = diff_scroll; i < last; ++i)
+            rows.push_back(diff_row(diffs[i]));
         }
 
         return vbox({
                    header,
                    vbox(std::move(progress_row)),
-                   vbox(std::move(rows)) | frame | flex,
+                   vbox(std::move(rows)) | frame | flex | reflect(diff_box),
                }) |
                flex | borderLight;
       });
 
-  // -------------------------------------------------------------------------------------------------
-  // LISTENER  (sole reader on each session post-handshake)
-  // -------------------------------------------------------------------------------------------------
+  // Scrolls the diff rows: wheel over the list, PageUp/PageDown, Home/End
+  diff_renderer = CatchEvent(diff_renderer, [&](Event event) {
+    int page = std::max(1, diff_box.y_max - diff_box.y_min - 2);  // rows
+    if (event.is_mouse()) {
+      auto& mouse = event.mouse();
+      if (!diff_box.Contain(mouse.x, mouse.y))
+        return false;
+      if (mouse.button == Mouse::WheelUp)
+        diff_scroll = std::max(0, diff_scroll - 3);
+      else if (mouse.button == Mouse::WheelDown)
+        diff_scroll += 3;  // clamped when rendering
+      else
+        return false;
+      return true;
+    }
+    if (event == Event::PageUp)
+      diff_scroll = std::max(0, diff_scroll - page);
+    else if (event == Event::PageDown)
+      diff_scroll += page;
+    else if (event == Event::Home)
+      diff_scroll = 0;
+    else if (event == Event::End)
+      diff_scroll = INT32_MAX;
+    else
+      return false;
+    return true;
+  });
 
-  start_refresh_listener = [&](std::size_t peer_idx,
-                               std::shared_ptr<net::Session> session) {
-    asio::co_spawn(
-        peer->getExecutor(),
-        [&, peer_idx, session]() -> asio::awaitable<void> {
-          try {
-            while (true) {
-              auto pkt = co_await session->receivePacketType();
-
-              // ---- TreeRequest: plain refresh (tree exchange only) ----
-              if (pkt == net::Session::PacketType::TreeRequest) {
-                // Requester sends: TreeRequest | Tree tag + payload (their
-                // tree) We reply with: Tree tag + payload (our tree)
-                auto pt2 = co_await session->receivePacketType();
-                if (pt2 != net::Session::PacketType::Tree)
-                  break;
-                auto new_tree   = co_await session->receiveTreePayload();
-                local_peer.tree = std::make_shared<fstree::DirectoryTree>(
-                    local_peer.tree->root_path);
-                co_await session->sendTaggedTree(*local_peer.tree);
-
-                {
-                  std::lock_guard<std::mutex> lock(peer_mutex);
-                  if (peer_idx < peer_list.size())
-                    peer_list[peer_idx].tree =
-                        std::make_shared<fstree::DirectoryTree>(
-                            std::move(new_tree));
-                }
-                screen.PostEvent(Event::Custom);
-
-                // ---- Tree: unsolicited push ----
-              } else if (pkt == net::Session::PacketType::Tree) {
-                auto new_tree = co_await session->receiveTreePayload();
-                {
-                  std::lock_guard<std::mutex> lock(peer_mutex);
-                  if (peer_idx < peer_list.size())
-                    peer_list[peer_idx].tree =
-                        std::make_shared<fstree::DirectoryTree>(
-                            std::move(new_tree));
-                }
-                screen.PostEvent(Event::Custom);
-
-                // ---- SyncRequest: remote wants us to send them our files ----
-              } else if (pkt == net::Session::PacketType::SyncRequest) {
-                // 1. Receive requester's current tree
-                auto pt2 = co_await session->receivePacketType();
-                if (pt2 != net::Session::PacketType::Tree)
-                  break;
-                auto requester_tree = co_await session->receiveTreePayload();
-
-                // 2. Compute what the requester is missing (diff from their
-                // POV)
-                //    local_peer.tree = "new" (ours), requester_tree = "old"
-                auto diffs = fstree::diffTree(requester_tree, *local_peer.tree);
-
-                std::function<int(const fstree::Node&)> countOps =
-                    [&](const fstree::Node& node) -> int {
-                  if (node.type == fstree::NodeType::File)
-                    return 1;
-                  const auto& kids = fstree::children(node);
-                  if (kids.empty())
-                    return 1;
-                  int n = 0;
-                  for (auto& c : kids)
-                    n += countOps(*c);
-                  return n;
-                };
-
-                // Helper: recursively send every file inside an added subtree,
-                // or send a CreateDir for an empty directory.
-                std::function<asio::awaitable<void>(const fstree::Node&)>
-                    sendSubtree;
-                sendSubtree =
-                    [&](const fstree::Node& node) -> asio::awaitable<void> {
-                  if (node.type == fstree::NodeType::File) {
-                    auto it = local_peer.tree->index.find(node.path);
-                    if (it != local_peer.tree->index.end())
-                      co_await session->sendTaggedFile(*local_peer.tree,
-                                                       *it->second);
-                  } else {
-                    const auto& kids = fstree::children(node);
-                    if (kids.empty()) {
-                      co_await session->sendCreateDir(node.path);
-                    } else {
-                      for (auto& child : kids)
-                        co_await sendSubtree(*child);
-                    }
-                  }
-                };
-
-                // Count all operations
-                int total_ops = 0;
-                for (auto& d : diffs) {
-                  if (d.type == fstree::ChangeType::Added) {
-                    auto it = local_peer.tree->index.find(d.new_node->path);
-                    if (it != local_peer.tree->index.end())
-                      total_ops += countOps(*it->second);
-                  } else if (d.type == fstree::ChangeType::Deleted) {
-                    ++total_ops;  // one remove_all
-                  } else if (d.type == fstree::ChangeType::Modified &&
-                             d.new_node->type == fstree::NodeType::File) {
-                    ++total_ops;
-                  }
-                }
-
-                // 3. Tell the requester how many operations to expect
-                co_await session->sendSyncHeader(
-                    static_cast<uint32_t>(total_ops));
-
-                // 4. Stream files / deletes to requester
-                for (auto& d : diffs) {
-                  if (d.type == fstree::ChangeType::Added) {
-                    // Added file or directory subtree
-                    auto it = local_peer.tree->index.find(d.new_node->path);
-                    if (it != local_peer.tree->index.end())
-                      co_await sendSubtree(*it->second);
-
-                  } else if (d.type == fstree::ChangeType::Deleted) {
-                    // Deleted file or directory — remove_all handles recursion
-                    co_await session->sendDeleteNotice(d.old_node->path);
-
-                  } else if (d.type == fstree::ChangeType::Modified &&
-                             d.new_node->type == fstree::NodeType::File) {
-                    auto it = local_peer.tree->index.find(d.new_node->path);
-                    if (it != local_peer.tree->index.end())
-                      co_await session->sendTaggedFile(*local_peer.tree,
-                                                       *it->second);
-                  }
-                }
-
-                // 5. Send our own tree so the requester's diff view updates,
-                //    then signal end of sync
-                co_await session->sendTaggedTree(*local_peer.tree);
-                co_await session->sendSyncDone();
-
-                // The requester now mirrors our tree — store a fresh snapshot
-                // so our diff view reflects the post-sync state immediately.
-                {
-                  std::lock_guard<std::mutex> lock(peer_mutex);
-                  if (peer_idx < peer_list.size())
-                    peer_list[peer_idx].tree =
-                        std::make_shared<fstree::DirectoryTree>(
-                            local_peer.tree->root_path);
-                }
-                screen.PostEvent(Event::Custom);
-
-                // ---- SyncHeader: total op count from sender ----
-              } else if (pkt == net::Session::PacketType::SyncHeader) {
-                uint32_t total = co_await session->receiveSyncHeader();
-                sync_state.files_total.store(static_cast<int>(total));
-                sync_state.phase.store(SyncState::Phase::SyncingFiles);
-                screen.PostEvent(Event::Custom);
-
-                // ---- FileData: we are the requester, receiving a file ----
-              } else if (pkt == net::Session::PacketType::FileData) {
-                co_await session->receiveFile(*local_peer.tree, false);
-                sync_state.files_done.fetch_add(1);
-                screen.PostEvent(Event::Custom);
-
-                // ---- DeleteFile: we are the requester, delete a path ----
-              } else if (pkt == net::Session::PacketType::DeleteFile) {
-                auto rel_path = co_await session->receiveRelPath();
-                auto abs_path = local_peer.tree->root_path / rel_path;
-                std::error_code ec;
-                std::filesystem::remove_all(abs_path, ec);
-                // defer tree rebuild to SyncDone
-                sync_state.files_done.fetch_add(1);
-                screen.PostEvent(Event::Custom);
-
-                // ---- CreateDir: create an empty directory ----
-              } else if (pkt == net::Session::PacketType::CreateDir) {
-                auto rel_path = co_await session->receiveRelPath();
-                auto abs_path = local_peer.tree->root_path / rel_path;
-                std::error_code ec;
-                std::filesystem::create_directories(abs_path, ec);
-                // defer tree rebuild to SyncDone
-                sync_state.files_done.fetch_add(1);
-                screen.PostEvent(Event::Custom);
-
-                // ---- SyncHeader: total op count from sender ----
-              } else if (pkt == net::Session::PacketType::SyncHeader) {
-                uint32_t total = co_await session->receiveSyncHeader();
-                sync_state.files_total.store(static_cast<int>(total));
-                sync_state.phase.store(SyncState::Phase::SyncingFiles);
-                screen.PostEvent(Event::Custom);
-
-                // ---- SyncDone: all operations received ----
-              } else if (pkt == net::Session::PacketType::SyncDone) {
-                // Single rebuild covering all received files, deletes, and dirs
-                *local_peer.tree =
-                    fstree::DirectoryTree(local_peer.tree->root_path);
-                sync_state.phase.store(SyncState::Phase::Done);
-                screen.PostEvent(Event::Custom);
-
-                // ---- DisconnectRequest: remote peer is leaving ----
-              } else if (pkt == net::Session::PacketType::DisconnectRequest) {
-                {
-                  std::lock_guard<std::mutex> lock(peer_mutex);
-                  remove_peer_by_session(session);
-                }
-                sync_state.phase.store(SyncState::Phase::Idle);
-                session->close();
-                screen.PostEvent(Event::Custom);
-                co_return;
-              }
-              // Unknown tags silently skipped — forward-compatible
-            }
-          } catch (const boost::system::system_error& e) {
-            // Session closed or I/O error — exit listener cleanly.
-            {
-              std::lock_guard<std::mutex> lock(peer_mutex);
-              remove_peer_by_session(session);
-            }
-            auto ph = sync_state.phase.load();
-            if (ph == SyncState::Phase::SyncingTrees ||
-                ph == SyncState::Phase::SyncingFiles) {
-              sync_state.phase.store(SyncState::Phase::Error);
-              post_error(
-                  "Sync Interrupted",
-                  std::string("Connection lost during sync: ") + e.what());
-            } else if (ph != SyncState::Phase::Idle &&
-                       ph != SyncState::Phase::Done) {
-              post_error(
-                  "Connection Lost",
-                  std::string("Peer disconnected unexpectedly: ") + e.what());
-            }
-            screen.PostEvent(Event::Custom);
-          } catch (const std::exception& e) {
-            {
-              std::lock_guard<std::mutex> lock(peer_mutex);
-              remove_peer_by_session(session);
-            }
-            auto ph = sync_state.phase.load();
-            if (ph == SyncState::Phase::SyncingTrees ||
-                ph == SyncState::Phase::SyncingFiles) {
-              sync_state.phase.store(SyncState::Phase::Error);
-              post_error("Sync Error", e.what());
-            }
-            screen.PostEvent(Event::Custom);
-          } catch (...) {
-            // Truly unknown error — remove peer silently
-            {
-              std::lock_guard<std::mutex> lock(peer_mutex);
-              remove_peer_by_session(session);
-            }
-            auto ph = sync_state.phase.load();
-            if (ph == SyncState::Phase::SyncingTrees ||
-                ph == SyncState::Phase::SyncingFiles)
-              sync_state.phase.store(SyncState::Phase::Error);
-            screen.PostEvent(Event::Custom);
-          }
-        },
-        asio::detached);
-  };
 
   // -------------------------------------------------------------------------------------------------
   // ERROR MODAL
@@ -1280,7 +904,12 @@ int main(int argc, char* argv[]) {
   auto ui = Modal(base_ui, error_modal_component, &error_state->visible);
   // clang-format on
 
+  // This frame shows everything reported so far
+  ui = Renderer(ui, [&, ui] {
+    redraw_posted.store(false);
+    return ui->Render();
+  });
+
   screen.Loop(ui);
-  peer->stop();
-  io_thread.join();
+  sync_engine.stop();
 }
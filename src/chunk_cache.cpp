@@ -0,0 +1,106 @@
+#include "../include/net/chunk_cache.hpp"
+#include <exception>
+#include <system_error>
+#include <utility>
+
+namespace net {
+namespace fs = std::filesystem;
+
+std::optional<ChunkCache::Key> ChunkCache::identify(const fs::path& path) {
+  std::error_code ec;
+  auto size = fs::file_size(path, ec);
+  if (ec)
+    return std::nullopt;
+  auto mtime = fs::last_write_time(path, ec);
+  if (ec)
+    return std::nullopt;
+
+  Key key;
+  key.path  = path.string();
+  key.size  = size;
+  key.mtime = static_cast<int64_t>(mtime.time_since_epoch().count());
+  return key;
+}
+
+std::size_t ChunkCache::KeyHash::operator()(const Key& key) const {
+  std::size_t h = std::hash<std::string>{}(key.path);
+  for (uint64_t v : {key.size,
+                     static_cast<uint64_t>(key.mtime),
+                     key.offset,
+                     key.length,
+                     static_cast<uint64_t>(key.level)})
+    h ^= std::hash<uint64_t>{}(v) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+  return h;
+}
+
+ChunkCache::ChunkCache(std::size_t capacity) : capacity_(capacity) {}
+
+ChunkCache::Chunk ChunkCache::get(const Key& key, const Load& load) {
+  std::promise<Chunk> promise;
+  {
+    std::unique_lock<std::mutex> lock(mtx_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      if (it->second.loaded)
+        lru_.splice(lru_.begin(), lru_, it->second.lru);
+      auto chunk = it->second.chunk;
+      lock.unlock();
+      return chunk.get();  // waits for a load in progress
+    }
+    entries_.emplace(key, Entry{promise.get_future().share(), false, 0, {}});
+  }
+
+  Chunk chunk;
+  try {
+    chunk = std::make_shared<const std::vector<char>>(load());
+  } catch (...) {
+    promise.set_exception(std::current_exception());
+    std::lock_guard<std::mutex> lock(mtx_);
+    entries_.erase(key);
+    throw;
+  }
+  promise.set_value(chunk);
+
+  std::lock_guard<std::mutex> lock(mtx_);
+  store(key, chunk);
+  return chunk;
+}
+
+ChunkCache::Chunk ChunkCache::find(const Key& key) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  auto it = entries_.find(key);
+  if (it == entries_.end() || !it->second.loaded)
+    return nullptr;
+  lru_.splice(lru_.begin(), lru_, it->second.lru);
+  return it->second.chunk.get();
+}
+
+void ChunkCache::put(const Key& key, Chunk chunk) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  if (entries_.count(key))
+    return;
+  std::promise<Chunk> promise;
+  promise.set_value(chunk);
+  entries_.emplace(key, Entry{promise.get_future().share(), false, 0, {}});
+  store(key, chunk);
+}
+
+void ChunkCache::store(const Key& key, const Chunk& chunk) {
+  auto& entry  = entries_.at(key);
+  entry.loaded = true;
+  entry.size   = chunk->size();
+  lru_.push_front(key);
+  entry.lru = lru_.begin();
+  used_ += entry.size;
+  evict();
+}
+
+void ChunkCache::evict() {
+  while (used_ > capacity_ && !lru_.empty()) {
+    auto it = entries_.find(lru_.back());
+    used_ -= it->second.size;
+    entries_.erase(it);
+    lru_.pop_back();
+  }
+}
+}  // namespace net
@@ -0,0 +1,132 @@
+#include "../include/net/compression.hpp"
+#include <zlib.h>
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+
+namespace net::compression {
+bool deflate(const void* data,
+             std::size_t size,
+             int level,
+             std::vector<uint8_t>& out) {
+  if (size == 0)
+    return false;
+  uLongf out_size = compressBound(static_cast<uLong>(size));
+  out.resize(out_size);
+  int rc = compress2(out.data(),
+                     &out_size,
+                     static_cast<const Bytef*>(data),
+                     static_cast<uLong>(size),
+                     level);
+  if (rc != Z_OK || out_size >= size - size / 16)
+    return false;
+  out.resize(out_size);
+  return true;
+}
+
+void inflate(const void* data,
+             std::size_t size,
+             void* out,
+             std::size_t raw_size) {
+  uLongf out_size = static_cast<uLongf>(raw_size);
+  int rc          = uncompress(static_cast<Bytef*>(out),
+                               &out_size,
+                               static_cast<const Bytef*>(data),
+                               static_cast<uLong>(size));
+  if (rc != Z_OK || out_size != raw_size)
+    throw std::runtime_error("corrupt compressed data");
+}
+
+struct Inflater::Stream {
+  z_stream z{};
+  uint64_t raw_size;
+  uint64_t produced = 0;
+  bool ended        = false;
+  std::array<uint8_t, 64 * 1024> out;
+};
+
+Inflater::Inflater(uint64_t raw_size) : stream_(std::make_unique<Stream>()) {
+  stream_->raw_size = raw_size;
+  if (inflateInit(&stream_->z) != Z_OK)
+    throw std::runtime_error("inflateInit failed");
+}
+
+Inflater::~Inflater() { inflateEnd(&stream_->z); }
+
+void Inflater::feed(const void* data, std::size_t size, const Sink& sink) {
+  auto& s      = *stream_;
+  s.z.next_in  = static_cast<Bytef*>(const_cast<void*>(data));
+  s.z.avail_in = static_cast<uInt>(size);
+  // A full output buffer may leave more output behind without any input left
+  bool full = true;
+  while (s.z.avail_in > 0 || (full && !s.ended)) {
+    if (s.ended)
+      throw std::runtime_error("corrupt compressed data");  // trailing data
+    s.z.next_out  = s.out.data();
+    s.z.avail_out = static_cast<uInt>(s.out.size());
+    int rc        = ::inflate(&s.z, Z_NO_FLUSH);
+    if (rc == Z_BUF_ERROR)
+      break;  // no progress possible until more input
+    if (rc != Z_OK && rc != Z_STREAM_END)
+      throw std::runtime_error("corrupt compressed data");
+    s.ended = rc == Z_STREAM_END;
+    full    = s.z.avail_out == 0;
+
+    std::size_t n = s.out.size() - s.z.avail_out;
+    s.produced += n;
+    if (s.produced > s.raw_size)
+      throw std::runtime_error("corrupt compressed data");
+    if (n > 0)
+      sink(std::span<const uint8_t>(s.out.data(), n));
+  }
+}
+
+void Inflater::finish() {
+  if (!stream_->ended || stream_->produced != stream_->raw_size)
+    throw std::runtime_error("corrupt compressed data");
+}
+
+bool compressibleName(const fs::path& path) {
+  static const std::unordered_set<std::string> compressed{
+      ".7z",   ".avi", ".br",  ".bz2", ".docx", ".flac", ".gif", ".gz",
+      ".heic", ".jar", ".jpeg", ".jpg", ".lz4", ".m4a", ".mkv", ".mov",
+      ".mp3",  ".mp4", ".ogg", ".pdf", ".png", ".pptx", ".rar", ".tgz",
+      ".webm", ".webp", ".whl", ".xlsx", ".xz", ".zip", ".zst",
+  };
+  auto ext = path.extension().string();
+  std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) {
+    return static_cast<char>(std::tolower(c));
+  });
+  return !compressed.count(ext);
+}
+
+bool compressibleSample(const void* data, std::size_t size) {
+  if (size == 0)
+    return false;
+  std::array<std::size_t, 256> counts{};
+  auto* bytes = static_cast<const uint8_t*>(data);
+  for (std::size_t i = 0; i < size; ++i)
+    counts[bytes[i]]++;
+
+  double entropy = 0;
+  for (auto c : counts) {
+    if (c == 0)
+      continue;
+    double p = static_cast<double>(c) / size;
+    entropy -= p * std::log2(p);
+  }
+  return entropy < 7.5;  // bits per byte
+}
+
+void AdaptiveLevel::update(std::chrono::steady_clock::duration compress,
+                           std::chrono::steady_clock::duration send) {
+  if (send > 2 * compress && level_ < MAX_LEVEL)
+    level_++;
+  else if (compress > send && level_ > MIN_LEVEL)
+    level_--;
+}
+}  // namespace net::compression
@@ -0,0 +1,137 @@
+#include "../include/net/disk_writer.hpp"
+#include <chrono>
+#include <optional>
+#include <utility>
+#include "../include/metrics/metrics.hpp"
+
+namespace net {
+namespace {
+// Over every writer in the process
+metrics::Gauge& queuedJobs() {
+  static auto& gauge = metrics::gauge("file_sync_disk_queue_jobs",
+                                      "Disk jobs submitted and not yet run");
+  return gauge;
+}
+
+// Sessions stalled on the disk: a full buffer pool or a flush
+metrics::Histogram& diskWait() {
+  static auto& histogram = metrics::histogram(
+      "file_sync_wait_seconds",
+      "Time sessions spend blocked on a resource",
+      {{"on", "disk_write"}});
+  return histogram;
+}
+}  // namespace
+
+DiskWriter::State::State(asio::strand<asio::any_io_executor> s)
+    : strand(s), wake(s) {
+  wake.expires_at(asio::steady_timer::time_point::max());
+}
+
+void DiskWriter::State::notify() {
+  wake.cancel();
+  wake.expires_at(asio::steady_timer::time_point::max());
+}
+
+DiskWriter::DiskWriter(asio::strand<asio::any_io_executor> strand,
+                       std::size_t buffers)
+    : state_(std::make_shared<State>(strand)),
+      max_buffers_(buffers == 0 ? 1 : buffers),
+      thread_([this] { run(); }) {}
+
+DiskWriter::~DiskWriter() {
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+}
+
+asio::awaitable<DiskWriter::Buffer> DiskWriter::acquire(std::size_t size) {
+  auto state = state_;
+  std::optional<metrics::Timer> waiting;
+  while (state->free.empty() && state->allocated >= max_buffers_) {
+    if (state->error)
+      break;
+    if (!waiting)
+      waiting.emplace(diskWait());
+    boost::system::error_code ec;
+    co_await state->wake.async_wait(
+        asio::redirect_error(asio::use_awaitable, ec));
+  }
+  if (state->error)
+    std::rethrow_exception(std::exchange(state->error, nullptr));
+
+  Buffer buffer;
+  if (!state->free.empty()) {
+    buffer = std::move(state->free.back());
+    state->free.pop_back();
+  } else {
+    state->allocated++;
+  }
+  buffer.resize(size);
+  co_return buffer;
+}
+
+void DiskWriter::release(Buffer buffer) {
+  asio::post(state_->strand,
+             [state = state_, buffer = std::move(buffer)]() mutable {
+               state->free.push_back(std::move(buffer));
+               state->notify();
+             });
+}
+
+void DiskWriter::submit(Job job) {
+  state_->submitted++;
+  queuedJobs().add(1);
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    jobs_.push_back(std::move(job));
+  }
+  cv_.notify_one();
+}
+
+asio::awaitable<void> DiskWriter::flush() {
+  auto state  = state_;
+  auto target = state->submitted;
+  std::optional<metrics::Timer> waiting;
+  if (state->completed < target)
+    waiting.emplace(diskWait());
+  while (state->completed < target) {
+    boost::system::error_code ec;
+    co_await state->wake.async_wait(
+        asio::redirect_error(asio::use_awaitable, ec));
+  }
+  if (state->error)
+    std::rethrow_exception(std::exchange(state->error, nullptr));
+}
+
+void DiskWriter::run() {
+  for (;;) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(mtx_);
+      cv_.wait(lock, [&] { return stop_ || !jobs_.empty(); });
+      if (jobs_.empty())
+        return;
+      job = std::move(jobs_.front());
+      jobs_.pop_front();
+    }
+
+    std::exception_ptr error;
+    try {
+      job();
+    } catch (...) {
+      error = std::current_exception();
+    }
+    queuedJobs().add(-1);
+    asio::post(state_->strand, [state = state_, error] {
+      state->completed++;
+      if (error && !state->error)
+        state->error = error;
+      state->notify();
+    });
+  }
+}
+}  // namespace net
@@ -0,0 +1,1618 @@
+#include "../include/engine/engine.hpp"
+#include <boost/asio/experimental/awaitable_operators.hpp>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include "../include/fstree/rsync.hpp"
+#include "../include/net/compute.hpp"
+
+namespace engine {
+using namespace asio::experimental::awaitable_operators;
+
+namespace {
+std::pair<std::string, asio::ip::address> hostInfo() {
+  asio::io_context io;
+
+  std::string hostname = asio::ip::host_name();
+  asio::ip::address ip;
+
+  try {
+    asio::ip::udp::socket socket(io);
+
+    socket.connect(
+        asio::ip::udp::endpoint(asio::ip::make_address("8.8.8.8"), 80));
+
+    ip = socket.local_endpoint().address();
+  } catch (...) {
+  }
+
+  return {hostname, ip};
+}
+
+PeerInfo peerInfo(const std::shared_ptr<net::Session>& session,
+                  const net::Session::HelloPacket& hello) {
+  auto endpoint = session->socket().remote_endpoint();
+
+  PeerInfo info;
+  info.address = endpoint.address();
+  info.port    = hello.listen_port ? hello.listen_port : endpoint.port();
+  info.session = session;
+
+  info.peer_id = hello.peer_id;
+  info.name    = hello.hostname;
+
+  return info;
+}
+
+// Trees are compared hash for hash, so both sides must use one algorithm
+void checkHashAlgorithm(const net::Session::HelloPacket& hello,
+                        fstree::HashAlgorithm local) {
+  if (hello.hash != local)
+    throw std::runtime_error(
+        std::string("Peer hashes files with ") +
+        fstree::hashAlgorithmName(hello.hash) + ", this side with " +
+        fstree::hashAlgorithmName(local) + "; start both with the same.");
+}
+
+bool isTreePacket(net::Session::PacketType pt) {
+  return pt == net::Session::PacketType::Tree ||
+         pt == net::Session::PacketType::TreeDelta;
+}
+}  // namespace
+
+SyncEngine::SyncEngine(Options options, Callbacks callbacks)
+    : options_(std::move(options)),
+      callbacks_(std::move(callbacks)),
+      peer_(std::make_shared<net::Peer>(options_.port, options_.io_threads)),
+      read_pool_(options_.transfer.read_threads),
+      compute_pool_(options_.compute_threads),
+      update_done_(peer_->getExecutor()) {
+  update_done_.expires_at(asio::steady_timer::time_point::max());
+  if (options_.chunk_cache)
+    peer_->enableChunkCache();
+  if (options_.total_rate_limit > 0)
+    total_rate_limiter_ =
+        std::make_shared<net::RateLimiter>(options_.total_rate_limit);
+
+  auto [hostname, address] = hostInfo();
+  local_.name              = hostname;
+  local_.peer_id           = peer_->id();
+  local_.address           = address;
+  local_.port              = peer_->port();
+  local_.tree              = std::make_shared<fstree::DirectoryTree>(
+      fstree::DirectoryTree(options_.root, options_.scan));
+
+  try {
+    watcher_ = std::make_unique<fstree::Watcher>(local_.tree->root_path);
+  } catch (const std::exception&) {
+    // No inotify available — fall back to full rebuilds
+  }
+
+  pool_metrics_ = metrics::addCollector(
+      "file_sync_pool_queued_tasks",
+      "Tasks waiting for a worker of a thread pool",
+      metrics::Kind::Gauge,
+      [this] {
+        return std::vector<metrics::Sample>{
+            {{{"pool", "read"}}, static_cast<double>(read_pool_.queued())},
+            {{{"pool", "compute"}},
+             static_cast<double>(compute_pool_.queued())},
+        };
+      });
+}
+
+SyncEngine::~SyncEngine() {
+  stop();
+  metrics::removeCollector(pool_metrics_);
+}
+
+void SyncEngine::start() {
+  peer_->doAccept([this](std::weak_ptr<net::Session> weak_session) {
+    if (auto session = weak_session.lock())
+      asio::co_spawn(peer_->getExecutor(), accepted(session), asio::detached);
+  });
+  if (watcher_)
+    asio::co_spawn(peer_->getExecutor(), watch(), asio::detached);
+
+  io_thread_ = std::thread([peer = peer_] { peer->run(); });
+}
+
+void SyncEngine::stop() {
+  if (!io_thread_.joinable())
+    return;
+  peer_->stop();
+  io_thread_.join();
+}
+
+std::vector<PeerInfo> SyncEngine::peers() const {
+  std::lock_guard<std::mutex> lock(peer_mutex_);
+  return peers_;
+}
+
+std::optional<PeerInfo> SyncEngine::findPeer(uint64_t peer_id) const {
+  std::lock_guard<std::mutex> lock(peer_mutex_);
+  for (const auto& info : peers_)
+    if (info.peer_id == peer_id)
+      return info;
+  return std::nullopt;
+}
+
+uint64_t SyncEngine::treeVersion() const {
+  std::lock_guard<std::mutex> lock(peer_mutex_);
+  return tree_version_;
+}
+
+// Trees are never changed once published, so only taking the snapshots
+// needs peer_mutex_
+std::optional<Diff> SyncEngine::diff(uint64_t peer_id) const {
+  Diff diff;
+  std::shared_ptr<const fstree::DirectoryTree> local, theirs;
+  {
+    std::lock_guard<std::mutex> lock(peer_mutex_);
+    for (const auto& info : peers_)
+      if (info.peer_id == peer_id)
+        theirs = info.tree;
+    if (!theirs)
+      return std::nullopt;
+    local        = local_.tree;
+    diff.version = tree_version_;
+  }
+  diff.diffs = fstree::diffTree(*local, *theirs, &diff.unloaded);
+  return diff;
+}
+
+SyncStatus SyncEngine::syncStatus() const {
+  return {phase_.load(), files_done_.load(), files_total_.load()};
+}
+
+void SyncEngine::changed() {
+  if (callbacks_.changed)
+    callbacks_.changed();
+}
+
+void SyncEngine::error(const std::string& title, const std::string& message) {
+  if (callbacks_.error)
+    callbacks_.error(title, message);
+  changed();
+}
+
+bool SyncEngine::removePeer(const SessionPtr& session) {
+  for (auto it = peers_.begin(); it != peers_.end(); ++it) {
+    if (it->session.lock() == session) {
+      subtree_requests_.erase(it->peer_id);
+      rate_limiters_.erase(it->peer_id);
+      peers_.erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
+std::vector<std::shared_ptr<net::RateLimiter>> SyncEngine::rateLimiters(
+    uint64_t peer_id) {
+  std::vector<std::shared_ptr<net::RateLimiter>> limiters;
+  if (options_.peer_rate_limit > 0) {
+    auto& limiter = rate_limiters_[peer_id];
+    if (!limiter)
+      limiter = std::make_shared<net::RateLimiter>(options_.peer_rate_limit);
+    limiters.push_back(limiter);
+  }
+  if (total_rate_limiter_)
+    limiters.push_back(total_rate_limiter_);
+  return limiters;
+}
+
+std::vector<SyncEngine::SessionPtr> SyncEngine::sessions() const {
+  std::lock_guard<std::mutex> lock(peer_mutex_);
+  std::vector<SessionPtr> sessions;
+  for (const auto& info : peers_)
+    if (auto session = info.session.lock())
+      sessions.push_back(std::move(session));
+  return sessions;
+}
+
+PeerInfo* SyncEngine::findPeer(const SessionPtr& session) {
+  for (auto& info : peers_)
+    if (info.session.lock() == session)
+      return &info;
+  return nullptr;
+}
+
+bool SyncEngine::known(uint64_t peer_id) const {
+  std::lock_guard<std::mutex> lock(peer_mutex_);
+  return std::any_of(peers_.begin(), peers_.end(), [&](const PeerInfo& p) {
+    return p.peer_id == peer_id;
+  });
+}
+
+bool SyncEngine::addPeer(PeerInfo info) {
+  {
+    std::lock_guard<std::mutex> lock(peer_mutex_);
+    for (const auto& existing : peers_)
+      if (existing.peer_id == info.peer_id)
+        return false;
+    if (auto session = info.session.lock())
+      session->limitRate(rateLimiters(info.peer_id));
+    peers_.push_back(std::move(info));
+    tree_version_++;
+  }
+  changed();
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// Local tree
+// -----------------------------------------------------------------------------
+
+// Our side of the handshake
+net::Session::HelloPacket SyncEngine::localHello(bool data_channel) {
+  return net::Session::HelloPacket{
+      peer_->id(),
+      local_.name,
+      peer_->port(),
+      data_channel,
+      net::FEATURE_COMPACT_TREE | net::FEATURE_TREE_DELTA |
+          net::FEATURE_FILE_DELTA | net::FEATURE_FILE_BUNDLE |
+          net::FEATURE_MULTI_STREAM | net::FEATURE_FILE_HASHES |
+          net::FEATURE_RESUME | net::FEATURE_LOCAL_COPY |
+          (options_.transfer.compression ? net::compression::FEATURE_DEFLATE
+                                         : 0u) |
+          (options_.lazy_trees ? net::FEATURE_LAZY_TREE : 0u),
+      options_.scan.hash_algorithm};
+}
+
+// Session calls read local_.tree from the session's strand, so it stays
+// pinned until they return.
+asio::awaitable<void> SyncEngine::sendLocalTree(SessionPtr session,
+                                                bool tagged) {
+  TreePin pin(tree_pins_);
+  if (tagged)
+    co_await session->sendTaggedTree(*local_.tree);
+  else
+    co_await session->sendTree(*local_.tree);
+}
+
+// The local tree with what changed on disk since base, null if nothing did.
+// The watcher applies its events to a copy of base on compute_pool_; the
+// tree is rebuilt there without one, or after events were lost.
+asio::awaitable<std::shared_ptr<fstree::DirectoryTree>>
+SyncEngine::scanLocalTree(std::shared_ptr<fstree::DirectoryTree> base) {
+  if (watcher_) {
+    watcher_->read();
+    if (!watcher_->pending())
+      co_return nullptr;
+    auto apply = [this, base]() -> std::shared_ptr<fstree::DirectoryTree> {
+      auto tree = std::make_shared<fstree::DirectoryTree>(base->clone());
+      if (!watcher_->apply(*tree))
+        return nullptr;
+      return tree;
+    };
+    if (auto tree = co_await net::offload(compute_pool_, apply))
+      co_return tree;
+  }
+  auto rescan = [root = base->root_path, scan = options_.scan] {
+    return std::make_shared<fstree::DirectoryTree>(root, scan);
+  };
+  co_return co_await net::offload(compute_pool_, rescan);
+}
+
+// Bring local_.tree in line with the disk. App strand only. One update runs
+// at a time, later callers wait for it and then pick up what it missed. A
+// result that finds the tree pinned is kept in pending_tree_ until an update
+// finds it free.
+asio::awaitable<void> SyncEngine::updateLocalTree() {
+  while (updating_) {
+    boost::system::error_code ec;
+    co_await update_done_.async_wait(
+        asio::redirect_error(asio::use_awaitable, ec));
+  }
+  if (tree_pins_ > 0)
+    co_return;
+
+  updating_ = true;
+  std::shared_ptr<fstree::DirectoryTree> fresh;
+  try {
+    fresh = co_await scanLocalTree(pending_tree_ ? pending_tree_
+                                                 : local_.tree);
+  } catch (...) {
+    updating_ = false;
+    update_done_.cancel();
+    throw;
+  }
+  updating_ = false;
+  update_done_.cancel();
+
+  if (fresh)
+    pending_tree_ = std::move(fresh);
+  if (!pending_tree_ || tree_pins_ > 0)
+    co_return;
+  std::lock_guard<std::mutex> lock(peer_mutex_);
+  tree_version_++;
+  local_.tree = std::move(pending_tree_);
+}
+
+// Usually a small delta. Skipped while our sync is running, its SyncDone
+// sends the tree anyway; a peer that fails is left to its listener.
+asio::awaitable<void> SyncEngine::pushLocalTree() {
+  if (syncStatus().busy())
+    co_return;
+  for (auto& session : sessions()) {
+    try {
+      co_await sendLocalTree(session, true);
+    } catch (const std::exception&) {
+    }
+  }
+}
+
+// Keeps local_.tree current from the app strand
+asio::awaitable<void> SyncEngine::watch() {
+  auto ex = co_await asio::this_coro::executor;
+  asio::posix::stream_descriptor events(ex, ::dup(watcher_->fd()));
+  asio::steady_timer timer(ex);
+
+  while (true) {
+    co_await events.async_wait(asio::posix::stream_descriptor::wait_read,
+                               asio::use_awaitable);
+    // An update applies events on compute_pool_, reads wait for it to end
+    if (!updating_)
+      watcher_->read();
+
+    // Debounce bursts: apply once events go quiet, but no later than
+    // watch_max_delay (or the end of a pin) after the first one
+    auto deadline = std::chrono::steady_clock::now() + options_.watch_max_delay;
+    bool more     = false;
+    do {
+      timer.expires_after(options_.watch_quiet);
+      co_await timer.async_wait(asio::use_awaitable);
+      more = !updating_ && watcher_->read();
+    } while ((more && std::chrono::steady_clock::now() < deadline) ||
+             tree_pins_ > 0 || updating_);
+
+    co_await updateLocalTree();
+    changed();
+    // More of a lazy peer's tree may differ from ours now
+    for (auto& session : sessions()) {
+      try {
+        co_await loadSubtrees(session);
+      } catch (const std::exception&) {
+      }
+    }
+    if (options_.push_changes)
+      co_await pushLocalTree();
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Handshakes
+// -----------------------------------------------------------------------------
+
+asio::awaitable<void> SyncEngine::accepted(SessionPtr session) {
+  try {
+    co_await session->sendHello(localHello(false));
+    auto hello = co_await session->receiveHello();
+
+    // Extra connection from a known peer carrying sync data
+    if (hello.data_channel) {
+      if (known(hello.peer_id))
+        co_await listenData(session);
+      session->close();
+      co_return;
+    }
+
+    if (known(hello.peer_id)) {
+      session->close();
+      co_return;
+    }
+    checkHashAlgorithm(hello, options_.scan.hash_algorithm);
+    auto info = peerInfo(session, hello);
+
+    co_await sendLocalTree(session, false);
+    info.tree = std::make_shared<fstree::DirectoryTree>(
+        co_await session->receiveTree());
+
+    if (!addPeer(std::move(info))) {
+      session->close();
+      co_return;
+    }
+  } catch (const boost::system::system_error& e) {
+    session->close();
+    error("Incoming Connection Error",
+          std::string("Handshake with incoming peer failed: ") + e.what());
+    co_return;
+  } catch (const std::exception& e) {
+    session->close();
+    error("Incoming Connection Error", e.what());
+    co_return;
+  } catch (...) {
+    session->close();
+    // Silently drop truly unknown errors on accept side
+    co_return;
+  }
+  co_await listen(session);
+}
+
+asio::awaitable<void> SyncEngine::handshake(
+    SessionPtr session,
+    std::function<void(uint64_t)> on_connected) {
+  auto hello = co_await session->receiveHello();
+  co_await session->sendHello(localHello(false));
+
+  if (known(hello.peer_id)) {
+    session->close();
+    if (on_connected)
+      on_connected(hello.peer_id);
+    co_return;
+  }
+  checkHashAlgorithm(hello, options_.scan.hash_algorithm);
+  auto info = peerInfo(session, hello);
+
+  info.tree = std::make_shared<fstree::DirectoryTree>(
+      co_await session->receiveTree());
+  co_await sendLocalTree(session, false);
+
+  if (!addPeer(std::move(info))) {
+    session->close();
+  } else {
+    asio::co_spawn(peer_->getExecutor(), listen(session), asio::detached);
+  }
+  if (on_connected)
+    on_connected(hello.peer_id);
+}
+
+void SyncEngine::connect(const std::string& host,
+                         uint16_t port,
+                         std::chrono::seconds timeout,
+                         std::function<void(uint64_t)> on_connected) {
+  peer_->doResolveAndConnect(
+      host,
+      port,
+      [this, host, timeout, on_connected](std::weak_ptr<net::Session> ws) {
+        auto session = ws.lock();
+        if (!session)
+          return;
+        asio::co_spawn(
+            peer_->getExecutor(),
+            [this, session, host, timeout, on_connected]()
+                -> asio::awaitable<void> {
+              try {
+                // Snapshot the target address before we potentially close
+                // the socket on timeout.
+                std::string target_addr;
+                try {
+                  target_addr =
+                      session->socket().remote_endpoint().address().to_string();
+                } catch (...) {
+                  target_addr = host;
+                }
+
+                asio::steady_timer timer(co_await asio::this_coro::executor);
+                timer.expires_after(timeout);
+
+                auto result =
+                    co_await (handshake(session, on_connected) ||
+                              timer.async_wait(asio::use_awaitable));
+
+                if (result.index() == 1) {
+                  // Timer won — timeout
+                  session->close();
+                  error("Connection Timed Out",
+                        "Could not complete handshake with " + target_addr +
+                            " within " + std::to_string(timeout.count()) +
+                            " s.");
+                }
+                // index == 0 means handshake completed normally
+              } catch (const boost::system::system_error& e) {
+                session->close();
+                error("Connection Error",
+                      std::string("Network error during handshake: ") +
+                          e.what());
+              } catch (const std::exception& e) {
+                session->close();
+                error("Handshake Failed", e.what());
+              } catch (...) {
+                session->close();
+                error("Connection Error",
+                      "An unknown error occurred while connecting.");
+              }
+            },
+            asio::detached);
+      },
+      // Resolve or TCP connect itself failed
+      [this, host, port](const boost::system::error_code& ec) {
+        error("Connection Failed",
+              "Could not connect to " + host + ":" + std::to_string(port) +
+                  ".\n" + ec.message());
+      });
+}
+
+// -----------------------------------------------------------------------------
+// Front end requests
+// -----------------------------------------------------------------------------
+
+void SyncEngine::refresh(std::optional<uint64_t> peer_id) {
+  phase_.store(SyncPhase::Idle);
+  SessionPtr session;
+  if (peer_id)
+    if (auto info = findPeer(*peer_id))
+      session = info->session.lock();
+
+  asio::co_spawn(
+      peer_->getExecutor(),
+      [this, session]() -> asio::awaitable<void> {
+        // Applies pending watcher events, or rebuilds without one
+        co_await updateLocalTree();
+        changed();
+        if (!session)
+          co_return;
+        co_await session->sendTreeRequest();
+        co_await sendLocalTree(session, true);
+      },
+      asio::detached);
+}
+
+// Sends SyncRequest + our tree. The listener on the remote side handles it:
+// it computes the diff (from the requester's perspective), streams files /
+// delete notices, then sends SyncDone. Our listener receives all of that and
+// updates the sync status as it goes.
+bool SyncEngine::sync(uint64_t peer_id) {
+  if (syncStatus().busy())
+    return false;
+  auto info = findPeer(peer_id);
+  if (!info)
+    return false;
+  auto session = info->session.lock();
+  if (!session)
+    return false;
+
+  phase_.store(SyncPhase::SyncingTrees);
+  files_done_.store(0);
+  files_total_.store(0);
+  changed();
+
+  asio::co_spawn(
+      peer_->getExecutor(),
+      [this, session]() -> asio::awaitable<void> {
+        try {
+          co_await session->sendPacketType(PacketType::SyncRequest);
+          co_await sendLocalTree(session, true);
+        } catch (const boost::system::system_error& e) {
+          phase_.store(SyncPhase::Error);
+          error("Sync Failed",
+                std::string("Failed to send sync request: ") + e.what());
+        } catch (const std::exception& e) {
+          phase_.store(SyncPhase::Error);
+          error("Sync Failed", e.what());
+        } catch (...) {
+          phase_.store(SyncPhase::Error);
+          error("Sync Failed",
+                "An unknown error occurred while starting sync.");
+        }
+      },
+      asio::detached);
+  return true;
+}
+
+void SyncEngine::disconnect(uint64_t peer_id) {
+  SessionPtr session;
+  {
+    std::lock_guard<std::mutex> lock(peer_mutex_);
+    for (const auto& info : peers_)
+      if (info.peer_id == peer_id)
+        session = info.session.lock();
+    if (!session)
+      return;
+    removePeer(session);
+  }
+
+  phase_.store(SyncPhase::Idle);
+  changed();
+
+  // Notify the remote peer, then close the socket
+  asio::co_spawn(
+      peer_->getExecutor(),
+      [session]() -> asio::awaitable<void> {
+        try {
+          co_await session->sendDisconnectRequest();
+        } catch (...) {
+          // Best-effort: ignore send errors on disconnect
+        }
+        session->close();
+      },
+      asio::detached);
+}
+
+// -----------------------------------------------------------------------------
+// Listeners  (sole reader on each session post-handshake)
+// -----------------------------------------------------------------------------
+
+// Listener time per packet, each type's histogram looked up once. App strand
+// only, like the listeners.
+metrics::Histogram& SyncEngine::packetSeconds(PacketType type) {
+  auto& slot = packet_histograms_[static_cast<uint8_t>(type)];
+  if (!slot)
+    slot = &metrics::histogram("file_sync_packet_seconds",
+                               "Listener time handling one packet, by type",
+                               {{"type", net::Session::packetTypeName(type)}});
+  return *slot;
+}
+
+// The peer's tree as stored, null if it has none (yet)
+std::shared_ptr<fstree::DirectoryTree> SyncEngine::peerTree(
+    const SessionPtr& session) {
+  std::lock_guard<std::mutex> lock(peer_mutex_);
+  auto* info = findPeer(session);
+  return info ? info->tree : nullptr;
+}
+
+// Reads a Tree or TreeDelta payload (tag already consumed) and stores it as
+// the peer's tree. A delta is applied to a copy on compute_pool_ that then
+// replaces the tree, so a diff never sees a half-applied one. Returns
+// nullptr if a delta didn't apply; a full tree has then been requested and
+// will follow as a Tree.
+asio::awaitable<std::shared_ptr<fstree::DirectoryTree>>
+SyncEngine::receivePeerTree(SessionPtr session, PacketType pt) {
+  if (pt == PacketType::Tree) {
+    auto tree = std::make_shared<fstree::DirectoryTree>(
+        co_await session->receiveTreePayload());
+    // A lazy tree takes over what was fetched into the one it replaces
+    auto previous = peerTree(session);
+    if (previous && session->lazyTrees())
+      tree->keepLoaded(*previous);
+
+    std::lock_guard<std::mutex> lock(peer_mutex_);
+    if (auto* info = findPeer(session)) {
+      subtree_requests_.erase(info->peer_id);
+      info->tree = tree;
+    }
+    tree_version_++;
+    co_return tree;
+  }
+
+  auto delta = co_await session->receiveTreeDeltaPayload();
+  auto base  = peerTree(session);
+  if (delta && base) {
+    auto apply = [&]() -> std::shared_ptr<fstree::DirectoryTree> {
+      auto tree = std::make_shared<fstree::DirectoryTree>(base->clone());
+      if (!tree->applyDelta(std::move(*delta)))
+        return nullptr;
+      return tree;
+    };
+    if (auto tree = co_await net::offload(compute_pool_, apply)) {
+      std::lock_guard<std::mutex> lock(peer_mutex_);
+      auto* info = findPeer(session);
+      if (info && info->tree == base) {
+        info->tree = tree;
+        tree_version_++;
+        co_return tree;
+      }
+    }
+  }
+  co_await session->sendTreeResync();
+  co_return nullptr;
+}
+
+// Each stub is asked for once per version of the peer's tree. Answers come
+// in at the listener, which then asks for what differs a level further down.
+asio::awaitable<void> SyncEngine::loadSubtrees(SessionPtr session) {
+  if (!session->lazyTrees())
+    co_return;
+  auto theirs = peerTree(session);
+  if (!theirs)
+    co_return;
+  auto find_unloaded = [local = local_.tree, theirs] {
+    std::vector<fs::path> unloaded;
+    fstree::diffTree(*local, *theirs, &unloaded);
+    return unloaded;
+  };
+  auto unloaded = co_await net::offload(compute_pool_, find_unloaded);
+
+  std::vector<fs::path> wanted;
+  {
+    std::lock_guard<std::mutex> lock(peer_mutex_);
+    auto* info = findPeer(session);
+    if (!info || info->tree != theirs)
+      co_return;  // its next tree is looked at instead
+    auto& asked = subtree_requests_[info->peer_id];
+    for (auto& path : unloaded)
+      if (asked.insert(path).second)
+        wanted.push_back(std::move(path));
+  }
+  if (!wanted.empty())
+    co_await session->sendSubtreeRequest(wanted);
+}
+
+// Session calls read local_.tree from the session's strand, so it stays
+// pinned until they return
+asio::awaitable<void> SyncEngine::serveSubtrees(SessionPtr session) {
+  auto rel_paths = co_await session->receiveSubtreeRequest();
+  TreePin pin(tree_pins_);
+  co_await session->sendSubtrees(*local_.tree, rel_paths);
+}
+
+// A stub that no longer matches its answer (the peer's tree changed since)
+// stays one until the peer's next tree. Grafts go to a copy that replaces
+// the peer's tree, like deltas.
+asio::awaitable<std::vector<fs::path>> SyncEngine::receiveSubtrees(
+    SessionPtr session) {
+  auto subtrees = co_await session->receiveSubtrees();
+  std::vector<fs::path> paths;
+  for (const auto& subtree : subtrees)
+    paths.push_back(subtree.path);
+
+  auto base = peerTree(session);
+  if (!base)
+    co_return paths;
+  auto graft = [&] {
+    auto tree = std::make_shared<fstree::DirectoryTree>(base->clone());
+    for (auto& subtree : subtrees)
+      if (subtree.node)
+        tree->graft(std::move(subtree.node));
+    return tree;
+  };
+  auto tree = co_await net::offload(compute_pool_, graft);
+
+  std::lock_guard<std::mutex> lock(peer_mutex_);
+  auto* info = findPeer(session);
+  if (info && info->tree == base) {
+    info->tree = tree;
+    tree_version_++;
+  }
+  co_return paths;
+}
+
+// Opens up to `count` data channels to the peer behind `session`. Fewer (or
+// none) if the peer can't be reached on its listen port.
+asio::awaitable<std::vector<SyncEngine::SessionPtr>>
+SyncEngine::openDataChannels(SessionPtr session, unsigned count) {
+  std::vector<SessionPtr> channels;
+  uint16_t port = 0;
+  std::vector<std::shared_ptr<net::RateLimiter>> limiters;
+  {
+    std::lock_guard<std::mutex> lock(peer_mutex_);
+    if (auto* info = findPeer(session)) {
+      port     = info->port;
+      limiters = rateLimiters(info->peer_id);
+    }
+  }
+  if (port == 0)
+    co_return channels;
+
+  try {
+    asio::ip::tcp::endpoint endpoint(
+        session->socket().remote_endpoint().address(), port);
+    for (unsigned i = 0; i < count; ++i) {
+      auto channel = co_await peer_->connect(endpoint);
+      channel->limitRate(limiters);
+      co_await channel->receiveHello();
+      co_await channel->sendHello(localHello(true));
+      channels.push_back(std::move(channel));
+    }
+  } catch (const std::exception&) {
+    // Carry on with what we have
+  }
+  co_return channels;
+}
+
+// Streams a sync's file ops. Past a size threshold, files above
+// small_file_size are cut into ranges that the control session and the data
+// channels pull from a shared queue; each channel confirms its writes hit the
+// disk before the control session goes on to SyncDone. Without channels,
+// files spanning several ranges are still cut up when interleaving is on, and
+// the control session sends one of their ranges per interleave_bytes of the
+// other ops, so a huge file doesn't hold back everything behind it.
+asio::awaitable<void> SyncEngine::sendSyncOps(SessionPtr session,
+                                              std::vector<net::SyncOp> ops) {
+  const auto& transfer = options_.transfer;
+  const auto& schedule = options_.schedule;
+  // A peer without FileRange and data channels takes everything in order
+  if (!session->supports(net::FEATURE_MULTI_STREAM)) {
+    co_await session->sendSyncOps(*local_.tree, ops, read_pool_, transfer);
+    co_return;
+  }
+  struct Range {
+    const fstree::Node* node;
+    uint64_t offset, length;
+  };
+  // A file replacing a deleted path must stay behind the delete on the
+  // control session, other sessions aren't ordered with it
+  std::unordered_set<fs::path> deleted;
+  for (auto& op : ops)
+    if (op.kind == net::SyncOp::Kind::Delete)
+      deleted.insert(op.path);
+  auto replaces_deleted = [&](const fs::path& path) {
+    for (auto p = path; !p.empty() && p != p.parent_path(); p = p.parent_path())
+      if (deleted.count(p))
+        return true;
+    return false;
+  };
+  auto size_of = [](const net::SyncOp& op) -> uint64_t {
+    return op.kind == net::SyncOp::Kind::File
+               ? std::get<fstree::FileMeta>(op.node->data).size
+               : 0;
+  };
+  auto rangeable = [&](const net::SyncOp& op, uint64_t min_size) {
+    return size_of(op) > min_size && !replaces_deleted(op.node->path);
+  };
+
+  uint64_t bulk_bytes = 0;
+  for (const auto& op : ops)
+    if (rangeable(op, transfer.small_file_size))
+      bulk_bytes += size_of(op) - op.offset;
+  std::vector<SessionPtr> channels;
+  if (transfer.streams > 1 && bulk_bytes >= transfer.multi_stream_min_bytes)
+    channels = co_await openDataChannels(session, transfer.streams - 1);
+
+  uint64_t min_ranged = transfer.small_file_size;
+  if (channels.empty())
+    min_ranged = schedule.interleave_bytes > 0
+                     ? std::max(transfer.small_file_size, transfer.range_size)
+                     : UINT64_MAX;
+  std::vector<Range> ranges;
+  std::vector<const fstree::Node*> ranged;  // completed after all ranges
+  std::vector<net::SyncOp> rest;
+  for (const auto& op : ops) {
+    if (rangeable(op, min_ranged)) {
+      uint64_t size = size_of(op);
+      ranged.push_back(op.node);
+      for (uint64_t off = op.offset; off < size; off += transfer.range_size)
+        ranges.push_back(
+            {op.node, off, std::min(transfer.range_size, size - off)});
+    } else {
+      rest.push_back(op);
+    }
+  }
+  if (channels.empty() && ranges.empty()) {
+    co_await session->sendSyncOps(*local_.tree, ops, read_pool_, transfer);
+    co_return;
+  }
+
+  std::size_t next_range = 0;
+  auto send_ranges = [&](SessionPtr s) -> asio::awaitable<void> {
+    while (next_range < ranges.size()) {
+      auto r = ranges[next_range++];
+      co_await s->sendFileRange(*local_.tree, *r.node, r.offset, r.length);
+    }
+  };
+
+  int running = static_cast<int>(channels.size());
+  std::exception_ptr error;
+  asio::steady_timer all_done(co_await asio::this_coro::executor);
+  all_done.expires_at(asio::steady_timer::time_point::max());
+  for (auto& channel : channels) {
+    asio::co_spawn(
+        peer_->getExecutor(),
+        [&, channel]() -> asio::awaitable<void> {
+          co_await send_ranges(channel);
+          co_await channel->sendSyncDone();
+          auto reply = co_await channel->receivePacketType();
+          if (reply != PacketType::SyncDone)
+            throw std::runtime_error("data channel out of step");
+        },
+        [&, channel](std::exception_ptr e) {
+          if (e && !error)
+            error = e;
+          channel->close();
+          if (--running == 0)
+            all_done.cancel();
+        });
+  }
+
+  // The control session's share: the other ops in slices of about
+  // interleave_bytes with a range after each, then what ranges are left
+  auto send_control = [&]() -> asio::awaitable<void> {
+    if (schedule.interleave_bytes == 0) {
+      co_await session->sendSyncOps(*local_.tree, rest, read_pool_, transfer);
+    } else {
+      for (auto op = rest.begin(); op != rest.end();) {
+        auto end       = op;
+        uint64_t bytes = 0;
+        while (end != rest.end() && bytes < schedule.interleave_bytes)
+          bytes += size_of(*end++);
+        std::vector<net::SyncOp> slice(op, end);
+        co_await session->sendSyncOps(
+            *local_.tree, slice, read_pool_, transfer);
+        op = end;
+        if (next_range < ranges.size()) {
+          auto r = ranges[next_range++];
+          co_await session->sendFileRange(
+              *local_.tree, *r.node, r.offset, r.length);
+        }
+      }
+    }
+    co_await send_ranges(session);
+  };
+
+  std::exception_ptr control_error;
+  try {
+    co_await send_control();
+  } catch (...) {
+    control_error = std::current_exception();
+    for (auto& channel : channels)
+      channel->close();
+  }
+  while (running > 0) {
+    boost::system::error_code ec;
+    co_await all_done.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+  }
+  if (control_error)
+    std::rethrow_exception(control_error);
+  if (error)
+    std::rethrow_exception(error);
+  // Every channel has confirmed its ranges are on disk
+  for (const auto* node : ranged)
+    co_await session->sendFileComplete(*node);
+}
+
+// The sending end of a sync the peer behind the listener asked for, once
+// its tree is in, up to our SyncDone
+asio::awaitable<void> SyncEngine::serveSync(
+    Listener& listener,
+    std::shared_ptr<fstree::DirectoryTree> requester_tree) {
+  SessionPtr session = listener.session;
+  if (!requester_tree)
+    throw std::runtime_error("expected the requester's tree");
+
+  // Index entries are held across co_awaits below
+  TreePin pin(tree_pins_);
+
+  // Waits for the requester's answer to a request. Whatever else it sends
+  // meanwhile (its own sync, tree pushes, ...) is handled like in listen().
+  bool replaced = false;  // the requester sent a new tree meanwhile
+  auto expect_reply = [&](PacketType expected,
+                          const char* what) -> asio::awaitable<void> {
+    auto reply = co_await session->receivePacketType();
+    while (reply != expected) {
+      replaced |= isTreePacket(reply);
+      if (!co_await dispatch(listener, reply))
+        throw std::runtime_error(std::string("peer left awaiting ") + what);
+      reply = co_await session->receivePacketType();
+    }
+  };
+
+  // 2. Compute what the requester is missing (diff from their POV)
+  //    local_.tree = "new" (ours), requester_tree = "old". Stubs of a lazy
+  //    tree are fetched where they differ from ours until none are left;
+  //    those equal to ours stay stubs, so their files aren't candidates for
+  //    copies and moves below.
+  std::vector<fstree::NodeDiff> diffs;
+  std::unordered_set<fs::path> asked, answered;
+  while (true) {
+    std::vector<fs::path> unloaded;
+    diffs = co_await net::offload(compute_pool_, [&] {
+      return fstree::diffTree(*requester_tree, *local_.tree, &unloaded);
+    });
+    if (unloaded.empty())
+      break;
+
+    std::vector<fs::path> wanted;
+    for (auto& path : unloaded) {
+      if (answered.count(path))
+        throw std::runtime_error("requester's tree changed during the sync");
+      if (asked.insert(path).second)
+        wanted.push_back(std::move(path));
+    }
+    if (!wanted.empty())
+      co_await session->sendSubtreeRequest(wanted);
+    replaced = false;
+    co_await expect_reply(PacketType::Subtrees, "subtrees");
+    for (auto& path : co_await receiveSubtrees(session))
+      answered.insert(std::move(path));
+
+    // Grafts go to the requester's latest tree, start over if it sent one
+    if (auto latest = peerTree(session))
+      requester_tree = std::move(latest);
+    if (replaced) {
+      asked.clear();
+      answered.clear();
+    }
+  }
+
+  // Quick-checked files of equal size but another mtime are hashed on both
+  // sides. Where the contents match only our mtime is sent, so the next
+  // quick check finds them equal. A peer that can't hash gets them in full.
+  std::vector<const fstree::Node*> equal;
+  std::vector<fs::path> unverified;
+  for (const auto& d : diffs)
+    if (d.needsHash() && session->supports(net::FEATURE_FILE_HASHES))
+      unverified.push_back(d.new_node->path);
+  if (!unverified.empty()) {
+    co_await session->sendHashRequest(unverified);
+    auto ours = co_await net::offload(compute_pool_, [&] {
+      std::vector<std::optional<fstree::Hash>> hashes;
+      for (const auto& d : diffs) {
+        if (!d.needsHash())
+          continue;
+        auto& hash = hashes.emplace_back(d.new_node->file_hash);
+        if (!hash) {
+          try {
+            hash = fstree::hashFile(local_.tree->root_path / d.new_node->path,
+                                    local_.tree->hash_algorithm);
+          } catch (const std::exception&) {
+          }  // unreadable, sent as changed
+        }
+      }
+      return hashes;
+    });
+
+    co_await expect_reply(PacketType::Hashes, "file hashes");
+    auto theirs = co_await session->receiveHashes();
+    if (theirs.size() != ours.size())
+      throw std::runtime_error("wrong number of file hashes");
+
+    std::size_t next = 0;
+    std::erase_if(diffs, [&](const fstree::NodeDiff& d) {
+      if (!d.needsHash())
+        return false;
+      std::size_t i = next++;
+      if (!ours[i] || !theirs[i] || *ours[i] != *theirs[i])
+        return false;
+      auto it = local_.tree->index.find(d.new_node->path);
+      if (it != local_.tree->index.end())
+        equal.push_back(it->second);
+      return true;
+    });
+  }
+
+  std::function<int(const fstree::Node&)> countOps =
+      [&](const fstree::Node& node) -> int {
+    if (node.type == fstree::NodeType::File)
+      return 1;
+    const auto& kids = fstree::children(node);
+    if (kids.empty())
+      return 1;
+    int n = 0;
+    for (auto& c : kids)
+      n += countOps(*c);
+    return n;
+  };
+
+  // Helper: queue every file inside an added subtree, or a CreateDir for an
+  // empty directory.
+  std::vector<net::SyncOp> ops;
+  std::function<void(const fstree::Node&)> queueSubtree =
+      [&](const fstree::Node& node) {
+        if (node.type == fstree::NodeType::File) {
+          ops.push_back({net::SyncOp::Kind::File, &node, {}});
+        } else {
+          const auto& kids = fstree::children(node);
+          if (kids.empty()) {
+            ops.push_back({net::SyncOp::Kind::CreateDir, nullptr, node.path});
+          } else {
+            for (auto& child : kids)
+              queueSubtree(*child);
+          }
+        }
+      };
+
+  // Modified files the requester already has a big enough copy of go as a
+  // block delta against it, the rest in full
+  auto sendModified = [&](const fstree::NodeSnapshot& old_node,
+                          const fstree::Node& node) -> asio::awaitable<void> {
+    if (session->supports(net::FEATURE_FILE_DELTA) &&
+        old_node.type == fstree::NodeType::File &&
+        old_node.size >= net::DELTA_MIN_FILE_SIZE &&
+        std::get<fstree::FileMeta>(node.data).size >=
+            net::DELTA_MIN_FILE_SIZE) {
+      co_await session->sendSignatureRequest(node.path);
+      co_await expect_reply(PacketType::Signature, "block signature");
+
+      auto sig = co_await session->receiveSignature();
+      if (sig.block_size != 0) {
+        co_await session->sendFileDelta(*local_.tree, node, sig);
+        co_await expect_reply(PacketType::DeltaResult, "delta result");
+        if (co_await session->receiveDeltaResult())
+          co_return;
+        // The requester's copy changed since its signature
+      }
+    }
+    co_await session->sendTaggedFile(*local_.tree, node);
+  };
+
+  // Count all operations
+  int total_ops = 0;
+  for (auto& d : diffs) {
+    if (d.type == fstree::ChangeType::Added) {
+      auto it = local_.tree->index.find(d.new_node->path);
+      if (it != local_.tree->index.end())
+        total_ops += countOps(*it->second);
+    } else if (d.type == fstree::ChangeType::Deleted) {
+      ++total_ops;  // one remove_all
+    } else if (d.type == fstree::ChangeType::Modified &&
+               d.new_node->type == fstree::NodeType::File) {
+      ++total_ops;
+    }
+  }
+
+  // 3. Tell the requester how many operations to expect
+  co_await session->sendSyncHeader(static_cast<uint32_t>(total_ops));
+
+  // 4. Stream files / deletes to requester. Everything but block deltas
+  //    (one round trip each) is pipelined.
+  std::vector<std::pair<const fstree::NodeSnapshot*, const fstree::Node*>>
+      modified;
+  for (auto& d : diffs) {
+    if (d.type == fstree::ChangeType::Added) {
+      // Added file or directory subtree
+      auto it = local_.tree->index.find(d.new_node->path);
+      if (it != local_.tree->index.end())
+        queueSubtree(*it->second);
+
+    } else if (d.type == fstree::ChangeType::Deleted) {
+      // Deleted file or directory — remove_all handles recursion
+      ops.push_back({net::SyncOp::Kind::Delete, nullptr, d.old_node->path});
+
+    } else if (d.type == fstree::ChangeType::Modified &&
+               d.new_node->type == fstree::NodeType::File) {
+      auto it = local_.tree->index.find(d.new_node->path);
+      if (it == local_.tree->index.end())
+        continue;
+      if (d.old_node->size >= net::DELTA_MIN_FILE_SIZE)
+        modified.emplace_back(&*d.old_node, it->second);
+      else
+        ops.push_back({net::SyncOp::Kind::File, it->second, {}});
+    }
+  }
+
+  for (const auto* node : equal)
+    ops.push_back({net::SyncOp::Kind::Mtime, node, {}});
+
+  // Each content crosses the wire once. A file the requester already has
+  // under a path it keeps or is about to delete, or gets earlier in this
+  // sync, is cloned or moved from there. Only hashes the trees already hold
+  // count: nothing is read for this, so quick-checked files without one
+  // are simply sent.
+  auto file_size = [](const fstree::Node& node) {
+    return std::get<fstree::FileMeta>(node.data).size;
+  };
+  auto known_hash = [](const fstree::Node& node) -> const fstree::Hash* {
+    const auto& hash = std::get<fstree::FileMeta>(node.data).file_hash;
+    return hash ? &*hash : nullptr;
+  };
+  std::vector<net::SyncOp> copies;
+  {
+    std::unordered_set<fs::path> changed, removed;
+    std::unordered_set<uint64_t> sent_sizes;
+    for (const auto& op : ops) {
+      if (op.kind == net::SyncOp::Kind::Delete)
+        removed.insert(op.path);
+      if (op.kind != net::SyncOp::Kind::File)
+        continue;
+      changed.insert(op.node->path);
+      if (session->supports(net::FEATURE_LOCAL_COPY) &&
+          file_size(*op.node) >= net::LOCAL_COPY_MIN_FILE_SIZE &&
+          known_hash(*op.node))
+        sent_sizes.insert(file_size(*op.node));
+    }
+    for (const auto& [old_node, node] : modified)
+      changed.insert(node->path);
+
+    // Same path on both sides and unchanged, so the requester's copy has
+    // our content. Neither tree is walked without a candidate to look for.
+    fstree::ContentIndex present, deletable;
+    auto candidate = [&](const fstree::Node& node) {
+      return node.type == fstree::NodeType::File &&
+             sent_sizes.count(file_size(node)) && known_hash(node);
+    };
+    if (!sent_sizes.empty()) {
+      for (const auto& [path, node] : local_.tree->index) {
+        if (!candidate(*node) || changed.count(path))
+          continue;
+        auto it = requester_tree->index.find(path);
+        if (it != requester_tree->index.end() &&
+            it->second->type == fstree::NodeType::File)
+          present.add(*known_hash(*node), path);
+      }
+    }
+    // The requester's files under the paths it deletes
+    std::function<void(const fstree::Node&)> collect =
+        [&](const fstree::Node& node) {
+          if (node.type == fstree::NodeType::Directory) {
+            for (const auto& child : fstree::children(node))
+              collect(*child);
+          } else if (candidate(node)) {
+            deletable.add(*known_hash(node), node.path);
+          }
+        };
+    for (const auto& path : removed) {
+      auto it = requester_tree->index.find(path);
+      if (it != requester_tree->index.end() && !sent_sizes.empty())
+        collect(*it->second);
+    }
+
+    // Moves run before the deletes, except onto a path that is about to be
+    // removed; copies after every file is written
+    auto under_removed = [&](fs::path path) {
+      for (; !path.empty() && path != path.parent_path();
+           path = path.parent_path())
+        if (removed.count(path))
+          return true;
+      return false;
+    };
+    std::vector<net::SyncOp> moves, rest;
+    for (const auto& op : ops) {
+      const fstree::Hash* hash = nullptr;
+      if (op.kind == net::SyncOp::Kind::File &&
+          sent_sizes.count(file_size(*op.node)))
+        hash = known_hash(*op.node);
+      if (!hash) {
+        rest.push_back(op);
+        continue;
+      }
+      std::optional<fs::path> from;
+      if (!under_removed(op.node->path))
+        from = deletable.take(*hash);
+      if (from) {
+        moves.push_back({net::SyncOp::Kind::Move, op.node, *from});
+      } else if (const auto* source = present.find(*hash)) {
+        copies.push_back({net::SyncOp::Kind::Copy, op.node, *source});
+        continue;
+      } else {
+        rest.push_back(op);
+      }
+      present.add(*hash, op.node->path);
+    }
+    ops = std::move(moves);
+    ops.insert(ops.end(), rest.begin(), rest.end());
+  }
+
+  // Large files a dropped sync left partly written on the requester carry
+  // on from the blocks that match ours
+  auto resumable = [&](const fstree::Node& node) {
+    return session->supports(net::FEATURE_RESUME) &&
+           file_size(node) >= net::RESUME_MIN_FILE_SIZE;
+  };
+  std::vector<fs::path> partial_paths;
+  for (const auto& op : ops)
+    if (op.kind == net::SyncOp::Kind::File && resumable(*op.node))
+      partial_paths.push_back(op.node->path);
+  for (const auto& [old_node, node] : modified)
+    if (resumable(*node))
+      partial_paths.push_back(node->path);
+  if (!partial_paths.empty()) {
+    co_await session->sendResumeRequest(partial_paths);
+    co_await expect_reply(PacketType::ResumeState, "resume state");
+    auto partials = co_await session->receiveResumeState();
+    if (partials.size() != partial_paths.size())
+      throw std::runtime_error("wrong number of partial files");
+
+    auto offsets = co_await net::offload(compute_pool_, [&] {
+      std::unordered_map<fs::path, uint64_t> found;
+      for (std::size_t i = 0; i < partials.size(); ++i) {
+        if (partials[i].empty())
+          continue;
+        uint64_t offset = fstree::rsync::matchingPrefix(
+            local_.tree->root_path / partial_paths[i],
+            partials[i],
+            net::RESUME_BLOCK_SIZE);
+        if (offset > 0)
+          found.emplace(partial_paths[i], offset);
+      }
+      return found;
+    });
+    for (auto& op : ops)
+      if (op.kind == net::SyncOp::Kind::File && offsets.count(op.node->path))
+        op.offset = offsets[op.node->path];
+    // Finishing a partial copy beats a delta against the old one
+    std::erase_if(modified, [&](const auto& m) {
+      auto it = offsets.find(m.second->path);
+      if (it == offsets.end())
+        return false;
+      ops.push_back({net::SyncOp::Kind::File, m.second, {}, it->second});
+      return true;
+    });
+  }
+
+  net::scheduleOps(ops, options_.schedule);
+  co_await sendSyncOps(session, ops);
+  for (auto& [old_node, node] : modified)
+    co_await sendModified(*old_node, *node);
+  if (!copies.empty())
+    co_await session->sendSyncOps(
+        *local_.tree, copies, read_pool_, options_.transfer);
+
+  // 5. Send our own tree so the requester's diff view updates, then signal
+  //    end of sync. The requester pushes its post-sync tree back, which
+  //    updates our diff view.
+  co_await sendLocalTree(session, true);
+  co_await session->sendSyncDone();
+  changed();
+}
+
+// Receiving end of a data channel: writes ranges and files until the sender
+// closes it, acking each SyncDone once the writes are flushed
+asio::awaitable<void> SyncEngine::listenData(SessionPtr session) {
+  try {
+    while (true) {
+      auto pkt = co_await session->receivePacketType();
+      metrics::Timer handling(packetSeconds(pkt));
+      // Updates replace local_.tree, this one stays valid for the packet
+      auto tree = local_.tree;
+      if (pkt == PacketType::FileRange) {
+        if (co_await session->receiveFileRange(*tree))
+          files_done_.fetch_add(1);
+        changed();
+      } else if (pkt == PacketType::FileData) {
+        co_await session->receiveFile(*tree, false);
+        files_done_.fetch_add(1);
+        changed();
+      } else if (pkt == PacketType::SyncDone) {
+        co_await session->flushWrites();
+        co_await session->sendSyncDone();
+      } else {
+        break;
+      }
+    }
+  } catch (const std::exception&) {
+    // Closed by the sender at the end of the sync
+  }
+}
+
+// Removes the peer behind a failed listener; true if that broke off our sync
+bool SyncEngine::lost(const SessionPtr& session) {
+  {
+    std::lock_guard<std::mutex> lock(peer_mutex_);
+    removePeer(session);
+  }
+  if (!syncStatus().busy())
+    return false;
+  phase_.store(SyncPhase::Error);
+  return true;
+}
+
+// One packet from the peer on the control session, at the top of listen()
+// or while serveSync() waits for a reply. False once the listener is done.
+asio::awaitable<bool> SyncEngine::dispatch(Listener& listener,
+                                           PacketType pkt) {
+  SessionPtr session = listener.session;
+  metrics::Timer handling(packetSeconds(pkt));
+  // Updates replace local_.tree, this one stays valid for the packet
+  auto tree = local_.tree;
+
+  // ---- TreeRequest: plain refresh (tree exchange only) ----
+  if (pkt == PacketType::TreeRequest) {
+    // Requester sends: TreeRequest | Tree tag + payload (their tree), which
+    // arrives as a push. We reply with: Tree tag + payload (our tree)
+    co_await updateLocalTree();
+    co_await sendLocalTree(session, true);
+    changed();
+
+    // ---- Tree / TreeDelta: unsolicited push ----
+  } else if (isTreePacket(pkt)) {
+    auto theirs = co_await receivePeerTree(session, pkt);
+    changed();
+    // The requester's tree follows its SyncRequest. Without it (a delta
+    // that didn't apply) the full tree it resends is waited for.
+    if (listener.sync_requested) {
+      if (theirs) {
+        listener.sync_requested = false;
+        listener.sync_pending   = true;
+      }
+    } else if (callbacks_.peer_tree) {
+      callbacks_.peer_tree(listener.peer_id);
+    }
+    if (!listener.serving)
+      co_await loadSubtrees(session);
+
+    // ---- SubtreeRequest: peer fetches stubs of our lazy tree ----
+  } else if (pkt == PacketType::SubtreeRequest) {
+    co_await serveSubtrees(session);
+
+    // ---- Subtrees: stubs of the peer's lazy tree we asked for ----
+  } else if (pkt == PacketType::Subtrees) {
+    co_await receiveSubtrees(session);
+    changed();
+    if (!listener.serving)
+      co_await loadSubtrees(session);
+
+    // ---- TreeResync: our last delta didn't apply remotely ----
+  } else if (pkt == PacketType::TreeResync) {
+    session->resetTreeDelta();
+    co_await sendLocalTree(session, true);
+
+    // ---- SyncRequest: remote wants us to send them our files ----
+  } else if (pkt == PacketType::SyncRequest) {
+    // Served by listen() once its tree is in and any running sync is done
+    listener.sync_requested = true;
+
+    // ---- SyncHeader: total op count from sender ----
+  } else if (pkt == PacketType::SyncHeader) {
+    uint32_t total = co_await session->receiveSyncHeader();
+    files_total_.store(static_cast<int>(total));
+    phase_.store(SyncPhase::SyncingFiles);
+    changed();
+
+    // ---- ResumeRequest: sender asks for our partial files ----
+  } else if (pkt == PacketType::ResumeRequest) {
+    auto rel_paths = co_await session->receiveResumeRequest();
+    co_await session->flushWrites();
+    auto read = [rel_paths, root = tree->root_path] {
+      std::vector<std::vector<fstree::Hash>> partials;
+      for (const auto& rel_path : rel_paths)
+        partials.push_back(fstree::rsync::blockHashes(
+            net::partialPath(root / rel_path), net::RESUME_BLOCK_SIZE));
+      return partials;
+    };
+    auto partials = co_await net::offload(compute_pool_, read);
+    co_await session->sendResumeState(partials);
+
+    // ---- CopyFile / MoveFile: content we already have ----
+  } else if (pkt == PacketType::CopyFile) {
+    co_await session->receiveCopyFile(*tree);
+    files_done_.fetch_add(1);
+    changed();
+  } else if (pkt == PacketType::MoveFile) {
+    co_await session->receiveMoveFile(*tree);
+    files_done_.fetch_add(1);
+    changed();
+
+    // ---- SetMtime: our copy was found equal to the sender's ----
+  } else if (pkt == PacketType::SetMtime) {
+    co_await session->receiveSetMtime(*tree);
+
+    // ---- FileComplete: every range of a file has arrived ----
+  } else if (pkt == PacketType::FileComplete) {
+    co_await session->receiveFileComplete(*tree);
+
+    // ---- FileData: we are the requester, receiving a file ----
+  } else if (pkt == PacketType::FileData) {
+    co_await session->receiveFile(*tree, false);
+    files_done_.fetch_add(1);
+    changed();
+
+    // ---- SignatureRequest: sender wants our old copy's blocks ----
+  } else if (pkt == PacketType::SignatureRequest) {
+    auto rel_path = co_await session->receiveRelPath();
+    auto abs_path = tree->root_path / rel_path;
+    co_await session->flushWrites();
+    fstree::rsync::Signature sig;
+    std::error_code ec;
+    if (fs::is_regular_file(abs_path, ec)) {
+      auto sign = [abs_path] {
+        return fstree::rsync::computeSignature(abs_path);
+      };
+      sig = co_await net::offload(compute_pool_, sign);
+    }
+    co_await session->sendSignature(sig);
+
+    // ---- HashRequest: sender can't tell a file by its mtime ----
+  } else if (pkt == PacketType::HashRequest) {
+    auto rel_paths = co_await session->receiveHashRequest();
+    co_await session->flushWrites();
+    auto hash_all = [rel_paths,
+                     root      = tree->root_path,
+                     algorithm = tree->hash_algorithm] {
+      std::vector<std::optional<fstree::Hash>> hashes;
+      for (const auto& rel_path : rel_paths) {
+        auto& hash = hashes.emplace_back();
+        try {
+          hash = fstree::hashFile(root / rel_path, algorithm);
+        } catch (const std::exception&) {
+        }  // missing here, the sender keeps it
+      }
+      return hashes;
+    };
+    auto hashes = co_await net::offload(compute_pool_, hash_all);
+    co_await session->sendHashes(hashes);
+
+    // ---- FileDelta: we are the requester, patch a file ----
+  } else if (pkt == PacketType::FileDelta) {
+    bool applied = co_await session->receiveFileDelta(*tree);
+    co_await session->sendDeltaResult(applied);
+    if (applied)
+      files_done_.fetch_add(1);  // else it comes again in full
+    changed();
+
+    // ---- FileRange: part of a large file in a multi-stream sync ----
+  } else if (pkt == PacketType::FileRange) {
+    if (co_await session->receiveFileRange(*tree))
+      files_done_.fetch_add(1);
+    changed();
+
+    // ---- FileBundle: we are the requester, many small files ----
+  } else if (pkt == PacketType::FileBundle) {
+    auto count = co_await session->receiveFileBundle(*tree);
+    files_done_.fetch_add(static_cast<int>(count));
+    changed();
+
+    // ---- DeleteFile: we are the requester, delete a path ----
+  } else if (pkt == PacketType::DeleteFile) {
+    auto rel_path = co_await session->receiveRelPath();
+    auto abs_path = tree->root_path / rel_path;
+    // Ordered with the received file writes still queued
+    session->queueDiskJob([abs_path] {
+      std::error_code ec;
+      fs::remove_all(abs_path, ec);
+    });
+    // defer tree rebuild to SyncDone
+    files_done_.fetch_add(1);
+    changed();
+
+    // ---- CreateDir: create an empty directory ----
+  } else if (pkt == PacketType::CreateDir) {
+    auto rel_path = co_await session->receiveRelPath();
+    auto abs_path = tree->root_path / rel_path;
+    // Ordered with the received file writes still queued
+    session->queueDiskJob([abs_path] {
+      std::error_code ec;
+      fs::create_directories(abs_path, ec);
+    });
+    // defer tree rebuild to SyncDone
+    files_done_.fetch_add(1);
+    changed();
+
+    // ---- SyncDone: all operations received ----
+  } else if (pkt == PacketType::SyncDone) {
+    // Single update covering all received files, deletes, and dirs
+    co_await session->flushWrites();
+    co_await updateLocalTree();
+    phase_.store(SyncPhase::Done);
+    changed();
+
+    // Let the sender see the result (usually a small delta)
+    co_await sendLocalTree(session, true);
+
+    // ---- DisconnectRequest: remote peer is leaving ----
+  } else if (pkt == PacketType::DisconnectRequest) {
+    {
+      std::lock_guard<std::mutex> lock(peer_mutex_);
+      removePeer(session);
+    }
+    phase_.store(SyncPhase::Idle);
+    session->close();
+    changed();
+    co_return false;
+  }
+  // Unknown tags silently skipped — forward-compatible
+  co_return true;
+}
+
+asio::awaitable<void> SyncEngine::listen(SessionPtr session) {
+  Listener listener;
+  listener.session = session;
+  {
+    std::lock_guard<std::mutex> lock(peer_mutex_);
+    if (auto* info = findPeer(session))
+      listener.peer_id = info->peer_id;
+  }
+
+  try {
+    // What differs below the top of a lazy handshake tree
+    co_await loadSubtrees(session);
+
+    while (true) {
+      auto pkt = co_await session->receivePacketType();
+      if (!co_await dispatch(listener, pkt))
+        co_return;
+      // Requests that came in while the last one was served go one by one
+      while (listener.sync_pending) {
+        listener.sync_pending = false;
+        listener.serving      = true;
+        metrics::Timer serving(packetSeconds(PacketType::SyncRequest));
+        co_await serveSync(listener, peerTree(session));
+        listener.serving = false;
+      }
+    }
+  } catch (const boost::system::system_error& e) {
+    // Session closed or I/O error — exit listener cleanly.
+    auto phase = phase_.load();
+    if (lost(session))
+      error("Sync Interrupted",
+            std::string("Connection lost during sync: ") + e.what());
+    else if (phase != SyncPhase::Idle && phase != SyncPhase::Done)
+      error("Connection Lost",
+            std::string("Peer disconnected unexpectedly: ") + e.what());
+    changed();
+  } catch (const std::exception& e) {
+    if (lost(session))
+      error("Sync Error", e.what());
+    changed();
+  } catch (...) {
+    // Truly unknown error — remove peer silently
+    lost(session);
+    changed();
+  }
+}
+}  // namespace engine
@@ -1,19 +1,166 @@
 #include "../include/fstree/fstree.hpp"
-#include <openssl/sha.h>
+#include "../include/fstree/hash_cache.hpp"
+#include "../include/fstree/thread_pool.hpp"
+#include "../include/metrics/metrics.hpp"
+#include <boost/endian/conversion.hpp>
+#include <openssl/evp.h>
 #include <algorithm>
+#include <array>
+#include <chrono>
 #include <cstdint>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <functional>
 #include <iomanip>
 #include <iostream>
 #include <memory>
-#include <sstream>
+#include <span>
+#include <optional>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 namespace fstree {
 
+// The hash cache (and the copy it saves through), partial files and files
+// rebuilt from a delta. Anything else under the prefix is the user's.
+bool isInternal(const fs::path& path) {
+  std::string name = path.filename().string();
+  if (!name.starts_with(INTERNAL_PREFIX))
+    return false;
+  std::string_view rest = std::string_view(name).substr(
+      std::char_traits<char>::length(INTERNAL_PREFIX));
+  return rest == ".cache" || rest == ".cache.tmp" ||
+         rest.starts_with(".part.") || rest.starts_with(".delta.");
+}
+
+const char* hashAlgorithmName(HashAlgorithm algorithm) {
+  switch (algorithm) {
+    case HashAlgorithm::Sha256:
+      return "sha256";
+    case HashAlgorithm::Sha512_256:
+      return "sha512-256";
+    case HashAlgorithm::Blake2b:
+      return "blake2b";
+  }
+  return "unknown";
+}
+
+std::optional<HashAlgorithm> parseHashAlgorithm(const std::string& name) {
+  for (auto algorithm : {HashAlgorithm::Sha256,
+                         HashAlgorithm::Sha512_256,
+                         HashAlgorithm::Blake2b}) {
+    if (name == hashAlgorithmName(algorithm))
+      return algorithm;
+  }
+  return std::nullopt;
+}
+
+namespace {
+struct TreeMetrics {
+  metrics::Histogram& scan = metrics::histogram(
+      "file_sync_scan_seconds", "Directory walks building a tree, unhashed");
+  metrics::Histogram& tree_hash = metrics::histogram(
+      "file_sync_tree_hash_seconds", "Hashing every file a scan must hash");
+  metrics::Histogram& file_hash = metrics::histogram(
+      "file_sync_hash_seconds", "Hashing the contents of one file");
+  metrics::Counter& hashed_bytes = metrics::counter(
+      "file_sync_hashed_bytes_total", "File contents read for hashing");
+  metrics::Histogram& serialize = metrics::histogram(
+      "file_sync_serialize_seconds", "serializeTree() calls");
+  metrics::Histogram& deserialize = metrics::histogram(
+      "file_sync_deserialize_seconds", "Decoding a tree, over all its bytes");
+  metrics::Histogram& diff =
+      metrics::histogram("file_sync_diff_seconds", "diffTree() calls");
+};
+
+TreeMetrics& treeMetrics() {
+  static TreeMetrics instance;
+  return instance;
+}
+
+// Fetched once: OpenSSL 3 otherwise looks the implementation up again on
+// every init, which shows up when hashing many small files and directories
+const EVP_MD* digest(HashAlgorithm algorithm) {
+  static const std::array<EVP_MD*, 3> digests = [] {
+    std::array<EVP_MD*, 3> fetched{
+        EVP_MD_fetch(nullptr, "SHA2-256", nullptr),
+        EVP_MD_fetch(nullptr, "SHA2-512/256", nullptr),
+        EVP_MD_fetch(nullptr, "BLAKE2B-512", nullptr)};
+    return fetched;
+  }();
+  auto index = static_cast<std::size_t>(algorithm);
+  if (index >= digests.size() || !digests[index])
+    throw std::runtime_error(std::string("Hash algorithm unavailable: ") +
+                             hashAlgorithmName(algorithm));
+  return digests[index];
+}
+
+// Incremental hash over OpenSSL's EVP interface, truncated to a Hash
+class Hasher {
+ public:
+  explicit Hasher(HashAlgorithm algorithm)
+      : ctx_(EVP_MD_CTX_new(), EVP_MD_CTX_free) {
+    if (!ctx_ || !EVP_DigestInit_ex(ctx_.get(), digest(algorithm), nullptr))
+      throw std::runtime_error("Failed to initialise hash context.");
+  }
+
+  void update(const void* data, std::size_t size) {
+    if (!EVP_DigestUpdate(ctx_.get(), data, size))
+      throw std::runtime_error("Failed to update hash.");
+  }
+
+  Hash final() {
+    std::array<uint8_t, EVP_MAX_MD_SIZE> digest;
+    unsigned size = 0;
+    if (!EVP_DigestFinal_ex(ctx_.get(), digest.data(), &size) ||
+        size < sizeof(Hash))
+      throw std::runtime_error("Failed to finalise hash.");
+    Hash hash;
+    std::memcpy(hash.data(), digest.data(), hash.size());
+    return hash;
+  }
+
+ private:
+  std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx_;
+};
+
+// Marks an unhashed file's entry in its directory's Merkle hash
+constexpr uint8_t UNHASHED_FILE = 0x80;
+
+// Childrens are ordered giving priority to directories then name in
+// lexicographically increasing order
+bool childOrder(const std::unique_ptr<Node>& a, const std::unique_ptr<Node>& b) {
+  if (a->type != b->type)
+    return a->type == NodeType::Directory;
+  else
+    return a->name < b->name;
+}
+
+void sortChildren(std::vector<std::unique_ptr<Node>>& children) {
+  std::sort(children.begin(), children.end(), childOrder);
+}
+
+// Index key of a node's parent, the root is stored as "."
+fs::path parentKey(const fs::path& path) {
+  fs::path parent = path.parent_path();
+  return parent.empty() ? fs::path(".") : parent;
+}
+
+// Rewrites the path of every node in a subtree from the `from` prefix to `to`
+void reprefix(Node& node, const fs::path& from, const fs::path& to) {
+  fs::path rel = node.path.lexically_relative(from);
+  node.path    = rel == "." ? to : to / rel;
+  if (node.type == NodeType::Directory) {
+    for (auto& child : children(node))
+      reprefix(*child, from, to);
+  }
+}
+}  // namespace
+
 // ---------- Node ----------
 
 Node::Node(NodeType type, fs::path path, Data&& data)
@@ -44,56 +191,80 @@ Node Node::file(fs::path file_path) {
   return Node(NodeType::File, std::move(file_path), Data{std::move(meta)});
 }
 
-Node Node::directory(fs::path dir_path) {
-  std::vector<std::unique_ptr<Node>> children;
+void Node::generate_hash(const fs::path& root, HashAlgorithm algorithm) {
+  if (type == NodeType::Directory) {
+    // A stub's children aren't here, the hash it came with stays
+    if (stub)
+      return;
+    // Merkle hash over each child's type, name and hash. Undefined while any
+    // child directory is still unhashed, diffTree then simply descends.
+    // Integers go in big-endian, so peers of either byte order agree.
+    dir_hash.reset();
+    Hasher sha(algorithm);
+    for (const auto& kid : children(*this)) {
+      uint8_t kid_type  = static_cast<uint8_t>(kid->type);
+      uint32_t name_len = boost::endian::native_to_big(
+          static_cast<uint32_t>(kid->name.size()));
 
-  if (!fs::directory_entry(dir_path).is_directory())
-    throw std::invalid_argument("Path must point a directory.");
+      if (kid->type == NodeType::File &&
+          !std::get<FileMeta>(kid->data).file_hash) {
+        // Left unhashed by a quick check: size and mtime stand in, which
+        // is what diffTree() compares such files by
+        uint64_t size = boost::endian::native_to_big(
+            std::get<FileMeta>(kid->data).size);
+        int64_t mtime = boost::endian::native_to_big(
+            static_cast<int64_t>(kid->mtime.time_since_epoch().count()));
+        kid_type |= UNHASHED_FILE;
+        sha.update(&kid_type, sizeof(kid_type));
+        sha.update(&name_len, sizeof(name_len));
+        sha.update(kid->name.data(), kid->name.size());
+        sha.update(&size, sizeof(size));
+        sha.update(&mtime, sizeof(mtime));
+        continue;
+      }
 
-  // Make node of each children
-  for (auto const& dir_entry : fs::directory_iterator(dir_path)) {
-    if (dir_entry.is_regular_file()) {
-      children.push_back(std::make_unique<Node>(Node::file(dir_entry.path())));
-    } else {
-      children.push_back(
-          std::make_unique<Node>(Node::directory(dir_entry.path())));
+      const std::optional<Hash>& kid_hash =
+          kid->type == NodeType::File
+              ? std::get<FileMeta>(kid->data).file_hash
+              : kid->dir_hash;
+      if (!kid_hash)
+        return;
+
+      sha.update(&kid_type, sizeof(kid_type));
+      sha.update(&name_len, sizeof(name_len));
+      sha.update(kid->name.data(), kid->name.size());
+      sha.update(kid_hash->data(), kid_hash->size());
     }
+    dir_hash = sha.final();
+    return;
   }
 
-  // Sort childrens, giving priority to directories then name in
-  // lexicographically increasing order
-  std::sort(children.begin(),
-            children.end(),
-            [](const std::unique_ptr<Node>& a, const std::unique_ptr<Node>& b) {
-              if (a->type != b->type)
-                return a->type == NodeType::Directory;
-              else
-                return a->name < b->name;
-            });
-
-  return Node(
-      NodeType::Directory, std::move(dir_path), Data{std::move(children)});
+  std::get<FileMeta>(data).file_hash = hashFile(root / path, algorithm);
 }
 
-void Node::generate_hash(const fs::path& root) {
-  if (type != NodeType::File)
-    return;
-
-  auto& file_meta = std::get<FileMeta>(data);
-
-  std::ifstream file(root / path, std::ios::binary | std::ios::ate);
+Hash hashFile(const fs::path& file_path, HashAlgorithm algorithm) {
+  metrics::Timer timer(treeMetrics().file_hash);
+  std::ifstream file(file_path, std::ios::binary);
   if (!file)
     throw std::runtime_error("Failed to open file.");
 
-  auto size = file.tellg();
-  std::vector<uint8_t> buffer(static_cast<size_t>(size));
-  file.seekg(0);
+  // Stream the file through a fixed-size block so memory use does not depend
+  // on file size. The buffer is reused across every file hashed on a thread.
+  thread_local std::vector<char> buffer(HASH_BLOCK_SIZE);
 
-  if (!file.read(reinterpret_cast<char*>(buffer.data()), size))
+  Hasher sha(algorithm);
+  while (file) {
+    file.read(buffer.data(), buffer.size());
+    std::streamsize got = file.gcount();
+    if (got > 0) {
+      sha.update(buffer.data(), static_cast<std::size_t>(got));
+      treeMetrics().hashed_bytes.add(static_cast<uint64_t>(got));
+    }
+  }
+  if (file.bad())
     throw std::runtime_error("Failed to read file.");
 
-  file_meta.file_hash.emplace();
-  SHA256(buffer.data(), buffer.size(), file_meta.file_hash->data());
+  return sha.final();
 }
 
 // ---------- Helpers ----------
@@ -106,13 +277,53 @@ std::vector<std::unique_ptr<Node>>& children(Node& n) {
   return std::get<std::vector<std::unique_ptr<Node>>>(n.data);
 }
 
+std::unique_ptr<Node> cloneNode(const Node& node) {
+  if (node.type == NodeType::File) {
+    return std::unique_ptr<Node>(new Node{node.path,
+                                          node.name,
+                                          node.type,
+                                          node.mtime,
+                                          Node::Data{std::get<FileMeta>(node.data)}});
+  }
+
+  std::vector<std::unique_ptr<Node>> kids;
+  for (const auto& kid : children(node))
+    kids.push_back(cloneNode(*kid));
+
+  auto copy = std::unique_ptr<Node>(new Node{
+      node.path, node.name, node.type, node.mtime, Node::Data{std::move(kids)}});
+  copy->dir_hash = node.dir_hash;
+  copy->stub     = node.stub;
+  return copy;
+}
+
 // ---------- Directory Tree ----------
 
 DirectoryTree::DirectoryTree(fs::path dir_path)
+    : DirectoryTree(std::move(dir_path), ScanOptions{}) {}
+
+DirectoryTree::DirectoryTree(fs::path dir_path, const ScanOptions& options)
     : root_path(dir_path),
-      root(std::make_unique<Node>(Node::directory(dir_path))) {
-  buildIndex(*root, true);
-  generate_hash();
+      hash_algorithm(options.hash_algorithm),
+      quick_check_(options.quick_check) {
+  if (!fs::directory_entry(dir_path).is_directory())
+    throw std::invalid_argument("Path must point a directory.");
+
+  ThreadPool pool(options.threads);
+
+  {
+    metrics::Timer timer(treeMetrics().scan);
+    root = std::make_unique<Node>(
+        Node(NodeType::Directory,
+             std::move(dir_path),
+             Node::Data{std::vector<std::unique_ptr<Node>>{}}));
+    scan(*root, pool);
+    pool.wait();
+
+    buildIndex(*root, true);
+  }
+  metrics::Timer timer(treeMetrics().tree_hash);
+  generate_hash(pool, options);
 }
 
 DirectoryTree::DirectoryTree(fs::path dir_path, std::unique_ptr<Node> node)
@@ -121,6 +332,42 @@ DirectoryTree::DirectoryTree(fs::path dir_path, std::unique_ptr<Node> node)
   buildIndex(*root);
 }
 
+DirectoryTree DirectoryTree::clone() const {
+  DirectoryTree copy(root_path, cloneNode(*root));
+  copy.hash_algorithm = hash_algorithm;
+  copy.quick_check_   = quick_check_;
+  return copy;
+}
+
+// Enumerates one directory per task. Child nodes are created and sorted before
+// subdirectory tasks are spawned, so their addresses are stable by then.
+void DirectoryTree::scan(Node& dir, ThreadPool& pool) {
+  pool.submit([this, &dir, &pool]() {
+    auto& kids = children(dir);
+
+    for (auto const& dir_entry : fs::directory_iterator(dir.path)) {
+      if (isInternal(dir_entry.path()))
+        continue;
+      if (dir_entry.is_regular_file()) {
+        kids.push_back(std::make_unique<Node>(Node::file(dir_entry.path())));
+      } else {
+        if (!dir_entry.is_directory())
+          throw std::invalid_argument("Path must point a directory.");
+        kids.push_back(std::make_unique<Node>(
+            Node(NodeType::Directory,
+                 dir_entry.path(),
+                 Node::Data{std::vector<std::unique_ptr<Node>>{}})));
+      }
+    }
+    sortChildren(kids);
+
+    for (auto& kid : kids) {
+      if (kid->type == NodeType::Directory)
+        scan(*kid, pool);
+    }
+  });
+}
+
 void DirectoryTree::buildIndex(Node& node, bool change_path) {
   // Stores path relative to the DirectoryTree.root_path
   if (change_path)
@@ -134,17 +381,274 @@ void DirectoryTree::buildIndex(Node& node, bool change_path) {
   }
 }
 
-void DirectoryTree::generate_hash() {
+void DirectoryTree::generate_hash(ThreadPool& pool,
+                                  const ScanOptions& options) {
+  std::optional<HashCache> cache;
+  if (options.hash_cache)
+    cache.emplace(root_path / HashCache::FILE_NAME, hash_algorithm);
+
+  bool quick = options.quick_check;
+  for (auto& [path, node] : index) {
+    if (node->type != NodeType::File || (quick && !cache))
+      continue;
+
+    pool.submit([this, &cache, quick, node = node]() {
+      if (!cache) {
+        node->generate_hash(root_path, hash_algorithm);
+        return;
+      }
+
+      auto st = HashCache::stat(root_path / node->path);
+      if (st) {
+        if (auto hash = cache->find(node->path, *st)) {
+          std::get<FileMeta>(node->data).file_hash = *hash;
+          return;
+        }
+      }
+      if (quick)
+        return;
+
+      node->generate_hash(root_path, hash_algorithm);
+      // Only trust the hash if the file didn't change while being read
+      if (st && HashCache::stat(root_path / node->path) == st)
+        cache->store(
+            node->path, *st, *std::get<FileMeta>(node->data).file_hash);
+    });
+  }
+  pool.wait();
+
+  if (cache)
+    cache->save();
+
+  updateHashes();
+}
+
+void DirectoryTree::updateHashes() {
+  // Directories that still hold a hash have no changes below them
   std::function<void(Node&)> loop = [&](Node& node) {
-    if (node.type == NodeType::File)
-      node.generate_hash(this->root_path);
-    else {
-      for (auto& child : children(node)) {
-        loop(*child.get());
+    if (node.type != NodeType::Directory || node.dir_hash)
+      return;
+    for (auto& child : children(node))
+      loop(*child);
+    node.generate_hash(root_path, hash_algorithm);
+  };
+  loop(*root);
+}
+
+void DirectoryTree::invalidate(const fs::path& dir) {
+  for (fs::path path = dir;; path = parentKey(path)) {
+    auto it = index.find(path);
+    if (it == index.end())
+      break;
+    it->second->dir_hash.reset();
+    if (path == ".")
+      break;
+  }
+}
+
+void DirectoryTree::refresh(const fs::path& rel_path) {
+  if (rel_path.empty() || rel_path == "." || isInternal(rel_path))
+    return;
+
+  // Nothing is known about the parent yet, rescanning it covers this path too
+  if (!index.count(parentKey(rel_path))) {
+    refresh(rel_path.parent_path());
+    return;
+  }
+
+  fs::path abs_path = root_path / rel_path;
+  std::error_code ec;
+  auto status = fs::status(abs_path, ec);
+
+  try {
+    if (fs::is_directory(status)) {
+      auto it = index.find(rel_path);
+      if (it != index.end() && it->second->type == NodeType::Directory) {
+        // Children arrive through their own events
+        it->second->mtime = fs::last_write_time(abs_path);
+        return;
       }
+
+      DirectoryTree sub(
+          abs_path, ScanOptions{1, false, quick_check_, hash_algorithm});
+      reprefix(*sub.root, ".", rel_path);
+      sub.root->name = rel_path.filename().string();
+      insert(std::move(sub.root));
+    } else if (fs::is_regular_file(status)) {
+      auto node  = std::make_unique<Node>(Node::file(abs_path));
+      node->path = rel_path;
+      if (!quick_check_)
+        node->generate_hash(root_path, hash_algorithm);
+      insert(std::move(node));
+    } else {
+      remove(rel_path);
+    }
+  } catch (const std::exception&) {
+    // Vanished or became unreadable while being scanned
+    remove(rel_path);
+  }
+}
+
+void DirectoryTree::remove(const fs::path& rel_path) {
+  detach(rel_path);
+}
+
+void DirectoryTree::rename(const fs::path& from, const fs::path& to) {
+  if (!index.count(from) || !index.count(parentKey(to)) || isInternal(to)) {
+    remove(from);
+    refresh(to);
+    return;
+  }
+
+  auto node = detach(from);
+  reprefix(*node, from, to);
+  node->name = to.filename().string();
+  insert(std::move(node));
+}
+
+bool DirectoryTree::applyDelta(TreeDelta&& delta) {
+  if (root->dir_hash != delta.base_root)
+    return false;
+
+  for (const auto& path : delta.removed)
+    remove(path);
+
+  for (auto& node : delta.upserted) {
+    auto parent = index.find(parentKey(node->path));
+    if (parent == index.end() || parent->second->type != NodeType::Directory)
+      return false;
+    insert(std::move(node));
+  }
+
+  updateHashes();
+  return root->dir_hash == delta.root;
+}
+
+bool DirectoryTree::graft(std::unique_ptr<Node> node) {
+  auto it = index.find(node->path);
+  if (it == index.end() || !it->second->stub ||
+      node->type != NodeType::Directory || !node->dir_hash ||
+      node->dir_hash != it->second->dir_hash)
+    return false;
+
+  // Equal hashes, so nothing above changes
+  if (it->second == root.get()) {
+    index.clear();
+    root = std::move(node);
+    buildIndex(*root);
+    return true;
+  }
+  auto& kids  = children(*index.at(parentKey(node->path)));
+  auto kid_it = std::find_if(
+      kids.begin(), kids.end(), [stub = it->second](const auto& kid) {
+        return kid.get() == stub;
+      });
+  if (kid_it == kids.end())
+    return false;
+  *kid_it = std::move(node);
+  buildIndex(**kid_it);
+  return true;
+}
+
+void DirectoryTree::keepLoaded(const DirectoryTree& previous) {
+  std::vector<fs::path> stubs;
+  for (const auto& [path, node] : index)
+    if (node->stub)
+      stubs.push_back(path);
+
+  for (const auto& path : stubs) {
+    auto it = previous.index.find(path);
+    if (it != previous.index.end() && !it->second->stub &&
+        it->second->type == NodeType::Directory &&
+        it->second->dir_hash == index.at(path)->dir_hash)
+      graft(cloneNode(*it->second));
+  }
+}
+
+// Places a node under its parent (which must be indexed) at its sorted
+// position, replacing any node already at that path
+void DirectoryTree::insert(std::unique_ptr<Node> node) {
+  detach(node->path);
+
+  auto& kids = children(*index.at(parentKey(node->path)));
+  auto pos   = std::lower_bound(kids.begin(), kids.end(), node, childOrder);
+
+  Node& inserted = **kids.insert(pos, std::move(node));
+  buildIndex(inserted);
+  invalidate(parentKey(inserted.path));
+}
+
+// Unlinks a subtree from its parent and the index
+std::unique_ptr<Node> DirectoryTree::detach(const fs::path& rel_path) {
+  auto it = index.find(rel_path);
+  if (it == index.end() || it->second == root.get())
+    return nullptr;
+
+  auto parent = index.find(parentKey(rel_path));
+  if (parent == index.end())
+    return nullptr;
+
+  auto& kids  = children(*parent->second);
+  auto kid_it = std::find_if(
+      kids.begin(), kids.end(), [node = it->second](const auto& kid) {
+        return kid.get() == node;
+      });
+  if (kid_it == kids.end())
+    return nullptr;
+
+  std::unique_ptr<Node> node = std::move(*kid_it);
+  kids.erase(kid_it);
+
+  std::function<void(Node&)> unindex = [&](Node& n) {
+    index.erase(n.path);
+    if (n.type == NodeType::Directory) {
+      for (auto& child : children(n))
+        unindex(*child);
     }
   };
-  loop(*this->root);
+  unindex(*node);
+  invalidate(parentKey(rel_path));
+
+  return node;
+}
+
+// ---------- Content Index ----------
+
+std::size_t HashKey::operator()(const Hash& hash) const {
+  // Already uniformly distributed, any 8 bytes do
+  std::size_t key;
+  std::memcpy(&key, hash.data(), sizeof(key));
+  return key;
+}
+
+ContentIndex::ContentIndex(const DirectoryTree& tree) {
+  for (const auto& [path, node] : tree.index) {
+    if (node->type != NodeType::File)
+      continue;
+    const auto& hash = std::get<FileMeta>(node->data).file_hash;
+    if (hash)
+      add(*hash, path);
+  }
+}
+
+void ContentIndex::add(const Hash& hash, const fs::path& path) {
+  paths_[hash].push_back(path);
+}
+
+const fs::path* ContentIndex::find(const Hash& hash) const {
+  auto it = paths_.find(hash);
+  return it == paths_.end() ? nullptr : &it->second.front();
+}
+
+std::optional<fs::path> ContentIndex::take(const Hash& hash) {
+  auto it = paths_.find(hash);
+  if (it == paths_.end())
+    return std::nullopt;
+  auto path = std::move(it->second.back());
+  it->second.pop_back();
+  if (it->second.empty())
+    paths_.erase(it);
+  return path;
 }
 
 // ---------- Node Snapshot ----------
@@ -176,15 +680,31 @@ NodeDiff NodeDiff::modified(const Node& old_node, const Node& new_node) {
   return {ChangeType::Modified, NodeSnapshot(old_node), NodeSnapshot(new_node)};
 }
 
+bool NodeDiff::needsHash() const {
+  return type == ChangeType::Modified && old_node->type == NodeType::File &&
+         new_node->type == NodeType::File && old_node->size == new_node->size &&
+         (!old_node->file_hash || !new_node->file_hash);
+}
+
 // ---------- Diff ----------
 
 std::vector<NodeDiff> diffTree(const DirectoryTree& old_tree,
-                               const DirectoryTree& new_tree) {
+                               const DirectoryTree& new_tree,
+                               std::vector<fs::path>* unloaded) {
+  if (old_tree.hash_algorithm != new_tree.hash_algorithm)
+    throw std::invalid_argument("Trees are hashed with different algorithms.");
+
+  metrics::Timer timer(treeMetrics().diff);
   std::vector<NodeDiff> nodeDiffVec;
 
   // Function to recursively loop through each node of DirectoryTree
   std::function<void(const Node*, const Node*)> diffLoop =
       [&](const Node* old_node, const Node* new_node) {
+        if (old_node->stub || new_node->stub) {
+          if (unloaded)
+            unloaded->push_back(new_node->path);
+          return;
+        }
         const std::vector<std::unique_ptr<Node>>& old_vec = children(*old_node);
         const std::vector<std::unique_ptr<Node>>& new_vec = children(*new_node);
         auto old_it                                       = old_vec.begin();
@@ -199,13 +719,18 @@ std::vector<NodeDiff> diffTree(const DirectoryTree& old_tree,
             } else if ((*old_it)->type == NodeType::File) {
               const auto& old_it_meta = std::get<FileMeta>((*old_it)->data);
               const auto& new_it_meta = std::get<FileMeta>((*new_it)->data);
-              if (old_it_meta.size != new_it_meta.size) {
+              bool changed;
+              if (old_it_meta.size != new_it_meta.size)
+                changed = true;
+              else if (old_it_meta.file_hash && new_it_meta.file_hash)
+                changed = old_it_meta.file_hash != new_it_meta.file_hash;
+              else  // quick check
+                changed = (*old_it)->mtime != (*new_it)->mtime;
+              if (changed)
                 nodeDiffVec.push_back(NodeDiff::modified(**old_it, **new_it));
-              } else {
-                if (old_it_meta.file_hash != new_it_meta.file_hash)
-                  nodeDiffVec.push_back(NodeDiff::modified(**old_it, **new_it));
-              }
-            } else {
+            } else if (!(*old_it)->dir_hash ||
+                       (*old_it)->dir_hash != (*new_it)->dir_hash) {
+              // Equal Merkle hashes mean identical subtrees, skip those
               diffLoop(old_it->get(), new_it->get());
             }
             old_it++;
@@ -234,7 +759,9 @@ std::vector<NodeDiff> diffTree(const DirectoryTree& old_tree,
         }
       };
 
-  diffLoop(old_tree.root.get(), new_tree.root.get());
+  if (!old_tree.root->dir_hash ||
+      old_tree.root->dir_hash != new_tree.root->dir_hash)
+    diffLoop(old_tree.root.get(), new_tree.root.get());
 
   return nodeDiffVec;
 }
@@ -281,32 +808,6 @@ void printDiff(const std::vector<NodeDiff>& diff) {
   }
 }
 
-void serializeNode(std::ostream& os, const Node& node) {
-  wire::write_u8(os, static_cast<uint8_t>(node.type));
-  wire::write_u64(os, node.mtime.time_since_epoch().count());
-  wire::write_string(os, node.name);
-  wire::write_string(os, node.path.string());
-
-  if (node.type == NodeType::File) {
-    const auto& meta = std::get<FileMeta>(node.data);
-
-    wire::write_u64(os, meta.size);
-
-    wire::write_u8(os, meta.file_hash.has_value());
-    if (meta.file_hash) {
-      os.write(reinterpret_cast<const char*>(meta.file_hash->data()),
-               meta.file_hash->size());
-    }
-  } else {
-    const auto& kids = children(node);
-    wire::write_u32(os, static_cast<uint32_t>(kids.size()));
-
-    for (const auto& kid : kids) {
-      serializeNode(os, *kid);
-    }
-  }
-}
-
 std::unique_ptr<Node> deserializeNode(std::istream& is) {
   NodeType type = static_cast<NodeType>(wire::read_u8(is));
   auto mtime =
@@ -342,19 +843,571 @@ std::unique_ptr<Node> deserializeNode(std::istream& is) {
   }
 }
 
-std::vector<uint8_t> serializeTree(const DirectoryTree& tree) {
-  std::ostringstream os(std::ios::binary);
-  wire::write_string(os, tree.root_path);
-  serializeNode(os, *tree.root);
-  const std::string& s = os.str();
-  return std::vector<uint8_t>(s.begin(), s.end());
+// ---------- Wire formats ----------
+
+namespace {
+constexpr uint8_t TREE_MAGIC[4]  = {0xF5, 'T', 'R', 2};
+constexpr uint8_t DELTA_MAGIC[4] = {0xF5, 'T', 'D', 2};
+constexpr uint8_t SUBTREE_MAGIC[4] = {0xF5, 'T', 'S', 2};
+
+bool hasMagic(std::span<const uint8_t> data, const uint8_t (&magic)[4]) {
+  return data.size() >= sizeof(magic) &&
+         std::memcmp(data.data(), magic, sizeof(magic)) == 0;
+}
+
+// The root is "." and its children are relative to it, as after a scan
+fs::path childPath(const fs::path& parent, const std::string& name) {
+  return parent == "." ? fs::path(name) : parent / name;
+}
+}  // namespace
+
+// Node records of both formats. A record is one node without its children,
+// which follow it depth first, so decoders can build a tree one record at a
+// time.
+//
+// Legacy: u8 type, u64 mtime, string name, string path,
+//   file: u64 size + u8 has-hash [+ hash], directory: u32 count
+// It is what peers without FEATURE_COMPACT_TREE speak, so directory hashes
+// stay out of it and are recomputed on receipt.
+// Compact: u8 flags, svarint mtime, name,
+//   file: varint size [+ hash], directory: [hash +] varint count
+// A compact name is varint 0 + vstring, or varint i + 1 for entry i of the
+// table; paths are rebuilt from the parent. Stubs are compact directories
+// with the STUB flag and a count of 0.
+class NodeCodec {
+ public:
+  static constexpr uint8_t DIR  = 1 << 0;
+  static constexpr uint8_t HASH = 1 << 1;
+  static constexpr uint8_t STUB = 1 << 2;
+
+  explicit NodeCodec(TreeFormat format) : format_(format) {}
+
+  TreeFormat format() const { return format_; }
+
+  // Writing compact: collect() every subtree, then writeTable()
+  void collect(const Node& node, std::size_t depth = FULL_DEPTH) {
+    counts_[node.name]++;
+    if (node.type == NodeType::Directory && depth > 0)
+      for (const auto& kid : children(node))
+        collect(*kid, depth - 1);
+  }
+
+  void writeTable(wire::Writer& w) {
+    // Repeated names only, most frequent first for the shortest indices
+    std::vector<std::pair<std::string, std::size_t>> repeated;
+    for (auto& [name, count] : counts_)
+      if (count > 1 && name.size() > 1)
+        repeated.emplace_back(name, count);
+    std::sort(repeated.begin(), repeated.end(), [](auto& a, auto& b) {
+      return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
+
+    w.write_varint(repeated.size());
+    for (std::size_t i = 0; i < repeated.size(); ++i) {
+      ids_[repeated[i].first] = i;
+      w.write_vstring(repeated[i].first);
+    }
+  }
+
+  void addName(std::string name) { names_.push_back(std::move(name)); }
+
+  // Directories depth levels down are written as stubs
+  void writeNode(wire::Writer& w,
+                 const Node& node,
+                 std::size_t depth = FULL_DEPTH) const {
+    bool dir         = node.type == NodeType::Directory;
+    bool stub        = dir && (depth == 0 || node.stub);
+    const auto& hash = dir ? node.dir_hash
+                           : std::get<FileMeta>(node.data).file_hash;
+    auto mtime       = node.mtime.time_since_epoch().count();
+    std::size_t kids = stub ? 0 : dir ? children(node).size() : 0;
+
+    if (format_ == TreeFormat::Legacy) {
+      if (stub)
+        throw std::invalid_argument("Stubs need the compact tree format.");
+      w.write_u8(static_cast<uint8_t>(node.type));
+      w.write_u64(static_cast<uint64_t>(mtime));
+      w.write_string(node.name);
+      w.write_string(node.path.string());
+      if (dir) {
+        w.write_u32(static_cast<uint32_t>(kids));
+      } else {
+        w.write_u64(std::get<FileMeta>(node.data).size);
+        w.write_u8(hash.has_value());
+        if (hash)
+          w.write_bytes(hash->data(), hash->size());
+      }
+    } else {
+      w.write_u8((dir ? DIR : 0) | (hash ? HASH : 0) | (stub ? STUB : 0));
+      w.write_svarint(mtime);
+      auto id = ids_.find(node.name);
+      if (id != ids_.end()) {
+        w.write_varint(id->second + 1);
+      } else {
+        w.write_varint(0);
+        w.write_vstring(node.name);
+      }
+      if (!dir)
+        w.write_varint(std::get<FileMeta>(node.data).size);
+      if (hash)
+        w.write_bytes(hash->data(), hash->size());
+      if (dir)
+        w.write_varint(kids);
+    }
+
+    if (dir && !stub)
+      for (const auto& kid : children(node))
+        writeNode(w, *kid, depth - 1);
+  }
+
+  // One record; directories come back without children, their count in
+  // kids. The compact path is the child of parent, or path without one.
+  // Returns nullptr if r went bad, throws on a bad name reference.
+  std::unique_ptr<Node> readRecord(wire::Reader& r,
+                                   const fs::path* parent,
+                                   fs::path path,
+                                   uint64_t& kids) const {
+    NodeType type;
+    fs::file_time_type mtime;
+    std::string name;
+    std::optional<Hash> hash;
+    FileMeta meta{};
+    bool stub = false;
+
+    auto read_hash = [&](bool present) {
+      if (present) {
+        hash.emplace();
+        r.read_bytes(hash->data(), hash->size());
+      }
+    };
+
+    if (format_ == TreeFormat::Legacy) {
+      type  = static_cast<NodeType>(r.read_u8());
+      mtime = fs::file_time_type(fs::file_time_type::duration(r.read_u64()));
+      name  = r.read_string();
+      path  = r.read_string();
+      if (type == NodeType::File) {
+        meta.size = r.read_u64();
+        read_hash(r.read_u8());
+      }
+      kids = type == NodeType::Directory ? r.read_u32() : 0;
+    } else {
+      uint8_t flags = r.read_u8();
+      type  = (flags & DIR) ? NodeType::Directory : NodeType::File;
+      stub  = type == NodeType::Directory && (flags & STUB);
+      mtime = fs::file_time_type(fs::file_time_type::duration(r.read_svarint()));
+      uint64_t id = r.read_varint();
+      if (id == 0)
+        name = r.read_vstring();
+      else if (r && id <= names_.size())
+        name = names_[id - 1];
+      else if (r)
+        throw std::runtime_error("Malformed tree.");
+      if (type == NodeType::File)
+        meta.size = r.read_varint();
+      read_hash(flags & HASH);
+      kids = type == NodeType::Directory ? r.read_varint() : 0;
+      if (parent)
+        path = childPath(*parent, name);
+    }
+    if (!r)
+      return nullptr;
+
+    if (type == NodeType::File) {
+      meta.file_hash = hash;
+      return std::unique_ptr<Node>(new Node{
+          std::move(path), std::move(name), type, mtime,
+          Node::Data{std::move(meta)}});
+    }
+    auto node      = std::unique_ptr<Node>(
+        new Node{std::move(path), std::move(name), type, mtime,
+                 Node::Data{std::vector<std::unique_ptr<Node>>{}}});
+    node->dir_hash = hash;
+    node->stub     = stub;
+    return node;
+  }
+
+  // A record and everything below it, from a complete buffer
+  std::unique_ptr<Node> readSubtree(wire::Reader& r,
+                                    const fs::path* parent,
+                                    fs::path path = {}) const {
+    uint64_t kids = 0;
+    auto node     = readRecord(r, parent, std::move(path), kids);
+    if (!node)
+      throw std::runtime_error("Malformed tree.");
+    for (uint64_t i = 0; i < kids; i++)
+      children(*node).push_back(readSubtree(r, &node->path));
+    return node;
+  }
+
+ private:
+  TreeFormat format_;
+  std::unordered_map<std::string, std::size_t> counts_;
+  std::unordered_map<std::string, std::size_t> ids_;
+  std::vector<std::string> names_;
+};
+
+void serializeNode(std::ostream& os, const Node& node) {
+  std::vector<uint8_t> out;
+  wire::Writer w(out);
+  NodeCodec(TreeFormat::Legacy).writeNode(w, node);
+  os.write(reinterpret_cast<const char*>(out.data()), out.size());
+}
+
+std::vector<uint8_t> serializeTree(const DirectoryTree& tree,
+                                   TreeFormat format,
+                                   std::size_t depth) {
+  metrics::Timer timer(treeMetrics().serialize);
+  std::vector<uint8_t> out;
+  wire::Writer w(out);
+  NodeCodec codec(format);
+  if (format == TreeFormat::Legacy) {
+    w.write_string(tree.root_path.string());
+  } else {
+    codec.collect(*tree.root, depth);
+    w.write_bytes(TREE_MAGIC, sizeof(TREE_MAGIC));
+    w.write_vstring(tree.root_path.string());
+    codec.writeTable(w);
+    w.write_vstring(tree.root->path.string());
+  }
+  codec.writeNode(w, *tree.root, depth);
+  return out;
 }
 
-DirectoryTree deserializeTree(std::vector<uint8_t> data) {
-  std::istringstream is(std::string(data.begin(), data.end()),
-                        std::ios::binary);
-  fs::path root_path = fs::path(wire::read_string(is));
-  auto node          = deserializeNode(is);
-  return DirectoryTree(root_path, std::move(node));
+// ---------- TreeDecoder ----------
+
+struct TreeDecoder::State {
+  enum class Step { Magic, RootPath, TableSize, Table, NodePath, Nodes, Done };
+
+  Step step = Step::Magic;
+  NodeCodec codec{TreeFormat::Legacy};
+  std::chrono::steady_clock::duration busy{};  // in feed(), for metrics
+  fs::path root_path;
+  fs::path node_path;  // compact, of the root node
+  uint64_t table_left = 0;
+
+  std::unique_ptr<Node> root;
+  struct Open {
+    Node* dir;
+    uint64_t left;  // children still to come
+  };
+  std::vector<Open> open;
+
+  // Start of an item split across feed() calls
+  std::vector<uint8_t> pending;
+
+  // Parses whole items, returns the bytes they used
+  std::size_t parse(std::span<const uint8_t> data) {
+    wire::Reader r(data);
+    if (step == Step::Magic) {
+      if (data.size() < sizeof(TREE_MAGIC))
+        return 0;
+      if (hasMagic(data, TREE_MAGIC)) {
+        codec = NodeCodec(TreeFormat::Compact);
+        r.skip(sizeof(TREE_MAGIC));
+      }
+      step = Step::RootPath;
+    }
+
+    std::size_t used = r.position();
+    while (step != Step::Done && parseItem(r))
+      used = r.position();
+    return used;
+  }
+
+  // False when r ran out of data, the item is parsed again with more
+  bool parseItem(wire::Reader& r) {
+    bool compact = codec.format() == TreeFormat::Compact;
+    switch (step) {
+      case Step::RootPath: {
+        std::string path = compact ? r.read_vstring() : r.read_string();
+        if (!check(r))
+          return false;
+        root_path = path;
+        step      = compact ? Step::TableSize : Step::Nodes;
+        return true;
+      }
+      case Step::TableSize:
+        table_left = r.read_varint();
+        if (!check(r))
+          return false;
+        step = table_left ? Step::Table : Step::NodePath;
+        return true;
+      case Step::Table: {
+        std::string name = r.read_vstring();
+        if (!check(r))
+          return false;
+        codec.addName(std::move(name));
+        if (--table_left == 0)
+          step = Step::NodePath;
+        return true;
+      }
+      case Step::NodePath: {
+        std::string path = r.read_vstring();
+        if (!check(r))
+          return false;
+        node_path = path;
+        step      = Step::Nodes;
+        return true;
+      }
+      case Step::Nodes:
+        return parseNode(r);
+      default:
+        return false;
+    }
+  }
+
+  bool parseNode(wire::Reader& r) {
+    const fs::path* parent = open.empty() ? nullptr : &open.back().dir->path;
+    uint64_t kids          = 0;
+    auto node              = codec.readRecord(r, parent, node_path, kids);
+    if (!check(r))
+      return false;
+
+    Node* added = node.get();
+    if (open.empty()) {
+      root = std::move(node);
+    } else {
+      children(*open.back().dir).push_back(std::move(node));
+      open.back().left--;
+    }
+    if (kids > 0)
+      open.push_back({added, kids});
+    while (!open.empty() && open.back().left == 0)
+      open.pop_back();
+    if (open.empty())
+      step = Step::Done;
+    return true;
+  }
+
+  static bool check(const wire::Reader& r) {
+    if (!r && !r.truncated())
+      throw std::runtime_error("Malformed tree.");
+    return static_cast<bool>(r);
+  }
+};
+
+TreeDecoder::TreeDecoder() : state_(std::make_unique<State>()) {}
+TreeDecoder::~TreeDecoder() = default;
+TreeDecoder::TreeDecoder(TreeDecoder&&) noexcept = default;
+TreeDecoder& TreeDecoder::operator=(TreeDecoder&&) noexcept = default;
+
+void TreeDecoder::feed(std::span<const uint8_t> data) {
+  auto start    = std::chrono::steady_clock::now();
+  auto& pending = state_->pending;
+
+  // Finish a split item first, growing the copy geometrically so a large
+  // item still costs linear time. Once it parses, the rest is read in place.
+  while (!pending.empty() && !data.empty()) {
+    std::size_t old  = pending.size();
+    std::size_t take = std::min(data.size(), std::max<std::size_t>(old, 4096));
+    pending.insert(pending.end(), data.begin(), data.begin() + take);
+
+    std::size_t used = state_->parse(pending);
+    if (used >= old) {
+      data = data.subspan(used - old);
+      pending.clear();
+    } else {
+      pending.erase(pending.begin(), pending.begin() + used);
+      data = data.subspan(take);
+    }
+  }
+
+  if (!data.empty()) {
+    std::size_t used = state_->parse(data);
+    pending.assign(data.begin() + used, data.end());
+  }
+  state_->busy += std::chrono::steady_clock::now() - start;
+}
+
+DirectoryTree TreeDecoder::finish() {
+  if (state_->step != State::Step::Done || !state_->pending.empty())
+    throw std::runtime_error("Malformed tree.");
+  treeMetrics().deserialize.observe(state_->busy);
+  DirectoryTree tree(state_->root_path, std::move(state_->root));
+  // Legacy trees come without directory hashes, from peers that only know
+  // SHA-256
+  if (state_->codec.format() == TreeFormat::Legacy)
+    tree.updateHashes();
+  return tree;
+}
+
+DirectoryTree deserializeTree(std::span<const uint8_t> data) {
+  TreeDecoder decoder;
+  decoder.feed(data);
+  return decoder.finish();
+}
+
+// ---------- Tree Delta ----------
+
+std::optional<TreeDelta> makeDelta(const DirectoryTree& base,
+                                   const DirectoryTree& tree) {
+  if (!base.root->dir_hash || !tree.root->dir_hash)
+    return std::nullopt;
+
+  TreeDelta delta;
+  delta.base_root = *base.root->dir_hash;
+  delta.root      = *tree.root->dir_hash;
+
+  for (const auto& d : diffTree(base, tree)) {
+    if (d.type == ChangeType::Deleted) {
+      delta.removed.push_back(d.old_node->path);
+    } else {
+      // Added and Modified both replace whatever is at the path
+      delta.upserted.push_back(cloneNode(*tree.index.at(d.new_node->path)));
+    }
+  }
+  return delta;
+}
+
+std::vector<uint8_t> serializeDelta(const TreeDelta& delta,
+                                    TreeFormat format) {
+  metrics::Timer timer(treeMetrics().serialize);
+  std::vector<uint8_t> out;
+  wire::Writer w(out);
+  NodeCodec codec(format);
+
+  if (format == TreeFormat::Legacy) {
+    w.write_u64(delta.base_generation);
+    w.write_u64(delta.generation);
+    w.write_bytes(delta.base_root.data(), delta.base_root.size());
+    w.write_bytes(delta.root.data(), delta.root.size());
+
+    w.write_u32(static_cast<uint32_t>(delta.removed.size()));
+    for (const auto& path : delta.removed)
+      w.write_string(path.string());
+
+    w.write_u32(static_cast<uint32_t>(delta.upserted.size()));
+    for (const auto& node : delta.upserted)
+      codec.writeNode(w, *node);
+  } else {
+    for (const auto& node : delta.upserted)
+      codec.collect(*node);
+
+    w.write_bytes(DELTA_MAGIC, sizeof(DELTA_MAGIC));
+    w.write_varint(delta.base_generation);
+    w.write_varint(delta.generation);
+    w.write_bytes(delta.base_root.data(), delta.base_root.size());
+    w.write_bytes(delta.root.data(), delta.root.size());
+    codec.writeTable(w);
+
+    w.write_varint(delta.removed.size());
+    for (const auto& path : delta.removed)
+      w.write_vstring(path.string());
+
+    w.write_varint(delta.upserted.size());
+    for (const auto& node : delta.upserted) {
+      w.write_vstring(node->path.string());
+      codec.writeNode(w, *node);
+    }
+  }
+  return out;
+}
+
+TreeDelta deserializeDelta(std::span<const uint8_t> data) {
+  wire::Reader r(data);
+  TreeDelta delta;
+  bool compact = hasMagic(data, DELTA_MAGIC);
+  NodeCodec codec(compact ? TreeFormat::Compact : TreeFormat::Legacy);
+
+  if (compact) {
+    r.skip(sizeof(DELTA_MAGIC));
+    delta.base_generation = r.read_varint();
+    delta.generation      = r.read_varint();
+  } else {
+    delta.base_generation = r.read_u64();
+    delta.generation      = r.read_u64();
+  }
+  r.read_bytes(delta.base_root.data(), delta.base_root.size());
+  r.read_bytes(delta.root.data(), delta.root.size());
+
+  if (compact) {
+    uint64_t names = r.read_varint();
+    for (uint64_t i = 0; i < names && r; i++)
+      codec.addName(r.read_vstring());
+
+    uint64_t removed = r.read_varint();
+    for (uint64_t i = 0; i < removed && r; i++)
+      delta.removed.emplace_back(r.read_vstring());
+
+    uint64_t upserted = r.read_varint();
+    for (uint64_t i = 0; i < upserted && r; i++) {
+      fs::path path = r.read_vstring();
+      delta.upserted.push_back(codec.readSubtree(r, nullptr, std::move(path)));
+    }
+  } else {
+    uint32_t removed = r.read_u32();
+    for (uint32_t i = 0; i < removed && r; i++)
+      delta.removed.emplace_back(r.read_string());
+
+    uint32_t upserted = r.read_u32();
+    for (uint32_t i = 0; i < upserted && r; i++)
+      delta.upserted.push_back(codec.readSubtree(r, nullptr));
+  }
+
+  if (!r || r.remaining() > 0)
+    throw std::runtime_error("Malformed tree delta.");
+  return delta;
+}
+
+// ---------- Subtrees ----------
+
+// Magic, name table, varint count, then per path its vstring and a u8 that
+// is 1 when the directory's nodes follow
+std::vector<uint8_t> serializeSubtrees(const DirectoryTree& tree,
+                                       const std::vector<fs::path>& paths,
+                                       std::size_t depth) {
+  metrics::Timer timer(treeMetrics().serialize);
+  std::vector<const Node*> dirs;
+  for (const auto& path : paths) {
+    auto it = tree.index.find(path);
+    dirs.push_back(it != tree.index.end() &&
+                           it->second->type == NodeType::Directory
+                       ? it->second
+                       : nullptr);
+  }
+
+  std::vector<uint8_t> out;
+  wire::Writer w(out);
+  NodeCodec codec(TreeFormat::Compact);
+  for (const auto* dir : dirs)
+    if (dir)
+      codec.collect(*dir, depth);
+
+  w.write_bytes(SUBTREE_MAGIC, sizeof(SUBTREE_MAGIC));
+  codec.writeTable(w);
+  w.write_varint(paths.size());
+  for (std::size_t i = 0; i < paths.size(); i++) {
+    w.write_vstring(paths[i].string());
+    w.write_u8(dirs[i] != nullptr);
+    if (dirs[i])
+      codec.writeNode(w, *dirs[i], depth);
+  }
+  return out;
+}
+
+std::vector<Subtree> deserializeSubtrees(std::span<const uint8_t> data) {
+  if (!hasMagic(data, SUBTREE_MAGIC))
+    throw std::runtime_error("Malformed subtrees.");
+  wire::Reader r(data);
+  r.skip(sizeof(SUBTREE_MAGIC));
+  NodeCodec codec(TreeFormat::Compact);
+
+  uint64_t names = r.read_varint();
+  for (uint64_t i = 0; i < names && r; i++)
+    codec.addName(r.read_vstring());
+
+  std::vector<Subtree> subtrees;
+  uint64_t count = r.read_varint();
+  for (uint64_t i = 0; i < count && r; i++) {
+    auto& subtree = subtrees.emplace_back();
+    subtree.path  = r.read_vstring();
+    if (r.read_u8() && r)
+      subtree.node = codec.readSubtree(r, nullptr, subtree.path);
+  }
+
+  if (!r || r.remaining() > 0)
+    throw std::runtime_error("Malformed subtrees.");
+  return subtrees;
 }
 }  // namespace fstree
@@ -0,0 +1,112 @@
+#include "../include/fstree/hash_cache.hpp"
+#include <sys/stat.h>
+#include <fstream>
+#include "../include/fstree/wire.hpp"
+
+namespace fstree {
+
+namespace {
+constexpr uint32_t CACHE_MAGIC   = 0x43485346;  // "FSHC"
+constexpr uint32_t CACHE_VERSION = 2;  // 2: algorithm after the version
+}  // namespace
+
+HashCache::HashCache(fs::path cache_file, HashAlgorithm algorithm)
+    : file_(std::move(cache_file)),
+      algorithm_(algorithm) {
+  load();
+}
+
+std::optional<HashCache::Stat> HashCache::stat(const fs::path& path) {
+  struct ::stat st;
+  if (::stat(path.c_str(), &st) != 0)
+    return std::nullopt;
+
+  return Stat{static_cast<uint64_t>(st.st_size),
+              static_cast<int64_t>(st.st_mtim.tv_sec) * 1'000'000'000 +
+                  st.st_mtim.tv_nsec,
+              static_cast<uint64_t>(st.st_ino)};
+}
+
+std::optional<Hash> HashCache::find(const fs::path& rel_path, const Stat& st) {
+  std::string key = rel_path.generic_string();
+
+  std::lock_guard<std::mutex> lock(mtx_);
+  auto it = loaded_.find(key);
+  if (it == loaded_.end() || it->second.stat != st)
+    return std::nullopt;
+
+  live_[key] = it->second;
+  return it->second.hash;
+}
+
+void HashCache::store(const fs::path& rel_path,
+                      const Stat& st,
+                      const Hash& hash) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  live_[rel_path.generic_string()] = Entry{st, hash};
+}
+
+bool HashCache::save() {
+  std::lock_guard<std::mutex> lock(mtx_);
+
+  fs::path tmp = file_;
+  tmp += ".tmp";
+
+  {
+    std::ofstream os(tmp, std::ios::binary | std::ios::trunc);
+    if (!os)
+      return false;
+
+    wire::write_u32(os, CACHE_MAGIC);
+    wire::write_u32(os, CACHE_VERSION);
+    wire::write_u8(os, static_cast<uint8_t>(algorithm_));
+    wire::write_u64(os, live_.size());
+    for (const auto& [path, entry] : live_) {
+      wire::write_string(os, path);
+      wire::write_u64(os, entry.stat.size);
+      wire::write_u64(os, static_cast<uint64_t>(entry.stat.mtime_ns));
+      wire::write_u64(os, entry.stat.inode);
+      os.write(reinterpret_cast<const char*>(entry.hash.data()),
+               entry.hash.size());
+    }
+    if (!os)
+      return false;
+  }
+
+  std::error_code ec;
+  fs::rename(tmp, file_, ec);
+  if (ec) {
+    fs::remove(tmp, ec);
+    return false;
+  }
+  loaded_ = live_;
+  return true;
+}
+
+void HashCache::load() {
+  std::ifstream is(file_, std::ios::binary);
+  if (!is)
+    return;
+
+  // A cache that is missing, truncated, from another version or of another
+  // algorithm is simply ignored; every file then gets hashed and the cache
+  // is rewritten.
+  if (wire::read_u32(is) != CACHE_MAGIC ||
+      wire::read_u32(is) != CACHE_VERSION ||
+      wire::read_u8(is) != static_cast<uint8_t>(algorithm_))
+    return;
+
+  uint64_t count = wire::read_u64(is);
+  for (uint64_t i = 0; i < count && is; i++) {
+    std::string path = wire::read_string(is);
+    Entry entry;
+    entry.stat.size     = wire::read_u64(is);
+    entry.stat.mtime_ns = static_cast<int64_t>(wire::read_u64(is));
+    entry.stat.inode    = wire::read_u64(is);
+    is.read(reinterpret_cast<char*>(entry.hash.data()), entry.hash.size());
+    if (!is)
+      break;
+    loaded_.emplace(std::move(path), entry);
+  }
+}
+}  // namespace fstree
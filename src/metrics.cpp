@@ -0,0 +1,328 @@
+#include "../include/metrics/metrics.hpp"
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <variant>
+
+namespace metrics {
+namespace {
+enum class Type { Counter, Gauge, Histogram };
+
+const char* typeName(Type type) {
+  switch (type) {
+    case Type::Counter:
+      return "counter";
+    case Type::Gauge:
+      return "gauge";
+    case Type::Histogram:
+      return "histogram";
+  }
+  return "untyped";
+}
+
+struct Series {
+  template <typename T>
+  Series(Labels l, std::in_place_type_t<T> type)
+      : labels(std::move(l)), metric(type) {}
+
+  Labels labels;
+  std::variant<Counter, Gauge, Histogram> metric;
+};
+
+struct Family {
+  Type type;
+  std::string help;
+  std::map<std::string, Series> series;  // by renderLabels()
+};
+
+struct CollectorEntry {
+  std::string name;
+  std::string help;
+  Kind kind;
+  Collector collect;
+};
+
+// Collectors are run under collectors_mtx alone, they may take locks of
+// their own that are held while metrics are looked up
+struct Registry {
+  std::mutex mtx;
+  std::map<std::string, Family> families;
+
+  std::mutex collectors_mtx;
+  std::map<uint64_t, CollectorEntry> collectors;
+  uint64_t next_id = 1;
+};
+
+// Left alive at exit, metrics may be updated from static destructors
+Registry& registry() {
+  static auto* instance = new Registry;
+  return *instance;
+}
+
+std::string escape(const std::string& s, bool json) {
+  std::string out;
+  for (char c : s) {
+    if (c == '"' || c == '\\')
+      out += '\\';
+    if (c == '\n') {
+      out += "\\n";
+      continue;
+    }
+    if (json && static_cast<unsigned char>(c) < 0x20) {
+      char code[8];
+      std::snprintf(code, sizeof(code), "\\u%04x", c);
+      out += code;
+      continue;
+    }
+    out += c;
+  }
+  return out;
+}
+
+// {a="1",b="2"}, empty without labels
+std::string renderLabels(const Labels& labels) {
+  if (labels.empty())
+    return {};
+  std::string out = "{";
+  for (const auto& [key, value] : labels) {
+    if (out.size() > 1)
+      out += ',';
+    out += key + "=\"" + escape(value, false) + '"';
+  }
+  return out + '}';
+}
+
+std::string number(double value) {
+  if (std::isinf(value))
+    return value > 0 ? "+Inf" : "-Inf";
+  if (std::isnan(value))
+    return "NaN";
+  char buf[32];
+  auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value);
+  return std::string(buf, end);
+}
+
+template <typename T>
+T& lookup(const std::string& name,
+          const std::string& help,
+          const Labels& labels,
+          Type type) {
+  auto& reg = registry();
+  std::lock_guard<std::mutex> lock(reg.mtx);
+  auto [family, added] = reg.families.try_emplace(name, Family{type, help, {}});
+  if (!added && family->second.type != type)
+    throw std::logic_error("metric " + name + " is already a " +
+                           typeName(family->second.type));
+  auto& series = family->second.series;
+  auto it      = series.find(renderLabels(labels));
+  if (it == series.end())
+    it = series
+             .try_emplace(renderLabels(labels), labels, std::in_place_type<T>)
+             .first;
+  return std::get<T>(it->second.metric);
+}
+
+// One exported series, a registered metric or a collected sample
+struct Line {
+  Labels labels;
+  const Series* series = nullptr;
+  double value         = 0;  // collected samples
+};
+
+struct Exported {
+  Type type;
+  std::string help;
+  std::vector<Line> lines;
+};
+
+// Both exporters work from this: the registered series, which stay put,
+// and the collected samples. Collectors run first, outside mtx.
+template <typename Fn>
+void exportAll(Fn&& fn) {
+  auto& reg = registry();
+  std::map<std::string, Exported> collected;
+  {
+    std::lock_guard<std::mutex> lock(reg.collectors_mtx);
+    for (auto& [id, entry] : reg.collectors) {
+      auto type = entry.kind == Kind::Counter ? Type::Counter : Type::Gauge;
+      auto& out =
+          collected.try_emplace(entry.name, Exported{type, entry.help, {}})
+              .first->second;
+      for (auto& sample : entry.collect())
+        out.lines.push_back({std::move(sample.labels), nullptr, sample.value});
+    }
+  }
+
+  std::map<std::string, Exported> all;
+  {
+    std::lock_guard<std::mutex> lock(reg.mtx);
+    for (auto& [name, family] : reg.families) {
+      auto& out = all.try_emplace(name, Exported{family.type, family.help, {}})
+                      .first->second;
+      for (auto& [key, series] : family.series)
+        out.lines.push_back({series.labels, &series, 0});
+    }
+  }
+  for (auto& [name, exported] : collected) {
+    auto [it, added] = all.try_emplace(name, std::move(exported));
+    if (!added)
+      it->second.lines.insert(it->second.lines.end(),
+                              exported.lines.begin(),
+                              exported.lines.end());
+  }
+
+  for (auto& [name, exported] : all)
+    fn(name, exported);
+}
+
+double value(const Line& line) {
+  if (!line.series)
+    return line.value;
+  if (auto* c = std::get_if<Counter>(&line.series->metric))
+    return static_cast<double>(c->value());
+  if (auto* g = std::get_if<Gauge>(&line.series->metric))
+    return static_cast<double>(g->value());
+  return 0;
+}
+}  // namespace
+
+void Histogram::observe(std::chrono::nanoseconds elapsed) {
+  auto ns = static_cast<uint64_t>(std::max<int64_t>(elapsed.count(), 0));
+  uint64_t us = (ns + 999) / 1000;  // bucket i holds (2^(i-1), 2^i] µs
+  std::size_t bucket =
+      us == 0 ? 0 : std::min<std::size_t>(std::bit_width(us - 1), BUCKETS - 1);
+  counts_[bucket].fetch_add(1, std::memory_order_relaxed);
+  sum_ns_.fetch_add(ns, std::memory_order_relaxed);
+}
+
+Histogram::Snapshot Histogram::snapshot() const {
+  Snapshot snap;
+  for (std::size_t i = 0; i < BUCKETS; ++i) {
+    snap.counts[i] = counts_[i].load(std::memory_order_relaxed);
+    snap.count += snap.counts[i];
+  }
+  snap.sum = sum_ns_.load(std::memory_order_relaxed) / 1e9;
+  return snap;
+}
+
+double Histogram::upperBound(std::size_t i) {
+  if (i + 1 >= BUCKETS)
+    return std::numeric_limits<double>::infinity();
+  return std::ldexp(1e-6, static_cast<int>(i));
+}
+
+Counter& counter(const std::string& name,
+                 const std::string& help,
+                 const Labels& labels) {
+  return lookup<Counter>(name, help, labels, Type::Counter);
+}
+
+Gauge& gauge(const std::string& name,
+             const std::string& help,
+             const Labels& labels) {
+  return lookup<Gauge>(name, help, labels, Type::Gauge);
+}
+
+Histogram& histogram(const std::string& name,
+                     const std::string& help,
+                     const Labels& labels) {
+  return lookup<Histogram>(name, help, labels, Type::Histogram);
+}
+
+uint64_t addCollector(const std::string& name,
+                      const std::string& help,
+                      Kind kind,
+                      Collector collect) {
+  auto& reg = registry();
+  std::lock_guard<std::mutex> lock(reg.collectors_mtx);
+  auto id = reg.next_id++;
+  reg.collectors.emplace(id,
+                         CollectorEntry{name, help, kind, std::move(collect)});
+  return id;
+}
+
+void removeCollector(uint64_t id) {
+  auto& reg = registry();
+  std::lock_guard<std::mutex> lock(reg.collectors_mtx);
+  reg.collectors.erase(id);
+}
+
+std::string prometheus() {
+  std::ostringstream out;
+  exportAll([&](const std::string& name, const Exported& exported) {
+    out << "# HELP " << name << ' ' << escape(exported.help, false) << '\n'
+        << "# TYPE " << name << ' ' << typeName(exported.type) << '\n';
+    for (const auto& line : exported.lines) {
+      auto labels = renderLabels(line.labels);
+      if (exported.type != Type::Histogram || !line.series) {
+        out << name << labels << ' ' << number(value(line)) << '\n';
+        continue;
+      }
+
+      auto snap = std::get<Histogram>(line.series->metric).snapshot();
+      auto le   = line.labels;
+      le.emplace_back("le", "");
+      uint64_t cumulative = 0;
+      for (std::size_t i = 0; i < Histogram::BUCKETS; ++i) {
+        cumulative += snap.counts[i];
+        le.back().second = number(Histogram::upperBound(i));
+        out << name << "_bucket" << renderLabels(le) << ' ' << cumulative
+            << '\n';
+      }
+      out << name << "_sum" << labels << ' ' << number(snap.sum) << '\n'
+          << name << "_count" << labels << ' ' << snap.count << '\n';
+    }
+  });
+  return out.str();
+}
+
+std::string json() {
+  std::ostringstream out;
+  bool first_family = true;
+  out << '{';
+  exportAll([&](const std::string& name, const Exported& exported) {
+    out << (first_family ? "\n  \"" : ",\n  \"") << escape(name, true)
+        << "\": {\"type\": \"" << typeName(exported.type) << "\", \"help\": \""
+        << escape(exported.help, true) << "\", \"series\": [";
+    first_family = false;
+
+    bool first_line = true;
+    for (const auto& line : exported.lines) {
+      out << (first_line ? "\n    {\"labels\": {" : ",\n    {\"labels\": {");
+      first_line = false;
+      for (std::size_t i = 0; i < line.labels.size(); ++i)
+        out << (i ? ", \"" : "\"") << escape(line.labels[i].first, true)
+            << "\": \"" << escape(line.labels[i].second, true) << '"';
+      out << '}';
+
+      if (exported.type != Type::Histogram || !line.series) {
+        out << ", \"value\": " << number(value(line)) << '}';
+        continue;
+      }
+      auto snap = std::get<Histogram>(line.series->metric).snapshot();
+      out << ", \"count\": " << snap.count << ", \"sum\": " << number(snap.sum)
+          << ", \"buckets\": [";
+      std::size_t last = Histogram::BUCKETS - 1;
+      while (last > 0 && snap.counts[last] == 0)
+        last--;
+      uint64_t cumulative = 0;
+      for (std::size_t i = 0; i <= last && i + 1 < Histogram::BUCKETS; ++i) {
+        cumulative += snap.counts[i];
+        out << (i ? ", [" : "[") << number(Histogram::upperBound(i)) << ", "
+            << cumulative << ']';
+      }
+      out << "]}";
+    }
+    out << (first_line ? "]}" : "\n  ]}");
+  });
+  out << (first_family ? "}\n" : "\n}\n");
+  return out.str();
+}
+}  // namespace metrics
@@ -0,0 +1,95 @@
+#include "../include/net/metrics_server.hpp"
+#include <boost/asio/experimental/awaitable_operators.hpp>
+#include <chrono>
+#include <string>
+#include "../include/metrics/metrics.hpp"
+
+namespace net {
+using namespace asio::experimental::awaitable_operators;
+
+namespace {
+constexpr std::size_t MAX_REQUEST_SIZE = 8 * 1024;
+constexpr auto REQUEST_TIMEOUT         = std::chrono::seconds(5);
+
+std::string response(const std::string& status,
+                     const std::string& content_type,
+                     const std::string& body) {
+  return "HTTP/1.0 " + status + "\r\nContent-Type: " + content_type +
+         "\r\nContent-Length: " + std::to_string(body.size()) +
+         "\r\nConnection: close\r\n\r\n" + body;
+}
+}  // namespace
+
+MetricsServer::MetricsServer(uint16_t port, const asio::ip::address& address)
+    : acceptor_(io_, tcp::endpoint(address, port)) {
+  asio::co_spawn(io_, acceptLoop(), asio::detached);
+  thread_ = std::thread([this] { io_.run(); });
+}
+
+MetricsServer::~MetricsServer() {
+  io_.stop();
+  thread_.join();
+}
+
+uint16_t MetricsServer::port() const {
+  return acceptor_.local_endpoint().port();
+}
+
+asio::awaitable<void> MetricsServer::acceptLoop() {
+  for (;;) {
+    boost::system::error_code ec;
+    auto socket = co_await acceptor_.async_accept(
+        asio::redirect_error(asio::use_awaitable, ec));
+    if (ec == asio::error::operation_aborted)
+      co_return;
+    if (!ec)
+      asio::co_spawn(io_, serve(std::move(socket)), asio::detached);
+  }
+}
+
+// Only the request line matters, headers are read and ignored. A client
+// that hasn't sent its request within REQUEST_TIMEOUT is cut off.
+asio::awaitable<void> MetricsServer::serve(tcp::socket socket) {
+  std::string request;
+  boost::system::error_code ec;
+  asio::steady_timer deadline(socket.get_executor(), REQUEST_TIMEOUT);
+  auto read = co_await (
+      asio::async_read_until(socket,
+                             asio::dynamic_buffer(request, MAX_REQUEST_SIZE),
+                             "\r\n\r\n",
+                             asio::redirect_error(asio::use_awaitable, ec)) ||
+      deadline.async_wait(asio::use_awaitable));
+  if (read.index() == 1 || ec) {
+    socket.close(ec);
+    co_return;
+  }
+
+  // "GET /metrics?x HTTP/1.1"
+  auto line   = request.substr(0, request.find("\r\n"));
+  auto space  = line.find(' ');
+  auto method = line.substr(0, space);
+  std::string target;
+  if (space != std::string::npos) {
+    target = line.substr(space + 1);
+    target = target.substr(0, target.find_first_of(" ?"));
+  }
+
+  std::string reply;
+  if (method != "GET")
+    reply = response("405 Method Not Allowed", "text/plain", "GET only\n");
+  else if (target == "/metrics")
+    reply = response("200 OK",
+                     "text/plain; version=0.0.4; charset=utf-8",
+                     metrics::prometheus());
+  else if (target == "/metrics.json")
+    reply = response("200 OK", "application/json", metrics::json());
+  else
+    reply = response("404 Not Found", "text/plain",
+                     "see /metrics or /metrics.json\n");
+
+  co_await asio::async_write(socket,
+                             asio::buffer(reply),
+                             asio::redirect_error(asio::use_awaitable, ec));
+  socket.shutdown(tcp::socket::shutdown_both, ec);
+}
+}  // namespace net
@@ -1,137 +1,949 @@
 #include "../include/net/peer.hpp"
+#include <algorithm>
+#include <array>
 #include <boost/endian/conversion.hpp>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <optional>
 #include <random>
+#include <span>
 #include <sstream>
 #include <stdexcept>
+#include <unordered_map>
+#include <utility>
 #include <vector>
+#ifdef __linux__
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
 
 namespace net {
-Session::Session(tcp::socket socket, OnClose on_close)
+namespace {
+void appendBytes(std::vector<uint8_t>& out, const void* p, std::size_t n) {
+  auto* bytes = static_cast<const uint8_t*>(p);
+  out.insert(out.end(), bytes, bytes + n);
+}
+
+// Same bytes as sendTaggedPath()
+void appendPathFrame(std::vector<uint8_t>& out,
+                     Session::PacketType pt,
+                     const fs::path& rel_path) {
+  std::ostringstream os;
+  fstree::wire::write_string(os, rel_path.generic_string());
+  auto buf       = os.str();
+  uint64_t sz_be = boost::endian::native_to_big(buf.size());
+  out.push_back(static_cast<uint8_t>(pt));
+  appendBytes(out, &sz_be, sizeof(sz_be));
+  appendBytes(out, buf.data(), buf.size());
+}
+
+// Tag + u64 payload size + payload, read back with receiveSizedPayload()
+std::vector<uint8_t> sizedFrame(Session::PacketType pt,
+                                const std::string& payload) {
+  uint64_t sz_be = boost::endian::native_to_big(
+      static_cast<uint64_t>(payload.size()));
+  std::vector<uint8_t> frame(1, static_cast<uint8_t>(pt));
+  appendBytes(frame, &sz_be, sizeof(sz_be));
+  appendBytes(frame, payload.data(), payload.size());
+  return frame;
+}
+
+// Totals over every session in the process, Peer exports each one's too
+struct SessionMetrics {
+  metrics::Counter& sent = metrics::counter(
+      "file_sync_sent_bytes_total", "Bytes written to peer sockets");
+  metrics::Counter& received = metrics::counter(
+      "file_sync_received_bytes_total", "Bytes read from peer sockets");
+  metrics::Gauge& send_queue = metrics::gauge(
+      "file_sync_send_queue_bytes", "Packets queued for the socket writers");
+  metrics::Histogram& network_read = wait("network_read");
+  metrics::Histogram& network_write = wait("network_write");
+  metrics::Histogram& disk_read = wait("disk_read");  // sends' read-ahead
+  metrics::Histogram& rate_limit = wait("rate_limit");
+
+  static metrics::Histogram& wait(const char* on) {
+    // Same family as DiskWriter's disk_write waits
+    return metrics::histogram("file_sync_wait_seconds",
+                              "Time sessions spend blocked on a resource",
+                              {{"on", on}});
+  }
+};
+
+SessionMetrics& sessionMetrics() {
+  static SessionMetrics instance;
+  return instance;
+}
+
+std::vector<char> readFile(const fs::path& file_path) {
+  std::ifstream file(file_path, std::ios::binary);
+  if (!file)
+    throw std::runtime_error("failed to open file");
+  std::vector<char> data{std::istreambuf_iterator<char>(file),
+                         std::istreambuf_iterator<char>()};
+  if (file.bad())
+    throw std::runtime_error("file read failed");
+  return data;
+}
+
+// File headers end with the sender's mtime, which the copy then gets so a
+// quick check finds both unchanged. Readers skip what they don't expect, so
+// it is absent from older senders only.
+void writeMtime(std::ostream& os, fs::file_time_type mtime) {
+  fstree::wire::write_u64(
+      os, static_cast<uint64_t>(mtime.time_since_epoch().count()));
+}
+
+std::optional<fs::file_time_type> readMtime(std::istream& is) {
+  if (is.peek() == std::char_traits<char>::eof())
+    return std::nullopt;
+  uint64_t mtime = fstree::wire::read_u64(is);
+  if (!is)
+    return std::nullopt;
+  return fs::file_time_type(
+      fs::file_time_type::duration(static_cast<int64_t>(mtime)));
+}
+
+void setMtime(const fs::path& path, std::optional<fs::file_time_type> mtime) {
+  if (!mtime)
+    return;
+  std::error_code ignored;  // the next scan just sees a newer file
+  fs::last_write_time(path, *mtime, ignored);
+}
+
+// Same bytes as sendTaggedFile(), for a file sent as a single chunk. The
+// header carries the size actually read, in case the file changed since the
+// scan. level > 0 compresses the chunk when that pays off.
+void appendFileFrame(std::vector<uint8_t>& out,
+                     const fs::path& rel_path,
+                     fs::file_time_type mtime,
+                     const std::vector<char>& data,
+                     int level) {
+  std::ostringstream header;
+  fstree::wire::write_string(header, rel_path.generic_string());
+  fstree::wire::write_u64(header, data.size());
+  writeMtime(header, mtime);
+  auto header_buf         = header.str();
+  uint64_t header_size_be = boost::endian::native_to_big(
+      static_cast<uint64_t>(header_buf.size()));
+
+  out.push_back(static_cast<uint8_t>(Session::PacketType::FileData));
+  appendBytes(out, &header_size_be, sizeof(header_size_be));
+  appendBytes(out, header_buf.data(), header_buf.size());
+  if (data.empty())
+    return;
+
+  std::vector<uint8_t> packed;
+  uint32_t raw_be = boost::endian::native_to_big(
+      static_cast<uint32_t>(data.size()));
+  if (level > 0 &&
+      compression::deflate(data.data(), data.size(), level, packed)) {
+    uint32_t chunk_be = boost::endian::native_to_big(
+        static_cast<uint32_t>(packed.size()) | compression::CHUNK_COMPRESSED);
+    appendBytes(out, &chunk_be, sizeof(chunk_be));
+    appendBytes(out, &raw_be, sizeof(raw_be));
+    appendBytes(out, packed.data(), packed.size());
+  } else {
+    appendBytes(out, &raw_be, sizeof(raw_be));
+    appendBytes(out, data.data(), data.size());
+  }
+}
+
+// FileBundle: tag + u64 payload size, payload is a u32 count followed by
+// path string + u64 size + contents per file (wire encoding), then a u64
+// mtime per file. A compressed payload has PAYLOAD_COMPRESSED set in its
+// size and the u64 raw size next.
+class BundleBuilder {
+ public:
+  explicit BundleBuilder(int level) : level_(level) { reset(); }
+
+  void add(const fs::path& rel_path,
+           fs::file_time_type mtime,
+           const std::vector<char>& data) {
+    std::ostringstream entry;
+    fstree::wire::write_string(entry, rel_path.generic_string());
+    fstree::wire::write_u64(entry, data.size());
+    auto buf = entry.str();
+    appendBytes(payload_, buf.data(), buf.size());
+    appendBytes(payload_, data.data(), data.size());
+    writeMtime(mtimes_, mtime);
+    count_++;
+  }
+
+  bool empty() const { return count_ == 0; }
+  std::size_t size() const { return payload_.size(); }
+
+  void flushInto(std::vector<uint8_t>& out) {
+    if (count_ == 0)
+      return;
+    std::memcpy(payload_.data(), &count_, sizeof(count_));
+    auto mtimes = mtimes_.str();
+    appendBytes(payload_, mtimes.data(), mtimes.size());
+
+    out.push_back(static_cast<uint8_t>(Session::PacketType::FileBundle));
+    uint64_t raw_size = payload_.size();
+    if (level_ > 0 &&
+        compression::deflate(payload_.data(), raw_size, level_, packed_)) {
+      uint64_t sz_be = boost::endian::native_to_big(
+          static_cast<uint64_t>(packed_.size()) |
+          compression::PAYLOAD_COMPRESSED);
+      uint64_t raw_be = boost::endian::native_to_big(raw_size);
+      appendBytes(out, &sz_be, sizeof(sz_be));
+      appendBytes(out, &raw_be, sizeof(raw_be));
+      out.insert(out.end(), packed_.begin(), packed_.end());
+    } else {
+      uint64_t sz_be = boost::endian::native_to_big(raw_size);
+      appendBytes(out, &sz_be, sizeof(sz_be));
+      out.insert(out.end(), payload_.begin(), payload_.end());
+    }
+    reset();
+  }
+
+ private:
+  void reset() {
+    payload_.assign(sizeof(count_), 0);  // count, filled in on flush
+    mtimes_.str({});
+    count_ = 0;
+  }
+
+  int level_;
+  std::vector<uint8_t> payload_;
+  std::ostringstream mtimes_;
+  std::vector<uint8_t> packed_;
+  uint32_t count_ = 0;
+};
+
+// A file read running on the read pool or the disk thread. done is only
+// touched on the session strand; the timer wakes the waiting coroutine.
+struct PendingRead {
+  explicit PendingRead(const asio::strand<asio::any_io_executor>& strand)
+      : ready(strand) {
+    ready.expires_at(asio::steady_timer::time_point::max());
+  }
+
+  // From the reading thread, once data or error is set
+  static void finish(std::shared_ptr<PendingRead> read) {
+    auto strand = read->ready.get_executor();
+    asio::post(strand, [read = std::move(read)] {
+      read->done = true;
+      read->ready.cancel();
+    });
+  }
+
+  asio::awaitable<void> wait() {
+    while (!done) {
+      boost::system::error_code ec;
+      co_await ready.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+    }
+  }
+
+  const std::vector<char>& bytes() const { return shared ? *shared : data; }
+
+  asio::steady_timer ready;
+  bool done = false;
+  std::vector<char> data;
+  ChunkCache::Chunk shared;  // instead of data, when read through the cache
+  std::exception_ptr error;
+};
+
+// Reads length bytes of file from offset as consecutive chunks on the
+// session's disk thread, one chunk ahead of the one handed out, so the next
+// read runs while the caller has the current chunk on the wire. With a cache
+// and the file's key, chunks other sessions read are taken from there.
+// Strand only.
+class ChunkReader {
+ public:
+  ChunkReader(DiskWriter& disk,
+              const asio::strand<asio::any_io_executor>& strand,
+              std::shared_ptr<std::ifstream> file,
+              uint64_t offset,
+              uint64_t length,
+              uint32_t chunk_size,
+              std::shared_ptr<ChunkCache> cache = nullptr,
+              std::optional<ChunkCache::Key> key = std::nullopt)
+      : disk_(disk),
+        strand_(strand),
+        file_(std::move(file)),
+        offset_(offset),
+        left_(length),
+        chunk_size_(chunk_size),
+        cache_(key ? std::move(cache) : nullptr),
+        key_(std::move(key)) {
+    file_->seekg(static_cast<std::streamoff>(offset));
+    ahead_ = start({});
+  }
+
+  // The next chunk, valid until the following call, nullptr after the last
+  asio::awaitable<const std::vector<char>*> next() {
+    if (!ahead_)
+      co_return nullptr;
+
+    // The caller is done with the current chunk, its buffer takes the read
+    // after this one
+    std::vector<char> spare;
+    if (current_)
+      spare = std::move(current_->data);
+    current_ = std::move(ahead_);
+    ahead_   = start(std::move(spare));
+
+    if (!current_->done) {
+      metrics::Timer timer(sessionMetrics().disk_read);
+      co_await current_->wait();
+    }
+    if (current_->error)
+      std::rethrow_exception(current_->error);
+    co_return &current_->bytes();
+  }
+
+ private:
+  std::shared_ptr<PendingRead> start(std::vector<char> buffer) {
+    if (left_ == 0)
+      return nullptr;
+    auto size =
+        static_cast<std::size_t>(std::min<uint64_t>(left_, chunk_size_));
+    auto offset = offset_;
+    offset_ += size;
+    left_ -= size;
+
+    auto read  = std::make_shared<PendingRead>(strand_);
+    read->data = std::move(buffer);
+    auto load  = [read, file = file_, offset, size] {
+      std::vector<char> data = std::move(read->data);
+      data.resize(size);
+      file->seekg(static_cast<std::streamoff>(offset));
+      file->read(data.data(), static_cast<std::streamsize>(size));
+      if (!*file)
+        throw std::runtime_error("file read failed");
+      return data;
+    };
+    disk_.submit([read, load, cache = cache_, key = key_, offset, size] {
+      try {
+        if (cache) {
+          auto chunk_key   = *key;
+          chunk_key.offset = offset;
+          chunk_key.length = size;
+          read->shared     = cache->get(chunk_key, load);
+        } else {
+          read->data = load();
+        }
+      } catch (...) {
+        read->error = std::current_exception();
+      }
+      PendingRead::finish(read);
+    });
+    return read;
+  }
+
+  DiskWriter& disk_;
+  asio::strand<asio::any_io_executor> strand_;
+  std::shared_ptr<std::ifstream> file_;
+  uint64_t offset_;  // of the next chunk to submit
+  uint64_t left_;    // not yet submitted
+  uint32_t chunk_size_;
+  std::shared_ptr<ChunkCache> cache_;
+  std::optional<ChunkCache::Key> key_;  // offset and length set per chunk
+  std::shared_ptr<PendingRead> current_;
+  std::shared_ptr<PendingRead> ahead_;
+};
+
+#ifdef __linux__
+struct FileDescriptor {
+  int fd = -1;
+  explicit FileDescriptor(const fs::path& path, int flags = O_RDONLY)
+      : fd(::open(path.c_str(), flags | O_CLOEXEC, 0666)) {}
+  ~FileDescriptor() {
+    if (fd >= 0)
+      ::close(fd);
+  }
+  FileDescriptor(const FileDescriptor&)            = delete;
+  FileDescriptor& operator=(const FileDescriptor&) = delete;
+};
+
+// Holds back partial segments while a file goes out as several writes,
+// the kernel flushes when the cork is removed
+struct TcpCork {
+  int fd;
+  explicit TcpCork(int f) : fd(f) { set(1); }
+  ~TcpCork() { set(0); }
+  void set(int on) { ::setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)); }
+};
+
+// Sends count bytes of fd from offset straight from the page cache. Returns
+// false without sending anything if the file can't be used with sendfile.
+asio::awaitable<bool> zeroCopySend(tcp::socket& socket,
+                                   int fd,
+                                   uint64_t offset,
+                                   uint64_t count) {
+  if (!socket.native_non_blocking())
+    socket.native_non_blocking(true);
+
+  auto off  = static_cast<off_t>(offset);
+  bool sent = false;
+  while (count > 0) {
+    ssize_t n = ::sendfile(socket.native_handle(), fd, &off, count);
+    if (n > 0) {
+      count -= static_cast<uint64_t>(n);
+      sent = true;
+    } else if (n == 0) {
+      throw std::runtime_error("file read failed");  // shrank since the scan
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      co_await socket.async_wait(tcp::socket::wait_write, asio::use_awaitable);
+    } else if (!sent && (errno == EINVAL || errno == ENOSYS)) {
+      co_return false;
+    } else if (errno != EINTR) {
+      throw boost::system::system_error(
+          errno, boost::system::system_category(), "sendfile");
+    }
+  }
+  co_return true;
+}
+#endif
+
+// Copies from into to, sharing its extents where the file system can reflink
+// and inside the kernel otherwise. False if from can't be copied.
+bool cloneFile(const fs::path& from, const fs::path& to) {
+#ifdef __linux__
+  FileDescriptor in(from);
+  FileDescriptor out(to, O_WRONLY | O_CREAT | O_TRUNC);
+  struct stat st;
+  if (in.fd >= 0 && out.fd >= 0 && ::fstat(in.fd, &st) == 0) {
+    if (::ioctl(out.fd, FICLONE, in.fd) == 0)
+      return true;
+    auto left = static_cast<std::size_t>(st.st_size);
+    while (left > 0) {
+      ssize_t n = ::copy_file_range(in.fd, nullptr, out.fd, nullptr, left, 0);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;  // e.g. across file systems on older kernels
+      left -= static_cast<std::size_t>(n);
+    }
+    if (left == 0)
+      return true;
+  }
+#endif
+  std::error_code ec;
+  fs::copy_file(from, to, fs::copy_options::overwrite_existing, ec);
+  return !ec;
+}
+
+// CopyFile / MoveFile after the tag: u64 payload size + source path string +
+// path string + u64 mtime
+void appendLocalFileFrame(std::vector<uint8_t>& out,
+                          Session::PacketType pt,
+                          const fs::path& from,
+                          const fstree::Node& node) {
+  std::ostringstream os;
+  fstree::wire::write_string(os, from.generic_string());
+  fstree::wire::write_string(os, node.path.generic_string());
+  writeMtime(os, node.mtime);
+  auto frame = sizedFrame(pt, os.str());
+  out.insert(out.end(), frame.begin(), frame.end());
+}
+
+// FileComplete / SetMtime after the tag: u64 payload size + path string +
+// u64 mtime
+void appendMtimeFrame(std::vector<uint8_t>& out,
+                      Session::PacketType pt,
+                      const fstree::Node& node) {
+  std::ostringstream os;
+  fstree::wire::write_string(os, node.path.generic_string());
+  writeMtime(os, node.mtime);
+  auto frame = sizedFrame(pt, os.str());
+  out.insert(out.end(), frame.begin(), frame.end());
+}
+
+uint64_t fileSize(const SyncOp& op) {
+  return std::get<fstree::FileMeta>(op.node->data).size;
+}
+
+// FileData after the tag: u64 header size + path string + u64 file size +
+// u64 mtime + u64 resume offset, the chunks from that offset follow
+std::string fileDataPrefix(const fstree::Node& node, uint64_t offset) {
+  std::ostringstream header;
+  fstree::wire::write_string(header, node.path.generic_string());
+  fstree::wire::write_u64(header, std::get<fstree::FileMeta>(node.data).size);
+  writeMtime(header, node.mtime);
+  fstree::wire::write_u64(header, offset);
+
+  auto header_buf         = header.str();
+  uint64_t header_size_be = boost::endian::native_to_big(
+      static_cast<uint64_t>(header_buf.size()));
+  std::string prefix(reinterpret_cast<const char*>(&header_size_be),
+                     sizeof(header_size_be));
+  prefix += header_buf;
+  return prefix;
+}
+
+// Iovecs per gathered write, what asio hands writev() in one call
+constexpr std::size_t TX_MAX_BUFFERS = 64;
+}  // namespace
+
+fs::path partialPath(const fs::path& abs_path) {
+  return abs_path.parent_path() /
+         (std::string(fstree::INTERNAL_PREFIX) + ".part." +
+          abs_path.filename().string());
+}
+
+// One-shot wakeup on the session strand, set() and done only run there
+struct Session::Signal {
+  explicit Signal(const asio::strand<asio::any_io_executor>& strand)
+      : timer(strand) {
+    timer.expires_at(asio::steady_timer::time_point::max());
+  }
+
+  asio::awaitable<void> wait() {
+    while (!done) {
+      boost::system::error_code ignored;
+      co_await timer.async_wait(
+          asio::redirect_error(asio::use_awaitable, ignored));
+    }
+    if (ec)
+      throw boost::system::system_error(ec);
+  }
+
+  void set(boost::system::error_code error = {}) {
+    done = true;
+    ec   = error;
+    timer.cancel();
+  }
+
+  asio::steady_timer timer;
+  bool done = false;
+  boost::system::error_code ec;
+};
+
+// A queued packet, or with claim set a stream waiting for the socket
+struct Session::Outgoing {
+  explicit Outgoing(const asio::strand<asio::any_io_executor>& strand)
+      : written(strand) {}
+
+  std::size_t size() const { return head.size() + body.size(); }
+
+  std::vector<uint8_t> head;
+  std::vector<uint8_t> body;
+  bool claim = false;
+  Signal written;  // granted, for a claim
+};
+
+Session::Session(tcp::socket socket,
+                 OnClose on_close,
+                 std::shared_ptr<ChunkCache> cache)
     : socket_(std::move(socket)),
       strand_(asio::make_strand(socket_.get_executor())),
-      on_close_(on_close) {}
+      on_close_(on_close),
+      cache_(std::move(cache)),
+      started_(std::chrono::steady_clock::now()) {
+  boost::system::error_code ec;
+  auto remote = socket_.remote_endpoint(ec);
+  if (!ec)
+    remote_ = remote.address().to_string() + ":" +
+              std::to_string(remote.port());
+}
 
-asio::awaitable<void> Session::sendTree(const fstree::DirectoryTree& tree) {
-  // Ensure strand entry
-  co_await asio::dispatch(strand_, asio::use_awaitable);
+Session::Turn::Turn(Session* session, void (Session::*release)())
+    : session_(session), release_(release) {}
+
+Session::Turn::Turn(Turn&& other) noexcept
+    : session_(std::exchange(other.session_, nullptr)),
+      release_(other.release_) {}
 
-  while (busy_.exchange(true)) {
-    co_await asio::post(strand_, asio::use_awaitable);
+Session::Turn::~Turn() {
+  if (session_)
+    (session_->*release_)();
+}
+
+asio::awaitable<Session::Turn> Session::receiveTurn() {
+  if (rx_busy_) {
+    auto waiter = std::make_shared<Signal>(strand_);
+    rx_waiters_.push_back(waiter);
+    co_await waiter->wait();  // handed over by releaseReceive()
   }
+  rx_busy_ = true;
+  co_return Turn(this, &Session::releaseReceive);
+}
 
-  // We own this session now
-  try {
-    buffer_  = fstree::serializeTree(tree);
-    size_be_ = boost::endian::native_to_big(static_cast<uint64_t>(buffer_.size()));
+void Session::releaseReceive() {
+  if (rx_waiters_.empty()) {
+    rx_busy_ = false;
+    return;
+  }
+  auto next = std::move(rx_waiters_.front());
+  rx_waiters_.pop_front();
+  next->set();
+}
 
-    std::vector<asio::const_buffer> buffers{
-        asio::buffer(&size_be_, sizeof(size_be_)), asio::buffer(buffer_)};
+asio::awaitable<void> Session::read(asio::mutable_buffer buf, bool timed) {
+  auto* out        = static_cast<uint8_t*>(buf.data());
+  std::size_t need = buf.size();
+  std::size_t have = std::min(need, rx_end_ - rx_begin_);
+  if (have > 0) {
+    std::memcpy(out, rx_buf_.data() + rx_begin_, have);
+    rx_begin_ += have;
+    out += have;
+    need -= have;
+  }
+  if (need == 0)
+    co_return;
 
-    co_await asio::async_write(
-        socket_, buffers, asio::bind_executor(strand_, asio::use_awaitable));
+  rx_begin_ = rx_end_ = 0;
+  metrics::Timer timer(timed ? &sessionMetrics().network_read : nullptr);
+  if (need >= READ_AHEAD_SIZE) {
+    co_await asio::async_read(
+        socket_, asio::buffer(out, need), asio::use_awaitable);
+    bytes_received_.fetch_add(need, std::memory_order_relaxed);
+    sessionMetrics().received.add(need);
+    co_return;
+  }
+  rx_buf_.resize(READ_AHEAD_SIZE);
+  std::size_t n = co_await asio::async_read(socket_,
+                                            asio::buffer(rx_buf_),
+                                            asio::transfer_at_least(need),
+                                            asio::use_awaitable);
+  bytes_received_.fetch_add(n, std::memory_order_relaxed);
+  sessionMetrics().received.add(n);
+  std::memcpy(out, rx_buf_.data(), need);
+  rx_begin_ = need;
+  rx_end_   = n;
+}
+
+asio::awaitable<void> Session::send(std::vector<uint8_t> head,
+                                    std::vector<uint8_t> body) {
+  if (tx_error_)
+    throw boost::system::system_error(tx_error_);
+
+  auto out  = std::make_shared<Outgoing>(strand_);
+  out->head = std::move(head);
+  out->body = std::move(body);
+  tx_queued_ += out->size();
+  sessionMetrics().send_queue.add(static_cast<int64_t>(out->size()));
+  tx_queue_.push_back(out);
+  startWriter();
+  if (tx_queued_ > TX_QUEUE_LIMIT)
+    co_await out->written.wait();
+}
+
+asio::awaitable<Session::Turn> Session::claimSocket() {
+  if (tx_error_)
+    throw boost::system::system_error(tx_error_);
+
+  auto claim   = std::make_shared<Outgoing>(strand_);
+  claim->claim = true;
+  tx_queue_.push_back(claim);
+  startWriter();
+  co_await claim->written.wait();
+  co_return Turn(this, &Session::releaseSocket);
+}
+
+void Session::releaseSocket() {
+  tx_claimed_ = false;
+  startWriter();
+}
+
+void Session::startWriter() {
+  if (tx_writing_ || tx_claimed_ || tx_queue_.empty())
+    return;
+  tx_writing_ = true;
+  asio::co_spawn(
+      strand_,
+      [self = shared_from_this()] { return self->writeQueued(); },
+      asio::detached);
+}
+
+// Everything queued up to the next claim goes out as one gathered write.
+// Stops when the queue runs dry or a claim takes the socket, startWriter()
+// brings it back.
+asio::awaitable<void> Session::writeQueued() {
+  std::vector<std::shared_ptr<Outgoing>> batch;
+  std::vector<asio::const_buffer> buffers;
+  while (!tx_queue_.empty()) {
+    if (tx_queue_.front()->claim) {
+      tx_claimed_ = true;
+      tx_queue_.front()->written.set();
+      tx_queue_.pop_front();
+      break;
+    }
+
+    batch.clear();
+    buffers.clear();
+    while (!tx_queue_.empty() && !tx_queue_.front()->claim &&
+           buffers.size() + 2 <= TX_MAX_BUFFERS) {
+      auto& out = tx_queue_.front();
+      buffers.push_back(asio::buffer(out->head));
+      if (!out->body.empty())
+        buffers.push_back(asio::buffer(out->body));
+      batch.push_back(std::move(out));
+      tx_queue_.pop_front();
+    }
+
+    co_await throttle(asio::buffer_size(buffers));
+    boost::system::error_code ec;
+    std::size_t n;
+    {
+      metrics::Timer timer(sessionMetrics().network_write);
+      n = co_await asio::async_write(
+          socket_, buffers, asio::redirect_error(asio::use_awaitable, ec));
+    }
+    countSent(n);
+    for (auto& out : batch) {
+      tx_queued_ -= out->size();
+      sessionMetrics().send_queue.add(-static_cast<int64_t>(out->size()));
+      out->written.set(ec);
+    }
+
+    if (ec) {
+      // Senders that didn't wait find out on their next send
+      tx_error_ = ec;
+      for (auto& out : tx_queue_)
+        out->written.set(ec);
+      tx_queue_.clear();
+      sessionMetrics().send_queue.add(-static_cast<int64_t>(tx_queued_));
+      tx_queued_ = 0;
+      close();
+      break;
+    }
+  }
+  tx_writing_ = false;
+}
+
+template <typename Buffers>
+asio::awaitable<void> Session::write(const Buffers& buffers) {
+  co_await throttle(asio::buffer_size(buffers));
+  metrics::Timer timer(sessionMetrics().network_write);
+  countSent(co_await asio::async_write(socket_, buffers, asio::use_awaitable));
+}
+
+// The slowest limiter sets the wait; all of them are charged
+asio::awaitable<void> Session::throttle(std::size_t bytes) {
+  if (limiters_.empty())
+    co_return;
+  auto wait = RateLimiter::Clock::duration::zero();
+  for (const auto& limiter : limiters_)
+    wait = std::max(wait, limiter->reserve(bytes));
+  if (wait <= RateLimiter::Clock::duration::zero())
+    co_return;
+
+  metrics::Timer waiting(sessionMetrics().rate_limit);
+  asio::steady_timer timer(strand_, wait);
+  co_await timer.async_wait(asio::use_awaitable);
+}
+
+void Session::countSent(std::size_t n) {
+  bytes_sent_.fetch_add(n, std::memory_order_relaxed);
+  sessionMetrics().sent.add(n);
+}
+
+asio::awaitable<void> Session::sendTree(const fstree::DirectoryTree& tree) {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendTree(tree));
+
+  try {
+    std::vector<uint8_t> payload;
+    if (lazy_) {
+      payload = fstree::serializeTree(tree, tree_format_, LAZY_TREE_DEPTH);
+      tx_generation_++;
+    } else {
+      payload = fstree::serializeTree(tree, tree_format_);
+      recordSentTree(tree);
+    }
+    co_await sendTreePayload(std::nullopt, std::move(payload));
   } catch (...) {
-    busy_.store(false);
     close();
     throw;
   }
-  busy_.store(false);
 }
 
 asio::awaitable<fstree::DirectoryTree> Session::receiveTree() {
-  // Ensure strand entry
-  co_await asio::dispatch(strand_, asio::use_awaitable);
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(receiveTree());
 
-  // If busy, wait by yielding into strand
-  while (busy_.exchange(true)) {
-    co_await asio::post(strand_, asio::use_awaitable);
-  }
+  auto turn = co_await receiveTurn();
 
   try {
-    // read size
-    co_await asio::async_read(
-        socket_,
-        asio::buffer(&size_be_, sizeof(size_be_)),
-        asio::bind_executor(strand_, asio::use_awaitable));
+    auto tree = co_await readTree();
+    rx_generation_++;
+    co_return tree;
+  } catch (...) {
+    close();
+    throw;
+  }
+}
 
-    auto size = boost::endian::big_to_native(size_be_);
-    if (size > MAX_TREE_SIZE)
-      throw std::runtime_error("Tree payload too large.\n");
-    buffer_.resize(size);
+// Tree payloads are u64 size + data, or when compressed u64 size with
+// PAYLOAD_COMPRESSED set + u64 raw size + deflate data. The handshake tree
+// has no tag.
+asio::awaitable<void> Session::sendTreePayload(std::optional<PacketType> tag,
+                                               std::vector<uint8_t> payload) {
+  std::vector<uint8_t> head;
+  if (tag)
+    head.push_back(static_cast<uint8_t>(*tag));
+
+  uint64_t raw_size = payload.size();
+  std::vector<uint8_t> packed;
+  if (compress_ &&
+      compression::deflate(payload.data(), payload.size(), 6, packed)) {
+    payload.swap(packed);
+    uint64_t size_be = boost::endian::native_to_big(
+        static_cast<uint64_t>(payload.size()) |
+        compression::PAYLOAD_COMPRESSED);
+    uint64_t raw_be = boost::endian::native_to_big(raw_size);
+    appendBytes(head, &size_be, sizeof(size_be));
+    appendBytes(head, &raw_be, sizeof(raw_be));
+  } else {
+    uint64_t size_be = boost::endian::native_to_big(raw_size);
+    appendBytes(head, &size_be, sizeof(size_be));
+  }
+  co_await send(std::move(head), std::move(payload));
+}
 
-    // read payload
-    co_await asio::async_read(
-        socket_,
-        asio::buffer(buffer_),
-        asio::bind_executor(strand_, asio::use_awaitable));
+asio::awaitable<Session::PayloadSize> Session::readPayloadSize() {
+  co_await read(asio::buffer(&size_be_, sizeof(size_be_)));
+  PayloadSize payload;
+  payload.size       = boost::endian::big_to_native(size_be_);
+  payload.raw_size   = payload.size;
+  payload.compressed = payload.size & compression::PAYLOAD_COMPRESSED;
+  if (payload.compressed) {
+    payload.size &= ~compression::PAYLOAD_COMPRESSED;
+    co_await read(asio::buffer(&raw_size_be_, sizeof(raw_size_be_)));
+    payload.raw_size = boost::endian::big_to_native(raw_size_be_);
+  }
+  co_return payload;
+}
 
-    busy_.store(false);
+// Reads a tree payload into buffer_. Caller holds the receive turn.
+asio::awaitable<void> Session::readTreePayload() {
+  auto payload = co_await readPayloadSize();
+  if (payload.size > MAX_TREE_SIZE || payload.raw_size > MAX_TREE_SIZE)
+    throw std::runtime_error("Tree payload too large.\n");
+
+  auto& target = payload.compressed ? packed_ : buffer_;
+  target.resize(payload.size);
+  co_await read(asio::buffer(target));
+  if (payload.compressed) {
+    buffer_.resize(payload.raw_size);
+    compression::inflate(
+        packed_.data(), payload.size, buffer_.data(), payload.raw_size);
+  }
+}
 
-    co_return fstree::deserializeTree(buffer_);
-  } catch (...) {
-    busy_.store(false);
-    close();
-    throw;
+// Decodes a full tree payload a read at a time, so only the tree itself is
+// held in memory. Caller holds the receive turn.
+asio::awaitable<fstree::DirectoryTree> Session::readTree() {
+  auto payload = co_await readPayloadSize();
+
+  fstree::TreeDecoder decoder;
+  std::optional<compression::Inflater> inflater;
+  if (payload.compressed)
+    inflater.emplace(payload.raw_size);
+  auto sink = [&](std::span<const uint8_t> data) { decoder.feed(data); };
+
+  buffer_.resize(std::min<uint64_t>(payload.size, TREE_READ_SIZE));
+  for (uint64_t left = payload.size; left > 0;) {
+    auto n = static_cast<std::size_t>(std::min<uint64_t>(left, buffer_.size()));
+    co_await read(asio::buffer(buffer_.data(), n));
+    left -= n;
+    if (inflater)
+      inflater->feed(buffer_.data(), n, sink);
+    else
+      sink(std::span<const uint8_t>(buffer_.data(), n));
   }
-  busy_.store(false);
+  if (inflater)
+    inflater->finish();
+  auto tree           = decoder.finish();
+  tree.hash_algorithm = remote_hash_;
+  co_return tree;
 }
 
 asio::awaitable<void> Session::sendTaggedTree(
     const fstree::DirectoryTree& tree) {
-  co_await asio::dispatch(strand_, asio::use_awaitable);
-  while (busy_.exchange(true))
-    co_await asio::post(strand_, asio::use_awaitable);
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendTaggedTree(tree));
 
   try {
-    buffer_  = fstree::serializeTree(tree);
-    size_be_ = boost::endian::native_to_big(static_cast<uint64_t>(buffer_.size()));
+    // Lazy trees are small, and the receiver's copy can't take a delta
+    if (lazy_) {
+      auto payload =
+          fstree::serializeTree(tree, tree_format_, LAZY_TREE_DEPTH);
+      tx_generation_++;
+      co_await sendTreePayload(PacketType::Tree, std::move(payload));
+      co_return;
+    }
+
+    // Send only the changes since the last tree when the peer takes deltas
+    // and both have a root hash
+    bool deltas = supports(FEATURE_TREE_DELTA);
+    std::optional<fstree::TreeDelta> delta;
+    if (deltas && last_sent_)
+      delta = fstree::makeDelta(*last_sent_, tree);
+
+    std::vector<uint8_t> payload;
+    PacketType tag;
+    if (delta) {
+      delta->base_generation = tx_generation_;
+      delta->generation      = tx_generation_ + 1;
+      payload                = fstree::serializeDelta(*delta, tree_format_);
+      tag                    = PacketType::TreeDelta;
+    } else {
+      payload = fstree::serializeTree(tree, tree_format_);
+      tag     = PacketType::Tree;
+    }
+    if (deltas)
+      recordSentTree(tree);
+    else
+      tx_generation_++;
+    co_await sendTreePayload(tag, std::move(payload));
+  } catch (...) {
+    close();
+    throw;
+  }
+}
 
-    uint8_t tag = static_cast<uint8_t>(PacketType::Tree);
+asio::awaitable<fstree::DirectoryTree> Session::receiveTreePayload() {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(receiveTreePayload());
 
-    std::vector<asio::const_buffer> buffers{
-        asio::buffer(&tag, 1),
-        asio::buffer(&size_be_, sizeof(size_be_)),
-        asio::buffer(buffer_)};
+  auto turn = co_await receiveTurn();
+
+  try {
+    auto tree = co_await readTree();
+    rx_generation_++;
 
-    co_await asio::async_write(
-        socket_, buffers, asio::bind_executor(strand_, asio::use_awaitable));
+    co_return tree;
   } catch (...) {
-    busy_.store(false);
     close();
     throw;
   }
-  busy_.store(false);
 }
 
-asio::awaitable<fstree::DirectoryTree> Session::receiveTreePayload() {
-  co_await asio::dispatch(strand_, asio::use_awaitable);
-  while (busy_.exchange(true))
-    co_await asio::post(strand_, asio::use_awaitable);
+asio::awaitable<std::optional<fstree::TreeDelta>>
+Session::receiveTreeDeltaPayload() {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(receiveTreeDeltaPayload());
 
-  try {
-    co_await asio::async_read(
-        socket_,
-        asio::buffer(&size_be_, sizeof(size_be_)),
-        asio::bind_executor(strand_, asio::use_awaitable));
+  auto turn = co_await receiveTurn();
 
-    auto size = boost::endian::big_to_native(size_be_);
-    if (size > MAX_TREE_SIZE)
-      throw std::runtime_error("Tree payload too large.\n");
-    buffer_.resize(size);
+  try {
+    co_await readTreePayload();
 
-    co_await asio::async_read(
-        socket_,
-        asio::buffer(buffer_),
-        asio::bind_executor(strand_, asio::use_awaitable));
+    auto delta   = fstree::deserializeDelta(buffer_);
+    bool in_sync = delta.base_generation == rx_generation_;
+    // Stay in step with the sender's count even when the delta is unusable
+    rx_generation_ = delta.generation;
 
-    busy_.store(false);
-    co_return fstree::deserializeTree(buffer_);
+    if (!in_sync)
+      co_return std::nullopt;
+    co_return std::move(delta);
   } catch (...) {
-    busy_.store(false);
     close();
     throw;
   }
@@ -140,92 +952,244 @@ asio::awaitable<fstree::DirectoryTree> Session::receiveTreePayload() {
 asio::awaitable<void> Session::sendFile(const fstree::DirectoryTree& tree,
                                         const fstree::Node& node,
                                         uint32_t chunk_size) {
-  // Ensure strand entry
-  co_await asio::dispatch(strand_, asio::use_awaitable);
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendFile(tree, node, chunk_size));
 
-  // If busy, wait by yielding into strand
-  while (busy_.exchange(true)) {
-    co_await asio::post(strand_, asio::use_awaitable);
-  }
-
-  if (chunk_size == 0 || chunk_size > MAX_FILE_CHUNK_SIZE)
+  if (chunk_size > MAX_FILE_CHUNK_SIZE)
     throw std::runtime_error("invalid chunk size");
 
-  // Resolve absolute path
-  fs::path file_path = tree.root_path / node.path;
-  auto file_size     = std::get<fstree::FileMeta>(node.data).size;
-
-  std::ifstream file(file_path, std::ios::binary);
-  if (!file)
-    throw std::runtime_error("failed to open file");
-
-  // Send header
-  std::ostringstream header;
-  fstree::wire::write_string(header, node.path.generic_string());
-  fstree::wire::write_u64(header, file_size);
-
-  auto header_buf         = header.str();
-  uint64_t header_size    = header_buf.size();
-  uint64_t header_size_be = boost::endian::native_to_big(header_size);
-
-  // --- Header Debug ---
-  // std::cout << "\nSend header ->"
-  //           << "\nSize: " << boost::endian::big_to_native(header_size_be)
-  //           << "\nrel_path: " << node.path.generic_string()
-  //           << "\nfile_size: " << file_size << "\nBuffer: ";  // debug
-  // for (auto& v : header_buf) {
-  //   std::cout << (int)v << " ";
-  // }
-  // std::cout << "\n";
-
-  co_await asio::async_write(
-      socket_,
-      asio::buffer(&header_size_be, sizeof(header_size_be)),
-      asio::use_awaitable);
-
-  co_await asio::async_write(
-      socket_, asio::buffer(header_buf), asio::use_awaitable);
-
-  // Send chunk
-  std::vector<char> buffer(chunk_size);
-  uint64_t remaining = file_size;
+  try {
+    auto claim = co_await claimSocket();
+    co_await streamFile(fileDataPrefix(node, 0),
+                        tree.root_path / node.path,
+                        0,
+                        std::get<fstree::FileMeta>(node.data).size,
+                        chunk_size);
+  } catch (...) {
+    close();
+    throw;
+  }
+}
 
-  while (remaining > 0) {
-    uint32_t to_read =
-        static_cast<uint32_t>(std::min<uint64_t>(remaining, chunk_size));
+// A couple of send buffers per chunk keep the socket busy while the next
+// chunk is read; larger chunks would only hold more memory. Linux reports
+// the send buffer as it autotunes, so later files follow it.
+uint32_t Session::chunkSize() {
+  asio::socket_base::send_buffer_size send_buffer;
+  boost::system::error_code ec;
+  socket_.get_option(send_buffer, ec);
+  if (ec || send_buffer.value() <= 0)
+    return MIN_SEND_CHUNK_SIZE;
+  return static_cast<uint32_t>(
+      std::clamp<uint64_t>(2 * static_cast<uint64_t>(send_buffer.value()),
+                           MIN_SEND_CHUNK_SIZE,
+                           MAX_SEND_CHUNK_SIZE));
+}
 
-    file.read(buffer.data(), to_read);
-    if (!file)
-      throw std::runtime_error("file read failed");
+// Writes prefix, then length bytes of the file from offset as chunks of
+// u32 size + data, chunk_size 0 picks chunkSize(). Caller holds a
+// claimSocket() turn.
+asio::awaitable<void> Session::streamFile(const std::string& prefix,
+                                          const fs::path& file_path,
+                                          uint64_t offset,
+                                          uint64_t length,
+                                          uint32_t chunk_size) {
+  auto file = std::make_shared<std::ifstream>(file_path, std::ios::binary);
+  if (!*file)
+    throw std::runtime_error("failed to open file");
+  if (chunk_size == 0)
+    chunk_size = chunkSize();
+  // What other sessions sending this file share through the cache
+  std::optional<ChunkCache::Key> key;
+  if (cache_)
+    key = ChunkCache::identify(file_path);
+
+  // Compressed, when the name and a sample of the data suggest it pays off
+  if (compress_ && length > 0 && compression::compressibleName(file_path)) {
+    std::vector<char> sample(
+        std::min<uint64_t>(length, compression::SAMPLE_SIZE));
+    file->seekg(static_cast<std::streamoff>(offset));
+    file->read(sample.data(), sample.size());
+    if (*file &&
+        compression::compressibleSample(sample.data(), sample.size())) {
+      co_await streamCompressed(
+          prefix, file, offset, length, chunk_size, std::move(key));
+      co_return;
+    }
+    file->clear();
+  }
 
-    uint32_t be_size = boost::endian::native_to_big(to_read);
+#ifdef __linux__
+  // Zero-copy: the chunk framing stays, payloads go out via sendfile(2).
+  // The cork keeps the prefixes from leaving as separate small segments.
+  FileDescriptor fd(file_path);
+  if (fd.fd >= 0) {
+    // Nothing is buffered here, the kernel's read-ahead does the work and
+    // its page cache is what sessions sending the same file share
+    ::posix_fadvise(fd.fd,
+                    static_cast<off_t>(offset),
+                    static_cast<off_t>(length),
+                    POSIX_FADV_SEQUENTIAL);
+    TcpCork cork(socket_.native_handle());
+    co_await write(asio::buffer(prefix));
+    uint64_t remaining = length;
+    while (remaining > 0) {
+      uint32_t to_send =
+          static_cast<uint32_t>(std::min<uint64_t>(remaining, chunk_size));
+      uint32_t be_size = boost::endian::native_to_big(to_send);
+      co_await write(asio::buffer(&be_size, sizeof(be_size)));
+
+      uint64_t at = offset + (length - remaining);
+      co_await throttle(to_send);
+      bool zero_copy;
+      {
+        metrics::Timer timer(sessionMetrics().network_write);
+        zero_copy = co_await zeroCopySend(socket_, fd.fd, at, to_send);
+      }
+      if (!zero_copy) {
+        // Not supported for this file: finish the chunk with a copy, the
+        // rest goes through copyChunks()
+        std::vector<char> buffer(to_send);
+        file->seekg(static_cast<std::streamoff>(at));
+        file->read(buffer.data(), to_send);
+        if (!*file)
+          throw std::runtime_error("file read failed");
+        co_await write(asio::buffer(buffer));
+        co_await copyChunks(file,
+                            at + to_send,
+                            remaining - to_send,
+                            chunk_size,
+                            std::move(key));
+        co_return;
+      }
+      countSent(to_send);
+      remaining -= to_send;
+    }
+    co_return;
+  }
+#endif
 
-    co_await asio::async_write(
-        socket_, asio::buffer(&be_size, sizeof(be_size)), asio::use_awaitable);
+  co_await write(asio::buffer(prefix));
+  co_await copyChunks(file, offset, length, chunk_size, std::move(key));
+}
 
-    co_await asio::async_write(
-        socket_, asio::buffer(buffer.data(), to_read), asio::use_awaitable);
+// The chunks of streamFile() through user space, each read on the disk
+// thread while the one before it is written
+asio::awaitable<void> Session::copyChunks(std::shared_ptr<std::ifstream> file,
+                                          uint64_t offset,
+                                          uint64_t length,
+                                          uint32_t chunk_size,
+                                          std::optional<ChunkCache::Key> key) {
+  ChunkReader reader(disk_,
+                     strand_,
+                     std::move(file),
+                     offset,
+                     length,
+                     chunk_size,
+                     cache_,
+                     std::move(key));
+  for (;;) {
+    const std::vector<char>* chunk = co_await reader.next();
+    if (!chunk)
+      break;
+
+    uint32_t be_size =
+        boost::endian::native_to_big(static_cast<uint32_t>(chunk->size()));
+    std::array<asio::const_buffer, 2> chunk_buffers{
+        asio::buffer(&be_size, sizeof(be_size)),
+        asio::buffer(*chunk),
+    };
+    co_await write(chunk_buffers);
+  }
+}
 
-    remaining -= to_read;
+// streamFile() with deflate per chunk. Chunks that don't shrink go out raw.
+// With a file key, chunks deflated for another session at the same level
+// are reused; an empty cached chunk means it didn't shrink.
+asio::awaitable<void> Session::streamCompressed(
+    const std::string& prefix,
+    std::shared_ptr<std::ifstream> file,
+    uint64_t offset,
+    uint64_t length,
+    uint32_t chunk_size,
+    std::optional<ChunkCache::Key> key) {
+  using clock = std::chrono::steady_clock;
+
+  co_await write(asio::buffer(prefix));
+
+  std::vector<uint8_t> packed;
+  uint32_t limit = static_cast<uint32_t>(
+      std::min<uint64_t>(chunk_size, compression::CHUNK_SIZE));
+  ChunkReader reader(disk_,
+                     strand_,
+                     std::move(file),
+                     offset,
+                     length,
+                     limit,
+                     cache_,
+                     key);
+  for (uint64_t at = offset;;) {
+    const std::vector<char>* raw = co_await reader.next();
+    if (!raw)
+      break;
+    auto to_read = static_cast<uint32_t>(raw->size());
+
+    std::optional<ChunkCache::Key> chunk_key;
+    ChunkCache::Chunk cached;
+    if (key && cache_) {
+      chunk_key         = *key;
+      chunk_key->offset = at;
+      chunk_key->length = to_read;
+      chunk_key->level  = level_.level();
+      cached            = cache_->find(*chunk_key);
+    }
+    at += to_read;
+
+    std::optional<clock::time_point> start, compressed;
+    asio::const_buffer body;
+    if (cached) {
+      body = asio::buffer(*cached);
+    } else {
+      start = clock::now();
+      bool small =
+          compression::deflate(raw->data(), to_read, level_.level(), packed);
+      compressed = clock::now();
+      body       = small ? asio::buffer(packed) : asio::const_buffer();
+      if (chunk_key)
+        cache_->put(*chunk_key,
+                    std::make_shared<const std::vector<char>>(
+                        small ? std::vector<char>(packed.begin(), packed.end())
+                              : std::vector<char>()));
+    }
+
+    uint32_t len_be = 0, raw_be = boost::endian::native_to_big(to_read);
+    std::vector<asio::const_buffer> buffers;
+    if (body.size() > 0) {
+      len_be = boost::endian::native_to_big(
+          static_cast<uint32_t>(body.size()) | compression::CHUNK_COMPRESSED);
+      buffers = {asio::buffer(&len_be, sizeof(len_be)),
+                 asio::buffer(&raw_be, sizeof(raw_be)),
+                 body};
+    } else {
+      len_be  = raw_be;
+      buffers = {asio::buffer(&len_be, sizeof(len_be)), asio::buffer(*raw)};
+    }
+    co_await write(buffers);
+    if (start)
+      level_.update(*compressed - *start, clock::now() - *compressed);
   }
-  busy_.store(false);
 }
 
 asio::awaitable<void> Session::receiveFile(fstree::DirectoryTree& tree,
                                            bool rebuild_tree) {
-  // Ensure strand entry
-  co_await asio::dispatch(strand_, asio::use_awaitable);
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(receiveFile(tree, rebuild_tree));
 
-  // If busy, wait by yielding into strand
-  while (busy_.exchange(true)) {
-    co_await asio::post(strand_, asio::use_awaitable);
-  }
+  auto turn = co_await receiveTurn();
 
   // Receive Header
   uint64_t hdr_size_be = 0;
-  co_await asio::async_read(socket_,
-                            asio::buffer(&hdr_size_be, sizeof(hdr_size_be)),
-                            asio::use_awaitable);
+  co_await read(asio::buffer(&hdr_size_be, sizeof(hdr_size_be)));
 
   uint64_t hdr_size = boost::endian::big_to_native(hdr_size_be);
   // std::cout << "Received header size: " << hdr_size << "\n";
@@ -234,13 +1198,18 @@ asio::awaitable<void> Session::receiveFile(fstree::DirectoryTree& tree,
     throw std::runtime_error("header too large");
 
   std::vector<uint8_t> hdr_buf(hdr_size);
-  co_await asio::async_read(
-      socket_, asio::buffer(hdr_buf), asio::use_awaitable);
+  co_await read(asio::buffer(hdr_buf));
 
   std::istringstream hdr_stream(std::string(hdr_buf.begin(), hdr_buf.end()));
 
   fs::path rel_path  = fstree::wire::read_string(hdr_stream);
   uint64_t file_size = fstree::wire::read_u64(hdr_stream);
+  auto mtime         = readMtime(hdr_stream);
+  uint64_t offset    = 0;  // bytes already in the partial file
+  if (hdr_stream.peek() != std::char_traits<char>::eof())
+    offset = fstree::wire::read_u64(hdr_stream);
+  if (!hdr_stream || offset > file_size)
+    throw std::runtime_error("invalid file header");
 
   // --- Header Debug ---
   // std::cout << "\nReceive header ->"
@@ -251,59 +1220,144 @@ asio::awaitable<void> Session::receiveFile(fstree::DirectoryTree& tree,
   // }
   // std::cout << "\n";  // debug
 
-  // Resolve path
+  // Resolve path. The file is created, written and closed on the disk
+  // thread while we keep reading the socket. Large files are written to a
+  // partial file that outlives a dropped connection and only replace the
+  // old copy once complete.
   fs::path abs_path = tree.root_path / rel_path;
-  fs::create_directories(abs_path.parent_path());
-
-  std::ofstream file(abs_path, std::ios::binary | std::ios::trunc);
-  if (!file)
-    throw std::runtime_error("failed to create file");
+  bool partial      = offset > 0 || file_size >= RESUME_MIN_FILE_SIZE;
+  fs::path target   = partial ? partialPath(abs_path) : abs_path;
+  auto file         = std::make_shared<std::fstream>();
+  disk_.submit([file, target, offset] {
+    fs::create_directories(target.parent_path());
+    if (offset == 0) {
+      file->open(target, std::ios::binary | std::ios::out | std::ios::trunc);
+    } else {
+      // Past the verified blocks may be data of another version
+      fs::resize_file(target, offset);
+      file->open(target, std::ios::binary | std::ios::in | std::ios::out);
+      file->seekp(static_cast<std::streamoff>(offset));
+    }
+    if (!*file)
+      throw std::runtime_error("failed to create file");
+  });
+
+  co_await receiveChunks(file, file_size - offset);
+  // A failed write leaves neither a truncated copy nor the old one stamped
+  // with the new mtime, either could pass the next quick check as in sync
+  disk_.submit([file, target, abs_path, mtime] {
+    bool written = file->is_open() && *file;
+    file->close();
+    if (!written || !*file) {
+      std::error_code ec;
+      fs::remove(target, ec);
+      throw std::runtime_error("failed to write " + abs_path.string());
+    }
+    if (target != abs_path)
+      fs::rename(target, abs_path);
+    setMtime(abs_path, mtime);
+  });
+  if (rebuild_tree) {
+    co_await disk_.flush();
+    fstree::ScanOptions scan;
+    scan.hash_algorithm = tree.hash_algorithm;
+    tree = fstree::DirectoryTree(tree.root_path, scan);
+  }
+}
 
-  // Receive chunk
+// Reads chunks covering length bytes and queues writes of them to file,
+// in pooled slices of at most RECV_BUFFER_SIZE. Caller holds the receive
+// turn.
+asio::awaitable<void> Session::receiveChunks(std::shared_ptr<std::fstream> file,
+                                             uint64_t length) {
   uint64_t received = 0;
 
-  while (received < file_size) {
+  while (received < length) {
     uint32_t chunk_size_be = 0;
-    co_await asio::async_read(
-        socket_,
-        asio::buffer(&chunk_size_be, sizeof(chunk_size_be)),
-        asio::use_awaitable);
+    co_await read(asio::buffer(&chunk_size_be, sizeof(chunk_size_be)));
     uint32_t chunk_size = boost::endian::big_to_native(chunk_size_be);
 
-    if (chunk_size > MAX_FILE_CHUNK_SIZE || chunk_size == 0)
+    // Compressed chunk: raw length follows, inflated on the disk thread
+    if (chunk_size & compression::CHUNK_COMPRESSED) {
+      chunk_size &= ~compression::CHUNK_COMPRESSED;
+      uint32_t raw_size_be = 0;
+      co_await read(asio::buffer(&raw_size_be, sizeof(raw_size_be)));
+      uint32_t raw_size = boost::endian::big_to_native(raw_size_be);
+      if (chunk_size > MAX_FILE_CHUNK_SIZE || chunk_size == 0 ||
+          raw_size > MAX_FILE_CHUNK_SIZE || raw_size > length - received)
+        throw std::runtime_error("chunk too large");
+
+      auto buffer = co_await disk_.acquire(chunk_size);
+      co_await read(asio::buffer(buffer));
+
+      disk_.submit(
+          [this, file, raw_size, buffer = std::move(buffer)]() mutable {
+            std::vector<char> raw(raw_size);
+            compression::inflate(
+                buffer.data(), buffer.size(), raw.data(), raw_size);
+            disk_.release(std::move(buffer));
+            if (file->is_open())
+              file->write(raw.data(), raw.size());
+            if (!*file)
+              throw std::runtime_error("file write failed");
+          });
+      received += raw_size;
+      continue;
+    }
+
+    if (chunk_size > MAX_FILE_CHUNK_SIZE || chunk_size == 0 ||
+        chunk_size > length - received)
       throw std::runtime_error("chunk too large");
 
-    std::vector<char> buffer(chunk_size);
-    co_await asio::async_read(
-        socket_, asio::buffer(buffer), asio::use_awaitable);
-
-    file.write(buffer.data(), chunk_size);
-    if (!file)
-      throw std::runtime_error("file write failed");
+    for (uint32_t left = chunk_size; left > 0;) {
+      auto slice  = std::min<std::size_t>(left, RECV_BUFFER_SIZE);
+      auto buffer = co_await disk_.acquire(slice);
+      co_await read(asio::buffer(buffer));
+
+      disk_.submit([this, file, buffer = std::move(buffer)]() mutable {
+        if (file->is_open())
+          file->write(buffer.data(), buffer.size());
+        disk_.release(std::move(buffer));
+        if (!*file)
+          throw std::runtime_error("file write failed");
+      });
+      left -= slice;
+    }
 
     received += chunk_size;
   }
+}
+
+asio::awaitable<void> Session::flushWrites() {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(flushWrites());
 
-  file.close();
-  if (rebuild_tree)
-    tree = fstree::DirectoryTree(tree.root_path);
-  busy_.store(false);
+  co_await disk_.flush();
 }
 
-asio::awaitable<void> Session::sendHello(const HelloPacket& hello) {
-  // Ensure strand entry
-  co_await asio::dispatch(strand_, asio::use_awaitable);
+void Session::queueDiskJob(DiskWriter::Job job) {
+  // Behind every receive that has finished, those ran on strand_ too
+  asio::dispatch(strand_,
+                 [self = shared_from_this(), job = std::move(job)]() mutable {
+                   self->disk_.submit(std::move(job));
+                 });
+}
 
-  // If busy, wait by yielding into strand
-  while (busy_.exchange(true)) {
-    co_await asio::post(strand_, asio::use_awaitable);
-  }
+asio::awaitable<void> Session::sendHello(const HelloPacket& hello) {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendHello(hello));
 
   try {
     // Send header
     std::ostringstream header;
     fstree::wire::write_u64(header, hello.peer_id);
     fstree::wire::write_string(header, hello.hostname);
+    fstree::wire::write_u32(header, hello.listen_port);
+    fstree::wire::write_u8(header, hello.data_channel ? 1 : 0);
+    fstree::wire::write_u32(header, hello.features);
+    fstree::wire::write_u8(header, static_cast<uint8_t>(hello.hash));
+    local_features_ = hello.features;
+    updateFeatures();
 
     auto header_buf         = header.str();
     uint64_t header_size    = header_buf.size();
@@ -314,40 +1368,27 @@ asio::awaitable<void> Session::sendHello(const HelloPacket& hello) {
     //           << " peer_id=" << hello.peer_id << " hostname=" <<
     //           hello.hostname
     //           << "\n";
-    co_await asio::async_write(
-        socket_,
-        asio::buffer(&header_size_be, sizeof(header_size_be)),
-        asio::bind_executor(strand_, asio::use_awaitable));
-
-    co_await asio::async_write(
-        socket_,
-        asio::buffer(header_buf),
-        asio::bind_executor(strand_, asio::use_awaitable));
+    std::vector<uint8_t> frame;
+    appendBytes(frame, &header_size_be, sizeof(header_size_be));
+    appendBytes(frame, header_buf.data(), header_buf.size());
+    co_await send(std::move(frame));
   } catch (...) {
-    busy_.store(false);
     close();
     throw;
   }
 
-  busy_.store(false);
 }
 
 asio::awaitable<Session::HelloPacket> Session::receiveHello() {
-  // Ensure strand entry
-  co_await asio::dispatch(strand_, asio::use_awaitable);
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(receiveHello());
 
-  // If busy, wait by yielding into strand
-  while (busy_.exchange(true)) {
-    co_await asio::post(strand_, asio::use_awaitable);
-  }
+  auto turn = co_await receiveTurn();
 
   try {
     // Receive header
     uint64_t header_size_be;
-    co_await asio::async_read(
-        socket_,
-        asio::buffer(&header_size_be, sizeof(header_size_be)),
-        asio::bind_executor(strand_, asio::use_awaitable));
+    co_await read(asio::buffer(&header_size_be, sizeof(header_size_be)));
     auto header_size = boost::endian::big_to_native(header_size_be);
     if (header_size > 1024)
       throw std::runtime_error("hello packet too large");
@@ -356,266 +1397,1308 @@ asio::awaitable<Session::HelloPacket> Session::receiveHello() {
     // std::cerr << "receiveHello: header_size=" << header_size << "\n";
 
     std::vector<uint8_t> buffer(header_size);
-    co_await asio::async_read(
-        socket_,
-        asio::buffer(buffer),
-        asio::bind_executor(strand_, asio::use_awaitable));
+    co_await read(asio::buffer(buffer));
 
     std::istringstream is(std::string(buffer.begin(), buffer.end()),
                           std::ios::binary);
     HelloPacket hello;
     hello.peer_id  = fstree::wire::read_u64(is);
     hello.hostname = fstree::wire::read_string(is);
-
-    busy_.store(false);
+    // Optional trailing fields, absent from older peers
+    if (is.peek() != std::char_traits<char>::eof()) {
+      hello.listen_port  = static_cast<uint16_t>(fstree::wire::read_u32(is));
+      hello.data_channel = fstree::wire::read_u8(is) != 0;
+    }
+    if (is.peek() != std::char_traits<char>::eof())
+      hello.features = fstree::wire::read_u32(is);
+    if (is.peek() != std::char_traits<char>::eof())
+      hello.hash =
+          static_cast<fstree::HashAlgorithm>(fstree::wire::read_u8(is));
+    remote_features_ = hello.features;
+    remote_hash_     = hello.hash;
+    updateFeatures();
     co_return hello;
   } catch (...) {
-    busy_.store(false);
     close();
     throw;
   }
 }
 
+void Session::updateFeatures() {
+  uint32_t shared = local_features_ & remote_features_;
+  compress_        = (shared & compression::FEATURE_DEFLATE) != 0;
+  tree_format_     = (shared & FEATURE_COMPACT_TREE)
+                         ? fstree::TreeFormat::Compact
+                         : fstree::TreeFormat::Legacy;
+  lazy_ = (shared & FEATURE_LAZY_TREE) && (shared & FEATURE_COMPACT_TREE);
+}
+
 asio::awaitable<void> Session::sendPacketType(PacketType pt) {
-  uint8_t tag = static_cast<uint8_t>(pt);
-  co_await asio::async_write(socket_,
-                             asio::buffer(&tag, 1),
-                             asio::bind_executor(strand_, asio::use_awaitable));
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendPacketType(pt));
+
+  try {
+    std::vector<uint8_t> frame(1, static_cast<uint8_t>(pt));
+    co_await send(std::move(frame));
+  } catch (...) {
+    close();
+    throw;
+  }
 }
 
 asio::awaitable<Session::PacketType> Session::receivePacketType() {
-  uint8_t tag = 0;
-  co_await asio::async_read(socket_,
-                            asio::buffer(&tag, 1),
-                            asio::bind_executor(strand_, asio::use_awaitable));
-  co_return static_cast<PacketType>(tag);
-}
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(receivePacketType());
 
-asio::awaitable<void> Session::sendTreeRequest() {
-  co_await asio::dispatch(strand_, asio::use_awaitable);
-  while (busy_.exchange(true))
-    co_await asio::post(strand_, asio::use_awaitable);
+  auto turn = co_await receiveTurn();
   try {
-    co_await sendPacketType(PacketType::TreeRequest);
+    uint8_t tag = 0;
+    co_await read(asio::buffer(&tag, 1), false);  // idle between packets
+    co_return static_cast<PacketType>(tag);
   } catch (...) {
-    busy_.store(false);
     close();
     throw;
   }
-  busy_.store(false);
+}
+
+asio::awaitable<void> Session::sendTreeRequest() {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendTreeRequest());
+
+  co_await sendPacketType(PacketType::TreeRequest);
 }
 
 asio::awaitable<bool> Session::receiveTreeRequest() {
-  co_await asio::dispatch(strand_, asio::use_awaitable);
-  while (busy_.exchange(true))
-    co_await asio::post(strand_, asio::use_awaitable);
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(receiveTreeRequest());
+
+  auto turn = co_await receiveTurn();
   try {
-    auto pt = co_await receivePacketType();
-    busy_.store(false);
-    co_return (pt == PacketType::TreeRequest);
+    uint8_t tag = 0;
+    co_await read(asio::buffer(&tag, 1));
+    co_return static_cast<PacketType>(tag) == PacketType::TreeRequest;
   } catch (...) {
-    busy_.store(false);
     close();
     throw;
   }
 }
 
 asio::awaitable<void> Session::sendTaggedFile(const fstree::DirectoryTree& tree,
-                                              const fstree::Node& node) {
-  // Tag byte first, then the existing sendFile payload.
-  // sendFile acquires busy_ itself, so we just prepend the tag here
-  // while we own the strand exclusively via sendFile's locking.
-  // Simplest correct approach: send tag then call sendFile (both acquire busy_
-  // sequentially — safe because we are the only writer at this point).
-  co_await asio::dispatch(strand_, asio::use_awaitable);
-  while (busy_.exchange(true))
-    co_await asio::post(strand_, asio::use_awaitable);
+                                              const fstree::Node& node,
+                                              uint64_t offset) {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendTaggedFile(tree, node, offset));
+
+  // Tag byte first, then the same payload as sendFile(). A peer that can't
+  // resume gets the whole file.
+  if (!supports(FEATURE_RESUME))
+    offset = 0;
   try {
-    co_await sendPacketType(PacketType::FileData);
+    auto claim     = co_await claimSocket();
+    auto file_size = std::get<fstree::FileMeta>(node.data).size;
+    if (offset > file_size)
+      throw std::runtime_error("invalid resume offset");
+    co_await streamFile(
+        std::string(1, static_cast<char>(PacketType::FileData)) +
+            fileDataPrefix(node, offset),
+        tree.root_path / node.path,
+        offset,
+        file_size - offset,
+        0);
   } catch (...) {
-    busy_.store(false);
     close();
     throw;
   }
-  busy_.store(false);
-  co_await sendFile(tree, node);
 }
 
-asio::awaitable<void> Session::sendDeleteNotice(
-    const std::filesystem::path& rel_path) {
-  co_await asio::dispatch(strand_, asio::use_awaitable);
-  while (busy_.exchange(true))
-    co_await asio::post(strand_, asio::use_awaitable);
+asio::awaitable<void> Session::sendFileRange(const fstree::DirectoryTree& tree,
+                                             const fstree::Node& node,
+                                             uint64_t offset,
+                                             uint64_t length) {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendFileRange(tree, node, offset, length));
+
   try {
-    std::ostringstream os;
-    fstree::wire::write_string(os, rel_path.generic_string());
-    auto buf       = os.str();
-    uint64_t sz_be = boost::endian::native_to_big(buf.size());
+    auto claim     = co_await claimSocket();
+    auto file_size = std::get<fstree::FileMeta>(node.data).size;
+    if (offset > file_size || length > file_size - offset)
+      throw std::runtime_error("invalid file range");
 
-    uint8_t tag = static_cast<uint8_t>(PacketType::DeleteFile);
-    std::vector<asio::const_buffer> buffers{
-        asio::buffer(&tag, 1),
-        asio::buffer(&sz_be, sizeof(sz_be)),
-        asio::buffer(buf),
-    };
-    co_await asio::async_write(
-        socket_, buffers, asio::bind_executor(strand_, asio::use_awaitable));
+    // Tag + u64 header size + header, then chunks like FileData
+    std::ostringstream header;
+    fstree::wire::write_string(header, node.path.generic_string());
+    fstree::wire::write_u64(header, file_size);
+    fstree::wire::write_u64(header, offset);
+    fstree::wire::write_u64(header, length);
+
+    auto header_buf         = header.str();
+    uint64_t header_size_be = boost::endian::native_to_big(
+        static_cast<uint64_t>(header_buf.size()));
+    std::string prefix(1, static_cast<char>(PacketType::FileRange));
+    prefix.append(reinterpret_cast<const char*>(&header_size_be),
+                  sizeof(header_size_be));
+    prefix += header_buf;
+
+    co_await streamFile(prefix, tree.root_path / node.path, offset, length, 0);
+  } catch (...) {
+    close();
+    throw;
+  }
+}
+
+asio::awaitable<bool> Session::receiveFileRange(fstree::DirectoryTree& tree) {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(receiveFileRange(tree));
+
+  // The FileRange tag byte has already been consumed by receivePacketType().
+  auto turn = co_await receiveTurn();
+  try {
+    uint64_t hdr_size_be = 0;
+    co_await read(asio::buffer(&hdr_size_be, sizeof(hdr_size_be)));
+    uint64_t hdr_size = boost::endian::big_to_native(hdr_size_be);
+    if (hdr_size > MAX_FILE_CHUNK_SIZE)
+      throw std::runtime_error("header too large");
+
+    std::vector<uint8_t> hdr_buf(hdr_size);
+    co_await read(asio::buffer(hdr_buf));
+
+    std::istringstream hdr_stream(std::string(hdr_buf.begin(), hdr_buf.end()));
+    fs::path rel_path  = fstree::wire::read_string(hdr_stream);
+    uint64_t file_size = fstree::wire::read_u64(hdr_stream);
+    uint64_t offset    = fstree::wire::read_u64(hdr_stream);
+    uint64_t length    = fstree::wire::read_u64(hdr_stream);
+    if (!hdr_stream || offset > file_size || length > file_size - offset)
+      throw std::runtime_error("invalid file range");
+
+    // Other ranges of the file may be written concurrently by other
+    // sessions: create the partial file without truncating, size it, then
+    // write in place. FileComplete moves it into place.
+    auto target = partialPath(tree.root_path / rel_path);
+    auto file   = std::make_shared<std::fstream>();
+    disk_.submit([file, target, file_size, offset] {
+      fs::create_directories(target.parent_path());
+      std::ofstream(target, std::ios::binary | std::ios::app);
+      if (fs::file_size(target) != file_size)
+        fs::resize_file(target, file_size);
+      file->open(target, std::ios::binary | std::ios::in | std::ios::out);
+      if (!*file)
+        throw std::runtime_error("failed to open file");
+      file->seekp(static_cast<std::streamoff>(offset));
+    });
+
+    co_await receiveChunks(file, length);
+    disk_.submit([file] { file->close(); });
+
+    co_return offset + length == file_size;
+  } catch (...) {
+    close();
+    throw;
+  }
+}
+
+asio::awaitable<void> Session::receiveCopyFile(fstree::DirectoryTree& tree) {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(receiveCopyFile(tree));
+
+  co_await receiveLocalFile(tree, false);
+}
+
+asio::awaitable<void> Session::receiveMoveFile(fstree::DirectoryTree& tree) {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(receiveMoveFile(tree));
+
+  co_await receiveLocalFile(tree, true);
+}
+
+asio::awaitable<void> Session::receiveLocalFile(fstree::DirectoryTree& tree,
+                                                bool move) {
+  // The tag byte has already been consumed by receivePacketType().
+  auto turn = co_await receiveTurn();
+  try {
+    auto buf = co_await receiveSizedPayload("file header");
+    std::istringstream is(std::string(buf.begin(), buf.end()),
+                          std::ios::binary);
+    fs::path from = fstree::wire::read_string(is);
+    fs::path to   = fstree::wire::read_string(is);
+    auto mtime    = readMtime(is);
+    if (!is)
+      throw std::runtime_error("malformed file header");
+
+    // Behind the writes queued so far, which include a source sent earlier
+    // in the sync
+    disk_.submit([from = tree.root_path / from,
+                  to   = tree.root_path / to,
+                  mtime,
+                  move] {
+      std::error_code ec;
+      fs::create_directories(to.parent_path(), ec);
+      if (move) {
+        fs::rename(from, to, ec);
+      } else {
+        auto part = partialPath(to);
+        if (!cloneFile(from, part)) {
+          fs::remove(part, ec);
+          return;  // the next sync sends it
+        }
+        fs::rename(part, to, ec);
+      }
+      if (!ec)
+        setMtime(to, mtime);
+    });
+  } catch (...) {
+    close();
+    throw;
+  }
+}
+
+asio::awaitable<void> Session::sendFileComplete(const fstree::Node& node) {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendFileComplete(node));
+
+  try {
+    std::vector<uint8_t> frame;
+    appendMtimeFrame(frame, PacketType::FileComplete, node);
+    co_await send(std::move(frame));
+  } catch (...) {
+    close();
+    throw;
+  }
+}
+
+asio::awaitable<void> Session::receiveFileComplete(
+    fstree::DirectoryTree& tree) {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(receiveFileComplete(tree));
+
+  // The FileComplete tag byte has already been consumed by
+  // receivePacketType().
+  auto turn = co_await receiveTurn();
+  try {
+    auto buf = co_await receiveSizedPayload("file header");
+    std::istringstream is(std::string(buf.begin(), buf.end()),
+                          std::ios::binary);
+    fs::path rel_path = fstree::wire::read_string(is);
+    auto mtime        = readMtime(is);
+    if (!is)
+      throw std::runtime_error("malformed file header");
+
+    // The data channels have flushed their ranges before the sender got
+    // here, ours are queued ahead of this
+    disk_.submit([abs_path = tree.root_path / rel_path, mtime] {
+      fs::rename(partialPath(abs_path), abs_path);
+      setMtime(abs_path, mtime);
+    });
+  } catch (...) {
+    close();
+    throw;
+  }
+}
+
+asio::awaitable<void> Session::receiveSetMtime(fstree::DirectoryTree& tree) {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(receiveSetMtime(tree));
+
+  // The SetMtime tag byte has already been consumed by receivePacketType().
+  auto turn = co_await receiveTurn();
+  try {
+    auto buf = co_await receiveSizedPayload("file header");
+    std::istringstream is(std::string(buf.begin(), buf.end()),
+                          std::ios::binary);
+    fs::path rel_path = fstree::wire::read_string(is);
+    auto mtime        = readMtime(is);
+    if (!is)
+      throw std::runtime_error("malformed file header");
+
+    disk_.submit([abs_path = tree.root_path / rel_path, mtime] {
+      setMtime(abs_path, mtime);
+    });
   } catch (...) {
-    busy_.store(false);
     close();
     throw;
   }
-  busy_.store(false);
+}
+
+asio::awaitable<void> Session::sendDeleteNotice(
+    const std::filesystem::path& rel_path) {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendDeleteNotice(rel_path));
+
+  co_await sendTaggedPath(PacketType::DeleteFile, rel_path);
 }
 
 asio::awaitable<void> Session::sendCreateDir(
     const std::filesystem::path& rel_path) {
-  co_await asio::dispatch(strand_, asio::use_awaitable);
-  while (busy_.exchange(true))
-    co_await asio::post(strand_, asio::use_awaitable);
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendCreateDir(rel_path));
+
+  co_await sendTaggedPath(PacketType::CreateDir, rel_path);
+}
+
+// Tag + u64 length + path string; read back with receiveRelPath()
+asio::awaitable<void> Session::sendTaggedPath(
+    PacketType pt,
+    const std::filesystem::path& rel_path) {
   try {
-    std::ostringstream os;
-    fstree::wire::write_string(os, rel_path.generic_string());
-    auto buf       = os.str();
-    uint64_t sz_be = boost::endian::native_to_big(buf.size());
-    uint8_t tag    = static_cast<uint8_t>(PacketType::CreateDir);
-    std::vector<asio::const_buffer> buffers{
-        asio::buffer(&tag, 1),
-        asio::buffer(&sz_be, sizeof(sz_be)),
-        asio::buffer(buf),
-    };
-    co_await asio::async_write(
-        socket_, buffers, asio::bind_executor(strand_, asio::use_awaitable));
+    std::vector<uint8_t> frame;
+    appendPathFrame(frame, pt, rel_path);
+    co_await send(std::move(frame));
   } catch (...) {
-    busy_.store(false);
     close();
     throw;
   }
-  busy_.store(false);
 }
 
-asio::awaitable<void> Session::sendSyncDone() {
-  co_await asio::dispatch(strand_, asio::use_awaitable);
-  while (busy_.exchange(true))
-    co_await asio::post(strand_, asio::use_awaitable);
+asio::awaitable<void> Session::sendSyncOps(const fstree::DirectoryTree& tree,
+                                           const std::vector<SyncOp>& ops,
+                                           fstree::ThreadPool& read_pool,
+                                           const TransferOptions& options) {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendSyncOps(tree, ops, read_pool, options));
+
+  auto is_small = [&](const SyncOp& op) {
+    return op.kind == SyncOp::Kind::File && op.offset == 0 &&
+           fileSize(op) <= options.small_file_size;
+  };
+  std::size_t bundle_size =
+      std::min<std::size_t>(options.bundle_size, MAX_FILE_CHUNK_SIZE / 2);
+  uint64_t bundle_file_size =
+      supports(FEATURE_FILE_BUNDLE) ? options.bundle_file_size : 0;
+
+  // Small files are read on the pool up to read_ahead ahead of the one
+  // being sent, in op order
+  std::deque<std::shared_ptr<PendingRead>> reads;
+  std::size_t next_read = 0;
+  auto schedule = [&] {
+    while (reads.size() < options.read_ahead && next_read < ops.size()) {
+      const auto& op = ops[next_read++];
+      if (!is_small(op))
+        continue;
+
+      auto read = std::make_shared<PendingRead>(strand_);
+      reads.push_back(read);
+      read_pool.submit([read,
+                        cache     = cache_,
+                        file_path = tree.root_path / op.node->path] {
+        try {
+          auto key = cache ? ChunkCache::identify(file_path) : std::nullopt;
+          if (key) {
+            key->length  = key->size;
+            read->shared = cache->get(*key, [&] { return readFile(file_path); });
+          } else {
+            read->data = readFile(file_path);
+          }
+        } catch (...) {
+          read->error = std::current_exception();
+        }
+        PendingRead::finish(read);
+      });
+    }
+  };
+
+  // Consecutive files up to bundle_file_size share a FileBundle, anything
+  // else closes the open bundle first so ops stay in order
+  std::vector<uint8_t> batch;
+  int level = compress_ ? level_.level() : 0;
+  BundleBuilder bundle(level);
+  for (const auto& op : ops) {
+    schedule();
+
+    if (is_small(op)) {
+      auto read = reads.front();
+      reads.pop_front();
+      // Put what we have on the wire while the read finishes
+      if (!read->done && (!batch.empty() || !bundle.empty())) {
+        bundle.flushInto(batch);
+        co_await send(std::move(batch));
+        batch.clear();
+      }
+      co_await read->wait();
+      if (read->error) {
+        close();
+        std::rethrow_exception(read->error);
+      }
+
+      const auto& data = read->bytes();
+      if (data.size() <= bundle_file_size) {
+        bundle.add(op.node->path, op.node->mtime, data);
+        if (bundle.size() >= bundle_size)
+          bundle.flushInto(batch);
+      } else {
+        bundle.flushInto(batch);
+        appendFileFrame(batch,
+                        op.node->path,
+                        op.node->mtime,
+                        data,
+                        compression::compressibleName(op.node->path) ? level
+                                                                     : 0);
+      }
+
+    } else if (op.kind == SyncOp::Kind::File ||
+               ((op.kind == SyncOp::Kind::Copy ||
+                 op.kind == SyncOp::Kind::Move) &&
+                !supports(FEATURE_LOCAL_COPY))) {
+      // A peer without CopyFile and MoveFile gets those files in full
+      bundle.flushInto(batch);
+      if (!batch.empty()) {
+        co_await send(std::move(batch));
+        batch.clear();
+      }
+      co_await sendTaggedFile(tree, *op.node, op.offset);
+
+    } else if (op.kind == SyncOp::Kind::Mtime) {
+      // Only an mtime, the requester keeps its own without SetMtime
+      bundle.flushInto(batch);
+      if (supports(FEATURE_FILE_HASHES))
+        appendMtimeFrame(batch, PacketType::SetMtime, *op.node);
+
+    } else if (op.kind == SyncOp::Kind::Copy ||
+               op.kind == SyncOp::Kind::Move) {
+      bundle.flushInto(batch);
+      appendLocalFileFrame(batch,
+                           op.kind == SyncOp::Kind::Copy ? PacketType::CopyFile
+                                                         : PacketType::MoveFile,
+                           op.path,
+                           *op.node);
+
+    } else {
+      bundle.flushInto(batch);
+      appendPathFrame(batch,
+                      op.kind == SyncOp::Kind::Delete ? PacketType::DeleteFile
+                                                      : PacketType::CreateDir,
+                      op.path);
+    }
+
+    if (batch.size() >= options.batch_size) {
+      co_await send(std::move(batch));
+      batch.clear();
+    }
+  }
+  bundle.flushInto(batch);
+  if (!batch.empty())
+    co_await send(std::move(batch));
+}
+
+asio::awaitable<uint32_t> Session::receiveFileBundle(
+    fstree::DirectoryTree& tree) {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(receiveFileBundle(tree));
+
+  // The FileBundle tag byte has already been consumed by receivePacketType().
+  auto turn = co_await receiveTurn();
   try {
-    co_await sendPacketType(PacketType::SyncDone);
+    uint64_t sz_be = 0;
+    co_await read(asio::buffer(&sz_be, sizeof(sz_be)));
+    uint64_t sz       = boost::endian::big_to_native(sz_be);
+    bool compressed   = sz & compression::PAYLOAD_COMPRESSED;
+    uint64_t raw_size = sz & ~compression::PAYLOAD_COMPRESSED;
+    if (compressed) {
+      sz = raw_size;
+      uint64_t raw_be = 0;
+      co_await read(asio::buffer(&raw_be, sizeof(raw_be)));
+      raw_size = boost::endian::big_to_native(raw_be);
+    }
+    if (sz > MAX_FILE_CHUNK_SIZE || raw_size > MAX_FILE_CHUNK_SIZE)
+      throw std::runtime_error("bundle too large");
+
+    auto payload = co_await disk_.acquire(raw_size);
+    if (compressed) {
+      packed_.resize(sz);
+      co_await read(asio::buffer(packed_));
+      compression::inflate(packed_.data(), sz, payload.data(), raw_size);
+    } else {
+      co_await read(asio::buffer(payload));
+    }
+    sz = raw_size;
+
+    // Only the count is needed here, the files are unpacked on the disk
+    // thread
+    std::istringstream count_stream(
+        std::string(payload.data(), std::min<std::size_t>(sz, 4)));
+    uint32_t count = fstree::wire::read_u32(count_stream);
+    if (!count_stream)
+      throw std::runtime_error("malformed bundle");
+
+    disk_.submit([this,
+                  root    = tree.root_path,
+                  payload = std::move(payload)]() mutable {
+      std::istringstream is(std::string(payload.data(), payload.size()),
+                            std::ios::binary);
+      disk_.release(std::move(payload));
+
+      uint32_t n = fstree::wire::read_u32(is);
+      std::vector<char> data;
+      std::vector<fs::path> written;
+      for (uint32_t i = 0; i < n; ++i) {
+        fs::path rel_path  = fstree::wire::read_string(is);
+        uint64_t file_size = fstree::wire::read_u64(is);
+        if (!is || file_size > MAX_FILE_CHUNK_SIZE)
+          throw std::runtime_error("malformed bundle");
+        data.resize(file_size);
+        is.read(data.data(), file_size);
+        if (!is)
+          throw std::runtime_error("malformed bundle");
+
+        fs::path abs_path = root / rel_path;
+        fs::create_directories(abs_path.parent_path());
+        std::ofstream file(abs_path, std::ios::binary | std::ios::trunc);
+        if (!file)
+          throw std::runtime_error("failed to create file");
+        file.write(data.data(), data.size());
+        if (!file)
+          throw std::runtime_error("file write failed");
+        file.close();
+        written.push_back(std::move(abs_path));
+      }
+      for (const auto& path : written)
+        setMtime(path, readMtime(is));
+    });
+
+    co_return count;
   } catch (...) {
-    busy_.store(false);
     close();
     throw;
   }
-  busy_.store(false);
+}
+
+asio::awaitable<void> Session::sendSyncDone() {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendSyncDone());
+
+  co_await sendPacketType(PacketType::SyncDone);
 }
 
 asio::awaitable<void> Session::sendSyncHeader(uint32_t total_ops) {
-  co_await asio::dispatch(strand_, asio::use_awaitable);
-  while (busy_.exchange(true))
-    co_await asio::post(strand_, asio::use_awaitable);
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendSyncHeader(total_ops));
+
   try {
-    uint8_t tag = static_cast<uint8_t>(PacketType::SyncHeader);
+    std::vector<uint8_t> frame(1,
+                               static_cast<uint8_t>(PacketType::SyncHeader));
     uint32_t be = boost::endian::native_to_big(total_ops);
-    std::vector<asio::const_buffer> bufs{
-        asio::buffer(&tag, 1),
-        asio::buffer(&be, sizeof(be)),
-    };
-    co_await asio::async_write(
-        socket_, bufs, asio::bind_executor(strand_, asio::use_awaitable));
+    appendBytes(frame, &be, sizeof(be));
+    co_await send(std::move(frame));
   } catch (...) {
-    busy_.store(false);
     close();
     throw;
   }
-  busy_.store(false);
 }
 
 asio::awaitable<uint32_t> Session::receiveSyncHeader() {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(receiveSyncHeader());
+
   // The SyncHeader tag byte has already been consumed by receivePacketType().
   // We only need to read the 4-byte operation count.
-  co_await asio::dispatch(strand_, asio::use_awaitable);
-  while (busy_.exchange(true))
-    co_await asio::post(strand_, asio::use_awaitable);
+  auto turn = co_await receiveTurn();
   try {
     uint32_t be = 0;
-    co_await asio::async_read(
-        socket_,
-        asio::buffer(&be, sizeof(be)),
-        asio::bind_executor(strand_, asio::use_awaitable));
-    busy_.store(false);
+    co_await read(asio::buffer(&be, sizeof(be)));
     co_return boost::endian::big_to_native(be);
   } catch (...) {
-    busy_.store(false);
     close();
     throw;
   }
 }
 
 asio::awaitable<std::filesystem::path> Session::receiveRelPath() {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(receiveRelPath());
+
   // Called from the listener after consuming a DeleteFile tag.
-  // Acquires busy_ independently.
-  co_await asio::dispatch(strand_, asio::use_awaitable);
-  while (busy_.exchange(true))
-    co_await asio::post(strand_, asio::use_awaitable);
+  auto turn = co_await receiveTurn();
   try {
     uint64_t sz_be = 0;
-    co_await asio::async_read(
-        socket_,
-        asio::buffer(&sz_be, sizeof(sz_be)),
-        asio::bind_executor(strand_, asio::use_awaitable));
+    co_await read(asio::buffer(&sz_be, sizeof(sz_be)));
     uint64_t sz = boost::endian::big_to_native(sz_be);
     if (sz > 4096)
       throw std::runtime_error("path too long");
 
     std::vector<uint8_t> buf(sz);
-    co_await asio::async_read(
-        socket_,
-        asio::buffer(buf),
-        asio::bind_executor(strand_, asio::use_awaitable));
+    co_await read(asio::buffer(buf));
 
     std::istringstream is(std::string(buf.begin(), buf.end()));
     auto path_str = fstree::wire::read_string(is);
 
-    busy_.store(false);
     co_return std::filesystem::path(path_str);
   } catch (...) {
-    busy_.store(false);
     close();
     throw;
   }
 }
 
 asio::awaitable<void> Session::sendDisconnectRequest() {
-  co_await asio::dispatch(strand_, asio::use_awaitable);
-  while (busy_.exchange(true))
-    co_await asio::post(strand_, asio::use_awaitable);
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendDisconnectRequest());
+
+  co_await sendPacketType(PacketType::DisconnectRequest);
+}
+
+asio::awaitable<void> Session::sendSignatureRequest(
+    const std::filesystem::path& rel_path) {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendSignatureRequest(rel_path));
+
+  co_await sendTaggedPath(PacketType::SignatureRequest, rel_path);
+}
+
+asio::awaitable<void> Session::sendSignature(
+    const fstree::rsync::Signature& sig) {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendSignature(sig));
+
+  try {
+    std::ostringstream os;
+    fstree::wire::write_u64(os, sig.file_size);
+    fstree::wire::write_u32(os, sig.block_size);
+    fstree::wire::write_u32(os, static_cast<uint32_t>(sig.blocks.size()));
+    for (const auto& block : sig.blocks) {
+      fstree::wire::write_u32(os, block.weak);
+      os.write(reinterpret_cast<const char*>(block.strong.data()),
+               block.strong.size());
+    }
+
+    auto buf       = os.str();
+    uint64_t sz_be = boost::endian::native_to_big(buf.size());
+    std::vector<uint8_t> frame(1,
+                               static_cast<uint8_t>(PacketType::Signature));
+    appendBytes(frame, &sz_be, sizeof(sz_be));
+    appendBytes(frame, buf.data(), buf.size());
+    co_await send(std::move(frame));
+  } catch (...) {
+    close();
+    throw;
+  }
+}
+
+asio::awaitable<fstree::rsync::Signature> Session::receiveSignature() {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(receiveSignature());
+
+  // The Signature tag byte has already been consumed by receivePacketType().
+  auto turn = co_await receiveTurn();
+  try {
+    uint64_t sz_be = 0;
+    co_await read(asio::buffer(&sz_be, sizeof(sz_be)));
+    uint64_t sz = boost::endian::big_to_native(sz_be);
+    if (sz > MAX_TREE_SIZE)
+      throw std::runtime_error("signature too large");
+
+    std::vector<uint8_t> buf(sz);
+    co_await read(asio::buffer(buf));
+
+    std::istringstream is(std::string(buf.begin(), buf.end()),
+                          std::ios::binary);
+    fstree::rsync::Signature sig;
+    sig.file_size  = fstree::wire::read_u64(is);
+    sig.block_size = fstree::wire::read_u32(is);
+    uint32_t count = fstree::wire::read_u32(is);
+    if (count > sz / sizeof(uint32_t))
+      throw std::runtime_error("malformed signature");
+
+    sig.blocks.resize(count);
+    for (auto& block : sig.blocks) {
+      block.weak = fstree::wire::read_u32(is);
+      is.read(reinterpret_cast<char*>(block.strong.data()),
+              block.strong.size());
+    }
+    if (!is)
+      throw std::runtime_error("malformed signature");
+
+    co_return sig;
+  } catch (...) {
+    close();
+    throw;
+  }
+}
+
+// Caller holds the receive turn
+asio::awaitable<std::vector<uint8_t>> Session::receiveSizedPayload(
+    const char* what) {
+  uint64_t sz_be = 0;
+  co_await read(asio::buffer(&sz_be, sizeof(sz_be)));
+  uint64_t sz = boost::endian::big_to_native(sz_be);
+  if (sz > MAX_TREE_SIZE)
+    throw std::runtime_error(std::string(what) + " too large");
+
+  std::vector<uint8_t> buf(sz);
+  co_await read(asio::buffer(buf));
+  co_return buf;
+}
+
+// HashRequest and ResumeRequest payload: u32 count + a path string each
+asio::awaitable<void> Session::sendPathList(
+    PacketType pt,
+    const std::vector<std::filesystem::path>& rel_paths) {
+  try {
+    std::ostringstream os;
+    fstree::wire::write_u32(os, static_cast<uint32_t>(rel_paths.size()));
+    for (const auto& rel_path : rel_paths)
+      fstree::wire::write_string(os, rel_path.generic_string());
+    co_await send(sizedFrame(pt, os.str()));
+  } catch (...) {
+    close();
+    throw;
+  }
+}
+
+asio::awaitable<std::vector<std::filesystem::path>>
+Session::receivePathList() {
+  // The tag byte has already been consumed by receivePacketType().
+  auto turn = co_await receiveTurn();
+  try {
+    auto buf = co_await receiveSizedPayload("path list");
+    std::istringstream is(std::string(buf.begin(), buf.end()),
+                          std::ios::binary);
+    uint32_t count = fstree::wire::read_u32(is);
+    if (count > buf.size() / sizeof(uint32_t))
+      throw std::runtime_error("malformed path list");
+
+    std::vector<std::filesystem::path> rel_paths;
+    rel_paths.reserve(count);
+    for (uint32_t i = 0; i < count; ++i)
+      rel_paths.emplace_back(fstree::wire::read_string(is));
+    if (!is)
+      throw std::runtime_error("malformed path list");
+
+    co_return rel_paths;
+  } catch (...) {
+    close();
+    throw;
+  }
+}
+
+asio::awaitable<void> Session::sendHashRequest(
+    const std::vector<std::filesystem::path>& rel_paths) {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendHashRequest(rel_paths));
+
+  co_await sendPathList(PacketType::HashRequest, rel_paths);
+}
+
+asio::awaitable<std::vector<std::filesystem::path>>
+Session::receiveHashRequest() {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(receiveHashRequest());
+
+  co_return co_await receivePathList();
+}
+
+// Hashes payload: u32 count + per path a u8 flag, followed by the 32 byte
+// hash when set
+asio::awaitable<void> Session::sendHashes(
+    const std::vector<std::optional<fstree::Hash>>& hashes) {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendHashes(hashes));
+
+  try {
+    std::ostringstream os;
+    fstree::wire::write_u32(os, static_cast<uint32_t>(hashes.size()));
+    for (const auto& hash : hashes) {
+      fstree::wire::write_u8(os, hash ? 1 : 0);
+      if (hash)
+        os.write(reinterpret_cast<const char*>(hash->data()), hash->size());
+    }
+    co_await send(sizedFrame(PacketType::Hashes, os.str()));
+  } catch (...) {
+    close();
+    throw;
+  }
+}
+
+asio::awaitable<std::vector<std::optional<fstree::Hash>>>
+Session::receiveHashes() {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(receiveHashes());
+
+  // The Hashes tag byte has already been consumed by receivePacketType().
+  auto turn = co_await receiveTurn();
+  try {
+    auto buf = co_await receiveSizedPayload("hashes");
+    std::istringstream is(std::string(buf.begin(), buf.end()),
+                          std::ios::binary);
+    uint32_t count = fstree::wire::read_u32(is);
+    if (count > buf.size())
+      throw std::runtime_error("malformed hashes");
+
+    std::vector<std::optional<fstree::Hash>> hashes(count);
+    for (auto& hash : hashes) {
+      if (fstree::wire::read_u8(is) == 0)
+        continue;
+      hash.emplace();
+      is.read(reinterpret_cast<char*>(hash->data()), hash->size());
+    }
+    if (!is)
+      throw std::runtime_error("malformed hashes");
+
+    co_return hashes;
+  } catch (...) {
+    close();
+    throw;
+  }
+}
+
+asio::awaitable<void> Session::sendResumeRequest(
+    const std::vector<std::filesystem::path>& rel_paths) {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendResumeRequest(rel_paths));
+
+  co_await sendPathList(PacketType::ResumeRequest, rel_paths);
+}
+
+asio::awaitable<std::vector<std::filesystem::path>>
+Session::receiveResumeRequest() {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(receiveResumeRequest());
+
+  co_return co_await receivePathList();
+}
+
+// ResumeState payload: u32 count + per path a u32 block count and that many
+// 32 byte hashes
+asio::awaitable<void> Session::sendResumeState(
+    const std::vector<std::vector<fstree::Hash>>& partials) {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendResumeState(partials));
+
+  try {
+    std::ostringstream os;
+    fstree::wire::write_u32(os, static_cast<uint32_t>(partials.size()));
+    for (const auto& blocks : partials) {
+      fstree::wire::write_u32(os, static_cast<uint32_t>(blocks.size()));
+      for (const auto& hash : blocks)
+        os.write(reinterpret_cast<const char*>(hash.data()), hash.size());
+    }
+    co_await send(sizedFrame(PacketType::ResumeState, os.str()));
+  } catch (...) {
+    close();
+    throw;
+  }
+}
+
+asio::awaitable<std::vector<std::vector<fstree::Hash>>>
+Session::receiveResumeState() {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(receiveResumeState());
+
+  // The ResumeState tag byte has already been consumed by receivePacketType().
+  auto turn = co_await receiveTurn();
+  try {
+    auto buf = co_await receiveSizedPayload("resume state");
+    std::istringstream is(std::string(buf.begin(), buf.end()),
+                          std::ios::binary);
+    uint32_t count = fstree::wire::read_u32(is);
+    if (count > buf.size() / sizeof(uint32_t))
+      throw std::runtime_error("malformed resume state");
+
+    std::vector<std::vector<fstree::Hash>> partials(count);
+    for (auto& blocks : partials) {
+      uint32_t n = fstree::wire::read_u32(is);
+      if (!is || n > buf.size() / sizeof(fstree::Hash))
+        throw std::runtime_error("malformed resume state");
+      blocks.resize(n);
+      for (auto& hash : blocks)
+        is.read(reinterpret_cast<char*>(hash.data()), hash.size());
+    }
+    if (!is)
+      throw std::runtime_error("malformed resume state");
+
+    co_return partials;
+  } catch (...) {
+    close();
+    throw;
+  }
+}
+
+asio::awaitable<void> Session::sendSubtreeRequest(
+    const std::vector<std::filesystem::path>& rel_paths) {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendSubtreeRequest(rel_paths));
+
+  co_await sendPathList(PacketType::SubtreeRequest, rel_paths);
+}
+
+asio::awaitable<std::vector<std::filesystem::path>>
+Session::receiveSubtreeRequest() {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(receiveSubtreeRequest());
+
+  co_return co_await receivePathList();
+}
+
+// Subtrees payload: a tree payload (compressed like one) holding
+// fstree::serializeSubtrees()
+asio::awaitable<void> Session::sendSubtrees(
+    const fstree::DirectoryTree& tree,
+    const std::vector<std::filesystem::path>& rel_paths) {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendSubtrees(tree, rel_paths));
+
+  try {
+    auto payload = fstree::serializeSubtrees(tree, rel_paths, SUBTREE_DEPTH);
+    co_await sendTreePayload(PacketType::Subtrees, std::move(payload));
+  } catch (...) {
+    close();
+    throw;
+  }
+}
+
+asio::awaitable<std::vector<fstree::Subtree>> Session::receiveSubtrees() {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(receiveSubtrees());
+
+  // The Subtrees tag byte has already been consumed by receivePacketType().
+  auto turn = co_await receiveTurn();
   try {
-    co_await sendPacketType(PacketType::DisconnectRequest);
+    co_await readTreePayload();
+    co_return fstree::deserializeSubtrees(buffer_);
   } catch (...) {
-    busy_.store(false);
     close();
     throw;
   }
-  busy_.store(false);
+}
+
+asio::awaitable<void> Session::sendFileDelta(
+    const fstree::DirectoryTree& tree,
+    const fstree::Node& node,
+    const fstree::rsync::Signature& sig) {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendFileDelta(tree, node, sig));
+
+  try {
+    auto claim         = co_await claimSocket();
+    fs::path file_path = tree.root_path / node.path;
+    auto file_size     = std::get<fstree::FileMeta>(node.data).size;
+    fstree::rsync::DeltaEncoder encoder(file_path, sig);
+
+    // Tag + header, same layout as FileData plus the base block size
+    std::ostringstream header;
+    fstree::wire::write_string(header, node.path.generic_string());
+    fstree::wire::write_u64(header, file_size);
+    fstree::wire::write_u32(header, sig.block_size);
+    writeMtime(header, node.mtime);
+
+    auto header_buf         = header.str();
+    uint64_t header_size_be = boost::endian::native_to_big(
+        static_cast<uint64_t>(header_buf.size()));
+    uint8_t tag = static_cast<uint8_t>(PacketType::FileDelta);
+    std::vector<asio::const_buffer> buffers{
+        asio::buffer(&tag, 1),
+        asio::buffer(&header_size_be, sizeof(header_size_be)),
+        asio::buffer(header_buf),
+    };
+    co_await write(buffers);
+
+    // Ops: u8 kind, then Copy: u64 block + u32 count, Literal: u32 len +
+    // data. End is followed by the checksum of the whole file.
+    std::vector<fstree::rsync::DeltaOp> ops;
+    fstree::Hash checksum;
+    std::vector<uint8_t> frames;
+    bool more = true;
+    while (more) {
+      ops.clear();
+      frames.clear();
+      more = encoder.next(ops, DELTA_MAX_LITERAL);
+
+      // Reserve the worst case up front so frame pointers stay valid
+      frames.reserve(ops.size() * 13 + 1);
+      std::vector<asio::const_buffer> out;
+      for (const auto& op : ops) {
+        uint8_t* at = frames.data() + frames.size();
+        frames.push_back(static_cast<uint8_t>(op.kind));
+        if (op.kind == fstree::rsync::DeltaOp::Kind::Copy) {
+          uint64_t block_be = boost::endian::native_to_big(op.block);
+          uint32_t count_be = boost::endian::native_to_big(op.count);
+          auto* bp          = reinterpret_cast<uint8_t*>(&block_be);
+          auto* cp          = reinterpret_cast<uint8_t*>(&count_be);
+          frames.insert(frames.end(), bp, bp + sizeof(block_be));
+          frames.insert(frames.end(), cp, cp + sizeof(count_be));
+          out.push_back(asio::buffer(at, 13));
+        } else {
+          uint32_t len_be = boost::endian::native_to_big(
+              static_cast<uint32_t>(op.data.size()));
+          auto* lp = reinterpret_cast<uint8_t*>(&len_be);
+          frames.insert(frames.end(), lp, lp + sizeof(len_be));
+          out.push_back(asio::buffer(at, 5));
+          out.push_back(asio::buffer(op.data));
+        }
+      }
+      if (!more) {
+        frames.push_back(
+            static_cast<uint8_t>(fstree::rsync::DeltaOp::Kind::End));
+        out.push_back(asio::buffer(&frames.back(), 1));
+        checksum = encoder.checksum();
+        out.push_back(asio::buffer(checksum));
+      }
+
+      co_await write(out);
+    }
+  } catch (...) {
+    close();
+    throw;
+  }
+}
+
+// The rebuild runs on the disk thread behind the writes queued before it,
+// literals in buffers of the receive pool
+asio::awaitable<bool> Session::receiveFileDelta(fstree::DirectoryTree& tree) {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(receiveFileDelta(tree));
+
+  // The FileDelta tag byte has already been consumed by receivePacketType().
+  auto turn = co_await receiveTurn();
+
+  fs::path tmp_path;
+  try {
+    uint64_t hdr_size_be = 0;
+    co_await read(asio::buffer(&hdr_size_be, sizeof(hdr_size_be)));
+    uint64_t hdr_size = boost::endian::big_to_native(hdr_size_be);
+    if (hdr_size > MAX_FILE_CHUNK_SIZE)
+      throw std::runtime_error("header too large");
+
+    std::vector<uint8_t> hdr_buf(hdr_size);
+    co_await read(asio::buffer(hdr_buf));
+
+    std::istringstream hdr_stream(std::string(hdr_buf.begin(), hdr_buf.end()));
+    fs::path rel_path   = fstree::wire::read_string(hdr_stream);
+    uint64_t file_size  = fstree::wire::read_u64(hdr_stream);
+    uint32_t block_size = fstree::wire::read_u32(hdr_stream);
+    if (block_size == 0 || block_size > fstree::rsync::MAX_BLOCK_SIZE)
+      throw std::runtime_error("bad delta block size");
+    auto mtime = readMtime(hdr_stream);
+
+    // Build next to the old copy, which the Copy ops read from, and only
+    // replace it once the whole file has arrived and checks out. A base
+    // that is gone by now fails the check rather than the session.
+    fs::path abs_path = tree.root_path / rel_path;
+    tmp_path          = abs_path.parent_path() /
+               (std::string(fstree::INTERNAL_PREFIX) + ".delta." +
+                abs_path.filename().string());
+    auto writer = std::make_shared<std::optional<fstree::rsync::DeltaWriter>>();
+    disk_.submit([writer, abs_path, tmp_path, block_size] {
+      try {
+        writer->emplace(abs_path, tmp_path, block_size);
+      } catch (const std::exception&) {
+      }
+    });
+
+    for (;;) {
+      uint8_t kind = 0;
+      co_await read(asio::buffer(&kind, 1));
+
+      fstree::rsync::DeltaOp op;
+      op.kind = static_cast<fstree::rsync::DeltaOp::Kind>(kind);
+      if (op.kind == fstree::rsync::DeltaOp::Kind::End)
+        break;
+
+      if (op.kind == fstree::rsync::DeltaOp::Kind::Copy) {
+        uint64_t block_be = 0;
+        uint32_t count_be = 0;
+        co_await read(asio::buffer(&block_be, sizeof(block_be)));
+        co_await read(asio::buffer(&count_be, sizeof(count_be)));
+        op.block = boost::endian::big_to_native(block_be);
+        op.count = boost::endian::big_to_native(count_be);
+      } else if (op.kind == fstree::rsync::DeltaOp::Kind::Literal) {
+        uint32_t len_be = 0;
+        co_await read(asio::buffer(&len_be, sizeof(len_be)));
+        uint32_t len = boost::endian::big_to_native(len_be);
+        if (len > MAX_FILE_CHUNK_SIZE || len == 0)
+          throw std::runtime_error("literal too large");
+
+        op.data = co_await disk_.acquire(len);
+        co_await read(asio::buffer(op.data));
+      } else {
+        throw std::runtime_error("unknown delta op");
+      }
+      disk_.submit([this, writer, op = std::move(op)]() mutable {
+        auto release = [&] {
+          if (!op.data.empty())
+            disk_.release(std::move(op.data));
+        };
+        try {
+          if (*writer)
+            (*writer)->apply(op);
+        } catch (...) {
+          release();
+          throw;
+        }
+        release();
+      });
+    }
+
+    fstree::Hash checksum;
+    co_await read(asio::buffer(checksum));
+    auto applied = std::make_shared<bool>(false);
+    disk_.submit(
+        [writer, applied, abs_path, tmp_path, file_size, checksum, mtime] {
+          bool ok = *writer && (*writer)->written() == file_size &&
+                    (*writer)->checksum() == checksum;
+          writer->reset();
+          if (!ok) {
+            std::error_code ec;
+            fs::remove(tmp_path, ec);
+            return;
+          }
+          fs::rename(tmp_path, abs_path);
+          setMtime(abs_path, mtime);
+          *applied = true;
+        });
+    co_await disk_.flush();
+    co_return *applied;
+  } catch (...) {
+    // Behind the jobs that may still write it
+    if (!tmp_path.empty())
+      disk_.submit([tmp_path] {
+        std::error_code ec;
+        fs::remove(tmp_path, ec);
+      });
+    close();
+    throw;
+  }
+}
+
+// DeltaResult after the tag: u64 payload size + u8 applied
+asio::awaitable<void> Session::sendDeltaResult(bool applied) {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendDeltaResult(applied));
+
+  co_await send(sizedFrame(PacketType::DeltaResult,
+                           std::string(1, applied ? 1 : 0)));
+}
+
+asio::awaitable<bool> Session::receiveDeltaResult() {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(receiveDeltaResult());
+
+  // The DeltaResult tag byte has already been consumed by receivePacketType().
+  auto turn = co_await receiveTurn();
+  try {
+    auto buf = co_await receiveSizedPayload("delta result");
+    if (buf.size() != 1)
+      throw std::runtime_error("malformed delta result");
+    co_return buf[0] != 0;
+  } catch (...) {
+    close();
+    throw;
+  }
+}
+
+asio::awaitable<void> Session::sendTreeResync() {
+  if (!strand_.running_in_this_thread())
+    co_return co_await onStrand(sendTreeResync());
+
+  co_await sendPacketType(PacketType::TreeResync);
+}
+
+void Session::limitRate(std::vector<std::shared_ptr<RateLimiter>> limiters) {
+  asio::dispatch(strand_,
+                 [self = shared_from_this(), limiters = std::move(limiters)] {
+                   self->limiters_ = std::move(limiters);
+                 });
+}
+
+void Session::resetTreeDelta() {
+  asio::dispatch(strand_,
+                 [self = shared_from_this()] { self->last_sent_.reset(); });
+}
+
+// Keeps a private copy: the caller's tree changes in place as files change
+void Session::recordSentTree(const fstree::DirectoryTree& tree) {
+  last_sent_ = std::make_unique<fstree::DirectoryTree>(
+      tree.root_path, fstree::cloneNode(*tree.root));
+  last_sent_->hash_algorithm = tree.hash_algorithm;
+  tx_generation_++;
+}
+
+Session::Stats Session::stats() const {
+  return {remote_,
+          started_,
+          bytes_sent_.load(std::memory_order_relaxed),
+          bytes_received_.load(std::memory_order_relaxed)};
+}
+
+const char* Session::packetTypeName(PacketType type) {
+  switch (type) {
+    case PacketType::Tree:
+      return "Tree";
+    case PacketType::TreeRequest:
+      return "TreeRequest";
+    case PacketType::SyncRequest:
+      return "SyncRequest";
+    case PacketType::FileData:
+      return "FileData";
+    case PacketType::DeleteFile:
+      return "DeleteFile";
+    case PacketType::SyncDone:
+      return "SyncDone";
+    case PacketType::SyncHeader:
+      return "SyncHeader";
+    case PacketType::CreateDir:
+      return "CreateDir";
+    case PacketType::DisconnectRequest:
+      return "DisconnectRequest";
+    case PacketType::TreeDelta:
+      return "TreeDelta";
+    case PacketType::TreeResync:
+      return "TreeResync";
+    case PacketType::SignatureRequest:
+      return "SignatureRequest";
+    case PacketType::Signature:
+      return "Signature";
+    case PacketType::FileDelta:
+      return "FileDelta";
+    case PacketType::FileBundle:
+      return "FileBundle";
+    case PacketType::FileRange:
+      return "FileRange";
+    case PacketType::HashRequest:
+      return "HashRequest";
+    case PacketType::Hashes:
+      return "Hashes";
+    case PacketType::ResumeRequest:
+      return "ResumeRequest";
+    case PacketType::ResumeState:
+      return "ResumeState";
+    case PacketType::FileComplete:
+      return "FileComplete";
+    case PacketType::CopyFile:
+      return "CopyFile";
+    case PacketType::MoveFile:
+      return "MoveFile";
+    case PacketType::SubtreeRequest:
+      return "SubtreeRequest";
+    case PacketType::Subtrees:
+      return "Subtrees";
+    case PacketType::SetMtime:
+      return "SetMtime";
+    case PacketType::DeltaResult:
+      return "DeltaResult";
+  }
+  return "?";
 }
 
 tcp::socket& Session::socket() {
   return socket_;
 }
 
+// Any thread; the socket is only touched on strand_
 void Session::close() {
-  if (!socket_.is_open())
-    return;
-
-  boost::system::error_code ignored;
-  socket_.close(ignored);
-  if (on_close_)
-    on_close_(shared_from_this());
+  asio::dispatch(strand_, [self = shared_from_this()] {
+    if (!self->socket_.is_open())
+      return;
+
+    boost::system::error_code ignored;
+    self->socket_.close(ignored);
+    if (self->on_close_)
+      self->on_close_(self);
+  });
 }
 
-Peer::Peer(uint16_t port)
-    : io_(),
+Peer::Peer(uint16_t port, unsigned threads)
+    : io_(static_cast<int>(threads == 0 ? defaultThreads() : threads)),
+      threads_(threads == 0 ? defaultThreads() : threads),
+      app_(asio::make_strand(io_)),
       acceptor_(io_),
-      resolver_(io_),
+      resolver_(app_),
       id_(std::mt19937_64{std::random_device{}()}()) {
   tcp::endpoint ep(tcp::v4(), port);
 
@@ -624,16 +2707,107 @@ Peer::Peer(uint16_t port)
   acceptor_.set_option(tcp::acceptor::reuse_address(true));
   acceptor_.bind(ep);
   acceptor_.listen();
+  addSessionMetrics();
+}
+
+Peer::~Peer() {
+  for (auto id : collectors_)
+    metrics::removeCollector(id);
+}
+
+// One sample per session, labelled with this peer's id and the remote end
+std::vector<metrics::Sample> Peer::sessionSamples(
+    const std::function<double(const Session&, const Session::Stats&)>& value) {
+  std::vector<metrics::Sample> samples;
+  std::lock_guard<std::mutex> lock(sessions_mtx_);
+  for (const auto& session : sessions_) {
+    auto stats = session->stats();
+    metrics::Labels labels{{"peer", std::to_string(id_)},
+                           {"session", stats.remote}};
+    samples.push_back({std::move(labels), value(*session, stats)});
+  }
+  return samples;
+}
+
+void Peer::addSessionMetrics() {
+  using clock = std::chrono::steady_clock;
+
+  collectors_.push_back(metrics::addCollector(
+      "file_sync_session_sent_bytes_total",
+      "Bytes written to the socket of one session",
+      metrics::Kind::Counter,
+      [this] {
+        return sessionSamples([](const Session&, const Session::Stats& stats) {
+          return static_cast<double>(stats.bytes_sent);
+        });
+      }));
+  collectors_.push_back(metrics::addCollector(
+      "file_sync_session_received_bytes_total",
+      "Bytes read from the socket of one session",
+      metrics::Kind::Counter,
+      [this] {
+        return sessionSamples([](const Session&, const Session::Stats& stats) {
+          return static_cast<double>(stats.bytes_received);
+        });
+      }));
+
+  // Bytes per second since the previous export, or since the session began.
+  // Collectors never run concurrently, so the last values need no lock.
+  struct Seen {
+    clock::time_point started;
+    clock::time_point at;
+    uint64_t bytes;
+  };
+  auto rate = [this](bool sent) {
+    auto seen = std::make_shared<std::unordered_map<const Session*, Seen>>();
+    return [this, seen, sent] {
+      auto now = clock::now();
+      std::unordered_map<const Session*, Seen> next;
+      auto samples = sessionSamples(
+          [&](const Session& session, const Session::Stats& stats) {
+            uint64_t bytes = sent ? stats.bytes_sent : stats.bytes_received;
+            auto it        = seen->find(&session);
+            Seen last      = it != seen->end() &&
+                                it->second.started == stats.started
+                                 ? it->second
+                                 : Seen{stats.started, stats.started, 0};
+            next[&session] = {stats.started, now, bytes};
+            double secs = std::chrono::duration<double>(now - last.at).count();
+            return secs > 0 ? (bytes - last.bytes) / secs : 0.0;
+          });
+      *seen = std::move(next);  // drops closed sessions
+      return samples;
+    };
+  };
+  collectors_.push_back(metrics::addCollector(
+      "file_sync_session_send_bytes_per_second",
+      "Send rate of one session since the previous export",
+      metrics::Kind::Gauge,
+      rate(true)));
+  collectors_.push_back(metrics::addCollector(
+      "file_sync_session_receive_bytes_per_second",
+      "Receive rate of one session since the previous export",
+      metrics::Kind::Gauge,
+      rate(false)));
+}
+
+unsigned Peer::defaultThreads() {
+  return std::max(1u, std::thread::hardware_concurrency());
 }
 
 // Expose execution context
 asio::any_io_executor Peer::getExecutor() {
-  return io_.get_executor();
+  return app_;
 }
 
 // Lifecycle control
 void Peer::run() {
+  std::vector<std::thread> extra;
+  for (unsigned i = 1; i < threads_; ++i)
+    extra.emplace_back([this] { io_.run(); });
   io_.run();
+  for (auto& t : extra)
+    t.join();
 }
 
 void Peer::stop() {
@@ -642,7 +2816,9 @@ void Peer::stop() {
 
 // Acceptor
 void Peer::doAccept(OnAccept on_accept) {
+  // Sockets on io_ itself, each session then makes its own strand
   acceptor_.async_accept(
+      io_,
       [self = shared_from_this(), on_accept = std::move(on_accept)](
           boost::system::error_code ec, tcp::socket socket) mutable {
         if (!ec) {
@@ -700,22 +2876,44 @@ void Peer::doResolveAndConnect(const std::string& host,
 }
 
 // Session control
+asio::awaitable<std::shared_ptr<Session>> Peer::connect(
+    tcp::endpoint endpoint) {
+  tcp::socket socket(io_);
+  co_await socket.async_connect(endpoint, asio::use_awaitable);
+  co_return createSession(std::move(socket));
+}
+
+uint16_t Peer::port() const {
+  return acceptor_.local_endpoint().port();
+}
+
 void Peer::clearSessions() {
   // s->close() deletes s from sessions_ without copying we would be
   // deleting elements from sessions_ while iterating throught it, NOT SAFE
-  auto copy = sessions_;
+  decltype(sessions_) copy;
+  {
+    std::lock_guard<std::mutex> lock(sessions_mtx_);
+    copy = std::move(sessions_);
+    sessions_.clear();
+  }
   for (auto& s : copy) {
     s->close();
   }
-  sessions_.clear();
+}
+
+void Peer::enableChunkCache(std::size_t capacity) {
+  chunk_cache_ = std::make_shared<ChunkCache>(capacity);
 }
 
 std::shared_ptr<Session> Peer::createSession(tcp::socket socket) {
   auto session = std::make_shared<Session>(
       std::move(socket),
       [self = shared_from_this()](std::shared_ptr<Session> s) {
+        std::lock_guard<std::mutex> lock(self->sessions_mtx_);
         self->sessions_.erase(s);
-      });
+      },
+      chunk_cache_);
+  std::lock_guard<std::mutex> lock(sessions_mtx_);
   sessions_.insert(session);
   return session;
 }
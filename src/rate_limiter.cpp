@@ -0,0 +1,28 @@
+#include "../include/net/rate_limiter.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+namespace net {
+
+RateLimiter::RateLimiter(uint64_t rate, uint64_t burst)
+    : rate_(rate),
+      burst_(static_cast<double>(burst ? burst : rate)),
+      tokens_(burst_),
+      last_(Clock::now()) {
+  if (rate == 0)
+    throw std::invalid_argument("rate limit of 0 bytes per second");
+}
+
+RateLimiter::Clock::duration RateLimiter::reserve(std::size_t bytes) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  auto now = Clock::now();
+  std::chrono::duration<double> elapsed = now - last_;
+  last_   = now;
+  tokens_ = std::min(burst_, tokens_ + elapsed.count() * rate_);
+  tokens_ -= static_cast<double>(bytes);
+  if (tokens_ >= 0)
+    return Clock::duration::zero();
+  return std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(-tokens_ / rate_));
+}
+}  // namespace net
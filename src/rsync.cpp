@@ -0,0 +1,291 @@
+#include "../include/fstree/rsync.hpp"
+#include <openssl/evp.h>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace fstree::rsync {
+
+namespace {
+Hash strongHash(const char* data, std::size_t size) {
+  Hash hash;
+  if (!EVP_Digest(data, size, hash.data(), nullptr, EVP_sha256(), nullptr))
+    throw std::runtime_error("Failed to hash block.");
+  return hash;
+}
+
+// rsync's weak checksum: a = sum of bytes, b = sum of running a, each mod 2^16
+void weakInit(const char* data, std::size_t len, uint32_t& a, uint32_t& b) {
+  a = b = 0;
+  for (std::size_t i = 0; i < len; i++) {
+    a += static_cast<unsigned char>(data[i]);
+    b += a;
+  }
+}
+
+uint32_t weakValue(uint32_t a, uint32_t b) {
+  return (a & 0xffff) | (b << 16);
+}
+}  // namespace
+
+uint32_t blockSize(uint64_t file_size) {
+  auto root = static_cast<uint64_t>(std::sqrt(static_cast<double>(file_size)));
+  return static_cast<uint32_t>(
+      std::clamp<uint64_t>(root, MIN_BLOCK_SIZE, MAX_BLOCK_SIZE));
+}
+
+// ---------- Signature ----------
+
+Signature computeSignature(const fs::path& path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    throw std::runtime_error("Failed to open file.");
+
+  Signature sig;
+  sig.file_size  = fs::file_size(path);
+  sig.block_size = blockSize(sig.file_size);
+
+  std::vector<char> block(sig.block_size);
+  while (file) {
+    file.read(block.data(), block.size());
+    auto got = static_cast<std::size_t>(file.gcount());
+    if (got == 0)
+      break;
+
+    uint32_t a, b;
+    weakInit(block.data(), got, a, b);
+    sig.blocks.push_back({weakValue(a, b), strongHash(block.data(), got)});
+  }
+  if (file.bad())
+    throw std::runtime_error("Failed to read file.");
+  return sig;
+}
+
+// ---------- Whole-file checksum ----------
+
+FileChecksum::FileChecksum() : ctx_(EVP_MD_CTX_new(), EVP_MD_CTX_free) {
+  if (!ctx_ || !EVP_DigestInit_ex(ctx_.get(), EVP_sha256(), nullptr))
+    throw std::runtime_error("Failed to initialise hash context.");
+}
+
+void FileChecksum::update(const char* data, std::size_t size) {
+  if (!EVP_DigestUpdate(ctx_.get(), data, size))
+    throw std::runtime_error("Failed to update hash.");
+}
+
+Hash FileChecksum::final() {
+  Hash hash;
+  if (!EVP_DigestFinal_ex(ctx_.get(), hash.data(), nullptr))
+    throw std::runtime_error("Failed to finalise hash.");
+  return hash;
+}
+
+// ---------- Delta Encoder ----------
+
+DeltaEncoder::DeltaEncoder(const fs::path& path, const Signature& sig)
+    : file_(path, std::ios::binary),
+      sig_(sig),
+      buf_(std::max<std::size_t>(4 * sig.block_size, 1024 * 1024)) {
+  if (!file_)
+    throw std::runtime_error("Failed to open file.");
+  if (sig_.block_size == 0)
+    throw std::invalid_argument("Signature has no blocks.");
+
+  if (!sig_.blocks.empty())
+    short_block_ = sig_.file_size - (sig_.blocks.size() - 1) * sig_.block_size;
+  for (uint64_t i = 0; i < sig_.blocks.size(); i++)
+    weak_index_.emplace(sig_.blocks[i].weak, i);
+}
+
+bool DeltaEncoder::fill(std::size_t want) {
+  while (end_ - pos_ < want && !eof_) {
+    // Keep the unconsumed window, drop everything before it
+    std::move(buf_.begin() + pos_, buf_.begin() + end_, buf_.begin());
+    end_ -= pos_;
+    pos_ = 0;
+
+    file_.read(buf_.data() + end_, buf_.size() - end_);
+    auto got = static_cast<std::size_t>(file_.gcount());
+    if (file_.bad())
+      throw std::runtime_error("Failed to read file.");
+    if (got == 0)
+      eof_ = true;
+    checksum_.update(buf_.data() + end_, got);
+    end_ += got;
+  }
+  return end_ - pos_ >= want;
+}
+
+std::optional<uint64_t> DeltaEncoder::match(std::size_t len) {
+  uint32_t a = a_, b = b_;
+  if (len != sig_.block_size)
+    weakInit(buf_.data() + pos_, len, a, b);
+
+  std::optional<Hash> strong;
+  auto [first, last] = weak_index_.equal_range(weakValue(a, b));
+  for (auto it = first; it != last; ++it) {
+    uint64_t block = it->second;
+    bool is_last   = block + 1 == sig_.blocks.size();
+    if ((is_last ? short_block_ : sig_.block_size) != len)
+      continue;
+
+    if (!strong)
+      strong = strongHash(buf_.data() + pos_, len);
+    if (*strong == sig_.blocks[block].strong)
+      return block;
+  }
+  return std::nullopt;
+}
+
+void DeltaEncoder::emitCopy(std::vector<DeltaOp>& ops, uint64_t block) {
+  if (!ops.empty() && ops.back().kind == DeltaOp::Kind::Copy &&
+      ops.back().block + ops.back().count == block) {
+    ops.back().count++;
+    return;
+  }
+  ops.push_back({DeltaOp::Kind::Copy, block, 1, {}});
+}
+
+bool DeltaEncoder::next(std::vector<DeltaOp>& ops, std::size_t max_literal) {
+  const std::size_t bs = sig_.block_size;
+
+  auto literal = [&]() -> std::vector<char>& {
+    if (ops.empty() || ops.back().kind != DeltaOp::Kind::Literal)
+      ops.push_back({DeltaOp::Kind::Literal, 0, 0, {}});
+    return ops.back().data;
+  };
+
+  while (!done_) {
+    fill(bs + 1);  // one byte past the window, to roll forward
+    std::size_t avail = end_ - pos_;
+
+    if (avail == 0) {
+      done_ = true;
+      break;
+    }
+
+    if (avail < bs) {
+      // Tail shorter than a block: it can only be the base's last block
+      rolling_ = false;
+      if (auto block = match(avail)) {
+        emitCopy(ops, *block);
+      } else {
+        auto& data = literal();
+        data.insert(data.end(), buf_.begin() + pos_, buf_.begin() + end_);
+      }
+      pos_ = end_;
+      continue;
+    }
+
+    if (!rolling_) {
+      weakInit(buf_.data() + pos_, bs, a_, b_);
+      rolling_ = true;
+    }
+
+    if (auto block = match(bs)) {
+      emitCopy(ops, *block);
+      pos_ += bs;
+      rolling_ = false;
+      continue;
+    }
+
+    // No match: emit one byte and slide the window
+    auto out = static_cast<unsigned char>(buf_[pos_]);
+    literal().push_back(buf_[pos_]);
+    if (pos_ + bs < end_) {
+      auto in = static_cast<unsigned char>(buf_[pos_ + bs]);
+      a_      = a_ - out + in;
+      b_      = b_ - static_cast<uint32_t>(bs) * out + a_;
+    } else {
+      rolling_ = false;
+    }
+    pos_++;
+
+    if (ops.back().data.size() >= max_literal || ops.size() >= 4096)
+      return true;
+  }
+  return false;
+}
+
+Hash DeltaEncoder::checksum() {
+  return checksum_.final();
+}
+
+// ---------- Delta Writer ----------
+
+DeltaWriter::DeltaWriter(const fs::path& base,
+                         const fs::path& out,
+                         uint32_t block_size)
+    : base_(base, std::ios::binary),
+      out_(out, std::ios::binary | std::ios::trunc),
+      block_size_(block_size),
+      buf_(std::min<std::size_t>(block_size, 1024 * 1024)) {
+  if (!base_)
+    throw std::runtime_error("Failed to open base file.");
+  if (!out_)
+    throw std::runtime_error("Failed to create file.");
+}
+
+void DeltaWriter::apply(const DeltaOp& op) {
+  if (op.kind == DeltaOp::Kind::Literal) {
+    out_.write(op.data.data(), op.data.size());
+    checksum_.update(op.data.data(), op.data.size());
+    written_ += op.data.size();
+  } else if (op.kind == DeltaOp::Kind::Copy) {
+    base_.clear();
+    base_.seekg(op.block * block_size_);
+
+    uint64_t remaining = static_cast<uint64_t>(op.count) * block_size_;
+    while (remaining > 0) {
+      auto want = static_cast<std::size_t>(
+          std::min<uint64_t>(remaining, buf_.size()));
+      base_.read(buf_.data(), want);
+      auto got = static_cast<std::size_t>(base_.gcount());
+      if (got == 0)
+        break;  // last block of the base may be short
+      out_.write(buf_.data(), got);
+      checksum_.update(buf_.data(), got);
+      written_ += got;
+      remaining -= got;
+    }
+    if (base_.bad())
+      throw std::runtime_error("Failed to read base file.");
+  }
+  if (!out_)
+    throw std::runtime_error("file write failed");
+}
+
+uint64_t DeltaWriter::written() const {
+  return written_;
+}
+
+Hash DeltaWriter::checksum() {
+  return checksum_.final();
+}
+
+// ---------- Resume ----------
+
+std::vector<Hash> blockHashes(const fs::path& path, uint32_t block_size) {
+  std::vector<Hash> hashes;
+  std::ifstream file(path, std::ios::binary);
+  std::vector<char> block(block_size);
+  while (file.read(block.data(), block.size()))
+    hashes.push_back(strongHash(block.data(), block.size()));
+  return hashes;
+}
+
+uint64_t matchingPrefix(const fs::path& path,
+                        const std::vector<Hash>& hashes,
+                        uint32_t block_size) {
+  std::ifstream file(path, std::ios::binary);
+  std::vector<char> block(block_size);
+  uint64_t matched = 0;
+  for (const auto& hash : hashes) {
+    if (!file.read(block.data(), block.size()) ||
+        strongHash(block.data(), block.size()) != hash)
+      break;
+    matched += block_size;
+  }
+  return matched;
+}
+}  // namespace fstree::rsync
@@ -0,0 +1,118 @@
+#include "../include/net/scheduler.hpp"
+#include <algorithm>
+#include <utility>
+
+namespace net {
+namespace {
+bool matchFrom(std::string_view glob, std::string_view path) {
+  while (!glob.empty()) {
+    if (glob.starts_with("**")) {
+      glob.remove_prefix(2);
+      // "a/**/b" takes "a/b" too
+      if (glob.starts_with('/') && matchFrom(glob.substr(1), path))
+        return true;
+      for (std::size_t i = 0; i <= path.size(); ++i)
+        if (matchFrom(glob, path.substr(i)))
+          return true;
+      return false;
+    }
+    if (glob[0] == '*') {
+      glob.remove_prefix(1);
+      for (std::size_t i = 0;; ++i) {
+        if (matchFrom(glob, path.substr(i)))
+          return true;
+        if (i == path.size() || path[i] == '/')
+          return false;
+      }
+    }
+    if (path.empty())
+      return false;
+    if (glob[0] == '?' ? path[0] == '/' : glob[0] != path[0])
+      return false;
+    glob.remove_prefix(1);
+    path.remove_prefix(1);
+  }
+  return path.empty();
+}
+}  // namespace
+
+const char* orderName(ScheduleOptions::Order order) {
+  switch (order) {
+    case ScheduleOptions::Order::Diff:
+      return "diff";
+    case ScheduleOptions::Order::SmallFirst:
+      return "small-first";
+    case ScheduleOptions::Order::NewestFirst:
+      return "newest-first";
+  }
+  return "unknown";
+}
+
+std::optional<ScheduleOptions::Order> parseOrder(const std::string& name) {
+  for (auto order : {ScheduleOptions::Order::Diff,
+                     ScheduleOptions::Order::SmallFirst,
+                     ScheduleOptions::Order::NewestFirst}) {
+    if (name == orderName(order))
+      return order;
+  }
+  return std::nullopt;
+}
+
+bool globMatch(std::string_view glob, const fs::path& rel_path) {
+  if (glob.find('/') == std::string_view::npos)
+    return matchFrom(glob, rel_path.filename().generic_string());
+  return matchFrom(glob, rel_path.generic_string());
+}
+
+void scheduleOps(std::vector<SyncOp>& ops, const ScheduleOptions& options) {
+  if (options.order == ScheduleOptions::Order::Diff &&
+      options.priority.empty())
+    return;
+
+  auto first_file =
+      std::stable_partition(ops.begin(), ops.end(), [](const SyncOp& op) {
+        return op.kind != SyncOp::Kind::File;
+      });
+
+  // Sort keys are worked out once per file, globs aren't cheap
+  struct Scheduled {
+    std::size_t rank;  // index of the first matching glob
+    uint64_t left;     // bytes still to send
+    fs::file_time_type mtime;
+    SyncOp op;
+  };
+  std::vector<Scheduled> files;
+  files.reserve(static_cast<std::size_t>(ops.end() - first_file));
+  for (auto it = first_file; it != ops.end(); ++it) {
+    std::size_t rank = 0;
+    while (rank < options.priority.size() &&
+           !globMatch(options.priority[rank], it->node->path))
+      ++rank;
+    uint64_t size = std::get<fstree::FileMeta>(it->node->data).size;
+    files.push_back({rank,
+                     size - std::min(size, it->offset),
+                     it->node->mtime,
+                     std::move(*it)});
+  }
+
+  std::stable_sort(files.begin(),
+                   files.end(),
+                   [&](const Scheduled& a, const Scheduled& b) {
+                     if (a.rank != b.rank)
+                       return a.rank < b.rank;
+                     switch (options.order) {
+                       case ScheduleOptions::Order::SmallFirst:
+                         return a.left < b.left;
+                       case ScheduleOptions::Order::NewestFirst:
+                         return a.mtime > b.mtime;
+                       case ScheduleOptions::Order::Diff:
+                         break;
+                     }
+                     return false;
+                   });
+
+  auto out = first_file;
+  for (auto& file : files)
+    *out++ = std::move(file.op);
+}
+}  // namespace net
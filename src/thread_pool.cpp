@@ -0,0 +1,130 @@
+#include "../include/fstree/thread_pool.hpp"
+#include <algorithm>
+
+namespace fstree {
+
+namespace {
+// Identifies the pool and queue owned by the current worker thread
+thread_local const ThreadPool* current_pool = nullptr;
+thread_local unsigned current_queue         = 0;
+}  // namespace
+
+ThreadPool::ThreadPool(unsigned threads) {
+  if (threads == 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+
+  for (unsigned i = 0; i < threads; i++)
+    queues_.push_back(std::make_unique<Queue>());
+
+  for (unsigned i = 0; i < threads; i++)
+    workers_.emplace_back([this, i]() {
+      workerLoop(i);
+    });
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+  for (auto& w : workers_)
+    w.join();
+}
+
+void ThreadPool::submit(Task task) {
+  unsigned idx = current_pool == this
+                     ? current_queue
+                     : next_queue_.fetch_add(1) % queues_.size();
+  {
+    std::lock_guard<std::mutex> lock(queues_[idx]->mtx);
+    queues_[idx]->tasks.push_back(std::move(task));
+  }
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    queued_++;
+    pending_++;
+  }
+  work_cv_.notify_one();
+}
+
+void ThreadPool::wait() {
+  std::unique_lock<std::mutex> lock(mtx_);
+  done_cv_.wait(lock, [this]() {
+    return pending_ == 0;
+  });
+  if (error_) {
+    auto err = error_;
+    error_   = nullptr;
+    std::rethrow_exception(err);
+  }
+}
+
+unsigned ThreadPool::size() const {
+  return static_cast<unsigned>(workers_.size());
+}
+
+std::size_t ThreadPool::queued() const {
+  std::lock_guard<std::mutex> lock(mtx_);
+  return queued_;
+}
+
+bool ThreadPool::tryPop(unsigned idx, Task& task) {
+  // Own queue first, newest task
+  {
+    std::lock_guard<std::mutex> lock(queues_[idx]->mtx);
+    if (!queues_[idx]->tasks.empty()) {
+      task = std::move(queues_[idx]->tasks.back());
+      queues_[idx]->tasks.pop_back();
+      return true;
+    }
+  }
+  // Steal the oldest task from another worker
+  for (std::size_t i = 1; i < queues_.size(); i++) {
+    auto& victim = *queues_[(idx + i) % queues_.size()];
+    std::lock_guard<std::mutex> lock(victim.mtx);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::workerLoop(unsigned idx) {
+  current_pool  = this;
+  current_queue = idx;
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mtx_);
+      work_cv_.wait(lock, [this]() {
+        return stop_ || queued_ > 0;
+      });
+      if (stop_ && queued_ == 0)
+        return;
+      // Claim one task; it is guaranteed to be in some queue
+      queued_--;
+    }
+
+    Task task;
+    while (!tryPop(idx, task)) {
+      // The claimed task is being pushed concurrently, retry
+      std::this_thread::yield();
+    }
+
+    try {
+      task();
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mtx_);
+      if (!error_)
+        error_ = std::current_exception();
+    }
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (--pending_ == 0)
+      done_cv_.notify_all();
+  }
+}
+}  // namespace fstree
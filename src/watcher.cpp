@@ -0,0 +1,171 @@
+#include "../include/fstree/watcher.hpp"
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+
+namespace fstree {
+
+namespace {
+constexpr uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MODIFY |
+                                IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM |
+                                IN_MOVED_TO | IN_ONLYDIR;
+
+bool isWithin(const fs::path& path, const fs::path& base) {
+  if (base == ".")
+    return true;
+  fs::path rel = path.lexically_relative(base);
+  return !rel.empty() && *rel.begin() != "..";
+}
+}  // namespace
+
+Watcher::Watcher(fs::path root) : root_(std::move(root)) {
+  fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd_ < 0)
+    throw std::system_error(errno, std::generic_category(), "inotify_init1");
+  watch(".");
+}
+
+Watcher::~Watcher() {
+  if (fd_ >= 0)
+    ::close(fd_);
+}
+
+int Watcher::fd() const {
+  return fd_;
+}
+
+bool Watcher::pending() const {
+  return overflow_ || !dirty_.empty() || !renames_.empty() ||
+         !moved_from_.empty();
+}
+
+void Watcher::watch(const fs::path& rel_dir) {
+  fs::path abs_dir = rel_dir == "." ? root_ : root_ / rel_dir;
+
+  int wd = inotify_add_watch(fd_, abs_dir.c_str(), WATCH_MASK);
+  if (wd < 0)
+    return;  // vanished already, or out of watches
+  watches_[wd] = rel_dir;
+
+  std::error_code ec;
+  for (auto const& entry : fs::directory_iterator(abs_dir, ec)) {
+    if (entry.is_directory(ec) && !entry.is_symlink(ec) &&
+        !isInternal(entry.path())) {
+      watch(rel_dir == "." ? entry.path().filename()
+                           : rel_dir / entry.path().filename());
+    }
+  }
+}
+
+bool Watcher::read() {
+  bool got_any = false;
+  alignas(inotify_event) char buffer[64 * 1024];
+
+  while (true) {
+    ssize_t len = ::read(fd_, buffer, sizeof(buffer));
+    if (len <= 0)
+      break;  // EAGAIN: drained
+
+    got_any = true;
+    for (char* ptr = buffer; ptr < buffer + len;) {
+      auto* ev = reinterpret_cast<inotify_event*>(ptr);
+      handle(ev->wd, ev->mask, ev->cookie, ev->len ? ev->name : "");
+      ptr += sizeof(inotify_event) + ev->len;
+    }
+  }
+  return got_any;
+}
+
+void Watcher::handle(int wd, uint32_t mask, uint32_t cookie, const char* name) {
+  if (mask & IN_Q_OVERFLOW) {
+    overflow_ = true;
+    return;
+  }
+
+  auto it = watches_.find(wd);
+  if (it == watches_.end())
+    return;
+  if (mask & IN_IGNORED) {
+    watches_.erase(it);
+    return;
+  }
+  if (*name == '\0' || isInternal(name))
+    return;
+
+  fs::path rel = it->second == "." ? fs::path(name) : it->second / name;
+
+  if (mask & IN_MOVED_FROM) {
+    moved_from_[cookie] = rel;
+
+  } else if (mask & IN_MOVED_TO) {
+    auto from = moved_from_.find(cookie);
+    if (from != moved_from_.end()) {
+      renames_.emplace_back(from->second, rel);
+
+      // Earlier events for the moved path are replayed at its new location
+      std::set<fs::path> dirty;
+      for (auto& path : dirty_) {
+        if (isWithin(path, from->second)) {
+          fs::path sub = path.lexically_relative(from->second);
+          dirty.insert(sub == "." ? rel : rel / sub);
+        } else {
+          dirty.insert(path);
+        }
+      }
+      dirty_ = std::move(dirty);
+
+      if (mask & IN_ISDIR) {
+        // The watches stay on the moved directories, only their paths change
+        for (auto& [_, dir] : watches_) {
+          if (isWithin(dir, from->second)) {
+            fs::path sub = dir.lexically_relative(from->second);
+            dir          = sub == "." ? rel : rel / sub;
+          }
+        }
+      }
+      moved_from_.erase(from);
+    } else {
+      if (mask & IN_ISDIR)
+        watch(rel);
+      dirty_.insert(rel);
+    }
+
+  } else {
+    if ((mask & IN_CREATE) && (mask & IN_ISDIR))
+      watch(rel);
+    dirty_.insert(rel);
+  }
+}
+
+bool Watcher::apply(DirectoryTree& tree) {
+  // A move whose other half never arrived left (or entered) the tree
+  for (auto& [_, from] : moved_from_)
+    dirty_.insert(from);
+  moved_from_.clear();
+
+  if (overflow_) {
+    overflow_ = false;
+    renames_.clear();
+    dirty_.clear();
+    for (auto& [wd, _] : watches_)
+      inotify_rm_watch(fd_, wd);
+    watches_.clear();
+    watch(".");
+    return false;
+  }
+
+  for (auto& [from, to] : renames_)
+    tree.rename(from, to);
+  renames_.clear();
+
+  for (auto& path : dirty_)
+    tree.refresh(path);
+  dirty_.clear();
+
+  tree.updateHashes();
+
+  return true;
+}
+}  // namespace fstree
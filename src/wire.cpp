@@ -1,4 +1,6 @@
 #include "../include/fstree/wire.hpp"
+#include <algorithm>
+#include <cstring>
 
 namespace fstree::wire {
 
@@ -43,4 +45,113 @@ std::string read_string(std::istream& is) {
   is.read(str.data(), len);
   return str;
 }
+
+// ---------- Writer ----------
+
+void Writer::write_u8(uint8_t v) { out_.push_back(v); }
+
+void Writer::write_u32(uint32_t v) { write_bytes(&v, sizeof(v)); }
+
+void Writer::write_u64(uint64_t v) { write_bytes(&v, sizeof(v)); }
+
+void Writer::write_varint(uint64_t v) {
+  while (v >= 0x80) {
+    out_.push_back(static_cast<uint8_t>(v | 0x80));
+    v >>= 7;
+  }
+  out_.push_back(static_cast<uint8_t>(v));
+}
+
+void Writer::write_svarint(int64_t v) {
+  write_varint((static_cast<uint64_t>(v) << 1) ^
+               static_cast<uint64_t>(v >> 63));
+}
+
+void Writer::write_string(std::string_view str) {
+  write_u32(static_cast<uint32_t>(str.size()));
+  write_bytes(str.data(), str.size());
+}
+
+void Writer::write_vstring(std::string_view str) {
+  write_varint(str.size());
+  write_bytes(str.data(), str.size());
+}
+
+void Writer::write_bytes(const void* data, std::size_t size) {
+  auto* p = static_cast<const uint8_t*>(data);
+  out_.insert(out_.end(), p, p + size);
+}
+
+// ---------- Reader ----------
+
+const uint8_t* Reader::take(std::size_t n) {
+  if (failed_ || remaining() < n) {
+    failed_ = truncated_ = true;
+    return nullptr;
+  }
+  const uint8_t* p = data_.data() + pos_;
+  pos_ += n;
+  return p;
+}
+
+uint8_t Reader::read_u8() {
+  const uint8_t* p = take(1);
+  return p ? *p : 0;
+}
+
+uint32_t Reader::read_u32() {
+  uint32_t v = 0;
+  read_bytes(&v, sizeof(v));
+  return v;
+}
+
+uint64_t Reader::read_u64() {
+  uint64_t v = 0;
+  read_bytes(&v, sizeof(v));
+  return v;
+}
+
+uint64_t Reader::read_varint() {
+  uint64_t v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    const uint8_t* p = take(1);
+    if (!p)
+      return 0;
+    v |= static_cast<uint64_t>(*p & 0x7f) << shift;
+    if (!(*p & 0x80))
+      return v;
+  }
+  failed_ = true;
+  return 0;
+}
+
+int64_t Reader::read_svarint() {
+  uint64_t v = read_varint();
+  return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+}
+
+std::string Reader::read_string() {
+  uint32_t len     = read_u32();
+  const uint8_t* p = take(len);
+  return p ? std::string(reinterpret_cast<const char*>(p), len) : std::string();
+}
+
+std::string Reader::read_vstring() {
+  uint64_t len = read_varint();
+  if (failed_)
+    return {};
+  const uint8_t* p = take(static_cast<std::size_t>(std::min<uint64_t>(
+      len, static_cast<uint64_t>(remaining()) + 1)));
+  return p ? std::string(reinterpret_cast<const char*>(p), len) : std::string();
+}
+
+void Reader::read_bytes(void* out, std::size_t n) {
+  const uint8_t* p = take(n);
+  if (p)
+    std::memcpy(out, p, n);
+  else
+    std::memset(out, 0, n);
+}
+
+void Reader::skip(std::size_t n) { take(n); }
 }  // namespace fstree::wire